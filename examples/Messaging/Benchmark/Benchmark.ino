@@ -0,0 +1,305 @@
+#ifdef ROO_TESTING
+
+// This section is intended for testing the example on Linux. You can disregard
+// it when analyzing the example itself - just scroll down to the #endif.
+
+#include "roo_io/ringpipe/ringpipe.h"
+#include "roo_testing/buses/uart/fake_uart.h"
+#include "roo_testing/microcontrollers/esp32/fake_esp32.h"
+
+class FakeUartEndpoint : public FakeUartDevice {
+ public:
+  FakeUartEndpoint() : tx_(256), rx_(256) {}
+
+  size_t write(const uint8_t* buf, uint16_t size) override {
+    return tx_.writeFully((const roo::byte*)buf, size);
+  }
+
+  size_t read(uint8_t* buf, uint16_t size) override {
+    return rx_.tryRead((roo::byte*)buf, size);
+  }
+
+  size_t availableForRead() override { return rx_.availableForRead(); }
+
+  size_t availableForWrite() override { return tx_.availableForWrite(); }
+
+  roo_io::RingPipe& tx() { return tx_; }
+  roo_io::RingPipe& rx() { return rx_; }
+
+ private:
+  roo_io::RingPipe tx_;
+  roo_io::RingPipe rx_;
+};
+
+class UartForwarder {
+ public:
+  UartForwarder(roo_io::RingPipe& from, roo_io::RingPipe& to,
+                FakeUartDevice& recv)
+      : from_(from), to_(to), recv_(recv) {}
+
+  void begin() {
+    roo::thread::attributes attrs;
+    attrs.set_name("uart forwarder");
+    forwarder_thread_ = roo::thread(attrs, [this]() {
+      roo::byte buffer[256];
+      while (true) {
+        size_t count = from_.read(buffer, sizeof(buffer));
+        if (count == 0) {
+          break;
+        }
+        do {
+          size_t written = to_.write(buffer, count);
+          recv_.notifyDataAvailable();
+          if (written == 0) {
+            break;
+          }
+          count -= written;
+        } while (count > 0);
+      }
+    });
+  }
+
+ private:
+  roo_io::RingPipe& from_;
+  roo_io::RingPipe& to_;
+  FakeUartDevice& recv_;
+  roo::thread forwarder_thread_;
+};
+
+struct Emulator {
+  FakeUartEndpoint serial1_;
+  FakeUartEndpoint serial2_;
+  UartForwarder forwarder_1_to_2_;
+  UartForwarder forwarder_2_to_1_;
+  Emulator()
+      : forwarder_1_to_2_(serial1_.tx(), serial2_.rx(), serial2_),
+        forwarder_2_to_1_(serial2_.tx(), serial1_.rx(), serial1_) {
+    forwarder_1_to_2_.begin();
+    forwarder_2_to_1_.begin();
+
+    auto& board = FakeEsp32();
+    board.attachUartDevice(serial1_, 27, 14);
+    board.attachUartDevice(serial2_, 25, 26);
+  }
+} emulator;
+
+#endif
+
+// This example measures the throughput of link messaging, in messages per
+// second, for a range of message sizes, with and without batching (see
+// LinkMessaging::setBatchingWindow()).
+//
+// The client sends a burst of messages of the given size, followed by an
+// end-of-round marker. The server counts the received messages, and responds
+// to the marker with the count. Without batching, every message gets flushed,
+// taking up at least one packet; with batching, small messages share packets.
+
+// Important: to run this example in the loopback mode, you need to connect the
+// TX and RX pins of the two UARTs to each other using jumper wires. The pin
+// numbers are defined by the constants kPinServerTx, kPinServerRx,
+// kPinClientTx, and kPinClientRx below. Make sure to cross the wires, i.e. to
+// connect kPinServerTx with kPinClientRx, and kPinServerRx with kPinClientTx.
+
+#include "roo_io/memory/load.h"
+#include "roo_io/memory/store.h"
+#include "roo_threads.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_transport.h"
+#include "roo_transport/link/arduino/reliable_serial.h"
+#include "roo_transport/link/link_messaging.h"
+
+using namespace roo_transport;
+
+#if defined(ESP_PLATFORM)
+
+static const int kPinServerTx = 27;
+static const int kPinServerRx = 14;
+static const int kPinClientTx = 25;
+static const int kPinClientRx = 26;
+
+static const uint32_t kBaudRate = 5000000;
+
+#elif defined(ARDUINO_ARCH_RP2040)
+
+static const int kPinServerTx = 12;
+static const int kPinServerRx = 13;
+static const int kPinClientTx = 4;
+static const int kPinClientRx = 5;
+
+static const uint32_t kBaudRate = 115200;
+
+#else
+#error "Unsupported platform"
+#endif
+
+// Build for a single microcontroller in loopback mode.
+#define MODE_LOOPBACK 0
+
+// Build for the server microcontroller.
+#define MODE_SERVER 1
+
+// Build for the client microcontroller.
+#define MODE_CLIENT 2
+
+// Select the desired mode.
+#define MODE MODE_LOOPBACK
+// #define MODE MODE_SERVER
+// #define MODE MODE_CLIENT
+
+static const size_t kMaxMessageSize = 256;
+
+// The first byte of each message.
+static const roo::byte kData = roo::byte{0};
+static const roo::byte kEndOfRound = roo::byte{1};
+
+#if MODE == MODE_LOOPBACK || MODE == MODE_SERVER
+
+ReliableSerial1 server_serial;
+
+LinkMessaging server_messaging(server_serial, kMaxMessageSize);
+
+// Only accessed from the receiver thread.
+uint32_t server_message_count = 0;
+
+Messaging::SimpleReceiver server_receiver(
+    [](Messaging::ConnectionId connection_id, const roo::byte* data,
+       size_t len) {
+      if (len == 0) return;
+      if (data[0] == kData) {
+        ++server_message_count;
+        return;
+      }
+      roo::byte response[4];
+      roo_io::StoreBeU32(server_message_count, response);
+      server_message_count = 0;
+      server_messaging.sendContinuation(connection_id, response, 4);
+      server_messaging.flush();
+    });
+
+void server() {
+#if defined(ESP_PLATFORM)
+  Serial1.setRxBufferSize(4096);
+  Serial1.begin(kBaudRate, SERIAL_8N1, kPinServerRx, kPinServerTx);
+#elif defined(ARDUINO_ARCH_RP2040)
+  Serial1.setPinout(kPinServerTx, kPinServerRx);
+  Serial1.setFIFOSize(1024);
+  Serial1.begin(kBaudRate, SERIAL_8N1);
+#endif
+  server_serial.begin();
+  server_messaging.setReceiver(server_receiver);
+  server_messaging.begin();
+}
+
+#endif  // MODE == MODE_LOOPBACK || MODE == MODE_SERVER
+
+#if MODE == MODE_LOOPBACK || MODE == MODE_CLIENT
+
+ReliableSerial2 client_serial;
+
+LinkMessaging client_messaging(client_serial, kMaxMessageSize);
+
+// Receives the server's responses to the end-of-round markers.
+roo::mutex client_mutex;
+roo::condition_variable client_response_received;
+bool client_has_response = false;
+uint32_t client_response = 0;
+
+Messaging::SimpleReceiver client_receiver(
+    [](Messaging::ConnectionId connection_id, const roo::byte* data,
+       size_t len) {
+      if (len != 4) return;
+      roo::lock_guard<roo::mutex> guard(client_mutex);
+      client_response = roo_io::LoadBeU32(data);
+      client_has_response = true;
+      client_response_received.notify_all();
+    });
+
+// Sends the specified number of messages of the specified size, and returns
+// the number of messages per second that the server received.
+float measure(size_t message_size, uint32_t message_count) {
+  roo::byte msg[kMaxMessageSize] = {};
+  msg[0] = kData;
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  for (uint32_t i = 0; i < message_count; ++i) {
+    client_messaging.send(msg, message_size);
+  }
+  msg[0] = kEndOfRound;
+  client_messaging.send(msg, 1);
+  client_messaging.flush();
+  uint32_t received;
+  {
+    roo::unique_lock<roo::mutex> guard(client_mutex);
+    while (!client_has_response) {
+      client_response_received.wait(guard);
+    }
+    client_has_response = false;
+    received = client_response;
+  }
+  roo_time::Uptime end = roo_time::Uptime::Now();
+  if (received != message_count) {
+    Serial.printf("Warning: sent %d messages, but %d received\n",
+                  message_count, received);
+  }
+  return received / (end - start).inSecondsFloat();
+}
+
+void client() {
+#if defined(ESP_PLATFORM)
+  Serial2.setRxBufferSize(4096);
+  Serial2.begin(kBaudRate, SERIAL_8N1, kPinClientRx, kPinClientTx);
+#elif defined(ARDUINO_ARCH_RP2040)
+  Serial2.setPinout(kPinClientTx, kPinClientRx);
+  Serial2.setFIFOSize(1024);
+  Serial2.begin(kBaudRate, SERIAL_8N1);
+#endif
+  client_serial.begin();
+  client_messaging.setReceiver(client_receiver);
+  client_messaging.begin();
+
+  static const size_t kMessageSizes[] = {1, 4, 16, 32, 64, 128, 256};
+  static const roo_time::Duration kBatchingWindows[] = {
+      roo_time::Micros(0), roo_time::Micros(200), roo_time::Millis(2)};
+  const uint32_t kMessageCount = 1000;
+  while (true) {
+    for (roo_time::Duration window : kBatchingWindows) {
+      client_messaging.setBatchingWindow(window);
+      Serial.printf("Batching window: %d us\n", (int)window.inMicros());
+      for (size_t size : kMessageSizes) {
+        float rate = measure(size, kMessageCount);
+        Serial.printf("  %3d-byte messages: %8.0f msg/s, %7.1f KB/s\n",
+                      (int)size, rate, rate * size / 1024.0f);
+      }
+    }
+    delay(1000);
+  }
+}
+
+#endif  // MODE == MODE_LOOPBACK || MODE == MODE_CLIENT
+
+#if (MODE == MODE_CLIENT)
+
+void setup() {
+  Serial.begin(115200);
+  client();
+}
+
+#elif (MODE == MODE_SERVER)
+
+void setup() {
+  Serial.begin(115200);
+  server();
+}
+
+#else  // loopback
+
+void setup() {
+  Serial.begin(115200);
+  server();
+  client();
+}
+
+#endif
+
+// Never called; all the work is done in setup() and new threads.
+void loop() {}
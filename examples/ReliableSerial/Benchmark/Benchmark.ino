@@ -60,6 +60,11 @@ static const uint32_t baud_rate = 115200;
 #error "Unsupported platform"
 #endif
 
+// Pace the outgoing data to slightly below the line rate (8N1 uses 10 bits per
+// byte), so that acks are not stuck behind bulk data in the UART FIFO. Set to
+// zero to compare with the unpaced behavior.
+static const uint32_t pacing_rate = baud_rate / 10 * 95 / 100;
+
 // Build for a single microcontroller in loopback mode.
 #define MODE_LOOPBACK 0
 
@@ -96,6 +101,7 @@ void server() {
   Serial1.setFIFOSize(1024);
   Serial1.begin(baud_rate, SERIAL_8N1);
 #endif
+  reliable_serial1.transport().setPacingRate(pacing_rate);
   reliable_serial1.begin();
   LinkStream link = reliable_serial1.connectOrDie();
   Serial.println("Server connected.");
@@ -200,6 +206,7 @@ void client() {
   Serial2.setFIFOSize(1024);
   Serial2.begin(baud_rate, SERIAL_8N1);
 #endif
+  reliable_serial2.transport().setPacingRate(pacing_rate);
   reliable_serial2.begin();
   LinkStream link = reliable_serial2.connectOrDie();
   CHECK_EQ(link.status(), LinkStatus::kConnected);
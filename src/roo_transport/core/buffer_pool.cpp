@@ -0,0 +1,148 @@
+#include "roo_transport/core/buffer_pool.h"
+
+#include <new>
+
+#include "roo_logging.h"
+
+namespace roo_transport {
+
+namespace {
+
+void UpdateMax(roo::atomic<size_t>& max, size_t value) {
+  size_t current = max.load();
+  while (value > current && !max.compare_exchange_weak(current, value)) {
+  }
+}
+
+}  // namespace
+
+void BufferPool::SlotStack::push(BufferPool& pool, uint16_t slot) {
+  uint32_t head = head_.load();
+  while (true) {
+    pool.next_[slot].store((uint16_t)head);
+    uint32_t new_head = ((head & 0xFFFF0000) + 0x10000) | (slot + 1);
+    if (head_.compare_exchange_weak(head, new_head)) return;
+  }
+}
+
+bool BufferPool::SlotStack::pop(BufferPool& pool, uint16_t& slot) {
+  uint32_t head = head_.load();
+  while (true) {
+    uint16_t top = (uint16_t)head;
+    if (top == 0) return false;
+    // If the top slot gets popped (and possibly pushed back) concurrently, the
+    // tag changes, and the CAS below fails.
+    uint16_t next = pool.next_[top - 1].load();
+    uint32_t new_head = ((head & 0xFFFF0000) + 0x10000) | next;
+    if (head_.compare_exchange_weak(head, new_head)) {
+      slot = top - 1;
+      return true;
+    }
+  }
+}
+
+BufferPool::BufferPool(size_t block_size, size_t max_blocks,
+                       uint16_t max_retained_blocks)
+    : block_size_(block_size),
+      max_blocks_(max_blocks),
+      memory_(new void*[max_retained_blocks]()),
+      next_(new roo::atomic<uint16_t>[max_retained_blocks]),
+      blocks_in_use_(0),
+      high_water_mark_(0),
+      blocks_retained_(0) {
+  // Slot indexes, plus one, must fit in 16 bits.
+  CHECK_LT(max_retained_blocks, 0xFFFF);
+  for (uint16_t i = max_retained_blocks; i > 0; --i) {
+    vacant_.push(*this, i - 1);
+  }
+}
+
+BufferPool::~BufferPool() {
+  CHECK_EQ(blocks_in_use(), 0u);
+  trim();
+}
+
+void* BufferPool::allocate() {
+  size_t in_use = blocks_in_use_.load();
+  do {
+    if (in_use >= max_blocks_) return nullptr;
+  } while (!blocks_in_use_.compare_exchange_weak(in_use, in_use + 1));
+  void* block;
+  uint16_t slot;
+  if (retained_.pop(*this, slot)) {
+    --blocks_retained_;
+    block = memory_[slot];
+    vacant_.push(*this, slot);
+  } else {
+    block = ::operator new(block_size_, std::nothrow);
+    if (block == nullptr) {
+      --blocks_in_use_;
+      return nullptr;
+    }
+  }
+  UpdateMax(high_water_mark_, in_use + 1);
+  return block;
+}
+
+void BufferPool::release(void* block) {
+  if (block == nullptr) return;
+  --blocks_in_use_;
+  uint16_t slot;
+  if (vacant_.pop(*this, slot)) {
+    memory_[slot] = block;
+    ++blocks_retained_;
+    retained_.push(*this, slot);
+    return;
+  }
+  ::operator delete(block);
+}
+
+void BufferPool::trim() {
+  uint16_t slot;
+  while (retained_.pop(*this, slot)) {
+    --blocks_retained_;
+    ::operator delete(memory_[slot]);
+    memory_[slot] = nullptr;
+    vacant_.push(*this, slot);
+  }
+}
+
+BufferPool::Quota::Quota(BufferPool& pool, size_t max_blocks)
+    : pool_(pool),
+      max_blocks_(max_blocks),
+      blocks_in_use_(0),
+      high_water_mark_(0) {}
+
+void* BufferPool::Quota::allocate(bool ignore_limit) {
+  size_t in_use = ++blocks_in_use_;
+  if (!ignore_limit && in_use > max_blocks_) {
+    --blocks_in_use_;
+    return nullptr;
+  }
+  void* block = pool_.allocate();
+  if (block == nullptr) {
+    --blocks_in_use_;
+    return nullptr;
+  }
+  UpdateMax(high_water_mark_, in_use);
+  return block;
+}
+
+void BufferPool::Quota::release(void* block) {
+  if (block == nullptr) return;
+  pool_.release(block);
+  --blocks_in_use_;
+}
+
+BufferPool& PacketBufferPool() {
+  // Never destroyed, so that it outlives any static links and framers.
+  static BufferPool* pool = new BufferPool(
+      kPacketBufferBlockSize,
+      ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS == 0
+          ? BufferPool::kUnlimited
+          : ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS,
+      ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_RETAINED_BLOCKS);
+  return *pool;
+}
+
+}  // namespace roo_transport
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstddef>
+#include <memory>
+
+#include "roo_backport/byte.h"
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+
+/// If non-zero, bounds the packet buffers of all the links combined. Note
+/// that a single link buffer of kBufferSize64KB or larger takes 256 blocks or
+/// more. Zero (the default) means unbounded, i.e. limited by the heap only.
+#ifndef ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS
+#define ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS 0
+#endif
+
+#ifndef ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_RETAINED_BLOCKS
+#define ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_RETAINED_BLOCKS 8
+#endif
+
+namespace roo_transport {
+
+/// Lock-free allocator of fixed-size memory blocks, shared by multiple users
+/// (e.g. by the packet buffers of all link transports).
+///
+/// The pool hands out up to `max_blocks` blocks (possibly `kUnlimited`),
+/// bounding the total memory used. The memory is allocated from the heap on
+/// demand. Released blocks are retained for reuse, up to
+/// `max_retained_blocks`; the excess is returned to the heap, so that memory
+/// that is no longer needed becomes available to the rest of the application.
+/// Allocation and release never block, except for the heap operations
+/// themselves.
+///
+/// Usage by individual clients can be tracked and limited by means of quotas.
+class BufferPool {
+ public:
+  class Quota;
+
+  static constexpr size_t kUnlimited = (size_t)-1;
+
+  BufferPool(size_t block_size, size_t max_blocks,
+             uint16_t max_retained_blocks);
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  ~BufferPool();
+
+  /// Returns a block of `block_size()` bytes, or nullptr if the pool is
+  /// exhausted, or out of memory.
+  void* allocate();
+
+  /// Returns the block, previously obtained from `allocate()`, to the pool.
+  void release(void* block);
+
+  /// Returns all the retained blocks to the heap.
+  void trim();
+
+  size_t block_size() const { return block_size_; }
+
+  size_t max_blocks() const { return max_blocks_; }
+
+  /// Number of blocks currently allocated (and not yet released).
+  size_t blocks_in_use() const { return blocks_in_use_; }
+
+  /// Maximum number of blocks that have been in use at the same time.
+  size_t high_water_mark() const { return high_water_mark_; }
+
+  /// Number of released blocks retained for reuse.
+  size_t blocks_retained() const { return blocks_retained_; }
+
+ private:
+  // Lock-free stack of slots for the retained blocks, linked by indexes. The
+  // head combines the index of the top slot (plus one, so that zero means
+  // 'empty') with a tag that gets incremented on every update, to prevent the
+  // ABA problem.
+  class SlotStack {
+   public:
+    SlotStack() : head_(0) {}
+
+    void push(BufferPool& pool, uint16_t slot);
+
+    // Returns false if empty.
+    bool pop(BufferPool& pool, uint16_t& slot);
+
+   private:
+    roo::atomic<uint32_t> head_;
+  };
+
+  const size_t block_size_;
+  const size_t max_blocks_;
+
+  // Retained blocks, indexed by slot. Only meaningful for the slots in
+  // retained_.
+  std::unique_ptr<void*[]> memory_;
+
+  // Links of the slot stacks.
+  std::unique_ptr<roo::atomic<uint16_t>[]> next_;
+
+  // Slots holding retained blocks, ready for reuse.
+  SlotStack retained_;
+
+  // Slots available to hold released blocks.
+  SlotStack vacant_;
+
+  roo::atomic<size_t> blocks_in_use_;
+  roo::atomic<size_t> high_water_mark_;
+  roo::atomic<size_t> blocks_retained_;
+};
+
+/// Accounts for the blocks used by one client of the pool (e.g. by one link),
+/// optionally limiting their number, and tracking the high-water mark.
+///
+/// Thread-safe.
+class BufferPool::Quota {
+ public:
+  static constexpr size_t kUnlimited = BufferPool::kUnlimited;
+
+  explicit Quota(BufferPool& pool, size_t max_blocks = kUnlimited);
+
+  Quota(const Quota&) = delete;
+  Quota& operator=(const Quota&) = delete;
+
+  /// Changes the limit. If the new limit is lower than the current usage,
+  /// subsequent allocations fail until enough blocks have been released.
+  void setLimit(size_t max_blocks) { max_blocks_ = max_blocks; }
+
+  size_t limit() const { return max_blocks_; }
+
+  /// Returns a block from the pool, or nullptr if the quota has been reached
+  /// (unless `ignore_limit` is true), or if the pool is exhausted.
+  void* allocate(bool ignore_limit = false);
+
+  /// Returns the block, previously obtained from `allocate()`, to the pool.
+  void release(void* block);
+
+  /// Number of blocks currently allocated through this quota.
+  size_t blocks_in_use() const { return blocks_in_use_; }
+
+  /// Maximum number of blocks that have been allocated through this quota at
+  /// the same time.
+  size_t high_water_mark() const { return high_water_mark_; }
+
+  BufferPool& pool() const { return pool_; }
+
+ private:
+  BufferPool& pool_;
+  roo::atomic<size_t> max_blocks_;
+  roo::atomic<size_t> blocks_in_use_;
+  roo::atomic<size_t> high_water_mark_;
+};
+
+/// Size of the blocks of the packet buffer pool. Fits a packet of the maximum
+/// size, along with its framing or bookkeeping data.
+static constexpr size_t kPacketBufferBlockSize = 288;
+
+/// Returns the process-wide pool of packet-sized blocks, which link
+/// transports allocate their buffers from. Unbounded by default; its capacity
+/// can be configured by defining ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS
+/// and ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_RETAINED_BLOCKS.
+BufferPool& PacketBufferPool();
+
+}  // namespace roo_transport
@@ -0,0 +1,37 @@
+#include "roo_transport/core/cancellation_token.h"
+
+namespace roo_transport {
+
+void CancellationToken::cancel() {
+  cancelled_ = true;
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  for (Registration* r = registrations_; r != nullptr; r = r->next_) {
+    r->wakeup_fn_();
+  }
+}
+
+CancellationToken::Registration::Registration(
+    const CancellationToken* token, std::function<void()> wakeup_fn)
+    : token_(token),
+      wakeup_fn_(std::move(wakeup_fn)),
+      prev_(nullptr),
+      next_(nullptr) {
+  if (token_ == nullptr) return;
+  roo::lock_guard<roo::mutex> guard(token_->mutex_);
+  next_ = token_->registrations_;
+  if (next_ != nullptr) next_->prev_ = this;
+  token_->registrations_ = this;
+}
+
+CancellationToken::Registration::~Registration() {
+  if (token_ == nullptr) return;
+  roo::lock_guard<roo::mutex> guard(token_->mutex_);
+  if (prev_ != nullptr) {
+    prev_->next_ = next_;
+  } else {
+    token_->registrations_ = next_;
+  }
+  if (next_ != nullptr) next_->prev_ = prev_;
+}
+
+}  // namespace roo_transport
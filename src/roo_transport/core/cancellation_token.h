@@ -0,0 +1,80 @@
+#pragma once
+
+#include <functional>
+
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/mutex.h"
+
+namespace roo_transport {
+
+/// Allows one thread to abort blocking operations issued by other threads.
+///
+/// A token can be passed to the deadline-aware blocking calls, such as
+/// `LinkOutputStream::write(buf, count, deadline, token)`. Calling `cancel()`
+/// wakes up all operations currently blocked with that token, and makes
+/// subsequent operations using it return immediately, until `reset()` is
+/// called. Cancelled operations return what they managed to transfer so far;
+/// the stream status is not affected.
+///
+/// A single token may be shared by any number of operations and threads, e.g.
+/// to abort all the work of a thread pool at shutdown.
+class CancellationToken {
+ public:
+  class Registration;
+
+  CancellationToken() : cancelled_(false), registrations_(nullptr) {}
+
+  CancellationToken(const CancellationToken&) = delete;
+  CancellationToken& operator=(const CancellationToken&) = delete;
+
+  /// Cancels the operations using this token, waking up those that are
+  /// currently blocked.
+  void cancel();
+
+  /// Returns true if `cancel()` has been called (and not followed by
+  /// `reset()`).
+  bool isCancelled() const { return cancelled_; }
+
+  /// Re-arms the token, so that it can be used for new operations.
+  void reset() { cancelled_ = false; }
+
+ private:
+  friend class Registration;
+
+  roo::atomic<bool> cancelled_;
+
+  mutable roo::mutex mutex_;
+
+  // Intrusive list of the wake-up callbacks of the currently blocked
+  // operations. Guarded by mutex_.
+  mutable Registration* registrations_;
+};
+
+/// RAII registration of a wake-up callback with a cancellation token. Used by
+/// the implementations of blocking operations.
+///
+/// The callback is invoked (from the thread calling `cancel()`) while the
+/// registration is alive. The destructor waits for any in-progress callback
+/// to complete. Therefore, the registration must not be created or destroyed
+/// while holding a lock that the callback acquires.
+class CancellationToken::Registration {
+ public:
+  /// Registers `wakeup_fn` with `token`. If `token` is null, does nothing.
+  Registration(const CancellationToken* token, std::function<void()> wakeup_fn);
+
+  ~Registration();
+
+  Registration(const Registration&) = delete;
+  Registration& operator=(const Registration&) = delete;
+
+ private:
+  friend class CancellationToken;
+
+  const CancellationToken* token_;
+  std::function<void()> wakeup_fn_;
+  Registration* prev_;
+  Registration* next_;
+};
+
+}  // namespace roo_transport
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <functional>
+
+#include "roo_io/status.h"
+
+namespace roo_transport {
+
+/// Completion callback of an asynchronous read or write operation.
+///
+/// `count` is the number of bytes transferred. It is positive when `status`
+/// is `kOk`, and zero otherwise (e.g. `kEndOfStream` or `kConnectionError`).
+using IoCompletionFn = std::function<void(size_t count, roo_io::Status status)>;
+
+}  // namespace roo_transport
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "roo_backport.h"
+#include "roo_backport/byte.h"
+
+namespace roo_transport {
+
+/// Describes one contiguous segment of data in a vectored (scatter/gather)
+/// write, in the spirit of POSIX `struct iovec`.
+///
+/// Segments with `size == 0` are permitted, and are skipped; their `data` may
+/// then be null.
+struct IoVec {
+  const roo::byte* data;
+  size_t size;
+};
+
+}  // namespace roo_transport
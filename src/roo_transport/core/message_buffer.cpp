@@ -0,0 +1,146 @@
+#include "roo_transport/core/message_buffer.h"
+
+#include <utility>
+
+#include "roo_logging.h"
+
+namespace roo_transport {
+
+MessageBuffer::MessageBuffer(const MessageBuffer& other)
+    : slot_(other.slot_), offset_(other.offset_), size_(other.size_) {
+  if (slot_ != nullptr) {
+    slot_->refcount.fetch_add(1, roo::memory_order_relaxed);
+  }
+}
+
+MessageBuffer::MessageBuffer(MessageBuffer&& other) noexcept
+    : slot_(other.slot_), offset_(other.offset_), size_(other.size_) {
+  other.slot_ = nullptr;
+  other.offset_ = 0;
+  other.size_ = 0;
+}
+
+MessageBuffer& MessageBuffer::operator=(const MessageBuffer& other) {
+  if (this != &other) {
+    MessageBuffer copy(other);
+    *this = std::move(copy);
+  }
+  return *this;
+}
+
+MessageBuffer& MessageBuffer::operator=(MessageBuffer&& other) noexcept {
+  if (this != &other) {
+    reset();
+    std::swap(slot_, other.slot_);
+    std::swap(offset_, other.offset_);
+    std::swap(size_, other.size_);
+  }
+  return *this;
+}
+
+void MessageBuffer::reset() {
+  if (slot_ == nullptr) return;
+  if (slot_->refcount.fetch_sub(1, roo::memory_order_acq_rel) == 1) {
+    slot_->pool->release(slot_);
+  }
+  slot_ = nullptr;
+  offset_ = 0;
+  size_ = 0;
+}
+
+const roo::byte* MessageBuffer::data() const {
+  return slot_ == nullptr ? nullptr : slot_->data + offset_;
+}
+
+roo::byte* MessageBuffer::mutable_data() {
+  DCHECK(unique());
+  return slot_->data + offset_;
+}
+
+size_t MessageBuffer::capacity() const {
+  return slot_ == nullptr ? 0 : slot_->pool->buffer_capacity() - offset_;
+}
+
+void MessageBuffer::resize(size_t size) {
+  CHECK_LE(size, capacity());
+  size_ = size;
+}
+
+bool MessageBuffer::unique() const {
+  return slot_ != nullptr &&
+         slot_->refcount.load(roo::memory_order_acquire) == 1;
+}
+
+MessageBuffer MessageBuffer::slice(size_t offset, size_t len) const {
+  CHECK_LE(offset, size_);
+  CHECK_LE(len, size_ - offset);
+  if (slot_ == nullptr) return MessageBuffer();
+  slot_->refcount.fetch_add(1, roo::memory_order_relaxed);
+  return MessageBuffer(slot_, offset_ + offset, len);
+}
+
+MessageBufferPool::MessageBufferPool(size_t buffer_count,
+                                     size_t buffer_capacity)
+    : buffer_count_(buffer_count),
+      buffer_capacity_(buffer_capacity),
+      slab_(new roo::byte[buffer_count * buffer_capacity]),
+      slots_(new MessageBuffer::Slot[buffer_count]),
+      free_(nullptr),
+      available_(buffer_count) {
+  CHECK_GT(buffer_count, 0);
+  for (size_t i = buffer_count; i > 0; --i) {
+    MessageBuffer::Slot& slot = slots_[i - 1];
+    slot.pool = this;
+    slot.data = &slab_[(i - 1) * buffer_capacity];
+    slot.refcount = 0;
+    slot.next_free = free_;
+    free_ = &slot;
+  }
+}
+
+MessageBufferPool::~MessageBufferPool() {
+  CHECK_EQ(available_, buffer_count_)
+      << "Message buffers must be released before their pool is destroyed";
+}
+
+MessageBuffer MessageBufferPool::tryAcquire() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  return take();
+}
+
+MessageBuffer MessageBufferPool::acquire(roo_time::Uptime deadline) {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  while (free_ == nullptr) {
+    if (deadline == roo_time::Uptime::Max()) {
+      released_.wait(guard);
+    } else if (released_.wait_until(guard, deadline) ==
+               roo::cv_status::timeout) {
+      break;
+    }
+  }
+  return take();
+}
+
+size_t MessageBufferPool::available() const {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  return available_;
+}
+
+MessageBuffer MessageBufferPool::take() {
+  if (free_ == nullptr) return MessageBuffer();
+  MessageBuffer::Slot* slot = free_;
+  free_ = slot->next_free;
+  --available_;
+  slot->refcount.store(1, roo::memory_order_relaxed);
+  return MessageBuffer(slot, 0, 0);
+}
+
+void MessageBufferPool::release(MessageBuffer::Slot* slot) {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  slot->next_free = free_;
+  free_ = slot;
+  ++available_;
+  released_.notify_one();
+}
+
+}  // namespace roo_transport
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "roo_backport.h"
+#include "roo_backport/byte.h"
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_time.h"
+
+namespace roo_transport {
+
+class MessageBufferPool;
+
+/// Reference-counted handle to a message buffer from a `MessageBufferPool`.
+///
+/// Copying the handle shares the underlying buffer (without copying the
+/// data); the buffer returns to its pool when the last handle referring to it
+/// is destroyed or reset. Handles may be passed between threads, e.g. to hand
+/// a received message off to a worker thread; the reference counting is
+/// thread-safe. The contents must not be modified once the buffer is shared.
+///
+/// A default-constructed handle is null.
+class MessageBuffer {
+ public:
+  MessageBuffer() : slot_(nullptr), offset_(0), size_(0) {}
+
+  MessageBuffer(const MessageBuffer& other);
+  MessageBuffer(MessageBuffer&& other) noexcept;
+
+  MessageBuffer& operator=(const MessageBuffer& other);
+  MessageBuffer& operator=(MessageBuffer&& other) noexcept;
+
+  ~MessageBuffer() { reset(); }
+
+  /// Releases the reference to the buffer, making this handle null.
+  void reset();
+
+  explicit operator bool() const { return slot_ != nullptr; }
+
+  /// The message content.
+  const roo::byte* data() const;
+
+  size_t size() const { return size_; }
+
+  /// Writable access to the content, for the sole owner of the buffer (e.g.
+  /// while it is being filled).
+  roo::byte* mutable_data();
+
+  /// The maximum size that the content can be resized to.
+  size_t capacity() const;
+
+  /// Sets the size of the content. Must not exceed `capacity()`.
+  void resize(size_t size);
+
+  /// Returns true if this is the only handle referring to the buffer.
+  bool unique() const;
+
+  /// Returns a handle to the specified range of the content, sharing the
+  /// buffer with this one.
+  MessageBuffer slice(size_t offset, size_t len) const;
+
+  /// Returns a handle to the content past the specified offset, sharing the
+  /// buffer with this one.
+  MessageBuffer slice(size_t offset) const {
+    return slice(offset, size_ - offset);
+  }
+
+ private:
+  friend class MessageBufferPool;
+
+  struct Slot {
+    MessageBufferPool* pool;
+    roo::byte* data;
+    roo::atomic<uint32_t> refcount;
+    Slot* next_free;
+  };
+
+  MessageBuffer(Slot* slot, size_t offset, size_t size)
+      : slot_(slot), offset_(offset), size_(size) {}
+
+  Slot* slot_;
+  size_t offset_;
+  size_t size_;
+};
+
+/// Fixed-size pool of message buffers, of equal capacity, allocated up front
+/// as a single slab, so that receiving messages involves no heap allocations.
+///
+/// Thread-safe. Must outlive all the buffers obtained from it.
+class MessageBufferPool {
+ public:
+  MessageBufferPool(size_t buffer_count, size_t buffer_capacity);
+
+  ~MessageBufferPool();
+
+  MessageBufferPool(const MessageBufferPool&) = delete;
+  MessageBufferPool& operator=(const MessageBufferPool&) = delete;
+
+  /// Returns an empty buffer, or a null handle if all the buffers are in use.
+  MessageBuffer tryAcquire();
+
+  /// Returns an empty buffer, blocking until one becomes available, or until
+  /// the deadline passes (in which case, returns a null handle).
+  MessageBuffer acquire(roo_time::Uptime deadline = roo_time::Uptime::Max());
+
+  size_t buffer_count() const { return buffer_count_; }
+
+  size_t buffer_capacity() const { return buffer_capacity_; }
+
+  /// Number of buffers not currently in use.
+  size_t available() const;
+
+ private:
+  friend class MessageBuffer;
+
+  // Must hold mutex_.
+  MessageBuffer take();
+
+  void release(MessageBuffer::Slot* slot);
+
+  size_t buffer_count_;
+  size_t buffer_capacity_;
+  std::unique_ptr<roo::byte[]> slab_;
+  std::unique_ptr<MessageBuffer::Slot[]> slots_;
+
+  mutable roo::mutex mutex_;
+  roo::condition_variable released_;
+  MessageBuffer::Slot* free_;
+  size_t available_;
+};
+
+}  // namespace roo_transport
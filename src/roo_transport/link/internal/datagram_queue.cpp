@@ -0,0 +1,69 @@
+#include "roo_transport/link/internal/datagram_queue.h"
+
+#include <string.h>
+
+#include "roo_io/memory/store.h"
+#include "roo_logging.h"
+#include "roo_transport/link/internal/protocol.h"
+
+namespace roo_transport {
+namespace internal {
+
+DatagramQueue::DatagramQueue(BufferPool::Quota& quota)
+    : quota_(quota), entries_(), head_(0), size_(0), dropped_(0) {}
+
+DatagramQueue::~DatagramQueue() { clear(); }
+
+bool DatagramQueue::push(uint16_t header, const IoVec* iov, size_t iovcnt,
+                         roo_time::Uptime deadline) {
+  if (size_ == kCapacity) {
+    // The oldest one is the most stale; make room for the new one.
+    dropFront();
+    ++dropped_;
+  }
+  roo::byte* data = (roo::byte*)quota_.allocate();
+  if (data == nullptr) {
+    ++dropped_;
+    return false;
+  }
+  roo_io::StoreBeU16(header, data);
+  size_t size = 2;
+  for (size_t i = 0; i < iovcnt; ++i) {
+    if (iov[i].size == 0) continue;
+    CHECK_LE(size + iov[i].size, kMaxDatagramSize + 2);
+    memcpy(data + size, iov[i].data, iov[i].size);
+    size += iov[i].size;
+  }
+  Entry& entry = entries_[(head_ + size_) % kCapacity];
+  entry.data = data;
+  entry.size = size;
+  entry.deadline = deadline;
+  ++size_;
+  return true;
+}
+
+size_t DatagramQueue::pop(roo::byte* buf, roo_time::Uptime now) {
+  while (size_ > 0 && entries_[head_].deadline < now) {
+    dropFront();
+    ++dropped_;
+  }
+  if (size_ == 0) return 0;
+  size_t size = entries_[head_].size;
+  memcpy(buf, entries_[head_].data, size);
+  dropFront();
+  return size;
+}
+
+void DatagramQueue::clear() {
+  while (size_ > 0) dropFront();
+}
+
+void DatagramQueue::dropFront() {
+  quota_.release(entries_[head_].data);
+  entries_[head_].data = nullptr;
+  head_ = (head_ + 1) % kCapacity;
+  --size_;
+}
+
+}  // namespace internal
+}  // namespace roo_transport
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "roo_backport.h"
+#include "roo_backport/byte.h"
+#include "roo_time.h"
+#include "roo_transport/core/buffer_pool.h"
+#include "roo_transport/core/iovec.h"
+
+namespace roo_transport {
+namespace internal {
+
+// Bounded queue of outgoing datagrams (see kDatagramPacket), waiting for the
+// sender thread. Each datagram has a deadline, past which it is dropped rather
+// than sent, so that stale data (e.g. an outdated sensor sample) doesn't
+// delay the fresher one. When the queue is full, the oldest datagram gets
+// dropped to make room for the new one, for the same reason.
+//
+// The packets are stored in blocks allocated from the buffer pool, on demand,
+// and released as soon as they have been sent or dropped.
+//
+// Not thread-safe.
+class DatagramQueue {
+ public:
+  static constexpr size_t kCapacity = 8;
+
+  // The packet buffers are accounted to the specified quota.
+  explicit DatagramQueue(BufferPool::Quota& quota);
+
+  ~DatagramQueue();
+
+  DatagramQueue(const DatagramQueue&) = delete;
+  DatagramQueue& operator=(const DatagramQueue&) = delete;
+
+  // Enqueues the packet consisting of the specified header, followed by the
+  // concatenated segments, which must fit in kMaxDatagramSize. Returns false
+  // if there is no memory for it.
+  bool push(uint16_t header, const IoVec* iov, size_t iovcnt,
+            roo_time::Uptime deadline);
+
+  // Drops the expired datagrams, and moves the first remaining one (if any)
+  // to buf, returning its size, or zero if the queue is empty.
+  size_t pop(roo::byte* buf, roo_time::Uptime now);
+
+  // Drops all pending datagrams.
+  void clear();
+
+  bool empty() const { return size_ == 0; }
+
+  // Number of datagrams dropped, either because they have expired, or because
+  // the queue overflowed.
+  uint32_t dropped() const { return dropped_; }
+
+ private:
+  struct Entry {
+    Entry() : data(nullptr), size(0), deadline(roo_time::Uptime::Start()) {}
+
+    roo::byte* data;
+    uint8_t size;
+    roo_time::Uptime deadline;
+  };
+
+  void dropFront();
+
+  BufferPool::Quota& quota_;
+  Entry entries_[kCapacity];
+  size_t head_;
+  size_t size_;
+  uint32_t dropped_;
+};
+
+}  // namespace internal
+}  // namespace roo_transport
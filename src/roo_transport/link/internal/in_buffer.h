@@ -10,28 +10,40 @@ namespace internal {
 
 class InBuffer {
  public:
-  enum Type { kUnset, kData, kFin };
-  InBuffer() : type_(kUnset), size_(0) {}
+  // kConsumed indicates data that has already been read out of order (see
+  // kMessageStartPacket), but that can't be removed from the ring yet,
+  // because some preceding packets are still missing.
+  enum Type { kUnset, kData, kFin, kConsumed };
+  InBuffer() : type_(kUnset), size_(0), message_start_(false) {}
 
   void clear() {
     type_ = kUnset;
     size_ = 0;
+    message_start_ = false;
   }
 
-  void set(Type type, const roo::byte* payload, uint8_t size) {
+  void set(Type type, const roo::byte* payload, uint8_t size,
+           bool message_start) {
     CHECK_LE(size, 248);
     memcpy(payload_, payload, size);
     type_ = type;
     size_ = size;
+    message_start_ = message_start;
   }
 
+  void markConsumed() { type_ = kConsumed; }
+
   const roo::byte* data() const { return payload_; }
   Type type() const { return type_; }
   uint8_t size() const { return size_; }
 
+  // Whether the payload begins a new message.
+  bool message_start() const { return message_start_; }
+
  private:
   Type type_;
   uint8_t size_;
+  bool message_start_;
   roo::byte payload_[248];
 };
 
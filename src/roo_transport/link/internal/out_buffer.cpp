@@ -43,8 +43,10 @@ roo_time::Duration Backoff(int retry_count) {
 
 }  // namespace
 
-void OutBuffer::markSent(roo_time::Uptime now) {
+void OutBuffer::markSent(roo_time::Uptime now, uint32_t send_serial) {
   if (send_counter_ < 255) ++send_counter_;
+  send_serial_ = send_serial;
+  send_time_ = now;
   expiration_ = now + Backoff(send_counter_);
 }
 
@@ -54,5 +56,11 @@ void OutBuffer::markFinal() {
   roo_io::StoreBeU16(raw, payload_);
 }
 
+void OutBuffer::markMessageStart() {
+  uint16_t raw = roo_io::LoadBeU16(payload_);
+  SetPacketHeaderTypeMessageStart(raw);
+  roo_io::StoreBeU16(raw, payload_);
+}
+
 }  // namespace internal
 }  // namespace roo_transport
\ No newline at end of file
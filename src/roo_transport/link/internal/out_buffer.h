@@ -17,7 +17,9 @@ class OutBuffer {
         finished_(false),
         final_(false),
         expiration_(roo_time::Uptime::Start()),
-        send_counter_(0) {}
+        send_counter_(0),
+        send_serial_(0),
+        send_time_(roo_time::Uptime::Start()) {}
 
   void init(SeqNum seq_id, bool control_bit);
 
@@ -50,6 +52,9 @@ class OutBuffer {
 
   void markFinal();
 
+  // Marks the packet as the first one of a message (see kMessageStartPacket).
+  void markMessageStart();
+
   void ack() { acked_ = true; }
 
   const roo::byte* data() const { return payload_; }
@@ -57,7 +62,9 @@ class OutBuffer {
 
   roo_time::Uptime expiration() const { return expiration_; }
 
-  void markSent(roo_time::Uptime now);
+  // Records a (re)transmission of the packet, with the specified transmission
+  // serial number (see send_serial()).
+  void markSent(roo_time::Uptime now, uint32_t send_serial);
 
   // Updates the timeout of the (already sent) packet to be retransmitted
   // immediately.
@@ -69,6 +76,14 @@ class OutBuffer {
   // How many times the packet has been already sent.
   uint8_t send_counter() const { return send_counter_; }
 
+  // Serial number of the most recent transmission of this packet. Serial
+  // numbers are assigned by the transmitter to every packet sent, including
+  // retransmissions, so they reflect the order in which the packets went out.
+  uint32_t send_serial() const { return send_serial_; }
+
+  // Time of the most recent transmission of this packet.
+  roo_time::Uptime send_time() const { return send_time_; }
+
  private:
   uint8_t size_;
   bool acked_;
@@ -92,6 +107,9 @@ class OutBuffer {
   roo_time::Uptime expiration_;
 
   uint8_t send_counter_;
+
+  uint32_t send_serial_;
+  roo_time::Uptime send_time_;
 };
 
 }  // namespace internal
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "roo_time.h"
+
+namespace roo_transport {
+namespace internal {
+
+// Token-bucket rate limiter for the outgoing packets, so that they leave at
+// (no more than) the line rate of the underlying transport, rather than
+// queueing up in its output buffers, delaying the latency-sensitive control
+// packets (acks and flow control) that follow.
+//
+// Implemented as a virtual clock (GCRA): each sent byte advances the
+// 'theoretical arrival time' by 1/rate; sending is allowed as long as that
+// time is no more than the burst allowance ahead of the real time.
+//
+// Not thread-safe; used by the sender thread only.
+class Pacer {
+ public:
+  Pacer()
+      : bytes_per_second_(0),
+        burst_us_(0),
+        tat_(roo_time::Uptime::Start()) {}
+
+  // Sets the rate. Zero disables pacing. The burst is the number of bytes
+  // that may be sent back-to-back after an idle period.
+  void setRate(uint32_t bytes_per_second, uint32_t burst_bytes) {
+    bytes_per_second_ = bytes_per_second;
+    burst_us_ = bytes_per_second == 0 ? 0 : costUs(burst_bytes);
+    tat_ = roo_time::Uptime::Start();
+  }
+
+  bool enabled() const { return bytes_per_second_ > 0; }
+
+  uint32_t bytes_per_second() const { return bytes_per_second_; }
+
+  // Returns zero if a packet can be sent at the specified time; otherwise,
+  // the delay, in microseconds, after which it can be sent.
+  long delayMicros(roo_time::Uptime now) const {
+    if (!enabled()) return 0;
+    int64_t allowed_at = tat_.inMicros() - burst_us_;
+    return now.inMicros() >= allowed_at ? 0 : allowed_at - now.inMicros();
+  }
+
+  // Accounts for a packet of the specified size, sent at the specified time.
+  // Control packets that bypass the pacer should still be accounted for, as
+  // they use the same line.
+  void consume(size_t bytes, roo_time::Uptime now) {
+    if (!enabled()) return;
+    if (tat_ < now) tat_ = now;
+    tat_ = tat_ + roo_time::Micros(costUs(bytes));
+  }
+
+ private:
+  int64_t costUs(size_t bytes) const {
+    return (int64_t)bytes * 1000000 / bytes_per_second_;
+  }
+
+  uint32_t bytes_per_second_;
+  int64_t burst_us_;
+
+  // Theoretical arrival time of the next byte.
+  roo_time::Uptime tat_;
+};
+
+}  // namespace internal
+}  // namespace roo_transport
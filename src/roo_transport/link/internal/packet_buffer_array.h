@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+#include "roo_logging.h"
+#include "roo_time.h"
+#include "roo_transport/core/buffer_pool.h"
+#include "roo_transport/link/internal/in_buffer.h"
+#include "roo_transport/link/internal/out_buffer.h"
+#include "roo_transport/link/internal/ring_buffer.h"
+
+namespace roo_transport {
+namespace internal {
+
+// Packet buffers get allocated in blocks of 2^kPacketBuffersPerBlockLog2.
+static constexpr int kPacketBuffersPerBlockLog2 = 0;
+
+// Blocks that are no longer used get released after this much inactivity.
+static constexpr long kPacketBufferIdleTimeoutMicros = 1000000;
+
+static_assert((sizeof(InBuffer) << kPacketBuffersPerBlockLog2) <=
+                  kPacketBufferBlockSize,
+              "InBuffers don't fit in the packet buffer pool blocks");
+
+static_assert((sizeof(OutBuffer) << kPacketBuffersPerBlockLog2) <=
+                  kPacketBufferBlockSize,
+              "OutBuffers don't fit in the packet buffer pool blocks");
+
+// Array of packet buffers (InBuffers or OutBuffers), indexed by the ring
+// buffer offsets. The memory gets committed lazily, one block at a time, as
+// the ring advances into it, and gets released after the buffers are no
+// longer used, so that idle links don't pin the memory of their entire
+// windows. The blocks come from the process-wide PacketBufferPool(), and are
+// accounted to the specified quota (if any).
+//
+// Unless constructed with reserve = false, the array also holds on to one
+// block of its own, taken from the pool up front (and regardless of the
+// quota), and kept when the other blocks get released. It backs the buffer
+// for an empty ring when the pool or the quota is exhausted, so that the
+// link can always make progress.
+template <typename Buffer>
+class PacketBufferArray {
+ public:
+  PacketBufferArray(int capacity_log2, BufferPool::Quota* quota,
+                    bool reserve = true)
+      : quota_(quota),
+        block_size_log2_(std::min(capacity_log2, kPacketBuffersPerBlockLog2)),
+        block_count_(1 << (capacity_log2 - block_size_log2_)),
+        blocks_(new Buffer*[block_count_]()),
+        blocks_allocated_(0),
+        reserving_(reserve),
+        reserve_(reserve ? allocateMemory(true) : nullptr),
+        used_(false),
+        next_idle_check_(roo_time::Uptime::Start()) {}
+
+  PacketBufferArray(PacketBufferArray&& other)
+      : quota_(other.quota_),
+        block_size_log2_(other.block_size_log2_),
+        block_count_(other.block_count_),
+        blocks_(std::move(other.blocks_)),
+        blocks_allocated_(other.blocks_allocated_),
+        reserving_(other.reserving_),
+        reserve_(other.reserve_),
+        used_(other.used_),
+        next_idle_check_(other.next_idle_check_) {
+    other.block_count_ = 0;
+    other.blocks_allocated_ = 0;
+    other.reserve_ = nullptr;
+  }
+
+  // Takes over the blocks of the other array. Keeps this array's reserve
+  // block (if any), or otherwise takes over the other one's.
+  PacketBufferArray& operator=(PacketBufferArray&& other) {
+    releaseAll();
+    if (reserve_ == nullptr) {
+      reserve_ = other.reserve_;
+    } else {
+      releaseMemory(other.reserve_);
+    }
+    other.reserve_ = nullptr;
+    quota_ = other.quota_;
+    block_size_log2_ = other.block_size_log2_;
+    block_count_ = other.block_count_;
+    blocks_ = std::move(other.blocks_);
+    blocks_allocated_ = other.blocks_allocated_;
+    used_ = other.used_;
+    next_idle_check_ = other.next_idle_check_;
+    other.block_count_ = 0;
+    other.blocks_allocated_ = 0;
+    return *this;
+  }
+
+  ~PacketBufferArray() {
+    releaseAll();
+    releaseMemory(reserve_);
+  }
+
+  // The buffer must have been acquired.
+  Buffer& operator[](uint16_t offset) const {
+    Buffer* block = blocks_[offset >> block_size_log2_];
+    DCHECK(block != nullptr);
+    return block[offset & ((1 << block_size_log2_) - 1)];
+  }
+
+  // Makes sure that the buffer for the specified sequence number, about to be
+  // pushed to the ring, is backed by memory. If the quota has been reached,
+  // reclaims the blocks that the ring no longer uses. A buffer for an empty
+  // ring is allocated regardless of the quota, or, if the pool is exhausted,
+  // from the reserve block, so that the link can always make progress.
+  // Returns false if out of memory, or over quota.
+  bool acquire(SeqNum seq, const RingBuffer& ring) {
+    if (allocate(seq, false)) return true;
+    releaseUnused(ring);
+    return allocate(seq, ring.empty());
+  }
+
+  // Like acquire(), but regardless of the quota. Used when relocating
+  // buffers, which are released right afterwards.
+  bool acquireIgnoringQuota(SeqNum seq) { return allocate(seq, true); }
+
+  // Releases the blocks that don't contain any of the ring's used slots, if
+  // no buffers have been acquired for a while. Otherwise, updates
+  // next_check_micros to reflect when to check again.
+  void releaseIfIdle(const RingBuffer& ring, long& next_check_micros) {
+    if (blocks_allocated_ == 0) return;
+    roo_time::Uptime now = roo_time::Uptime::Now();
+    if (now < next_idle_check_) {
+      next_check_micros = std::min(next_check_micros,
+                                   (long)(next_idle_check_ - now).inMicros());
+      return;
+    }
+    if (!used_) {
+      releaseUnused(ring);
+      if (blocks_allocated_ == 0) return;
+    }
+    used_ = false;
+    next_idle_check_ = now + roo_time::Micros(kPacketBufferIdleTimeoutMicros);
+    next_check_micros =
+        std::min(next_check_micros, kPacketBufferIdleTimeoutMicros);
+  }
+
+  size_t blocks_allocated() const { return blocks_allocated_; }
+
+  BufferPool::Quota* quota() const { return quota_; }
+
+ private:
+  bool allocate(SeqNum seq, bool ignore_quota) {
+    used_ = true;
+    uint16_t offset = seq.raw() & ((block_count_ << block_size_log2_) - 1);
+    Buffer*& block = blocks_[offset >> block_size_log2_];
+    if (block != nullptr) return true;
+    void* mem = allocateMemory(ignore_quota);
+    if (mem == nullptr && ignore_quota && reserve_ != nullptr) {
+      mem = reserve_;
+      reserve_ = nullptr;
+    }
+    if (mem == nullptr) return false;
+    block = static_cast<Buffer*>(mem);
+    for (int i = 0; i < (1 << block_size_log2_); ++i) {
+      new (&block[i]) Buffer();
+    }
+    ++blocks_allocated_;
+    return true;
+  }
+
+  void releaseBlock(Buffer*& block) {
+    for (int i = 0; i < (1 << block_size_log2_); ++i) {
+      block[i].~Buffer();
+    }
+    if (reserving_ && reserve_ == nullptr) {
+      // Replenishes the reserve.
+      reserve_ = block;
+    } else {
+      releaseMemory(block);
+    }
+    block = nullptr;
+    --blocks_allocated_;
+  }
+
+  void* allocateMemory(bool ignore_quota) {
+    return quota_ != nullptr ? quota_->allocate(ignore_quota)
+                             : PacketBufferPool().allocate();
+  }
+
+  void releaseMemory(void* mem) {
+    if (quota_ != nullptr) {
+      quota_->release(mem);
+    } else {
+      PacketBufferPool().release(mem);
+    }
+  }
+
+  void releaseUnused(const RingBuffer& ring) {
+    uint16_t mask = ring.capacity() - 1;
+    uint16_t begin = ring.begin().raw();
+    for (size_t i = 0; i < block_count_; ++i) {
+      if (blocks_[i] == nullptr) continue;
+      bool used = false;
+      for (int j = 0; j < (1 << block_size_log2_); ++j) {
+        uint16_t offset = (i << block_size_log2_) + j;
+        if (((uint16_t)(offset - begin) & mask) < ring.slotsUsed()) {
+          used = true;
+          break;
+        }
+      }
+      if (!used) releaseBlock(blocks_[i]);
+    }
+  }
+
+  void releaseAll() {
+    for (size_t i = 0; i < block_count_; ++i) {
+      if (blocks_[i] != nullptr) releaseBlock(blocks_[i]);
+    }
+  }
+
+  BufferPool::Quota* quota_;
+  int block_size_log2_;
+  size_t block_count_;
+  std::unique_ptr<Buffer*[]> blocks_;
+  size_t blocks_allocated_;
+
+  // Whether to keep a reserve block.
+  bool reserving_;
+
+  // The reserve block, if held (i.e. not used by the buffers).
+  void* reserve_;
+
+  // Set whenever a buffer is acquired; cleared by the idle checks.
+  bool used_;
+
+  roo_time::Uptime next_idle_check_;
+};
+
+}  // namespace internal
+}  // namespace roo_transport
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "roo_backport.h"
+#include "roo_backport/byte.h"
+#include "roo_io/memory/load.h"
+#include "roo_io/memory/store.h"
 #include "roo_transport/link/internal/seq_num.h"
 
 namespace roo_transport {
@@ -34,7 +41,10 @@ namespace internal {
 // * 'final data', indicating end-of-stream;
 // * 'data ack', acknowledging reception of data packets;
 // * 'flow control', indicating the maximum sequence number that the recipient
-//   has space to receive.
+//   has space to receive;
+// * 'keepalive', used to detect dead peers;
+// * 'message start', a data packet that begins a new message (see below);
+// * 'datagram', carrying an unreliable, unsequenced message.
 //
 // Each packet consists of a 16-bit header, and an optional payload. The format
 // of the header is the following:
@@ -59,10 +69,12 @@ namespace internal {
 // clears the control bit in all its outgoing packets. This way, both sides can
 // easily identify and ignore cross-talk packets.
 //
-// Control bit is always zero for handshake packets, since the stream IDs are
-// not known yet at that point. During handshake, reception of a CONN packet
-// with stream ID and sequence ID identical to our own is interpreted as
-// cross-talk. (Probability of that happening by chance is less than 6e-14).
+// Handshake packets don't carry the control bit, since the stream IDs are not
+// known yet at that point. Instead, the bit is the 'keepalive' bit: it
+// indicates that the sender replies to keepalive pings (see 'keepalive'
+// packet). During handshake, reception of a CONN packet with stream ID and
+// sequence ID identical to our own is interpreted as cross-talk. (Probability
+// of that happening by chance is less than 6e-14).
 //
 // Packet payload formats and semantics:
 //
@@ -75,7 +87,17 @@ namespace internal {
 //   acknowledgement of the handshake (1 indicates that the ack is requested),
 //   and the 4 least significant bits communicate the peer's receive buffer
 //   size, as a power of 2 (valid values are 0-12, indicating buffer sizes of
-//   1-4096 packets). Remaining bits are reserved and must be zero.
+//   1-4096 packets). The bit 0x40 is the 'resume' bit: it is set in a
+//   handshake that carries both stream IDs of an already established session,
+//   to request the peer to resume that session (rather than to open a new
+//   one). The peer responds with a regular handshake ack, and both sides keep
+//   their send and receive queues, promptly retransmitting whatever has been
+//   lost in the meantime. The bit 0x20 is the 'unordered' bit: it indicates
+//   that the sender accepts messages out of order (see 'message start'
+//   packet). The bit 0x10 is the 'compact framing' bit: it indicates that the
+//   sender supports the compact message framing (see 'message start' packet);
+//   the compact framing is used in both directions if both peers set it.
+//   Remaining bits are reserved and must be zero.
 //
 // * 'data' packet:
 //   the payload is all application data. Must not be empty.
@@ -98,7 +120,49 @@ namespace internal {
 //
 // * 'flow control' packet:
 //   Sent by the recipient, to indicate maximum sequence number that the
-//   recipient has space to receive.
+//   recipient has space to receive. The (optional) payload consists of a
+//   single byte, whose 4 least significant bits communicate the recipient's
+//   new receive buffer size, as a power of 2 (like in the handshake). It is
+//   included after the recipient has resized its receive buffer within the
+//   session. Remaining bits are reserved and must be zero.
+//
+// * 'keepalive' packet:
+//   Header-only packet, sent by a peer that has not heard from the other side
+//   for a while, to verify that the other side is still alive. The least
+//   significant bit of the sequence number field indicates whether a reply is
+//   requested (1, 'ping'), or whether this packet is itself a reply (0,
+//   'pong'). The peer replies to pings regardless of whether it has
+//   keepalives enabled itself. Pings are only sent to peers that have set the
+//   'keepalive' bit in their handshake. Carries the sender's control bit, so
+//   that echoes of our own pings are not mistaken for replies. Keepalives are
+//   only sent within established sessions; any packet received from the peer
+//   counts as a sign of life, so keepalives are suppressed while data is
+//   flowing.
+//
+// * 'message start' packet:
+//   Like 'data' packet, but additionally indicates that the payload begins a
+//   new message. A message consists of its length in bytes, followed by the
+//   message content; it spans as many packets as needed, and the next message
+//   starts in a new packet. The length is a 32-bit integer (in the network
+//   order), or, with the compact framing, a LEB128 varint (1-5 bytes; 7 bits
+//   per byte, least significant group first, with the most significant bit
+//   set in all bytes but the last). Sent only to peers that have set the
+//   'unordered' bit in their handshake. Such peers may deliver the complete
+//   messages to the reader out of order, so that a lost packet only delays
+//   the message that it belongs to, rather than all the subsequent messages
+//   as well. (Other data is still delivered in order, and the retransmissions
+//   guarantee that all the messages get eventually delivered.) To other
+//   peers, messages are sent as regular data, framed the same way.
+//
+// * 'datagram' packet:
+//   Carries a single application message, outside of the reliable stream: it
+//   is not acknowledged, nor retransmitted, and it doesn't consume sequence
+//   numbers, so that its loss never delays any other data. The payload is the
+//   message (at most kMaxDatagramSize bytes; may be empty). The sequence
+//   number field is reserved, and must be zero. Datagrams are only exchanged
+//   within an established session; they carry the sender's control bit, and
+//   the recipient drops the ones that arrive before it has learned the
+//   peer's stream ID.
 
 enum PacketType {
   kDataPacket = 0,
@@ -106,8 +170,56 @@ enum PacketType {
   kDataAckPacket = 2,
   kHandshakePacket = 3,
   kFlowControlPacket = 4,
+  kKeepAlivePacket = 5,
+  kMessageStartPacket = 6,
+  kDatagramPacket = 7,
 };
 
+// Maximum payload size of a 'datagram' packet.
+static constexpr size_t kMaxDatagramSize = 248;
+
+// Maximum length of the message length prefix (see 'message start' packet).
+static constexpr size_t kMaxMessageSizePrefixLength = 5;
+
+// Writes the message length prefix to buf, which must have space for at least
+// kMaxMessageSizePrefixLength bytes. Returns the prefix length.
+inline size_t EncodeMessageSize(uint32_t size, bool compact, roo::byte* buf) {
+  if (!compact) {
+    roo_io::StoreBeU32(size, buf);
+    return 4;
+  }
+  size_t len = 0;
+  while (size >= 0x80) {
+    roo_io::StoreU8((uint8_t)(size | 0x80), buf + len++);
+    size >>= 7;
+  }
+  roo_io::StoreU8((uint8_t)size, buf + len++);
+  return len;
+}
+
+// Parses the message length prefix at the beginning of buf. Returns the prefix
+// length, or zero if buf doesn't begin with a complete, valid prefix.
+inline size_t DecodeMessageSize(const roo::byte* buf, size_t len, bool compact,
+                                uint32_t& size) {
+  if (!compact) {
+    if (len < 4) return 0;
+    size = roo_io::LoadBeU32(buf);
+    return 4;
+  }
+  uint32_t result = 0;
+  for (size_t i = 0; i < len && i < kMaxMessageSizePrefixLength; ++i) {
+    uint8_t b = roo_io::LoadU8(buf + i);
+    // The last byte carries the remaining 4 bits.
+    if (i == kMaxMessageSizePrefixLength - 1 && b > 0x0F) return 0;
+    result |= (uint32_t)(b & 0x7F) << (7 * i);
+    if ((b & 0x80) == 0) {
+      size = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
 inline bool GetPacketControlBit(uint16_t header) {
   return (header & 0x8000) != 0;
 }
@@ -128,5 +240,10 @@ inline void SetPacketHeaderTypeFin(uint16_t& header) {
   header |= 0x1000;  // Set the 'final' type.
 }
 
+inline void SetPacketHeaderTypeMessageStart(uint16_t& header) {
+  DCHECK_EQ(header & 0x7000, 0) << "Must be 'data' packet";
+  header |= (kMessageStartPacket << 12);
+}
+
 }  // namespace internal
 }  // namespace roo_transport
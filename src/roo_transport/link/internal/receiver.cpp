@@ -1,31 +1,44 @@
 #include "roo_transport/link/internal/receiver.h"
 
+#include "roo_io/memory/load.h"
 #include "roo_io/memory/store.h"
 #include "roo_transport/link/internal/protocol.h"
 
 namespace roo_transport {
 namespace internal {
 
-Receiver::Receiver(unsigned int recvbuf_log2)
+Receiver::Receiver(unsigned int recvbuf_log2, BufferPool::Quota* quota)
     : my_stream_id_(0),
       state_(kIdle),
       self_closed_(false),
       peer_closed_(false),
       end_of_stream_(false),
-      in_buffers_(new InBuffer[1 << recvbuf_log2]),
+      in_buffers_(recvbuf_log2, quota),
       current_in_buffer_(nullptr),
       current_in_buffer_pos_(0),
       in_ring_(recvbuf_log2, 0),
+      unordered_(false),
+      compact_framing_(false),
+      read_pos_(in_ring_.begin()),
+      message_remaining_(0),
+      requested_buffer_size_log2_(recvbuf_log2),
+      buffer_size_changed_(false),
       needs_ack_(false),
       unack_seq_(0),
       recv_himark_(in_ring_.begin() + (1 << recvbuf_log2)),
       recv_himark_update_expiration_(roo_time::Uptime::Start()),
       packets_received_(0) {}
 
-void Receiver::setConnected(SeqNum peer_seq_num, bool control_bit) {
+void Receiver::setConnected(SeqNum peer_seq_num, bool control_bit,
+                            bool compact_framing) {
   CHECK(in_ring_.empty());
+  compact_framing_ = compact_framing;
   in_ring_.reset(peer_seq_num);
+  read_pos_ = in_ring_.begin();
+  message_remaining_ = 0;
   unack_seq_ = peer_seq_num.raw();
+  // Matches what the peer assumes, based on our handshake.
+  recv_himark_ = in_ring_.begin() + in_ring_.capacity();
   state_ = kConnected;
   control_bit_ = control_bit;
 }
@@ -37,6 +50,46 @@ void Receiver::setIdle() {
   end_of_stream_ = false;
 }
 
+void Receiver::setBufferSize(unsigned int recvbuf_log2) {
+  CHECK_LE(recvbuf_log2, 10u);
+  requested_buffer_size_log2_ = recvbuf_log2;
+  maybeResize();
+}
+
+void Receiver::maybeResize() {
+  int log2 = requested_buffer_size_log2_;
+  if (log2 == in_ring_.capacity_log2()) return;
+  uint16_t capacity = 1 << log2;
+  if (in_ring_.slotsUsed() > capacity) return;
+  if (state_ == kConnected && in_ring_.begin() + capacity < recv_himark_) {
+    // The peer may still send packets up to the recv himark; need to wait
+    // until they fit.
+    return;
+  }
+  // Slot offsets depend on the capacity, so the received packets need to be
+  // relocated.
+  PacketBufferArray<InBuffer> buffers(log2, in_buffers_.quota(),
+                                      /*reserve=*/false);
+  for (SeqNum pos = in_ring_.begin(); pos < in_ring_.end(); ++pos) {
+    // If out of memory, we'll try again later.
+    if (!buffers.acquireIgnoringQuota(pos)) return;
+  }
+  InBuffer* current_in_buffer = nullptr;
+  for (SeqNum pos = in_ring_.begin(); pos < in_ring_.end(); ++pos) {
+    InBuffer& buf = buffers[pos.raw() & (capacity - 1)];
+    buf = getInBuffer(pos);
+    if (&getInBuffer(pos) == current_in_buffer_) {
+      current_in_buffer = &buf;
+    }
+  }
+  in_buffers_ = std::move(buffers);
+  current_in_buffer_ = current_in_buffer;
+  in_ring_.setCapacityLog2(log2);
+  buffer_size_changed_ = true;
+  // Let the peer know.
+  recv_himark_update_expiration_ = roo_time::Uptime::Start();
+}
+
 void Receiver::setBroken() {
   if (in_ring_.empty()) {
     setIdle();
@@ -57,38 +110,57 @@ size_t Receiver::tryRead(roo::byte* buf, size_t count,
   outgoing_data_ready = false;
   if (state_ == kConnecting || state_ == kIdle) return 0;
   do {
-    if (current_in_buffer_ == nullptr) {
-      if (in_ring_.empty()) {
-        if (state_ == kBroken) {
-          setIdle();
-        }
-        break;
+    if (!selectInBuffer()) {
+      if (state_ == kBroken) {
+        setIdle();
       }
-      current_in_buffer_ = &getInBuffer(in_ring_.begin());
-      current_in_buffer_pos_ = 0;
+      break;
     }
     if (current_in_buffer_->type() == InBuffer::kUnset) {
       // Not received yet.
       break;
     }
+    if (unordered_ && message_remaining_ == 0 &&
+        current_in_buffer_pos_ == 0 && current_in_buffer_->message_start()) {
+      uint32_t size;
+      size_t prefix_length =
+          DecodeMessageSize(current_in_buffer_->data(),
+                            current_in_buffer_->size(), compact_framing_, size);
+      if (prefix_length > 0) message_remaining_ = size + prefix_length;
+    }
     CHECK_GE(current_in_buffer_->size(), current_in_buffer_pos_);
     size_t available = current_in_buffer_->size() - current_in_buffer_pos_;
     if (count < available) {
       memcpy(buf, current_in_buffer_->data() + current_in_buffer_pos_, count);
       total_read += count;
       current_in_buffer_pos_ += count;
+      message_remaining_ -= std::min<uint32_t>(message_remaining_, count);
       break;
     }
     memcpy(buf, current_in_buffer_->data() + current_in_buffer_pos_, available);
     buf += available;
     total_read += available;
     count -= available;
+    message_remaining_ -= std::min<uint32_t>(message_remaining_, available);
     InBuffer::Type buffer_type = current_in_buffer_->type();
-    current_in_buffer_->clear();
     current_in_buffer_ = nullptr;
+    if (read_pos_ != in_ring_.begin()) {
+      // Read out of order; it will be removed once the preceding packets get
+      // read.
+      getInBuffer(read_pos_).markConsumed();
+      ++read_pos_;
+      continue;
+    }
+    getInBuffer(read_pos_).clear();
+    in_ring_.pop();
+    while (!in_ring_.empty() &&
+           getInBuffer(in_ring_.begin()).type() == InBuffer::kConsumed) {
+      getInBuffer(in_ring_.begin()).clear();
+      in_ring_.pop();
+    }
+    read_pos_ = in_ring_.begin();
     recv_himark_update_expiration_ = roo_time::Uptime::Start();
     outgoing_data_ready = true;
-    in_ring_.pop();
     if (buffer_type == InBuffer::kFin) {
       CHECK(in_ring_.empty()) << in_ring_.slotsUsed();
       end_of_stream_ = true;
@@ -98,22 +170,80 @@ size_t Receiver::tryRead(roo::byte* buf, size_t count,
   return total_read;
 }
 
+bool Receiver::selectInBuffer() const {
+  if (current_in_buffer_ != nullptr &&
+      (current_in_buffer_->type() != InBuffer::kUnset || !unordered_ ||
+       message_remaining_ > 0)) {
+    return true;
+  }
+  if (in_ring_.empty()) {
+    current_in_buffer_ = nullptr;
+    return false;
+  }
+  if (message_remaining_ == 0) {
+    read_pos_ = in_ring_.begin();
+    if (unordered_ && getInBuffer(read_pos_).type() == InBuffer::kUnset) {
+      // Head-of-line blocked; see if any later message can be read meanwhile.
+      findCompleteMessage(read_pos_);
+    }
+  }
+  current_in_buffer_ = &getInBuffer(read_pos_);
+  current_in_buffer_pos_ = 0;
+  return true;
+}
+
+bool Receiver::findCompleteMessage(SeqNum& pos) const {
+  SeqNum start = in_ring_.begin() + 1;
+  while (start < in_ring_.end()) {
+    const InBuffer& first = getInBuffer(start);
+    uint32_t size;
+    size_t prefix_length =
+        (first.type() == InBuffer::kData && first.message_start())
+            ? DecodeMessageSize(first.data(), first.size(), compact_framing_,
+                                size)
+            : 0;
+    if (prefix_length == 0) {
+      ++start;
+      continue;
+    }
+    uint32_t remaining = size + prefix_length;
+    SeqNum seq = start;
+    while (seq < in_ring_.end()) {
+      const InBuffer& buf = getInBuffer(seq);
+      if (buf.type() != InBuffer::kData ||
+          (seq != start && buf.message_start()) || buf.size() > remaining) {
+        // Incomplete (or malformed).
+        break;
+      }
+      remaining -= buf.size();
+      if (remaining == 0) {
+        pos = start;
+        return true;
+      }
+      ++seq;
+    }
+    // Continue with the first packet that doesn't belong to this message.
+    start = (seq == start) ? seq + 1 : seq;
+  }
+  return false;
+}
+
 void Receiver::markInputClosed(bool& outgoing_data_ready) {
   self_closed_ = true;
   if (in_ring_.empty()) return;
   recv_himark_update_expiration_ = roo_time::Uptime::Start();
   outgoing_data_ready = true;
   do {
+    getInBuffer(in_ring_.begin()).clear();
     in_ring_.pop();
   } while (!in_ring_.empty());
+  current_in_buffer_ = nullptr;
+  read_pos_ = in_ring_.begin();
+  message_remaining_ = 0;
 }
 
 int Receiver::peek() {
-  if (current_in_buffer_ == nullptr) {
-    if (in_ring_.empty()) return -1;
-    current_in_buffer_ = &getInBuffer(in_ring_.begin());
-    current_in_buffer_pos_ = 0;
-  }
+  if (!selectInBuffer()) return -1;
   if (current_in_buffer_->type() != InBuffer::kData) {
     // Not received yet, or EOS.
     return -1;
@@ -123,11 +253,7 @@ int Receiver::peek() {
 }
 
 size_t Receiver::availableForRead() const {
-  if (current_in_buffer_ == nullptr) {
-    if (in_ring_.empty()) return 0;
-    current_in_buffer_ = &getInBuffer(in_ring_.begin());
-    current_in_buffer_pos_ = 0;
-  }
+  if (!selectInBuffer()) return 0;
   switch (current_in_buffer_->type()) {
     case InBuffer::kUnset: {
       return 0;
@@ -156,19 +282,35 @@ void Receiver::reset() {
   }
   current_in_buffer_ = nullptr;
   current_in_buffer_pos_ = 0;
+  read_pos_ = in_ring_.begin();
+  message_remaining_ = 0;
   needs_ack_ = false;
   recv_himark_update_expiration_ = roo_time::Uptime::Start();
+  maybeResize();
 }
 
-void Receiver::init(uint32_t my_stream_id) {
+void Receiver::init(uint32_t my_stream_id, bool unordered) {
   while (!in_ring_.empty()) {
+    getInBuffer(in_ring_.begin()).clear();
     in_ring_.pop();
   }
   my_stream_id_ = my_stream_id;
+  unordered_ = unordered;
+  message_remaining_ = 0;
   peer_closed_ = false;
   self_closed_ = false;
   end_of_stream_ = false;
   state_ = kConnecting;
+  current_in_buffer_ = nullptr;
+  maybeResize();
+  // The handshake will advertise the current size.
+  buffer_size_changed_ = false;
+}
+
+void Receiver::resync() {
+  if (state_ != kConnected) return;
+  needs_ack_ = true;
+  recv_himark_update_expiration_ = roo_time::Uptime::Start();
 }
 
 size_t Receiver::updateRecvHimark(roo::byte* buf, long& next_send_micros) {
@@ -182,14 +324,24 @@ size_t Receiver::updateRecvHimark(roo::byte* buf, long& next_send_micros) {
                  (long)(recv_himark_update_expiration_ - now).inMicros());
     return 0;
   }
-  recv_himark_ = in_ring_.begin() + in_ring_.capacity();
+  maybeResize();
+  // While shrinking, the himark is not advanced beyond the requested size
+  // (but it can't retreat, either).
+  SeqNum recv_himark =
+      in_ring_.begin() + std::min<uint16_t>(in_ring_.capacity(),
+                                            1 << requested_buffer_size_log2_);
+  if (recv_himark_ < recv_himark) recv_himark_ = recv_himark;
   uint16_t payload =
       FormatPacketHeader(recv_himark_, kFlowControlPacket, control_bit_);
   roo_io::StoreBeU16(payload, buf);
   recv_himark_update_expiration_ =
       now + roo_time::Micros(kRecvHimarkExpirationTimeoutUs);
   next_send_micros = std::min(next_send_micros, kRecvHimarkExpirationTimeoutUs);
-  return 2;
+  if (!buffer_size_changed_) return 2;
+  // Since flow control updates get resent periodically, this reliably
+  // delivers the new size to the peer.
+  roo_io::StoreU8(in_ring_.capacity_log2(), buf + 2);
+  return 3;
 }
 
 size_t Receiver::ack(roo::byte* buf) {
@@ -230,7 +382,8 @@ size_t Receiver::ack(roo::byte* buf) {
 
 bool Receiver::handleDataPacket(bool control_bit, uint16_t seq_id,
                                 const roo::byte* payload, size_t len,
-                                bool is_final, bool& has_new_data_to_read) {
+                                bool is_final, bool is_message_start,
+                                bool& has_new_data_to_read) {
   has_new_data_to_read = false;
   bool has_ack_to_send = false;
   if (state_ == kConnecting || state_ == kIdle) {
@@ -260,14 +413,21 @@ bool Receiver::handleDataPacket(bool control_bit, uint16_t seq_id,
       return has_ack_to_send;
     }
     for (size_t i = 0; i < advance; ++i) {
+      if (!in_buffers_.acquire(in_ring_.end(), in_ring_)) {
+        // Out of memory, or over quota. Dropping the packet; the peer will
+        // retransmit it.
+        return has_ack_to_send;
+      }
       getInBuffer(in_ring_.push()).clear();
     }
     DCHECK(in_ring_.contains(seq))
         << seq << ", " << in_ring_.begin() << "--" << in_ring_.end();
   }
   InBuffer& buffer = getInBuffer(seq);
-  if (buffer.type() == InBuffer::kUnset) {
-    buffer.set(is_final ? InBuffer::kFin : InBuffer::kData, payload, len);
+  bool is_new = (buffer.type() == InBuffer::kUnset);
+  if (is_new) {
+    buffer.set(is_final ? InBuffer::kFin : InBuffer::kData, payload, len,
+               is_message_start);
   } else {
     // Ignore the retransmitted packet; stick to the previously received one.
   }
@@ -295,6 +455,9 @@ bool Receiver::handleDataPacket(bool control_bit, uint16_t seq_id,
     } else {
       has_new_data_to_read = true;
     }
+  } else if (unordered_ && is_new && !self_closed_) {
+    // The packet may have completed a message that can be read out of order.
+    has_new_data_to_read = true;
   }
   return has_ack_to_send;
 }
@@ -3,6 +3,7 @@
 #include <memory>
 
 #include "roo_transport/link/internal/in_buffer.h"
+#include "roo_transport/link/internal/packet_buffer_array.h"
 #include "roo_transport/link/internal/ring_buffer.h"
 
 namespace roo_transport {
@@ -27,14 +28,18 @@ class Receiver {
     kBroken = 3,
   };
 
-  Receiver(unsigned int recvbuf_log2);
+  // The packet buffers are accounted to the specified quota, if any.
+  Receiver(unsigned int recvbuf_log2, BufferPool::Quota* quota = nullptr);
 
   State state() const { return state_; }
   bool eos() const { return end_of_stream_; }
 
   bool done() const;
 
-  void setConnected(SeqNum peer_seq_num, bool control_bit);
+  // The compact_framing flag indicates the negotiated message framing (see
+  // kMessageStartPacket).
+  void setConnected(SeqNum peer_seq_num, bool control_bit,
+                    bool compact_framing);
   void setIdle();
   void setBroken();
 
@@ -44,16 +49,44 @@ class Receiver {
   size_t availableForRead() const;
 
   void reset();
-  void init(uint32_t my_stream_id);
+
+  // If unordered is true, complete messages may be read out of order (see
+  // kMessageStartPacket).
+  void init(uint32_t my_stream_id, bool unordered);
+
+  // Whether complete messages may be read out of order.
+  bool unordered() const { return unordered_; }
+
+  // Whether the messages are prefixed with their length as a varint, rather
+  // than as a 32-bit integer. Valid once connected.
+  bool compact_framing() const { return compact_framing_; }
+
+  // Called when the session gets resumed after a suspected outage (see
+  // Channel::resume()). Schedules an immediate ack and flow control update,
+  // so that the peer can promptly learn what needs to be retransmitted.
+  void resync();
 
   void markInputClosed(bool& outgoing_data_ready);
 
+  // Resizes the receive buffer to 2^recvbuf_log2 packets. The new size gets
+  // advertised to the peer in the flow control updates. Growing takes effect
+  // immediately. When shrinking, the recv himark stops advancing until the
+  // data that the peer has already been allowed to send fits in the new size;
+  // the buffer gets reallocated then.
+  void setBufferSize(unsigned int recvbuf_log2);
+
   size_t ack(roo::byte* buf);
   size_t updateRecvHimark(roo::byte* buf, long& next_send_micros);
 
+  // Releases the memory of the packet buffers that have not been used for a
+  // while. Updates next_send_micros to reflect when to check again.
+  void releaseIdleBuffers(long& next_send_micros) {
+    in_buffers_.releaseIfIdle(in_ring_, next_send_micros);
+  }
+
   bool handleDataPacket(bool control_bit, uint16_t seq_id,
                         const roo::byte* payload, size_t len, bool is_final,
-                        bool& has_new_data_to_read);
+                        bool is_message_start, bool& has_new_data_to_read);
 
   bool empty() const { return in_ring_.empty(); }
 
@@ -69,6 +102,21 @@ class Receiver {
     return in_buffers_[in_ring_.offset_for(seq)];
   }
 
+  // Points current_in_buffer_ at the packet to be read next. That's normally
+  // the head of the ring; but in the unordered mode, when the head is missing,
+  // it may be the first packet of a later message that has been received in
+  // its entirety. Returns false if the ring is empty.
+  bool selectInBuffer() const;
+
+  // Looks for the earliest complete message, past the head of the ring, that
+  // has not been read yet. If found, sets pos to its first packet, and
+  // returns true.
+  bool findCompleteMessage(SeqNum& pos) const;
+
+  // Reallocates the buffers to match the requested size, if it differs from
+  // the current one, and if it is safe to do so.
+  void maybeResize();
+
   uint32_t my_stream_id_;
   State state_;
 
@@ -85,11 +133,33 @@ class Receiver {
   // Set when the stream is read till end without error.
   bool end_of_stream_;
 
-  std::unique_ptr<InBuffer[]> in_buffers_;
+  PacketBufferArray<InBuffer> in_buffers_;
   mutable InBuffer* current_in_buffer_;
   mutable uint8_t current_in_buffer_pos_;
   RingBuffer in_ring_;
 
+  // Whether complete messages may be read out of order.
+  bool unordered_;
+
+  // See compact_framing().
+  bool compact_framing_;
+
+  // Position of the packet to be read next. Differs from the head of the ring
+  // only when reading a message out of order.
+  mutable SeqNum read_pos_;
+
+  // In the unordered mode, the number of bytes remaining to be read in the
+  // current message, or zero if the reader is at a message boundary.
+  uint32_t message_remaining_;
+
+  // As requested by setBufferSize(). Differs from the in_ring_ capacity only
+  // while shrinking.
+  unsigned int requested_buffer_size_log2_;
+
+  // Set when the buffer has been resized since the handshake, and thus the
+  // flow control updates need to carry the new size.
+  bool buffer_size_changed_;
+
   // Whether we need to send kDataAckPacket.
   bool needs_ack_;
 
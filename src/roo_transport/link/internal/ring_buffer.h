@@ -61,6 +61,15 @@ class RingBuffer {
     return left + (((uint16_t)(truncated_pos - left)) % (1 << pos_bits));
   }
 
+  // Changes the capacity. The used slots must fit in the new capacity. Note
+  // that the slot offsets change as a result, so the caller needs to relocate
+  // the contents accordingly.
+  void setCapacityLog2(int capacity_log2) {
+    CHECK_LE(capacity_log2, 10);
+    CHECK_LE(slotsUsed(), 1 << capacity_log2);
+    capacity_log2_ = capacity_log2;
+  }
+
   int capacity_log2() const { return capacity_log2_; }
   uint16_t capacity() const { return 1 << capacity_log2_; }
 
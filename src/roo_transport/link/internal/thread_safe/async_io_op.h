@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "roo_io/status.h"
+#include "roo_transport/core/io_completion.h"
+
+namespace roo_transport {
+namespace internal {
+
+// State of an outstanding asynchronous read (with Byte = roo::byte) or write
+// (with Byte = const roo::byte). Owned by the thread-safe transmitter or
+// receiver, and guarded by its mutex.
+//
+// The operation goes through two stages: first, it is pending, until it gets
+// completed (with a result and a status), typically by the receiving thread.
+// Then, it awaits dispatch, i.e. the invocation of the callback, which happens
+// outside of any locks. Only then a new operation can be started.
+template <typename Byte>
+struct AsyncIoOp {
+  AsyncIoOp()
+      : buf(nullptr),
+        count(0),
+        my_stream_id(0),
+        result(0),
+        status(roo_io::kOk),
+        completed(false) {}
+
+  // Returns true if an operation has been started and not yet dispatched.
+  bool active() const { return fn != nullptr; }
+
+  // Returns true if an operation has been started and not yet completed.
+  bool pending() const { return fn != nullptr && !completed; }
+
+  void start(Byte* buf, size_t count, uint32_t my_stream_id,
+             IoCompletionFn fn) {
+    this->buf = buf;
+    this->count = count;
+    this->my_stream_id = my_stream_id;
+    this->fn = std::move(fn);
+    result = 0;
+    status = roo_io::kOk;
+    completed = false;
+  }
+
+  void complete(size_t result, roo_io::Status status) {
+    this->result = result;
+    this->status = status;
+    completed = true;
+  }
+
+  // If the operation has completed, moves its callback to `fn`, and resets
+  // the state so that a new operation can be started.
+  void takeCompleted(IoCompletionFn& fn, size_t& result,
+                     roo_io::Status& status) {
+    if (!completed) return;
+    fn = std::move(this->fn);
+    this->fn = nullptr;
+    result = this->result;
+    status = this->status;
+    buf = nullptr;
+    completed = false;
+  }
+
+  Byte* buf;
+  size_t count;
+  uint32_t my_stream_id;
+  IoCompletionFn fn;
+  size_t result;
+  roo_io::Status status;
+  bool completed;
+};
+
+}  // namespace internal
+}  // namespace roo_transport
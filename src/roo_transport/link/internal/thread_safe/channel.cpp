@@ -9,10 +9,13 @@
 #if (defined ESP32 || defined ROO_TESTING)
 #include "esp_random.h"
 #define RANDOM_INTEGER esp_random
+#define RANDOM_INTEGER_MAX UINT32_MAX
 #elif (defined ARDUINO_ARCH_RP2040)
 #define RANDOM_INTEGER rp2040.hwrand32
+#define RANDOM_INTEGER_MAX UINT32_MAX
 #else
 #define RANDOM_INTEGER rand
+#define RANDOM_INTEGER_MAX RAND_MAX
 #endif
 
 #if !defined(MLOG_roo_transport_reliable_channel_connection)
@@ -23,16 +26,19 @@ namespace roo_transport {
 
 namespace {
 
-roo_time::Duration Backoff(int retry_count) {
-  float min_delay_us = 1000.0f;     // 1ms
-  float max_delay_us = 1000000.0f;  // 1s
-  float delay = pow(1.33, retry_count) * min_delay_us;
-  if (delay > max_delay_us) {
-    delay = max_delay_us;
-  }
-  // Randomize by +=20%, to make unrelated retries spread more evenly in time.
-  delay += (float)delay * ((float)RANDOM_INTEGER() / RAND_MAX - 0.5f) * 0.4f;
-  return roo_time::Micros((uint64_t)delay);
+// Warns if the packet buffer pool can't back a window of the specified size,
+// even if the link had the pool to itself.
+void CheckPoolCapacity(roo::string_view log_prefix, const char* direction,
+                       unsigned int buffer_size_log2) {
+  size_t max_blocks = PacketBufferPool().max_blocks();
+  if (((size_t)1 << buffer_size_log2) < max_blocks) return;
+  LOG(WARNING) << log_prefix << "The " << direction << " buffer ("
+               << (1 << buffer_size_log2)
+               << " packets) exceeds the capacity of the packet buffer pool ("
+               << max_blocks
+               << " blocks, shared by all links), and will be effectively "
+                  "limited by it. Consider increasing "
+                  "ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS.";
 }
 
 }  // namespace
@@ -41,17 +47,36 @@ Channel::Channel(PacketSender& sender, LinkBufferSize sendbuf,
                  LinkBufferSize recvbuf, roo::string_view name)
     : packet_sender_(sender),
       outgoing_data_ready_(),
-      transmitter_((unsigned int)sendbuf),
-      receiver_((unsigned int)recvbuf),
+      readiness_(),
+      buffer_quota_(PacketBufferPool()),
+      transmitter_((unsigned int)sendbuf, readiness_, &buffer_quota_),
+      receiver_((unsigned int)recvbuf, readiness_, &buffer_quota_),
       my_stream_id_(0),
       my_stream_id_acked_by_peer_(false),
       peer_stream_id_(0),
       needs_handshake_ack_(false),
+      resuming_(false),
       successive_handshake_retries_(0),
       next_scheduled_handshake_update_(roo_time::Uptime::Start()),
+      backoff_policy_(),
+      unordered_delivery_(false),
+      compact_framing_(false),
+      offer_compact_framing_(false),
       disconnect_fn_(nullptr),
+      pacer_(),
+      pacing_config_(0),
+      applied_pacing_config_(0),
+      keepalive_interval_ms_(0),
+      keepalive_miss_threshold_(0),
+      last_peer_activity_ms_(0),
+      peer_keepalive_(false),
+      session_control_bit_(false),
+      keepalive_reply_requested_(false),
+      last_keepalive_sent_ms_(0),
       sender_thread_(),
       active_(true),
+      datagrams_(buffer_quota_),
+      datagram_fn_(nullptr),
       log_prefix_(name.empty() ? std::string("")
                                : (std::string("(").append(name).append(") "))),
       send_thread_name_(name.empty() ? "send_loop"
@@ -59,48 +84,161 @@ Channel::Channel(PacketSender& sender, LinkBufferSize sendbuf,
   CHECK_LE(static_cast<unsigned int>(sendbuf), 12u);
   CHECK_LE(static_cast<unsigned int>(sendbuf),
            static_cast<unsigned int>(recvbuf));
+  CheckPoolCapacity(log_prefix_, "send", (unsigned int)sendbuf);
+  CheckPoolCapacity(log_prefix_, "receive", (unsigned int)recvbuf);
 }
 
 Channel::~Channel() { end(); }
 
 size_t Channel::write(const roo::byte* buf, size_t count, uint32_t my_stream_id,
-                      roo_io::Status& stream_status) {
+                      roo_io::Status& stream_status, roo_time::Uptime deadline,
+                      const CancellationToken* cancel) {
   bool outgoing_data_ready = false;
-  return transmitter_.write(buf, count, my_stream_id, stream_status,
-                            outgoing_data_ready);
+  size_t result = transmitter_.write(buf, count, my_stream_id, stream_status,
+                                     outgoing_data_ready, deadline, cancel);
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
+  return result;
 }
 
 size_t Channel::tryWrite(const roo::byte* buf, size_t count,
                          uint32_t my_stream_id, roo_io::Status& stream_status) {
   bool outgoing_data_ready = false;
-  return transmitter_.tryWrite(buf, count, my_stream_id, stream_status,
-                               outgoing_data_ready);
+  size_t result = transmitter_.tryWrite(buf, count, my_stream_id,
+                                        stream_status, outgoing_data_ready);
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
+  return result;
+}
+
+size_t Channel::writev(const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+                       roo_io::Status& stream_status) {
+  return transmitter_.writev(iov, iovcnt, my_stream_id, stream_status,
+                             outgoing_data_ready_);
+}
+
+uint32_t Channel::sendDatagram(const IoVec* iov, size_t iovcnt,
+                               roo_time::Duration ttl, uint32_t my_stream_id) {
+  size_t size = 0;
+  for (size_t i = 0; i < iovcnt; ++i) size += iov[i].size;
+  if (size > internal::kMaxDatagramSize) return 0;
+  {
+    roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+    if (my_stream_id_ == 0 ||
+        (my_stream_id != 0 && my_stream_id != my_stream_id_)) {
+      return 0;
+    }
+    if (receiver_.state() != internal::Receiver::kConnected) {
+      // We don't know the peer yet (or anymore).
+      return 0;
+    }
+    my_stream_id = my_stream_id_;
+    uint16_t header = internal::FormatPacketHeader(
+        internal::SeqNum(0), internal::kDatagramPacket, my_control_bit());
+    roo::lock_guard<roo::mutex> datagram_guard(datagram_mutex_);
+    if (!datagrams_.push(header, iov, iovcnt, roo_time::Uptime::Now() + ttl)) {
+      return 0;
+    }
+  }
+  outgoing_data_ready_.notify();
+  return my_stream_id;
+}
+
+void Channel::setDatagramReceiver(DatagramFn fn) {
+  roo::lock_guard<roo::mutex> guard(datagram_mutex_);
+  datagram_fn_ = std::move(fn);
+}
+
+uint32_t Channel::datagrams_dropped() const {
+  roo::lock_guard<roo::mutex> guard(datagram_mutex_);
+  return datagrams_.dropped();
+}
+
+void Channel::handleDatagram(bool control_bit, const roo::byte* payload,
+                             size_t len) {
+  uint32_t my_stream_id;
+  {
+    roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+    if (receiver_.state() != internal::Receiver::kConnected ||
+        control_bit == my_control_bit()) {
+      // Not within a session, or cross-talk.
+      return;
+    }
+    my_stream_id = my_stream_id_;
+  }
+  DatagramFn fn;
+  {
+    roo::lock_guard<roo::mutex> guard(datagram_mutex_);
+    fn = datagram_fn_;
+  }
+  if (fn != nullptr) fn(my_stream_id, payload, len);
+}
+
+bool Channel::writeMessage(const IoVec* iov, size_t iovcnt,
+                           uint32_t my_stream_id,
+                           roo_io::Status& stream_status) {
+  size_t size = 0;
+  for (size_t i = 0; i < iovcnt; ++i) size += iov[i].size;
+  return transmitter_.writeMessage(size, iov, iovcnt, my_stream_id,
+                                   stream_status, outgoing_data_ready_);
+}
+
+bool Channel::beginMessage(size_t size, uint32_t my_stream_id,
+                           roo_io::Status& stream_status) {
+  return transmitter_.writeMessage(size, nullptr, 0, my_stream_id,
+                                   stream_status, outgoing_data_ready_);
 }
 
 size_t Channel::read(roo::byte* buf, size_t count, uint32_t my_stream_id,
-                     roo_io::Status& stream_status) {
+                     roo_io::Status& stream_status, roo_time::Uptime deadline,
+                     const CancellationToken* cancel) {
   bool outgoing_data_ready = false;
-  return receiver_.read(buf, count, my_stream_id, stream_status,
-                        outgoing_data_ready);
+  size_t result = receiver_.read(buf, count, my_stream_id, stream_status,
+                                 outgoing_data_ready, deadline, cancel);
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
+  return result;
 }
 
 size_t Channel::tryRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
                         roo_io::Status& stream_status) {
   bool outgoing_data_ready = false;
-  return receiver_.tryRead(buf, count, my_stream_id, stream_status,
-                           outgoing_data_ready);
+  size_t result = receiver_.tryRead(buf, count, my_stream_id, stream_status,
+                                    outgoing_data_ready);
+  if (outgoing_data_ready) {
+    outgoing_data_ready_.notify();
+  }
+  return result;
+}
+
+bool Channel::asyncRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
+                        IoCompletionFn fn) {
+  bool outgoing_data_ready = false;
+  bool result = receiver_.asyncRead(buf, count, my_stream_id, std::move(fn),
+                                    outgoing_data_ready);
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
+  return result;
+}
+
+bool Channel::asyncWrite(const roo::byte* buf, size_t count,
+                         uint32_t my_stream_id, IoCompletionFn fn) {
+  bool outgoing_data_ready = false;
+  bool result = transmitter_.asyncWrite(buf, count, my_stream_id,
+                                        std::move(fn), outgoing_data_ready);
+  if (outgoing_data_ready) {
+    outgoing_data_ready_.notify();
+  }
+  return result;
+}
+
+void Channel::dispatchAsyncCompletions() {
+  transmitter_.dispatchAsyncCompletion();
+  receiver_.dispatchAsyncCompletion();
 }
 
 int Channel::peek(uint32_t my_stream_id, roo_io::Status& stream_status) {
@@ -120,14 +258,28 @@ void Channel::flush(uint32_t my_stream_id, roo_io::Status& stream_status) {
   }
 }
 
-void Channel::close(uint32_t my_stream_id, roo_io::Status& stream_status) {
+void Channel::flushBy(roo_time::Uptime deadline, uint32_t my_stream_id,
+                      roo_io::Status& stream_status) {
   bool outgoing_data_ready = false;
-  transmitter_.close(my_stream_id, stream_status, outgoing_data_ready);
+  transmitter_.flushBy(deadline, my_stream_id, stream_status,
+                       outgoing_data_ready);
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
 }
 
+bool Channel::close(uint32_t my_stream_id, roo_io::Status& stream_status,
+                    roo_time::Uptime deadline,
+                    const CancellationToken* cancel) {
+  bool outgoing_data_ready = false;
+  bool result = transmitter_.close(my_stream_id, stream_status,
+                                   outgoing_data_ready, deadline, cancel);
+  if (outgoing_data_ready) {
+    outgoing_data_ready_.notify();
+  }
+  return result;
+}
+
 // Called by ChannelInput::close().
 void Channel::closeInput(uint32_t my_stream_id, roo_io::Status& stream_status) {
   bool outgoing_data_ready = false;
@@ -142,6 +294,61 @@ size_t Channel::availableForWrite(uint32_t my_stream_id,
   return transmitter_.availableForWrite(my_stream_id, stream_status);
 }
 
+void Channel::setHandshakeBackoff(const LinkBackoffPolicy& policy) {
+  DCHECK_GE(policy.factor, 1.0f);
+  DCHECK(policy.min_delay <= policy.max_delay);
+  DCHECK(policy.jitter >= 0.0f && policy.jitter <= 1.0f);
+  roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  backoff_policy_ = policy;
+  // Keeps the delays non-decreasing and within bounds, even if misconfigured.
+  if (!(backoff_policy_.factor >= 1.0f)) backoff_policy_.factor = 1.0f;
+  if (backoff_policy_.max_delay < backoff_policy_.min_delay) {
+    backoff_policy_.max_delay = backoff_policy_.min_delay;
+  }
+  if (!(backoff_policy_.jitter >= 0.0f)) backoff_policy_.jitter = 0.0f;
+  if (backoff_policy_.jitter > 1.0f) backoff_policy_.jitter = 1.0f;
+}
+
+void Channel::setUnorderedDelivery(bool enabled) {
+  roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  unordered_delivery_ = enabled;
+}
+
+void Channel::setCompactFraming(bool enabled) {
+  roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  compact_framing_ = enabled;
+}
+
+roo_time::Duration Channel::handshakeBackoff(int retry_count) const {
+  float min_delay_us = (float)backoff_policy_.min_delay.inMicros();
+  float max_delay_us = (float)backoff_policy_.max_delay.inMicros();
+  float delay = pow(backoff_policy_.factor, retry_count) * min_delay_us;
+  if (delay > max_delay_us) {
+    delay = max_delay_us;
+  }
+  // Randomize, to make unrelated retries spread more evenly in time.
+  delay += delay *
+           ((float)RANDOM_INTEGER() / (float)RANDOM_INTEGER_MAX - 0.5f) *
+           2.0f * backoff_policy_.jitter;
+  if (delay < 0) delay = 0;
+  return roo_time::Micros((uint64_t)delay);
+}
+
+void Channel::onPeerActivity(bool& outgoing_data_ready) {
+  roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  if (transmitter_.state() != internal::Transmitter::kConnecting) return;
+  // The peer is evidently alive; if we have backed off, retry the handshake
+  // right away. (Unless the next retry is imminent anyway, which also bounds
+  // the rate of handshakes triggered this way.)
+  roo_time::Uptime now = roo_time::Uptime::Now();
+  if (next_scheduled_handshake_update_ <= now + backoff_policy_.min_delay) {
+    return;
+  }
+  successive_handshake_retries_ = 0;
+  next_scheduled_handshake_update_ = now;
+  outgoing_data_ready = true;
+}
+
 uint32_t Channel::my_stream_id() const {
   roo::lock_guard<roo::mutex> guard(handshake_mutex_);
   return my_stream_id_;
@@ -162,15 +369,24 @@ uint32_t Channel::connect(std::function<void()> disconnect_fn) {
     MLOG(roo_transport_reliable_channel_connection)
         << getLogPrefix() << "Transmitter and receiver are now connecting.";
     transmitter_.init(my_stream_id_, RANDOM_INTEGER() % 0x0FFF);
-    receiver_.init(my_stream_id_);
+    receiver_.init(my_stream_id_, unordered_delivery_);
+    offer_compact_framing_ = compact_framing_;
+    peer_keepalive_ = false;
+    {
+      roo::lock_guard<roo::mutex> datagram_guard(datagram_mutex_);
+      datagrams_.clear();
+    }
     needs_handshake_ack_ = false;
+    resuming_ = false;
     successive_handshake_retries_ = 0;
     next_scheduled_handshake_update_ = roo_time::Uptime::Start();
     connected_cv_.notify_all();
+    readiness_.notify();
     my_stream_id = my_stream_id_;
   }
   // We need to send that handshake message.
   outgoing_data_ready_.notify();
+  dispatchAsyncCompletions();
   if (old_disconnect_fn != nullptr) {
     old_disconnect_fn();
   }
@@ -185,20 +401,48 @@ void Channel::disconnect(uint32_t my_stream_id) {
     my_stream_id_ = 0;
     my_stream_id_acked_by_peer_ = false;
     peer_stream_id_ = 0;
+    needs_handshake_ack_ = false;
+    resuming_ = false;
     MLOG(roo_transport_reliable_channel_connection)
         << getLogPrefix() << "Transmitter and receiver are now disconnected.";
     transmitter_.reset();
     receiver_.reset();
+    {
+      roo::lock_guard<roo::mutex> datagram_guard(datagram_mutex_);
+      datagrams_.clear();
+    }
     connected_cv_.notify_all();
+    readiness_.notify();
     disconnect_fn = std::move(disconnect_fn_);
     disconnect_fn_ = nullptr;
   }
   outgoing_data_ready_.notify();
+  dispatchAsyncCompletions();
   if (disconnect_fn != nullptr) {
     disconnect_fn();
   }
 }
 
+bool Channel::resume(uint32_t my_stream_id) {
+  {
+    roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+    if (getLinkStatusInternal(my_stream_id) != LinkStatus::kConnected) {
+      return false;
+    }
+    if (receiver_.state() != internal::Receiver::kConnected) {
+      // The peer has already terminated the session.
+      return false;
+    }
+    MLOG(roo_transport_reliable_channel_connection)
+        << getLogPrefix() << "Resuming the session.";
+    resuming_ = true;
+    successive_handshake_retries_ = 0;
+    next_scheduled_handshake_update_ = roo_time::Uptime::Start();
+  }
+  outgoing_data_ready_.notify();
+  return true;
+}
+
 LinkStatus Channel::getLinkStatus(uint32_t stream_id) {
   roo::lock_guard<roo::mutex> guard(handshake_mutex_);
   return getLinkStatusInternal(stream_id);
@@ -234,10 +478,20 @@ long Channel::trySend() {
   roo::byte buf[250];
   long next_send_micros = std::numeric_limits<long>::max();
   size_t len = 0;
+  uint64_t pacing_config = pacing_config_;
+  if (pacing_config != applied_pacing_config_) {
+    pacer_.setRate((uint32_t)(pacing_config >> 32), (uint32_t)pacing_config);
+    applied_pacing_config_ = pacing_config;
+  }
   len = conn(buf, next_send_micros);
   if (len > 0) {
-    packet_sender_.send(buf, len);
+    sendPacket(buf, len);
   }
+  transmitter_.releaseIdleBuffers(next_send_micros);
+  receiver_.releaseIdleBuffers(next_send_micros);
+  // If that makes a (pending EOF) packet ready, it gets sent below.
+  bool ignored;
+  transmitter_.retryAllocation(next_send_micros, ignored);
   // Don't send anything besides handshake while we're connecting. But, keep
   // sending stuff (acks, etc.) if we're idle, which normally means that our
   // output stream has been closed, but we still need to keep sending acks and
@@ -245,31 +499,199 @@ long Channel::trySend() {
   if (transmitter_.state() == internal::Transmitter::kConnecting) {
     return next_send_micros;
   }
+  bool peer_timed_out = false;
+  len = keepAlive(buf, next_send_micros, peer_timed_out);
+  if (peer_timed_out) {
+    handlePeerTimeout();
+    return next_send_micros;
+  }
+  if (len > 0) {
+    sendPacket(buf, len);
+  }
+  // Control packets (acks, flow control, and keepalives) bypass the pacer, so
+  // that they never queue up behind bulk data.
   len = receiver_.ack(buf);
   if (len > 0) {
-    packet_sender_.send(buf, len);
+    sendPacket(buf, len);
   }
   len = receiver_.updateRecvHimark(buf, next_send_micros);
   if (len > 0) {
-    packet_sender_.send(buf, len);
+    sendPacket(buf, len);
+  }
+  if (pacer_.enabled()) {
+    long pacing_delay = pacer_.delayMicros(roo_time::Uptime::Now());
+    if (pacing_delay > 0) {
+      next_send_micros = std::min(next_send_micros, pacing_delay);
+      return next_send_micros;
+    }
+  }
+  {
+    // Datagrams go ahead of the reliable data, since they are only useful
+    // while fresh.
+    roo::lock_guard<roo::mutex> guard(datagram_mutex_);
+    len = datagrams_.pop(buf, roo_time::Uptime::Now());
+  }
+  if (len > 0) {
+    sendPacket(buf, len);
+    // Let the pacer account for it before sending anything else.
+    return 0;
   }
   len = transmitter_.send(buf, next_send_micros);
   if (len > 0) {
-    packet_sender_.send(buf, len);
+    sendPacket(buf, len);
   }
   return next_send_micros;
 }
 
+void Channel::sendPacket(const roo::byte* buf, size_t len) {
+  if (pacer_.enabled()) {
+    pacer_.consume(len, roo_time::Uptime::Now());
+  }
+  packet_sender_.send(buf, len);
+}
+
+void Channel::setBufferQuota(size_t max_packets) {
+  buffer_quota_.setLimit(max_packets);
+  // Lets the writers retry, if they are blocked.
+  outgoing_data_ready_.notify();
+}
+
+void Channel::setSendBufferSize(LinkBufferSize sendbuf) {
+  CheckPoolCapacity(log_prefix_, "send", (unsigned int)sendbuf);
+  bool outgoing_data_ready = false;
+  transmitter_.setBufferSize((unsigned int)sendbuf, outgoing_data_ready);
+  if (outgoing_data_ready) {
+    outgoing_data_ready_.notify();
+  }
+}
+
+void Channel::setReceiveBufferSize(LinkBufferSize recvbuf) {
+  CheckPoolCapacity(log_prefix_, "receive", (unsigned int)recvbuf);
+  receiver_.setBufferSize((unsigned int)recvbuf);
+  // Advertise the new size (or, when shrinking, check whether it can already
+  // take effect).
+  outgoing_data_ready_.notify();
+}
+
+void Channel::setPacingRate(uint32_t bytes_per_second, uint32_t burst_bytes) {
+  pacing_config_ = ((uint64_t)bytes_per_second << 32) | burst_bytes;
+  outgoing_data_ready_.notify();
+}
+
+namespace {
+
+uint32_t NowMillis() { return (uint32_t)roo_time::Uptime::Now().inMillis(); }
+
+}  // namespace
+
+void Channel::setKeepAlive(roo_time::Duration interval,
+                           uint8_t miss_threshold) {
+  CHECK_GT(miss_threshold, 0);
+  // Start counting from now, so that a long-idle session doesn't get
+  // declared dead right away.
+  last_peer_activity_ms_ = NowMillis();
+  keepalive_miss_threshold_ = miss_threshold;
+  keepalive_interval_ms_ = (uint32_t)interval.inMillis();
+  outgoing_data_ready_.notify();
+}
+
+size_t Channel::keepAlive(roo::byte* buf, long& next_send_micros,
+                          bool& peer_timed_out) {
+  bool reply = keepalive_reply_requested_;
+  if (reply) keepalive_reply_requested_ = false;
+  uint32_t interval_ms = keepalive_interval_ms_;
+  if (interval_ms == 0 && !reply) return 0;
+  roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  if (getLinkStatusInternal(my_stream_id_) != LinkStatus::kConnected ||
+      receiver_.state() != internal::Receiver::kConnected) {
+    // Keepalives only make sense within an established session.
+    return 0;
+  }
+  bool ping = false;
+  if (interval_ms > 0 && peer_keepalive_) {
+    uint32_t now_ms = NowMillis();
+    uint32_t silence_ms = now_ms - last_peer_activity_ms_;
+    uint32_t timeout_ms = interval_ms * keepalive_miss_threshold_;
+    if (silence_ms >= timeout_ms) {
+      peer_timed_out = true;
+      return 0;
+    }
+    uint32_t wait_ms;
+    if (silence_ms < interval_ms) {
+      // We've heard from the peer recently; no need to ping yet.
+      wait_ms = interval_ms - silence_ms;
+    } else {
+      uint32_t since_ping_ms = now_ms - last_keepalive_sent_ms_;
+      if (since_ping_ms >= interval_ms) {
+        ping = true;
+        last_keepalive_sent_ms_ = now_ms;
+        since_ping_ms = 0;
+      }
+      wait_ms = std::min(interval_ms - since_ping_ms, timeout_ms - silence_ms);
+    }
+    next_send_micros = std::min(next_send_micros, (long)wait_ms * 1000);
+  }
+  if (!ping && !reply) return 0;
+  // A ping is as good as a pong, since any packet counts as a sign of life.
+  uint16_t header = FormatPacketHeader(internal::SeqNum(ping ? 1 : 0),
+                                       internal::kKeepAlivePacket,
+                                       my_control_bit());
+  roo_io::StoreBeU16(header, buf);
+  return 2;
+}
+
+void Channel::notePeerAlive(internal::PacketType type, bool control_bit) {
+  if (keepalive_interval_ms_ == 0) return;
+  if (type != internal::kHandshakePacket) {
+    // Make sure that we don't mistake an echo of our own packets for a sign
+    // of life. (Handshake packets handle cross-talk on their own.)
+    if (control_bit == session_control_bit_) return;
+  }
+  last_peer_activity_ms_ = NowMillis();
+}
+
+void Channel::handlePeerTimeout() {
+  std::function<void()> disconnect_fn;
+  {
+    roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+    if (getLinkStatusInternal(my_stream_id_) != LinkStatus::kConnected) {
+      return;
+    }
+    LOG(WARNING) << getLogPrefix()
+                 << "Peer is not responding to keepalives; disconnecting.";
+    disconnect_fn = std::move(disconnect_fn_);
+    disconnect_fn_ = nullptr;
+    if (transmitter_.state() == internal::Transmitter::kConnected) {
+      transmitter_.setBroken();
+    } else {
+      transmitter_.reset();
+    }
+    receiver_.setBroken();
+    my_stream_id_ = 0;
+    resuming_ = false;
+    needs_handshake_ack_ = false;
+    connected_cv_.notify_all();
+    readiness_.notify();
+  }
+  dispatchAsyncCompletions();
+  if (disconnect_fn != nullptr) {
+    disconnect_fn();
+  }
+}
+
 namespace {
 struct HandshakePacket {
   uint16_t self_seq_num;
   uint32_t self_stream_id;
   uint32_t ack_stream_id;
   bool want_ack;
+  bool resume;
 
   friend roo_logging::Stream& operator<<(roo_logging::Stream& s,
                                          const HandshakePacket& p) {
-    if (p.ack_stream_id == 0) {
+    if (p.resume) {
+      s << "RESUME " << p.self_stream_id << "/" << p.ack_stream_id;
+    } else if (p.ack_stream_id == 0) {
       s << "CONN " << p.self_stream_id << ":" << p.self_seq_num;
     } else {
       s << (p.want_ack ? "CONN/ACK " : "ACK ") << p.self_stream_id << ":"
@@ -284,39 +706,49 @@ struct HandshakePacket {
 size_t Channel::conn(roo::byte* buf, long& next_send_micros) {
   roo::lock_guard<roo::mutex> guard(handshake_mutex_);
   auto transmitter_state = transmitter_.state();
-  if (transmitter_state == internal::Transmitter::kIdle ||
-      transmitter_state == internal::Transmitter::kBroken) {
-    // Don't send handshake requests until we're connecting.
+  if (transmitter_state == internal::Transmitter::kBroken) return 0;
+  if (transmitter_state == internal::Transmitter::kIdle &&
+      (my_stream_id_ == 0 || (!resuming_ && !needs_handshake_ack_))) {
+    // Don't send handshake requests until we're connecting. (The transmitter
+    // can also be idle within an established session, after our output has
+    // been closed; the session can still be resumed, though.)
     return 0;
   }
   if (transmitter_state == internal::Transmitter::kConnected &&
-      !needs_handshake_ack_) {
+      !needs_handshake_ack_ && !resuming_) {
     // The handshake has already been concluded.
     return 0;
   }
   // In case we're in backoff or expect an ack, the delay is updated to reflect
   // the remaining timeout.
   long delay = std::numeric_limits<long>::max();
-  if (transmitter_state == internal::Transmitter::kConnecting) {
+  if (transmitter_state == internal::Transmitter::kConnecting || resuming_) {
     roo_time::Uptime now = roo_time::Uptime::Now();
-    if (now < next_scheduled_handshake_update_) {
-      // We do need to send a handshake packet, but not yet.
+    if (now < next_scheduled_handshake_update_ && !needs_handshake_ack_) {
+      // We do need to send a handshake packet, but not yet. (If the peer is
+      // waiting for our response, though, we send it right away.)
       long delay = (next_scheduled_handshake_update_ - now).inMicros();
       next_send_micros = std::min(next_send_micros, delay);
       return 0;
     }
-    delay = Backoff(successive_handshake_retries_++).inMicros();
+    delay = handshakeBackoff(successive_handshake_retries_++).inMicros();
     next_scheduled_handshake_update_ = now + roo_time::Micros(delay);
   }
   // Clearing the flag, as we're about to send the handshake packet.
   needs_handshake_ack_ = false;
-  bool we_need_ack = (transmitter_state != internal::Transmitter::kConnected);
+  bool we_need_ack =
+      (transmitter_state != internal::Transmitter::kConnected) || resuming_;
+  // In handshake packets, the control bit advertises that we reply to
+  // keepalive pings.
   uint16_t header = FormatPacketHeader(transmitter_.front(),
-                                       internal::kHandshakePacket, false);
+                                       internal::kHandshakePacket, true);
   roo_io::StoreBeU16(header, buf);
   roo_io::StoreBeU32(my_stream_id_, buf + 2);
   roo_io::StoreBeU32(peer_stream_id_, buf + 6);
   uint8_t last_byte = we_need_ack ? 0x80 : 0x00;
+  if (resuming_) last_byte |= 0x40;
+  if (receiver_.unordered()) last_byte |= 0x20;
+  if (offer_compact_framing_) last_byte |= 0x10;
   last_byte |= receiver_.buffer_size_log2();
   roo_io::StoreU8(last_byte, buf + 10);
   next_send_micros = std::min(next_send_micros, delay);
@@ -327,6 +759,7 @@ size_t Channel::conn(roo::byte* buf, long& next_send_micros) {
              .self_stream_id = my_stream_id_,
              .ack_stream_id = peer_stream_id_,
              .want_ack = we_need_ack,
+             .resume = resuming_,
          };
   return 11;
 }
@@ -334,10 +767,14 @@ size_t Channel::conn(roo::byte* buf, long& next_send_micros) {
 void Channel::handleHandshakePacket(uint16_t peer_seq_num,
                                     uint32_t peer_stream_id,
                                     uint32_t ack_stream_id, bool want_ack,
+                                    bool resume, bool peer_accepts_unordered,
+                                    bool peer_compact_framing,
+                                    bool peer_keepalive,
                                     uint16_t peer_receive_buffer_size,
                                     bool& outgoing_data_ready) {
   std::function<void()> disconnect_fn;
   roo::lock_guard<roo::mutex> guard(handshake_mutex_);
+  bool compact_framing = offer_compact_framing_ && peer_compact_framing;
   MLOG(roo_transport_reliable_channel_connection)
       << getLogPrefix() << "Handshake packet received: "
       << HandshakePacket{
@@ -345,6 +782,7 @@ void Channel::handleHandshakePacket(uint16_t peer_seq_num,
              .self_stream_id = peer_stream_id,
              .ack_stream_id = ack_stream_id,
              .want_ack = want_ack,
+             .resume = resume,
          };
   if (peer_stream_id == my_stream_id_) {
     // The peer is echoing our own stream ID. This is probably a cross-talk from
@@ -382,26 +820,51 @@ void Channel::handleHandshakePacket(uint16_t peer_seq_num,
         transmitter_.setBroken();
         my_stream_id_ = 0;
         connected_cv_.notify_all();
+        readiness_.notify();
         break;
       }
       peer_stream_id_ = peer_stream_id;
+      peer_keepalive_ = peer_keepalive;
+      session_control_bit_ = my_control_bit();
       CHECK(receiver_.empty());
       MLOG(roo_transport_reliable_channel_connection)
           << getLogPrefix() << "Receiver is now connected.";
-      receiver_.setConnected(peer_seq_num, my_control_bit());
+      receiver_.setConnected(peer_seq_num, my_control_bit(), compact_framing);
       outgoing_data_ready = true;
 
       if (ack_stream_id == my_stream_id_) {
         MLOG(roo_transport_reliable_channel_connection)
             << getLogPrefix() << "Transmitter is now connected.";
         my_stream_id_acked_by_peer_ = true;
-        transmitter_.setConnected(peer_receive_buffer_size, my_control_bit());
+        transmitter_.setConnected(peer_receive_buffer_size, my_control_bit(),
+                                  peer_accepts_unordered, compact_framing);
       }
       needs_handshake_ack_ = want_ack;
       connected_cv_.notify_all();
+      readiness_.notify();
       break;
     }
     case internal::Receiver::kConnected: {
+      if (my_stream_id_ != 0 && my_stream_id_acked_by_peer_ &&
+          peer_stream_id == peer_stream_id_ && ack_stream_id == my_stream_id_) {
+        // The handshake refers to the current session.
+        if (resume || resuming_) {
+          // Either the peer asks to resume the session (e.g. after an outage),
+          // or it confirms that it still holds the session that we asked to
+          // resume. Either way, both sides are now in sync, and can quickly
+          // retransmit whatever has been lost.
+          MLOG(roo_transport_reliable_channel_connection)
+              << getLogPrefix()
+              << (resume ? "Peer is resuming the session."
+                         : "Session resumed.");
+          resuming_ = false;
+          transmitter_.resync();
+          receiver_.resync();
+          outgoing_data_ready = true;
+        }
+        needs_handshake_ack_ = want_ack;
+        break;
+      }
       // Note: we only consider initial connection requests as 'breaking' -
       // others might be latend acks.
       if (want_ack && (peer_stream_id_ != peer_stream_id) &&
@@ -425,6 +888,7 @@ void Channel::handleHandshakePacket(uint16_t peer_seq_num,
           }
           my_stream_id_ = 0;
           connected_cv_.notify_all();
+          readiness_.notify();
           MLOG(roo_transport_reliable_channel_connection)
               << getLogPrefix() << "Receiver is now broken.";
           receiver_.setBroken();
@@ -436,6 +900,7 @@ void Channel::handleHandshakePacket(uint16_t peer_seq_num,
         my_stream_id_ = 0;
         receiver_.reset();
         connected_cv_.notify_all();
+        readiness_.notify();
         break;
       }
       if (ack_stream_id == my_stream_id_ && !my_stream_id_acked_by_peer_) {
@@ -443,9 +908,11 @@ void Channel::handleHandshakePacket(uint16_t peer_seq_num,
         MLOG(roo_transport_reliable_channel_connection)
             << getLogPrefix() << "Transmitter is now connected.";
         my_stream_id_acked_by_peer_ = true;
-        transmitter_.setConnected(peer_receive_buffer_size, my_control_bit());
+        transmitter_.setConnected(peer_receive_buffer_size, my_control_bit(),
+                                  peer_accepts_unordered, compact_framing);
         outgoing_data_ready = true;
         connected_cv_.notify_all();
+        readiness_.notify();
       }
       needs_handshake_ack_ = want_ack;
       break;
@@ -472,6 +939,7 @@ void Channel::packetReceived(const roo::byte* buf, size_t len) {
   uint16_t header = roo_io::LoadBeU16(buf);
   bool control_bit = internal::GetPacketControlBit(header);
   auto type = internal::GetPacketType(header);
+  notePeerAlive(type, control_bit);
   switch (type) {
     case internal::kDataAckPacket: {
       transmitter_.ack(control_bit, header & 0x0FFF, buf + 2, len - 2,
@@ -479,8 +947,13 @@ void Channel::packetReceived(const roo::byte* buf, size_t len) {
       break;
     }
     case internal::kFlowControlPacket: {
-      // Update to available slots received.
-      transmitter_.updateRecvHimark(control_bit, header & 0x0FFF);
+      // Update to available slots received, possibly along with the new size
+      // of the peer's receive buffer.
+      int peer_receive_buffer_size_log2 =
+          (len >= 3) ? roo_io::LoadU8(buf + 2) & 0x0F : -1;
+      transmitter_.updateRecvHimark(control_bit, header & 0x0FFF,
+                                    peer_receive_buffer_size_log2,
+                                    outgoing_data_ready);
       break;
     }
     case internal::kHandshakePacket: {
@@ -493,27 +966,59 @@ void Channel::packetReceived(const roo::byte* buf, size_t len) {
       uint32_t ack_stream_id = roo_io::LoadBeU32(buf + 6);
       uint8_t last_byte = roo_io::LoadU8(buf + 10);
       bool want_ack = ((last_byte & 0x80) != 0);
+      bool resume = ((last_byte & 0x40) != 0);
+      bool unordered = ((last_byte & 0x20) != 0);
+      bool compact_framing = ((last_byte & 0x10) != 0);
+      // The control bit advertises keepalive support.
+      bool keepalive = control_bit;
       uint8_t peer_receive_buffer_size_log2 = last_byte & 0x0F;
       if (peer_receive_buffer_size_log2 > 12) {
         peer_receive_buffer_size_log2 = 12;
       }
       handleHandshakePacket(peer_seq_num, peer_stream_id, ack_stream_id,
-                            want_ack, (1 << peer_receive_buffer_size_log2),
+                            want_ack, resume, unordered, compact_framing,
+                            keepalive, (1 << peer_receive_buffer_size_log2),
                             outgoing_data_ready);
+      dispatchAsyncCompletions();
       break;
     }
     case internal::kDataPacket:
-    case internal::kFinPacket: {
+    case internal::kFinPacket:
+    case internal::kMessageStartPacket: {
       if (receiver_.handleDataPacket(control_bit, header & 0x0FFF, buf + 2,
-                                     len - 2, type == internal::kFinPacket)) {
+                                     len - 2, type == internal::kFinPacket,
+                                     type == internal::kMessageStartPacket)) {
         outgoing_data_ready = true;
       }
       break;
     }
+    case internal::kDatagramPacket: {
+      handleDatagram(control_bit, buf + 2, len - 2);
+      break;
+    }
+    case internal::kKeepAlivePacket: {
+      if ((header & 1) == 0) {
+        // A pong; we have already noted that the peer is alive.
+        break;
+      }
+      if (control_bit == session_control_bit_) {
+        // Echo of our own ping.
+        break;
+      }
+      keepalive_reply_requested_ = true;
+      outgoing_data_ready = true;
+      break;
+    }
     default: {
       // Unrecognized packet type; ignoring.
     }
   }
+  if (type != internal::kHandshakePacket &&
+      transmitter_.state() == internal::Transmitter::kConnecting) {
+    // Handshake packets are handled above (they get responded to right away,
+    // as needed); other packets still indicate that the peer is alive.
+    onPeerActivity(outgoing_data_ready);
+  }
   if (outgoing_data_ready) {
     outgoing_data_ready_.notify();
   }
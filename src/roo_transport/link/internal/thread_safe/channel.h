@@ -15,15 +15,23 @@
 #include "roo_threads/atomic.h"
 #include "roo_threads/mutex.h"
 #include "roo_threads/thread.h"
+#include "roo_transport/core/buffer_pool.h"
+#include "roo_transport/core/io_completion.h"
+#include "roo_transport/core/iovec.h"
+#include "roo_transport/link/internal/datagram_queue.h"
 #include "roo_transport/link/internal/in_buffer.h"
 #include "roo_transport/link/internal/out_buffer.h"
+#include "roo_transport/link/internal/pacer.h"
+#include "roo_transport/link/internal/protocol.h"
 #include "roo_transport/link/internal/receiver.h"
 #include "roo_transport/link/internal/ring_buffer.h"
 #include "roo_transport/link/internal/seq_num.h"
 #include "roo_transport/link/internal/thread_safe/outgoing_data_ready_notification.h"
+#include "roo_transport/link/internal/thread_safe/readiness_notification.h"
 #include "roo_transport/link/internal/thread_safe/thread_safe_receiver.h"
 #include "roo_transport/link/internal/thread_safe/thread_safe_transmitter.h"
 #include "roo_transport/link/internal/transmitter.h"
+#include "roo_transport/link/link_backoff_policy.h"
 #include "roo_transport/link/link_buffer_size.h"
 #include "roo_transport/link/link_status.h"
 #include "roo_transport/packets/packet_receiver.h"
@@ -45,18 +53,61 @@ class Channel {
 
   uint32_t my_stream_id() const;
 
+  // Blocks until some data can be written, or until the deadline passes, or
+  // the operation gets cancelled via the (optional) token.
   size_t write(const roo::byte* buf, size_t count, uint32_t my_stream_id,
-               roo_io::Status& stream_status);
+               roo_io::Status& stream_status,
+               roo_time::Uptime deadline = roo_time::Uptime::Max(),
+               const CancellationToken* cancel = nullptr);
 
   size_t tryWrite(const roo::byte* buf, size_t count, uint32_t my_stream_id,
                   roo_io::Status& stream_status);
 
+  // Writes all the data from the specified segments, blocking as needed.
+  // Returns the total number of bytes written, which is less than the total
+  // size of the segments only if the connection has been interrupted.
+  size_t writev(const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+                roo_io::Status& stream_status);
+
+  // See LinkOutputStream::writeMessage().
+  bool writeMessage(const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+                    roo_io::Status& stream_status);
+
+  // See LinkOutputStream::beginMessage().
+  bool beginMessage(size_t size, uint32_t my_stream_id,
+                    roo_io::Status& stream_status);
+
+  // See LinkTransport::DatagramFn.
+  using DatagramFn = std::function<void(uint32_t my_stream_id,
+                                        const roo::byte* data, size_t len)>;
+
+  // See LinkTransport::sendDatagram().
+  uint32_t sendDatagram(const IoVec* iov, size_t iovcnt, roo_time::Duration ttl,
+                        uint32_t my_stream_id);
+
+  // See LinkTransport::setDatagramReceiver().
+  void setDatagramReceiver(DatagramFn fn);
+
+  uint32_t datagrams_dropped() const;
+
+  // Blocks until some data can be read, or until the deadline passes, or the
+  // operation gets cancelled via the (optional) token.
   size_t read(roo::byte* buf, size_t count, uint32_t my_stream_id,
-              roo_io::Status& stream_status);
+              roo_io::Status& stream_status,
+              roo_time::Uptime deadline = roo_time::Uptime::Max(),
+              const CancellationToken* cancel = nullptr);
 
   size_t tryRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
                  roo_io::Status& stream_status);
 
+  // See ThreadSafeReceiver::asyncRead().
+  bool asyncRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
+                 IoCompletionFn fn);
+
+  // See ThreadSafeTransmitter::asyncWrite().
+  bool asyncWrite(const roo::byte* buf, size_t count, uint32_t my_stream_id,
+                  IoCompletionFn fn);
+
   // Returns -1 if no data available to read immediately.
   int peek(uint32_t my_stream_id, roo_io::Status& stream_status);
 
@@ -65,7 +116,15 @@ class Channel {
 
   void flush(uint32_t my_stream_id, roo_io::Status& stream_status);
 
-  void close(uint32_t my_stream_id, roo_io::Status& stream_status);
+  // See LinkOutputStream::flushWithin().
+  void flushBy(roo_time::Uptime deadline, uint32_t my_stream_id,
+               roo_io::Status& stream_status);
+
+  // Returns true if all the written data has been confirmed by the peer
+  // before the deadline passed (and the operation has not been cancelled).
+  bool close(uint32_t my_stream_id, roo_io::Status& stream_status,
+             roo_time::Uptime deadline = roo_time::Uptime::Max(),
+             const CancellationToken* cancel = nullptr);
 
   void closeInput(uint32_t my_stream_id, roo_io::Status& stream_status);
 
@@ -90,11 +149,62 @@ class Channel {
 
   uint32_t packets_received() const { return receiver_.packets_received(); }
 
+  // See LinkTransport::setCongestionControl().
+  void setCongestionControl(bool enabled) {
+    transmitter_.setCongestionControl(enabled);
+  }
+
+  // See LinkTransport::setBufferQuota().
+  void setBufferQuota(size_t max_packets);
+
+  size_t buffers_in_use() const { return buffer_quota_.blocks_in_use(); }
+
+  size_t buffers_high_water_mark() const {
+    return buffer_quota_.high_water_mark();
+  }
+
+  // See LinkTransport::setSendBufferSize().
+  void setSendBufferSize(LinkBufferSize sendbuf);
+
+  // See LinkTransport::setReceiveBufferSize().
+  void setReceiveBufferSize(LinkBufferSize recvbuf);
+
+  // See LinkTransport::setHandshakeBackoff().
+  void setHandshakeBackoff(const LinkBackoffPolicy& policy);
+
+  // See LinkTransport::setUnorderedDelivery().
+  void setUnorderedDelivery(bool enabled);
+
+  // See LinkTransport::setCompactFraming().
+  void setCompactFraming(bool enabled);
+
+  // See Link::compactFraming().
+  bool compactFraming() const { return receiver_.compact_framing(); }
+
+  // See LinkTransport::setKeepAlive().
+  void setKeepAlive(roo_time::Duration interval, uint8_t miss_threshold);
+
+  // See LinkTransport::setPacingRate().
+  void setPacingRate(uint32_t bytes_per_second, uint32_t burst_bytes);
+
   // Returns a newly-generated my_stream_id.
   uint32_t connect(std::function<void()> disconnect_fn = nullptr);
 
   LinkStatus getLinkStatus(uint32_t my_stream_id);
 
+  // See Link::resume().
+  bool resume(uint32_t my_stream_id);
+
+  // Registers a listener to be notified about the readiness events. The
+  // listener must be removed before it is destroyed.
+  void addReadinessListener(internal::ReadinessListener* listener) {
+    readiness_.addListener(listener);
+  }
+
+  void removeReadinessListener(internal::ReadinessListener* listener) {
+    readiness_.removeListener(listener);
+  }
+
   void awaitConnected(uint32_t my_stream_id);
   bool awaitConnected(uint32_t my_stream_id, roo_time::Duration timeout);
 
@@ -111,13 +221,50 @@ class Channel {
 
   void handleHandshakePacket(uint16_t peer_seq_num, uint32_t peer_stream_id,
                              uint32_t ack_stream_id, bool want_ack,
+                             bool resume, bool peer_accepts_unordered,
+                             bool peer_compact_framing,
+                             bool peer_keepalive,
                              uint16_t peer_receive_buffer_size,
                              bool& outgoing_data_ready);
 
   size_t conn(roo::byte* buf, long& next_send_micros);
 
+  // Returns the delay before the specified handshake retry, according to the
+  // backoff policy. Must hold handshake_mutex_.
+  roo_time::Duration handshakeBackoff(int retry_count) const;
+
+  // Called upon receiving a packet while connecting. Resets the handshake
+  // backoff, so that the handshake gets retried promptly.
+  void onPeerActivity(bool& outgoing_data_ready);
+
+  // Sends keepalive pings when the peer has been silent for the keepalive
+  // interval, and replies to the peer's pings. Sets peer_timed_out if the
+  // peer has been silent for longer than the miss threshold allows. Called by
+  // the sender thread.
+  size_t keepAlive(roo::byte* buf, long& next_send_micros,
+                   bool& peer_timed_out);
+
+  // Records that a packet has been received from the peer, for the purpose of
+  // dead-peer detection.
+  void notePeerAlive(internal::PacketType type, bool control_bit);
+
+  // Breaks the session after the peer stopped responding to keepalives.
+  void handlePeerTimeout();
+
+  // Passes the received datagram to the datagram receiver, if it belongs to
+  // the current session.
+  void handleDatagram(bool control_bit, const roo::byte* payload, size_t len);
+
+  // Invokes the callbacks of asynchronous operations that have been completed
+  // by connection state changes. Must be called without holding
+  // handshake_mutex_.
+  void dispatchAsyncCompletions();
+
   void sendLoop();
 
+  // Sends the packet via the packet sender, accounting for it in the pacer.
+  void sendPacket(const roo::byte* buf, size_t len);
+
   roo::string_view getLogPrefix() const { return log_prefix_; }
 
   bool my_control_bit() const { return my_stream_id_ > peer_stream_id_; }
@@ -127,6 +274,14 @@ class Channel {
   // Signals the sender thread that there are packets to send.
   internal::OutgoingDataReadyNotification outgoing_data_ready_;
 
+  // Signals the registered listeners (e.g. LinkSelectors) that the channel
+  // may have become readable, writable, connected, or broken.
+  internal::ReadinessNotification readiness_;
+
+  // Accounts for the packet buffers of both the transmitter and the receiver,
+  // allocated from the process-wide PacketBufferPool().
+  BufferPool::Quota buffer_quota_;
+
   internal::ThreadSafeTransmitter transmitter_;
   internal::ThreadSafeReceiver receiver_;
 
@@ -146,6 +301,11 @@ class Channel {
   // GUARDED_BY(handshake_mutex_).
   bool needs_handshake_ack_;
 
+  // Indicates that we have requested the peer to resume the session (see
+  // resume()), and we are waiting for the peer to acknowledge that.
+  // GUARDED_BY(handshake_mutex_).
+  bool resuming_;
+
   // Used in the handshake backoff protocol.
   // GUARDED_BY(handshake_mutex_).
   uint32_t successive_handshake_retries_;
@@ -153,18 +313,84 @@ class Channel {
   // GUARDED_BY(handshake_mutex_).
   roo_time::Uptime next_scheduled_handshake_update_;
 
-  // If not null, will be called, exactly once (from the receive thread) as soon
+  // GUARDED_BY(handshake_mutex_).
+  LinkBackoffPolicy backoff_policy_;
+
+  // As requested by setUnorderedDelivery(). Picked up by the next connect().
+  // GUARDED_BY(handshake_mutex_).
+  bool unordered_delivery_;
+
+  // As requested by setCompactFraming(). Picked up by the next connect(), into
+  // offer_compact_framing_, which is advertised in our handshakes.
+  // GUARDED_BY(handshake_mutex_).
+  bool compact_framing_;
+
+  // GUARDED_BY(handshake_mutex_).
+  bool offer_compact_framing_;
+
+  // If not null, will be called, exactly once (from the receive thread, or
+  // from the send thread if the peer stops responding to keepalives) as soon
   // as disconnection is detected.
   // GUARDED_BY(handshake_mutex_).
   std::function<void()> disconnect_fn_;
 
+  // Limits the rate of outgoing data packets. Used by the sender thread only.
+  internal::Pacer pacer_;
+
 #ifdef ROO_USE_THREADS
+  // Pacing configuration, as requested by setPacingRate(): the rate in the
+  // upper 32 bits, and the burst in the lower 32 bits, so that both change
+  // together. Picked up by the sender thread.
+  roo::atomic<uint64_t> pacing_config_;
+
+  // The pacing configuration last applied to pacer_. Used by the sender
+  // thread only.
+  uint64_t applied_pacing_config_;
+
+  // Keepalive configuration, as requested by setKeepAlive(). Zero interval
+  // means that keepalives are disabled.
+  roo::atomic<uint32_t> keepalive_interval_ms_;
+  roo::atomic<uint32_t> keepalive_miss_threshold_;
+
+  // Uptime, in milliseconds (wrapping), when we last heard from the peer.
+  // Only maintained while keepalives are enabled.
+  roo::atomic<uint32_t> last_peer_activity_ms_;
+
+  // Whether the peer of the current session replies to keepalive pings, as
+  // advertised in its handshake. Older peers don't, so we neither ping them
+  // nor time them out.
+  // GUARDED_BY(handshake_mutex_).
+  bool peer_keepalive_;
+
+  // my_control_bit() of the current session, as of when we learned the
+  // peer's stream ID. Lets the receive thread tell echoes of our own packets
+  // from the peer's without taking handshake_mutex_.
+  roo::atomic<bool> session_control_bit_;
+
+  // Set when the peer has sent us a ping, which we need to reply to.
+  roo::atomic<bool> keepalive_reply_requested_;
+
+  // Uptime, in milliseconds (wrapping), when we last sent a ping. Used by the
+  // sender thread only.
+  uint32_t last_keepalive_sent_ms_;
+
   roo::thread sender_thread_;
   roo::atomic<bool> active_;
 
   mutable roo::mutex handshake_mutex_;
 
   roo::condition_variable connected_cv_;
+
+  // Guards the datagram state below. Acquired after handshake_mutex_, if
+  // both are needed.
+  mutable roo::mutex datagram_mutex_;
+
+  // Outgoing datagrams, waiting for the sender thread.
+  // GUARDED_BY(datagram_mutex_).
+  internal::DatagramQueue datagrams_;
+
+  // GUARDED_BY(datagram_mutex_).
+  DatagramFn datagram_fn_;
 #endif
 
   std::string log_prefix_;
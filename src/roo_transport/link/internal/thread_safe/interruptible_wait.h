@@ -0,0 +1,42 @@
+#pragma once
+
+#include "roo_transport/link/internal/thread_safe/compile_guard.h"
+#ifdef ROO_USE_THREADS
+
+#include "roo_threads.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_time.h"
+#include "roo_transport/core/cancellation_token.h"
+
+namespace roo_transport {
+namespace internal {
+
+// Blocks on the condition variable, as a part of an operation bounded by the
+// specified deadline (roo_time::Uptime::Max() meaning 'none'), and by the
+// optional cancellation token. Returns true if woken up normally (possibly
+// spuriously), and false if the deadline has passed or the operation has been
+// cancelled.
+//
+// The caller is expected to keep a CancellationToken::Registration that
+// notifies the condition variable (under the same mutex) on cancellation.
+inline bool InterruptibleWait(roo::condition_variable& cv,
+                              roo::unique_lock<roo::mutex>& guard,
+                              roo_time::Uptime deadline,
+                              const CancellationToken* cancel) {
+  if (cancel != nullptr && cancel->isCancelled()) return false;
+  if (deadline == roo_time::Uptime::Max()) {
+    cv.wait(guard);
+  } else {
+    if (roo_time::Uptime::Now() >= deadline) return false;
+    if (cv.wait_until(guard, deadline) == roo::cv_status::timeout) {
+      return false;
+    }
+  }
+  return cancel == nullptr || !cancel->isCancelled();
+}
+
+}  // namespace internal
+}  // namespace roo_transport
+
+#endif  // ROO_USE_THREADS
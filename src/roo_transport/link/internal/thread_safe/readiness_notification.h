@@ -0,0 +1,66 @@
+#pragma once
+
+#include "roo_transport/link/internal/thread_safe/compile_guard.h"
+#ifdef ROO_USE_THREADS
+
+#include <algorithm>
+#include <vector>
+
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/mutex.h"
+
+namespace roo_transport {
+namespace internal {
+
+// Gets called when a channel may have become readable, writable, connected,
+// or broken.
+class ReadinessListener {
+ public:
+  virtual ~ReadinessListener() = default;
+
+  // Called from arbitrary threads, possibly with internal locks held. Must
+  // not block, and must not call back into the channel.
+  virtual void onReadinessChanged() = 0;
+};
+
+// Fans out the readiness events of a channel to the registered listeners
+// (e.g. LinkSelectors). The events are spurious-tolerant hints; the listeners
+// are expected to re-check the actual state. When there are no listeners,
+// notify() is a single atomic load.
+class ReadinessNotification {
+ public:
+  ReadinessNotification() : has_listeners_(false) {}
+
+  void addListener(ReadinessListener* listener) {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    listeners_.push_back(listener);
+    has_listeners_ = true;
+  }
+
+  void removeListener(ReadinessListener* listener) {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    listeners_.erase(
+        std::remove(listeners_.begin(), listeners_.end(), listener),
+        listeners_.end());
+    has_listeners_ = !listeners_.empty();
+  }
+
+  void notify() {
+    if (!has_listeners_) return;
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    for (ReadinessListener* listener : listeners_) {
+      listener->onReadinessChanged();
+    }
+  }
+
+ private:
+  roo::mutex mutex_;
+  roo::atomic<bool> has_listeners_;
+  std::vector<ReadinessListener*> listeners_;
+};
+
+}  // namespace internal
+}  // namespace roo_transport
+
+#endif  // ROO_USE_THREADS
@@ -3,26 +3,34 @@
 
 #include "roo_transport/link/internal/thread_safe/thread_safe_receiver.h"
 
+#include "roo_transport/link/internal/thread_safe/interruptible_wait.h"
+
 namespace roo_transport {
 namespace internal {
 
-ThreadSafeReceiver::ThreadSafeReceiver(unsigned int recvbuf_log2)
-    : receiver_(recvbuf_log2) {}
+ThreadSafeReceiver::ThreadSafeReceiver(unsigned int recvbuf_log2,
+                                       ReadinessNotification& readiness,
+                                       BufferPool::Quota* quota)
+    : receiver_(recvbuf_log2, quota), readiness_(readiness) {}
 
 Receiver::State ThreadSafeReceiver::state() const {
   roo::lock_guard<roo::mutex> guard(mutex_);
   return receiver_.state();
 }
 
-void ThreadSafeReceiver::setConnected(SeqNum peer_seq_num, bool control_bit) {
+void ThreadSafeReceiver::setConnected(SeqNum peer_seq_num, bool control_bit,
+                                      bool compact_framing) {
   roo::lock_guard<roo::mutex> guard(mutex_);
-  receiver_.setConnected(peer_seq_num, control_bit);
+  receiver_.setConnected(peer_seq_num, control_bit, compact_framing);
 }
 
 void ThreadSafeReceiver::setBroken() {
   roo::lock_guard<roo::mutex> guard(mutex_);
   receiver_.setBroken();
   has_data_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncRead(ignored);
 }
 
 bool ThreadSafeReceiver::checkConnectionStatus(uint32_t my_stream_id,
@@ -50,8 +58,15 @@ bool ThreadSafeReceiver::checkConnectionStatus(uint32_t my_stream_id,
 size_t ThreadSafeReceiver::read(roo::byte* buf, size_t count,
                                 uint32_t my_stream_id,
                                 roo_io::Status& stream_status,
-                                bool& outgoing_data_ready) {
+                                bool& outgoing_data_ready,
+                                roo_time::Uptime deadline,
+                                const CancellationToken* cancel) {
   if (count == 0) return 0;
+  // Must be registered before acquiring mutex_, since the callback acquires it.
+  CancellationToken::Registration registration(cancel, [this]() {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    has_data_.notify_all();
+  });
   roo::unique_lock<roo::mutex> guard(mutex_);
   if (!checkConnectionStatus(my_stream_id, stream_status)) return 0;
   while (true) {
@@ -60,7 +75,7 @@ size_t ThreadSafeReceiver::read(roo::byte* buf, size_t count,
       return total_read;
     }
     if (!checkConnectionStatus(my_stream_id, stream_status)) return 0;
-    has_data_.wait(guard);
+    if (!InterruptibleWait(has_data_, guard, deadline, cancel)) return 0;
   }
 }
 
@@ -75,6 +90,60 @@ size_t ThreadSafeReceiver::tryRead(roo::byte* buf, size_t count,
   return total_read;
 }
 
+bool ThreadSafeReceiver::asyncRead(roo::byte* buf, size_t count,
+                                   uint32_t my_stream_id, IoCompletionFn fn,
+                                   bool& outgoing_data_ready) {
+  IoCompletionFn done_fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (async_read_.active()) return false;
+    async_read_.start(buf, count, my_stream_id, std::move(fn));
+    tryAsyncRead(outgoing_data_ready);
+    async_read_.takeCompleted(done_fn, result, status);
+  }
+  // Completed immediately.
+  if (done_fn != nullptr) done_fn(result, status);
+  return true;
+}
+
+void ThreadSafeReceiver::tryAsyncRead(bool& outgoing_data_ready) {
+  if (!async_read_.pending()) return;
+  roo_io::Status status;
+  uint32_t my_stream_id = async_read_.my_stream_id;
+  if (!checkConnectionStatus(my_stream_id, status)) {
+    async_read_.complete(0, status);
+    return;
+  }
+  if (async_read_.count == 0) {
+    async_read_.complete(0, roo_io::kOk);
+    return;
+  }
+  bool has_ack_to_send = false;
+  size_t total_read = receiver_.tryRead(async_read_.buf, async_read_.count,
+                                        has_ack_to_send);
+  if (has_ack_to_send) outgoing_data_ready = true;
+  if (total_read > 0) {
+    async_read_.complete(total_read, roo_io::kOk);
+    return;
+  }
+  if (!checkConnectionStatus(my_stream_id, status)) {
+    async_read_.complete(0, status);
+  }
+}
+
+void ThreadSafeReceiver::dispatchAsyncCompletion() {
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    async_read_.takeCompleted(fn, result, status);
+  }
+  if (fn != nullptr) fn(result, status);
+}
+
 int ThreadSafeReceiver::peek(uint32_t my_stream_id,
                              roo_io::Status& stream_status) {
   roo::lock_guard<roo::mutex> guard(mutex_);
@@ -101,12 +170,28 @@ void ThreadSafeReceiver::reset() {
   roo::lock_guard<roo::mutex> guard(mutex_);
   receiver_.reset();
   has_data_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncRead(ignored);
 }
 
-void ThreadSafeReceiver::init(uint32_t my_stream_id) {
+void ThreadSafeReceiver::init(uint32_t my_stream_id, bool unordered) {
   roo::lock_guard<roo::mutex> guard(mutex_);
-  receiver_.init(my_stream_id);
+  receiver_.init(my_stream_id, unordered);
   has_data_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncRead(ignored);
+}
+
+void ThreadSafeReceiver::resync() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  receiver_.resync();
+}
+
+void ThreadSafeReceiver::setBufferSize(unsigned int recvbuf_log2) {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  receiver_.setBufferSize(recvbuf_log2);
 }
 
 size_t ThreadSafeReceiver::ack(roo::byte* buf) {
@@ -122,15 +207,26 @@ size_t ThreadSafeReceiver::updateRecvHimark(roo::byte* buf,
 
 bool ThreadSafeReceiver::handleDataPacket(bool control_bit, uint16_t seq_id,
                                           const roo::byte* payload, size_t len,
-                                          bool is_final) {
+                                          bool is_final,
+                                          bool is_message_start) {
   bool has_new_data_to_read = false;
   bool has_ack_to_send;
-  roo::lock_guard<roo::mutex> guard(mutex_);
-  has_ack_to_send = receiver_.handleDataPacket(
-      control_bit, seq_id, payload, len, is_final, has_new_data_to_read);
-  if (has_new_data_to_read) {
-    has_data_.notify_all();
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    has_ack_to_send =
+        receiver_.handleDataPacket(control_bit, seq_id, payload, len, is_final,
+                                   is_message_start, has_new_data_to_read);
+    if (has_new_data_to_read) {
+      has_data_.notify_all();
+      readiness_.notify();
+      tryAsyncRead(has_ack_to_send);
+      async_read_.takeCompleted(fn, result, status);
+    }
   }
+  if (fn != nullptr) fn(result, status);
   return has_ack_to_send;
 }
 
@@ -4,8 +4,13 @@
 #ifdef ROO_USE_THREADS
 
 #include "roo_io/status.h"
+#include "roo_time.h"
+#include "roo_transport/core/cancellation_token.h"
+#include "roo_transport/core/io_completion.h"
 #include "roo_transport/link/internal/receiver.h"
+#include "roo_transport/link/internal/thread_safe/async_io_op.h"
 #include "roo_transport/link/internal/thread_safe/outgoing_data_ready_notification.h"
+#include "roo_transport/link/internal/thread_safe/readiness_notification.h"
 
 namespace roo_transport {
 namespace internal {
@@ -15,19 +20,41 @@ class ThreadSafeReceiver {
   // Can be supplied to be notified when new data is available for read.
   using RecvCb = std::function<void()>;
 
-  ThreadSafeReceiver(unsigned int recvbuf_log2);
+  ThreadSafeReceiver(unsigned int recvbuf_log2,
+                     ReadinessNotification& readiness,
+                     BufferPool::Quota* quota);
 
   Receiver::State state() const;
 
-  void setConnected(SeqNum peer_seq_num, bool control_bit);
+  void setConnected(SeqNum peer_seq_num, bool control_bit,
+                    bool compact_framing);
   void setBroken();
 
+  // Blocks until some data is available, the stream ends or gets
+  // interrupted, the deadline passes, or the operation gets cancelled. In the
+  // latter two cases, returns zero and leaves stream_status as kOk.
   size_t read(roo::byte* buf, size_t count, uint32_t my_stream_id,
-              roo_io::Status& stream_status, bool& outgoing_data_ready);
+              roo_io::Status& stream_status, bool& outgoing_data_ready,
+              roo_time::Uptime deadline = roo_time::Uptime::Max(),
+              const CancellationToken* cancel = nullptr);
 
   size_t tryRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
                  roo_io::Status& stream_status, bool& outgoing_data_ready);
 
+  // Starts an asynchronous read. The callback gets invoked as soon as some
+  // data is available, or the stream ends or gets interrupted. If that is
+  // already the case, the callback is invoked immediately, from the calling
+  // thread. Otherwise, it is invoked later, from the thread that handles the
+  // incoming packets. Returns false (without invoking the callback) if another
+  // asynchronous read is still outstanding.
+  bool asyncRead(roo::byte* buf, size_t count, uint32_t my_stream_id,
+                 IoCompletionFn fn, bool& outgoing_data_ready);
+
+  // Invokes the callback of the asynchronous read, if it has been completed
+  // by a state change (e.g. setBroken() or reset()). Must be called without
+  // holding any locks.
+  void dispatchAsyncCompletion();
+
   int peek(uint32_t my_stream_id, roo_io::Status& stream_status);
 
   size_t availableForRead(uint32_t my_stream_id,
@@ -37,13 +64,34 @@ class ThreadSafeReceiver {
                        bool& outgoing_data_ready);
 
   void reset();
-  void init(uint32_t my_stream_id);
+  // See Receiver::init().
+  void init(uint32_t my_stream_id, bool unordered);
+  void resync();
+
+  bool unordered() const {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    return receiver_.unordered();
+  }
+
+  bool compact_framing() const {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    return receiver_.compact_framing();
+  }
+
+  // See Receiver::setBufferSize().
+  void setBufferSize(unsigned int recvbuf_log2);
 
   size_t ack(roo::byte* buf);
   size_t updateRecvHimark(roo::byte* buf, long& next_send_micros);
 
+  void releaseIdleBuffers(long& next_send_micros) {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    receiver_.releaseIdleBuffers(next_send_micros);
+  }
+
   bool handleDataPacket(bool control_bit, uint16_t seq_id,
-                        const roo::byte* payload, size_t len, bool is_final);
+                        const roo::byte* payload, size_t len, bool is_final,
+                        bool is_message_start);
 
   bool empty() const {
     roo::lock_guard<roo::mutex> guard(mutex_);
@@ -75,8 +123,18 @@ class ThreadSafeReceiver {
   bool checkConnectionStatus(uint32_t my_stream_id,
                              roo_io::Status& status) const;
 
+  // Tries to complete the pending asynchronous read, if any.
+  //
+  // Must be called with mutex_ held.
+  void tryAsyncRead(bool& outgoing_data_ready);
+
   internal::Receiver receiver_;
 
+  // Notified whenever the stream may have become readable.
+  ReadinessNotification& readiness_;
+
+  AsyncIoOp<roo::byte> async_read_;
+
   mutable roo::mutex mutex_;
   roo::condition_variable has_data_;
 };
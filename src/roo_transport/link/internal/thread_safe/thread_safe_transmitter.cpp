@@ -3,11 +3,26 @@
 
 #include "roo_transport/link/internal/thread_safe/thread_safe_transmitter.h"
 
+#include <algorithm>
+
+#include "roo_transport/link/internal/protocol.h"
+#include "roo_transport/link/internal/thread_safe/interruptible_wait.h"
+
 namespace roo_transport {
 namespace internal {
 
-ThreadSafeTransmitter::ThreadSafeTransmitter(unsigned int sendbuf_log2)
-    : transmitter_(sendbuf_log2) {}
+namespace {
+
+// How often to retry writes that are blocked by lack of memory for the packet
+// buffers.
+constexpr long kOutOfMemoryRetryMicros = 10000;
+
+}  // namespace
+
+ThreadSafeTransmitter::ThreadSafeTransmitter(unsigned int sendbuf_log2,
+                                             ReadinessNotification& readiness,
+                                             BufferPool::Quota* quota)
+    : transmitter_(sendbuf_log2, quota), readiness_(readiness) {}
 
 bool ThreadSafeTransmitter::checkConnectionStatus(
     uint32_t my_stream_id, roo_io::Status& status) const {
@@ -24,7 +39,14 @@ bool ThreadSafeTransmitter::checkConnectionStatus(
 size_t ThreadSafeTransmitter::write(const roo::byte* buf, size_t count,
                                     uint32_t my_stream_id,
                                     roo_io::Status& stream_status,
-                                    bool& outgoing_data_ready) {
+                                    bool& outgoing_data_ready,
+                                    roo_time::Uptime deadline,
+                                    const CancellationToken* cancel) {
+  // Must be registered before acquiring mutex_, since the callback acquires it.
+  CancellationToken::Registration registration(cancel, [this]() {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    has_space_.notify_all();
+  });
   roo::unique_lock<roo::mutex> guard(mutex_);
   if (!checkConnectionStatus(my_stream_id, stream_status)) return 0;
   while (true) {
@@ -35,7 +57,7 @@ size_t ThreadSafeTransmitter::write(const roo::byte* buf, size_t count,
     }
     if (!checkConnectionStatus(my_stream_id, stream_status)) return 0;
     // Wait for space to be available.
-    has_space_.wait(guard);
+    if (!waitForSpace(guard, deadline, cancel)) return 0;
   }
 }
 
@@ -49,6 +71,155 @@ size_t ThreadSafeTransmitter::tryWrite(const roo::byte* buf, size_t count,
   return total_written;
 }
 
+size_t ThreadSafeTransmitter::writev(
+    const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+    roo_io::Status& stream_status,
+    OutgoingDataReadyNotification& outgoing_data_ready) {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  if (!checkConnectionStatus(my_stream_id, stream_status)) return 0;
+  bool has_data_to_send = false;
+  size_t total_written =
+      writeSegments(iov, iovcnt, my_stream_id, stream_status, guard,
+                    has_data_to_send, outgoing_data_ready);
+  if (has_data_to_send) {
+    outgoing_data_ready.notify();
+  }
+  return total_written;
+}
+
+bool ThreadSafeTransmitter::writeMessage(
+    size_t size, const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+    roo_io::Status& stream_status,
+    OutgoingDataReadyNotification& outgoing_data_ready) {
+  size_t segments_size = 0;
+  for (size_t i = 0; i < iovcnt; ++i) segments_size += iov[i].size;
+  DCHECK_LE(segments_size, size);
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  if (!checkConnectionStatus(my_stream_id, stream_status)) return false;
+  // The framing gets negotiated in the handshake. (Nothing can be written
+  // before the connection is established, anyway.)
+  while (transmitter_.state() == Transmitter::kConnecting) {
+    waitForSpace(guard, roo_time::Uptime::Max(), nullptr);
+    if (!checkConnectionStatus(my_stream_id, stream_status)) return false;
+  }
+  roo::byte serialized_size[kMaxMessageSizePrefixLength];
+  size_t prefix_length = EncodeMessageSize(
+      size, transmitter_.compact_framing(), serialized_size);
+  const IoVec header = {serialized_size, prefix_length};
+  bool has_data_to_send = transmitter_.startMessage();
+  size_t total_written =
+      writeSegments(&header, 1, my_stream_id, stream_status, guard,
+                    has_data_to_send, outgoing_data_ready);
+  if (total_written == prefix_length) {
+    total_written += writeSegments(iov, iovcnt, my_stream_id, stream_status,
+                                   guard, has_data_to_send,
+                                   outgoing_data_ready);
+  }
+  if (has_data_to_send) {
+    outgoing_data_ready.notify();
+  }
+  return total_written == segments_size + prefix_length;
+}
+
+size_t ThreadSafeTransmitter::writeSegments(
+    const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+    roo_io::Status& stream_status, roo::unique_lock<roo::mutex>& guard,
+    bool& has_data_to_send,
+    OutgoingDataReadyNotification& outgoing_data_ready) {
+  size_t total_written = 0;
+  for (size_t i = 0; i < iovcnt; ++i) {
+    const roo::byte* buf = iov[i].data;
+    size_t count = iov[i].size;
+    while (count > 0) {
+      bool finished_packet = false;
+      size_t written = transmitter_.tryWrite(buf, count, finished_packet);
+      if (finished_packet) has_data_to_send = true;
+      if (written > 0) {
+        buf += written;
+        count -= written;
+        total_written += written;
+        continue;
+      }
+      if (!checkConnectionStatus(my_stream_id, stream_status)) {
+        return total_written;
+      }
+      // Out of space. Make sure that the sender knows about the packets we
+      // have already filled, and wait for them to get acked.
+      if (has_data_to_send) {
+        outgoing_data_ready.notify();
+        has_data_to_send = false;
+      }
+      waitForSpace(guard, roo_time::Uptime::Max(), nullptr);
+    }
+  }
+  return total_written;
+}
+
+bool ThreadSafeTransmitter::asyncWrite(const roo::byte* buf, size_t count,
+                                       uint32_t my_stream_id,
+                                       IoCompletionFn fn,
+                                       bool& outgoing_data_ready) {
+  IoCompletionFn done_fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (async_write_.active()) return false;
+    async_write_.start(buf, count, my_stream_id, std::move(fn));
+    tryAsyncWrite(outgoing_data_ready);
+    async_write_.takeCompleted(done_fn, result, status);
+  }
+  // Completed immediately.
+  if (done_fn != nullptr) done_fn(result, status);
+  return true;
+}
+
+bool ThreadSafeTransmitter::waitForSpace(roo::unique_lock<roo::mutex>& guard,
+                                         roo_time::Uptime deadline,
+                                         const CancellationToken* cancel) {
+  if (!transmitter_.out_of_memory()) {
+    return InterruptibleWait(has_space_, guard, deadline, cancel);
+  }
+  roo_time::Uptime retry =
+      roo_time::Uptime::Now() + roo_time::Micros(kOutOfMemoryRetryMicros);
+  if (deadline <= retry) {
+    return InterruptibleWait(has_space_, guard, deadline, cancel);
+  }
+  InterruptibleWait(has_space_, guard, retry, cancel);
+  return cancel == nullptr || !cancel->isCancelled();
+}
+
+void ThreadSafeTransmitter::tryAsyncWrite(bool& outgoing_data_ready) {
+  if (!async_write_.pending()) return;
+  roo_io::Status status;
+  if (!checkConnectionStatus(async_write_.my_stream_id, status)) {
+    async_write_.complete(0, status);
+    return;
+  }
+  if (async_write_.count == 0) {
+    async_write_.complete(0, roo_io::kOk);
+    return;
+  }
+  bool finished_packet = false;
+  size_t total_written = transmitter_.tryWrite(
+      async_write_.buf, async_write_.count, finished_packet);
+  if (finished_packet) outgoing_data_ready = true;
+  if (total_written > 0) {
+    async_write_.complete(total_written, roo_io::kOk);
+  }
+}
+
+void ThreadSafeTransmitter::dispatchAsyncCompletion() {
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    async_write_.takeCompleted(fn, result, status);
+  }
+  if (fn != nullptr) fn(result, status);
+}
+
 void ThreadSafeTransmitter::flush(uint32_t my_stream_id,
                                   roo_io::Status& stream_status,
                                   bool& outgoing_data_ready) {
@@ -59,6 +230,17 @@ void ThreadSafeTransmitter::flush(uint32_t my_stream_id,
   }
 }
 
+void ThreadSafeTransmitter::flushBy(roo_time::Uptime deadline,
+                                    uint32_t my_stream_id,
+                                    roo_io::Status& stream_status,
+                                    bool& outgoing_data_ready) {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  if (!checkConnectionStatus(my_stream_id, stream_status)) return;
+  if (transmitter_.flushBy(deadline)) {
+    outgoing_data_ready = true;
+  }
+}
+
 bool ThreadSafeTransmitter::hasPendingData(
     uint32_t my_stream_id, roo_io::Status& stream_status) const {
   if (!checkConnectionStatus(my_stream_id, stream_status)) return false;
@@ -66,18 +248,25 @@ bool ThreadSafeTransmitter::hasPendingData(
   return transmitter_.hasPendingData();
 }
 
-void ThreadSafeTransmitter::close(uint32_t my_stream_id,
+bool ThreadSafeTransmitter::close(uint32_t my_stream_id,
                                   roo_io::Status& stream_status,
-                                  bool& outgoing_data_ready) {
+                                  bool& outgoing_data_ready,
+                                  roo_time::Uptime deadline,
+                                  const CancellationToken* cancel) {
+  // Must be registered before acquiring mutex_, since the callback acquires it.
+  CancellationToken::Registration registration(cancel, [this]() {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    all_acked_.notify_all();
+  });
   roo::unique_lock<roo::mutex> guard(mutex_);
-  if (!checkConnectionStatus(my_stream_id, stream_status)) return;
+  if (!checkConnectionStatus(my_stream_id, stream_status)) return false;
   transmitter_.close();
   outgoing_data_ready = true;
-  if (!transmitter_.hasPendingData()) return;
+  if (!transmitter_.hasPendingData()) return true;
   while (true) {
-    all_acked_.wait(guard);
-    if (!transmitter_.hasPendingData()) return;
-    if (!checkConnectionStatus(my_stream_id, stream_status)) return;
+    if (!InterruptibleWait(all_acked_, guard, deadline, cancel)) return false;
+    if (!transmitter_.hasPendingData()) return true;
+    if (!checkConnectionStatus(my_stream_id, stream_status)) return false;
   }
 }
 
@@ -100,30 +289,136 @@ size_t ThreadSafeTransmitter::send(roo::byte* buf, long& next_send_micros) {
   return size;
 }
 
+void ThreadSafeTransmitter::retryAllocation(long& next_send_micros,
+                                            bool& outgoing_data_ready) {
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (!transmitter_.out_of_memory()) return;
+    if (!transmitter_.retryAllocation()) {
+      next_send_micros = std::min(next_send_micros, kOutOfMemoryRetryMicros);
+      return;
+    }
+    // Possibly added the pending EOF packet.
+    outgoing_data_ready = true;
+    has_space_.notify_all();
+    readiness_.notify();
+    tryAsyncWrite(outgoing_data_ready);
+    async_write_.takeCompleted(fn, result, status);
+  }
+  if (fn != nullptr) fn(result, status);
+}
+
 void ThreadSafeTransmitter::reset() {
   roo::lock_guard<roo::mutex> guard(mutex_);
   transmitter_.reset();
   all_acked_.notify_all();
+  // Blocked writers need to learn that the connection is gone.
+  has_space_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncWrite(ignored);
 }
 
 void ThreadSafeTransmitter::init(uint32_t my_stream_id, SeqNum new_start) {
   roo::lock_guard<roo::mutex> guard(mutex_);
   transmitter_.init(my_stream_id, new_start);
   all_acked_.notify_all();
+  // Blocked writers need to learn that the connection is gone.
+  has_space_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncWrite(ignored);
+}
+
+void ThreadSafeTransmitter::setConnected(uint16_t peer_receive_buffer_size,
+                                         bool control_bit,
+                                         bool peer_accepts_unordered,
+                                         bool compact_framing) {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  transmitter_.setConnected(peer_receive_buffer_size, control_bit,
+                            peer_accepts_unordered, compact_framing);
+  // Unblocks the writers waiting for the connection.
+  has_space_.notify_all();
+  readiness_.notify();
+  // The caller takes care of notifying the sender thread.
+  bool ignored;
+  tryAsyncWrite(ignored);
+}
+
+void ThreadSafeTransmitter::setBroken() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  transmitter_.setBroken();
+  all_acked_.notify_all();
+  has_space_.notify_all();
+  readiness_.notify();
+  bool ignored;
+  tryAsyncWrite(ignored);
+}
+
+void ThreadSafeTransmitter::setBufferSize(unsigned int sendbuf_log2,
+                                          bool& outgoing_data_ready) {
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (!transmitter_.setBufferSize(sendbuf_log2)) return;
+    has_space_.notify_all();
+    readiness_.notify();
+    tryAsyncWrite(outgoing_data_ready);
+    async_write_.takeCompleted(fn, result, status);
+  }
+  if (fn != nullptr) fn(result, status);
 }
 
 void ThreadSafeTransmitter::ack(bool control_bit, uint16_t seq_id,
                                 const roo::byte* ack_bitmap,
                                 size_t ack_bitmap_len,
                                 bool& outgoing_data_ready) {
-  roo::lock_guard<roo::mutex> guard(mutex_);
-  if (transmitter_.ack(control_bit, seq_id, ack_bitmap, ack_bitmap_len)) {
-    // We have a new packet ready to be sent.
-    outgoing_data_ready = true;
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    size_t available_before = transmitter_.availableForWrite();
+    if (transmitter_.ack(control_bit, seq_id, ack_bitmap, ack_bitmap_len)) {
+      // We have a new packet ready to be sent.
+      outgoing_data_ready = true;
+    }
+    if (!transmitter_.hasPendingData()) {
+      all_acked_.notify_all();
+    }
+    if (transmitter_.availableForWrite() != available_before) {
+      readiness_.notify();
+    }
+    tryAsyncWrite(outgoing_data_ready);
+    async_write_.takeCompleted(fn, result, status);
   }
-  if (!transmitter_.hasPendingData()) {
-    all_acked_.notify_all();
+  if (fn != nullptr) fn(result, status);
+}
+
+void ThreadSafeTransmitter::updateRecvHimark(bool control_bit,
+                                             uint16_t recv_himark,
+                                             int peer_receive_buffer_size_log2,
+                                             bool& outgoing_data_ready) {
+  IoCompletionFn fn;
+  size_t result = 0;
+  roo_io::Status status = roo_io::kOk;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (!transmitter_.updateRecvHimark(control_bit, recv_himark,
+                                       peer_receive_buffer_size_log2)) {
+      return;
+    }
+    has_space_.notify_all();
+    readiness_.notify();
+    tryAsyncWrite(outgoing_data_ready);
+    async_write_.takeCompleted(fn, result, status);
   }
+  if (fn != nullptr) fn(result, status);
 }
 
 }  // namespace internal
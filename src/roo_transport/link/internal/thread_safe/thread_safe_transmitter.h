@@ -6,6 +6,13 @@
 #include "roo_io/status.h"
 #include "roo_threads.h"
 #include "roo_threads/mutex.h"
+#include "roo_time.h"
+#include "roo_transport/core/cancellation_token.h"
+#include "roo_transport/core/io_completion.h"
+#include "roo_transport/core/iovec.h"
+#include "roo_transport/link/internal/thread_safe/async_io_op.h"
+#include "roo_transport/link/internal/thread_safe/outgoing_data_ready_notification.h"
+#include "roo_transport/link/internal/thread_safe/readiness_notification.h"
 #include "roo_transport/link/internal/transmitter.h"
 
 namespace roo_transport {
@@ -13,7 +20,9 @@ namespace internal {
 
 class ThreadSafeTransmitter {
  public:
-  ThreadSafeTransmitter(unsigned int sendbuf_log2);
+  ThreadSafeTransmitter(unsigned int sendbuf_log2,
+                        ReadinessNotification& readiness,
+                        BufferPool::Quota* quota);
 
   void reset();
 
@@ -29,36 +38,91 @@ class ThreadSafeTransmitter {
     return transmitter_.packets_delivered();
   }
 
+  // Blocks until some data can be written, the connection gets interrupted,
+  // the deadline passes, or the operation gets cancelled. In the latter two
+  // cases, returns zero and leaves stream_status as kOk.
   size_t write(const roo::byte* buf, size_t count, uint32_t my_stream_id,
-               roo_io::Status& stream_status, bool& outgoing_data_ready);
+               roo_io::Status& stream_status, bool& outgoing_data_ready,
+               roo_time::Uptime deadline = roo_time::Uptime::Max(),
+               const CancellationToken* cancel = nullptr);
 
   size_t tryWrite(const roo::byte* buf, size_t count, uint32_t my_stream_id,
                   roo_io::Status& stream_status, bool& outgoing_data_ready);
 
+  // Writes all the data from the specified segments, in order, blocking as
+  // needed until all of it has been accepted, or until the connection gets
+  // interrupted. Returns the total number of bytes written.
+  //
+  // Unlike write(), it takes the notification object directly, rather than
+  // a flag to be acted upon by the caller, because it needs to wake up the
+  // sender before blocking on a full send buffer.
+  size_t writev(const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+                roo_io::Status& stream_status,
+                OutgoingDataReadyNotification& outgoing_data_ready);
+
+  // Writes a message of the specified size: its length prefix (see
+  // kMessageStartPacket), followed by the data from the specified segments.
+  // The segments may hold just the beginning of the message, in which case
+  // the caller writes the remainder via regular writes. Blocks like writev().
+  // If the peer accepts messages out of order, the message starts in a new
+  // packet, marked as the message start. Returns true if the prefix and all
+  // the segments have been written.
+  bool writeMessage(size_t size, const IoVec* iov, size_t iovcnt,
+                    uint32_t my_stream_id, roo_io::Status& stream_status,
+                    OutgoingDataReadyNotification& outgoing_data_ready);
+
+  // Starts an asynchronous write. The callback gets invoked as soon as some
+  // data has been written, or the connection gets interrupted. If that can
+  // happen right away, the callback is invoked immediately, from the calling
+  // thread. Otherwise, it is invoked later, from the thread that handles the
+  // incoming packets (acks and flow control). Returns false (without invoking
+  // the callback) if another asynchronous write is still outstanding.
+  bool asyncWrite(const roo::byte* buf, size_t count, uint32_t my_stream_id,
+                  IoCompletionFn fn, bool& outgoing_data_ready);
+
+  // Invokes the callback of the asynchronous write, if it has been completed
+  // by a state change (e.g. setBroken() or reset()). Must be called without
+  // holding any locks.
+  void dispatchAsyncCompletion();
+
   size_t availableForWrite(uint32_t my_stream_id,
                            roo_io::Status& stream_status) const;
 
   void flush(uint32_t my_stream_id, roo_io::Status& stream_status,
              bool& outgoing_data_ready);
 
+  // See Transmitter::flushBy().
+  void flushBy(roo_time::Uptime deadline, uint32_t my_stream_id,
+               roo_io::Status& stream_status, bool& outgoing_data_ready);
+
   bool hasPendingData(uint32_t my_stream_id,
                       roo_io::Status& stream_status) const;
 
   // Closes the stream and blocks until all the data has been confirmed by the
-  // recipient.
-  void close(uint32_t my_stream_id, roo_io::Status& stream_status,
-             bool& outgoing_data_ready);
-
-  void setConnected(uint16_t peer_receive_buffer_size, bool control_bit) {
+  // recipient, the connection gets interrupted, the deadline passes, or the
+  // operation gets cancelled. Returns true if all the data has been
+  // confirmed; false otherwise.
+  bool close(uint32_t my_stream_id, roo_io::Status& stream_status,
+             bool& outgoing_data_ready,
+             roo_time::Uptime deadline = roo_time::Uptime::Max(),
+             const CancellationToken* cancel = nullptr);
+
+  void setConnected(uint16_t peer_receive_buffer_size, bool control_bit,
+                    bool peer_accepts_unordered, bool compact_framing);
+
+  void setCongestionControl(bool enabled) {
     roo::lock_guard<roo::mutex> guard(mutex_);
-    transmitter_.setConnected(peer_receive_buffer_size, control_bit);
+    transmitter_.setCongestionControl(enabled);
   }
 
-  void setBroken() {
+  void setBroken();
+
+  // See Transmitter::setBufferSize().
+  void setBufferSize(unsigned int sendbuf_log2, bool& outgoing_data_ready);
+
+  void resync() {
     roo::lock_guard<roo::mutex> guard(mutex_);
-    transmitter_.setBroken();
-    all_acked_.notify_all();
-    has_space_.notify_all();
+    transmitter_.resync();
   }
 
   Transmitter::State state() const {
@@ -68,6 +132,16 @@ class ThreadSafeTransmitter {
 
   size_t send(roo::byte* buf, long& next_send_micros);
 
+  void releaseIdleBuffers(long& next_send_micros) {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    transmitter_.releaseIdleBuffers(next_send_micros);
+  }
+
+  // If writes are blocked by lack of memory for the packet buffers, retries
+  // the allocation, and wakes up the writers if it succeeds. Otherwise,
+  // updates next_send_micros to retry again later. Called by the send thread.
+  void retryAllocation(long& next_send_micros, bool& outgoing_data_ready);
+
   SeqNum front() const {
     roo::lock_guard<roo::mutex> guard(mutex_);
     return transmitter_.front();
@@ -76,12 +150,9 @@ class ThreadSafeTransmitter {
   void ack(bool control_bit, uint16_t seq_id, const roo::byte* ack_bitmap,
            size_t ack_bitmap_len, bool& outgoing_data_ready);
 
-  void updateRecvHimark(bool control_bit, uint16_t recv_himark) {
-    roo::lock_guard<roo::mutex> guard(mutex_);
-    if (transmitter_.updateRecvHimark(control_bit, recv_himark)) {
-      has_space_.notify_all();
-    }
-  }
+  void updateRecvHimark(bool control_bit, uint16_t recv_himark,
+                        int peer_receive_buffer_size_log2,
+                        bool& outgoing_data_ready);
 
  private:
   // Checks the state of the underlying receiver, and whether its stream ID
@@ -94,8 +165,38 @@ class ThreadSafeTransmitter {
   bool checkConnectionStatus(uint32_t my_stream_id,
                              roo_io::Status& status) const;
 
+  // Writes all the data from the specified segments, blocking as needed. Sets
+  // has_data_to_send if some packets are ready to be sent, but the sender
+  // hasn't been notified yet. Returns the total number of bytes written.
+  //
+  // Must be called with mutex_ held.
+  size_t writeSegments(const IoVec* iov, size_t iovcnt, uint32_t my_stream_id,
+                       roo_io::Status& stream_status,
+                       roo::unique_lock<roo::mutex>& guard,
+                       bool& has_data_to_send,
+                       OutgoingDataReadyNotification& outgoing_data_ready);
+
+  // Waits for space to be available for writing, like InterruptibleWait().
+  // If out of memory, wakes up periodically to retry, since the memory may get
+  // released by other links, with no notification.
+  //
+  // Must be called with mutex_ held.
+  bool waitForSpace(roo::unique_lock<roo::mutex>& guard,
+                    roo_time::Uptime deadline,
+                    const CancellationToken* cancel);
+
+  // Tries to complete the pending asynchronous write, if any.
+  //
+  // Must be called with mutex_ held.
+  void tryAsyncWrite(bool& outgoing_data_ready);
+
   internal::Transmitter transmitter_;
 
+  // Notified whenever the stream may have become writable.
+  ReadinessNotification& readiness_;
+
+  AsyncIoOp<const roo::byte> async_write_;
+
   mutable roo::mutex mutex_;
 
   // Notifies the application writer thread that the output stream might have
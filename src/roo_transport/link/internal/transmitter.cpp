@@ -1,22 +1,76 @@
 #include "roo_transport/link/internal/transmitter.h"
 
+#include <algorithm>
+
 #include "roo_backport.h"
 #include "roo_backport/byte.h"
 
 namespace roo_transport {
 namespace internal {
 
-Transmitter::Transmitter(unsigned int sendbuf_log2)
+namespace {
+
+// Initial congestion window, in packets.
+constexpr uint16_t kInitialCwnd = 4;
+
+// Smallest congestion window that slow start falls back to after loss.
+constexpr uint16_t kMinSsthresh = 2;
+
+// An unacked packet is deemed lost once a packet transmitted at least this many
+// transmissions after it has been acked. The underlying packet writer delivers
+// packets in order, so there is no reordering to tolerate; any later
+// transmission that gets acked is equivalent to a duplicate ack.
+constexpr uint32_t kDupThreshold = 1;
+
+// Max number of packets that may be sent beyond the congestion window in
+// response to duplicate acks (see RFC 3042).
+constexpr uint8_t kLimitedTransmitMax = 2;
+
+// If no ack arrives for about two round-trip times after the last
+// transmission, the most recently sent packet gets retransmitted, so that its
+// ack reveals any losses among the preceding packets. Needed because losses at
+// the tail of a burst (e.g. of a small RPC that fits in a single packet) are
+// not followed by any acks that would otherwise reveal them. Until the
+// round-trip time is measured, the initial timeout is used.
+constexpr uint32_t kInitialTailLossProbeTimeoutMicros = 10000;
+constexpr uint32_t kMinTailLossProbeTimeoutMicros = 1000;
+
+// Max number of consecutive tail loss probes, sent without any ack in between.
+// Beyond that, we fall back to the regular retransmission timeout.
+constexpr uint8_t kMaxTailLossProbes = 2;
+
+}  // namespace
+
+Transmitter::Transmitter(unsigned int sendbuf_log2, BufferPool::Quota* quota)
     : state_(kIdle),
       end_of_stream_(false),
-      out_buffers_(new OutBuffer[1 << sendbuf_log2]),
+      out_buffers_(sendbuf_log2, quota),
       current_out_buffer_(nullptr),
       out_ring_(sendbuf_log2, 0),
+      requested_buffer_size_log2_(sendbuf_log2),
       next_to_send_(out_ring_.begin()),
       recv_himark_(out_ring_.begin() + (1 << sendbuf_log2)),
       has_pending_eof_(false),
+      mark_messages_(false),
+      compact_framing_(false),
+      message_start_pending_(false),
+      flush_deadline_(roo_time::Uptime::Max()),
+      out_of_memory_(false),
       packets_sent_(0),
       packets_delivered_(0),
+      congestion_control_(true),
+      cwnd_(kInitialCwnd),
+      ssthresh_(0xFFFF),
+      cwnd_acked_(0),
+      recovery_point_(out_ring_.begin()),
+      next_send_serial_(0),
+      delivered_serial_(0),
+      limited_transmit_(0),
+      resyncing_(false),
+      resync_serial_(0),
+      srtt_micros_(0),
+      last_send_time_(roo_time::Uptime::Start()),
+      tail_loss_probes_sent_(0),
       peer_receive_buffer_size_(0),
       control_bit_(false) {}
 
@@ -34,12 +88,21 @@ size_t Transmitter::tryWrite(const roo::byte* buf, size_t count,
         // No more tokens.
         break;
       }
-      if (out_ring_.slotsFree() == 0) {
+      if (slotsAvailable() == 0) {
+        break;
+      }
+      SeqNum pos = out_ring_.end();
+      if (!push(pos)) {
+        // Let the send thread retry the allocation later.
+        outgoing_data_ready = true;
         break;
       }
-      SeqNum pos = out_ring_.push();
       current_out_buffer_ = &getOutBuffer(pos);
       current_out_buffer_->init(pos, control_bit_);
+      if (message_start_pending_) {
+        current_out_buffer_->markMessageStart();
+        message_start_pending_ = false;
+      }
     }
     size_t written = current_out_buffer_->write(buf, count);
     total_written += written;
@@ -47,6 +110,8 @@ size_t Transmitter::tryWrite(const roo::byte* buf, size_t count,
     count -= written;
     if (current_out_buffer_->finished()) {
       current_out_buffer_ = nullptr;
+      // All the data awaiting the deferred flush is now in finished packets.
+      flush_deadline_ = roo_time::Uptime::Max();
       outgoing_data_ready = true;
     }
 
@@ -57,19 +122,68 @@ size_t Transmitter::tryWrite(const roo::byte* buf, size_t count,
 bool Transmitter::flush() {
   if (current_out_buffer_ != nullptr) {
     current_out_buffer_->flush();
+    flush_deadline_ = roo_time::Uptime::Max();
     return true;
   }
   return false;
 }
 
+bool Transmitter::flushBy(roo_time::Uptime deadline) {
+  if (current_out_buffer_ == nullptr || current_out_buffer_->flushed()) {
+    return false;
+  }
+  if (deadline >= flush_deadline_) return false;
+  flush_deadline_ = deadline;
+  return true;
+}
+
+void Transmitter::finishPacket(OutBuffer& buf) {
+  buf.finish();
+  if (&buf == current_out_buffer_) current_out_buffer_ = nullptr;
+}
+
+bool Transmitter::startMessage() {
+  if (!mark_messages_) return false;
+  message_start_pending_ = true;
+  if (current_out_buffer_ == nullptr) return false;
+  bool newly_finished = !current_out_buffer_->finished();
+  if (newly_finished) current_out_buffer_->finish();
+  current_out_buffer_ = nullptr;
+  flush_deadline_ = roo_time::Uptime::Max();
+  return newly_finished;
+}
+
 bool Transmitter::hasPendingData() const { return !out_ring_.empty(); }
 
-void Transmitter::addEosPacket() {
-  SeqNum pos = out_ring_.push();
+bool Transmitter::push(SeqNum& pos) {
+  if (!out_buffers_.acquire(out_ring_.end(), out_ring_)) {
+    out_of_memory_ = true;
+    return false;
+  }
+  out_of_memory_ = false;
+  pos = out_ring_.push();
+  return true;
+}
+
+bool Transmitter::retryAllocation() {
+  if (!out_of_memory_) return false;
+  // Pre-allocates the buffer for the next packet.
+  if (!out_buffers_.acquire(out_ring_.end(), out_ring_)) return false;
+  out_of_memory_ = false;
+  if (has_pending_eof_ && slotsAvailable() > 0 && addEosPacket()) {
+    has_pending_eof_ = false;
+  }
+  return true;
+}
+
+bool Transmitter::addEosPacket() {
+  SeqNum pos = out_ring_.end();
+  if (!push(pos)) return false;
   auto* buf = &getOutBuffer(pos);
   buf->init(pos, control_bit_);
   buf->markFinal();
   buf->finish();
+  return true;
 }
 
 void Transmitter::close() {
@@ -80,28 +194,81 @@ void Transmitter::close() {
     return;
   }
   flush();
-  if (out_ring_.slotsFree() == 0) {
+  if (slotsAvailable() == 0 || !addEosPacket()) {
     has_pending_eof_ = true;
-  } else {
-    addEosPacket();
   }
   end_of_stream_ = true;
 }
 
+void Transmitter::resync() {
+  if (state_ != kConnected) return;
+  resyncing_ = true;
+  resync_serial_ = next_send_serial_;
+  tail_loss_probes_sent_ = 0;
+}
+
 void Transmitter::setBroken() {
   while (!out_ring_.empty()) {
     out_ring_.pop();
   }
+  current_out_buffer_ = nullptr;
+  flush_deadline_ = roo_time::Uptime::Max();
   state_ = kBroken;
+  maybeResize();
 }
 
 size_t Transmitter::availableForWrite() const {
-  if (end_of_stream_ || state_ == kIdle || state_ == kBroken) {
+  if (end_of_stream_ || state_ == kIdle || state_ == kBroken ||
+      out_of_memory_) {
     return 0;
   }
   // In the extreme case, if flush is issued after every write, we might only
   // fit one byte per slot.
-  return out_ring_.slotsFree();
+  return slotsAvailable();
+}
+
+uint16_t Transmitter::slotsAvailable() const {
+  uint16_t capacity = std::min<uint16_t>(out_ring_.capacity(),
+                                         1 << requested_buffer_size_log2_);
+  uint16_t used = out_ring_.slotsUsed();
+  return used < capacity ? capacity - used : 0;
+}
+
+bool Transmitter::setBufferSize(unsigned int sendbuf_log2) {
+  CHECK_LE(sendbuf_log2, 10u);
+  size_t available_before = slotsAvailable();
+  requested_buffer_size_log2_ = sendbuf_log2;
+  maybeResize();
+  return slotsAvailable() > available_before;
+}
+
+void Transmitter::maybeResize() {
+  int log2 = requested_buffer_size_log2_;
+  if (log2 == out_ring_.capacity_log2()) return;
+  uint16_t capacity = 1 << log2;
+  if (out_ring_.slotsUsed() > capacity) {
+    // Need to wait for more packets to get acked.
+    return;
+  }
+  // Slot offsets depend on the capacity, so the queued packets need to be
+  // relocated.
+  PacketBufferArray<OutBuffer> buffers(log2, out_buffers_.quota(),
+                                       /*reserve=*/false);
+  for (SeqNum pos = out_ring_.begin(); pos < out_ring_.end(); ++pos) {
+    // If out of memory, we'll try again later.
+    if (!buffers.acquireIgnoringQuota(pos)) return;
+  }
+  OutBuffer* current_out_buffer = nullptr;
+  for (SeqNum pos = out_ring_.begin(); pos < out_ring_.end(); ++pos) {
+    OutBuffer& buf = buffers[pos.raw() & (capacity - 1)];
+    buf = getOutBuffer(pos);
+    if (&getOutBuffer(pos) == current_out_buffer_) {
+      current_out_buffer = &buf;
+    }
+  }
+  out_buffers_ = std::move(buffers);
+  current_out_buffer_ = current_out_buffer;
+  out_ring_.setCapacityLog2(log2);
 }
 
 size_t Transmitter::send(roo::byte* buf, long& next_send_micros) {
@@ -116,16 +283,29 @@ size_t Transmitter::send(roo::byte* buf, long& next_send_micros) {
 const internal::OutBuffer* Transmitter::getBufferToSend(
     long& next_send_micros) {
   if (state_ != kConnected) return nullptr;
-  if (out_ring_.contains(next_to_send_)) {
+  if (flush_deadline_ != roo_time::Uptime::Max()) {
+    // Deferred flush (see flushBy()).
+    roo_time::Uptime now = roo_time::Uptime::Now();
+    if (current_out_buffer_ == nullptr || current_out_buffer_->flushed()) {
+      // Already flushed (e.g. auto-flushed, below).
+      flush_deadline_ = roo_time::Uptime::Max();
+    } else if (flush_deadline_ <= now) {
+      flush();
+    } else {
+      next_send_micros =
+          std::min(next_send_micros, (long)(flush_deadline_ - now).inMicros());
+    }
+  }
+  SeqNum send_limit = sendLimit();
+  if (out_ring_.contains(next_to_send_) && next_to_send_ < send_limit) {
     // Best-effort attempt to quickly send the next buffer in the sequence.
     OutBuffer& buf = getOutBuffer(next_to_send_);
     if (!buf.acked() && buf.flushed()) {
-      if (!buf.finished()) buf.finish();
+      if (!buf.finished()) finishPacket(buf);
       if (buf.send_counter() == 0) {
         // Never sent before.
         ++next_to_send_;
-        ++packets_sent_;
-        buf.markSent(roo_time::Uptime::Now());
+        markSent(buf, roo_time::Uptime::Now());
         next_send_micros = 0;
         return &buf;
       }
@@ -136,7 +316,7 @@ const internal::OutBuffer* Transmitter::getBufferToSend(
   SeqNum to_send = out_ring_.end();
   roo_time::Uptime min_send_time = roo_time::Uptime::Max();
   for (SeqNum pos = out_ring_.begin();
-       pos < out_ring_.end() && pos < recv_himark_; ++pos) {
+       pos < out_ring_.end() && pos < send_limit; ++pos) {
     OutBuffer& buf = getOutBuffer(pos);
     if (buf.acked()) {
       continue;
@@ -157,11 +337,21 @@ const internal::OutBuffer* Transmitter::getBufferToSend(
       min_send_time = buf.expiration();
     }
   }
+  if (min_send_time > now) {
+    // Nothing to send right now; perhaps it is time to probe the tail.
+    OutBuffer* probe = getTailLossProbe(now, next_send_micros);
+    if (probe != nullptr) {
+      markSent(*probe, now);
+      next_send_micros = 0;
+      return probe;
+    }
+  }
   if (!out_ring_.contains(to_send)) {
     // No more packets to send at all.
     // Auto-flush: let's see if we can opportunistically close and send a
-    // packet?
-    if (out_ring_.slotsUsed() != 1 || out_ring_.begin() >= recv_himark_) {
+    // packet? (Unless the writer asked to hold it back; see flushBy().)
+    if (out_ring_.slotsUsed() != 1 || out_ring_.begin() >= send_limit ||
+        flush_deadline_ != roo_time::Uptime::Max()) {
       return nullptr;
     }
     OutBuffer& buf = getOutBuffer(out_ring_.begin());
@@ -171,7 +361,7 @@ const internal::OutBuffer* Transmitter::getBufferToSend(
     }
     DCHECK(!buf.acked());
     DCHECK_GT(buf.size(), 0);
-    buf.finish();
+    finishPacket(buf);
     to_send = out_ring_.begin();
     min_send_time = roo_time::Uptime::Start();
   }
@@ -184,15 +374,56 @@ const internal::OutBuffer* Transmitter::getBufferToSend(
 
   OutBuffer& buf = getOutBuffer(to_send);
   if (!buf.finished()) {
-    buf.finish();
+    finishPacket(buf);
+  }
+  if (min_send_time != roo_time::Uptime::Start()) {
+    // Retransmission due to the expired timeout (rather than rushed).
+    onRetransmissionTimeout(to_send);
   }
-  buf.markSent(now);
+  markSent(buf, now);
   next_to_send_ = to_send + 1;
-  ++packets_sent_;
   next_send_micros = 0;
   return &buf;
 }
 
+void Transmitter::markSent(OutBuffer& buf, roo_time::Uptime now) {
+  buf.markSent(now, next_send_serial_++);
+  last_send_time_ = now;
+  ++packets_sent_;
+}
+
+OutBuffer* Transmitter::getTailLossProbe(roo_time::Uptime now,
+                                         long& next_send_micros) {
+  if (tail_loss_probes_sent_ >= kMaxTailLossProbes) return nullptr;
+  // Probe with the most recently transmitted packet.
+  OutBuffer* probe = nullptr;
+  for (SeqNum pos = out_ring_.begin(); pos < out_ring_.end(); ++pos) {
+    OutBuffer& buf = getOutBuffer(pos);
+    if (buf.acked() || buf.send_counter() == 0) continue;
+    if (probe == nullptr ||
+        (int32_t)(buf.send_serial() - probe->send_serial()) > 0) {
+      probe = &buf;
+    }
+  }
+  if (probe == nullptr) return nullptr;
+  roo_time::Uptime probe_time = last_send_time_ + tailLossProbeTimeout();
+  if (probe_time > now) {
+    next_send_micros =
+        std::min(next_send_micros, (long)(probe_time - now).inMicros());
+    return nullptr;
+  }
+  ++tail_loss_probes_sent_;
+  return probe;
+}
+
+roo_time::Duration Transmitter::tailLossProbeTimeout() const {
+  uint32_t timeout_micros =
+      (srtt_micros_ == 0)
+          ? kInitialTailLossProbeTimeoutMicros
+          : std::max(2 * srtt_micros_, kMinTailLossProbeTimeoutMicros);
+  return roo_time::Micros(timeout_micros << tail_loss_probes_sent_);
+}
+
 void Transmitter::reset() {
   while (!out_ring_.empty()) {
     out_ring_.pop();
@@ -201,7 +432,11 @@ void Transmitter::reset() {
   my_stream_id_ = 0;
   state_ = kIdle;
   current_out_buffer_ = nullptr;
+  flush_deadline_ = roo_time::Uptime::Max();
   has_pending_eof_ = false;
+  message_start_pending_ = false;
+  out_of_memory_ = false;
+  maybeResize();
 }
 
 void Transmitter::init(uint32_t my_stream_id, SeqNum new_start) {
@@ -211,12 +446,26 @@ void Transmitter::init(uint32_t my_stream_id, SeqNum new_start) {
   while (!out_ring_.empty()) {
     out_ring_.pop();
   }
+  maybeResize();
   out_ring_.reset(new_start);
   // To be updated by setConnected().
   recv_himark_ = out_ring_.begin();
   next_to_send_ = out_ring_.begin();
   current_out_buffer_ = nullptr;
+  flush_deadline_ = roo_time::Uptime::Max();
   has_pending_eof_ = false;
+  mark_messages_ = false;
+  compact_framing_ = false;
+  message_start_pending_ = false;
+  out_of_memory_ = false;
+  cwnd_ = kInitialCwnd;
+  ssthresh_ = 0xFFFF;
+  cwnd_acked_ = 0;
+  recovery_point_ = out_ring_.begin();
+  delivered_serial_ = next_send_serial_;
+  limited_transmit_ = 0;
+  resyncing_ = false;
+  tail_loss_probes_sent_ = 0;
 }
 
 bool Transmitter::ack(bool control_bit, uint16_t seq_id,
@@ -238,17 +487,30 @@ bool Transmitter::ack(bool control_bit, uint16_t seq_id,
                  << "; current: " << out_ring_.end();
     return false;
   }
+  roo_time::Uptime now = roo_time::Uptime::Now();
+  uint16_t acked_count = 0;
   while (out_ring_.begin() < seq && !out_ring_.empty()) {
+    OutBuffer& buf = getOutBuffer(out_ring_.begin());
+    // The memory of the popped packet may get released.
+    if (&buf == current_out_buffer_) current_out_buffer_ = nullptr;
+    onDelivered(buf, now);
     out_ring_.pop();
     ++packets_delivered_;
-    if (has_pending_eof_) {
-      // Process that pending EOF, now that we have space.
-      addEosPacket();
+    ++acked_count;
+    if (has_pending_eof_ && addEosPacket()) {
+      // Processed that pending EOF, now that we have space.
       has_pending_eof_ = false;
     }
   }
+  if (acked_count > 0) {
+    maybeResize();
+    onPacketsAcked(acked_count);
+    limited_transmit_ = 0;
+    tail_loss_probes_sent_ = 0;
+  }
   if (out_ring_.empty()) {
-    if (end_of_stream_) {
+    resyncing_ = false;
+    if (end_of_stream_ && !has_pending_eof_) {
       reset();
     }
     return false;
@@ -256,51 +518,141 @@ bool Transmitter::ack(bool control_bit, uint16_t seq_id,
   // Process the skip-ack notifications.
   size_t offset = 0;
   SeqNum out_pos = out_ring_.begin() + 1;
-  SeqNum last_acked = out_ring_.begin() - 1;
+  bool skip_acked = false;
   while (offset < ack_bitmap_len) {
     uint8_t val = (uint8_t)ack_bitmap[offset];
     for (int i = 7; i >= 0; --i) {
       if (out_ring_.contains(out_pos) && (val & (1 << i)) != 0) {
-        getOutBuffer(out_pos).ack();
-        last_acked = out_pos;
+        OutBuffer& buf = getOutBuffer(out_pos);
+        if (!buf.acked()) {
+          onDelivered(buf, now);
+          buf.ack();
+          skip_acked = true;
+          tail_loss_probes_sent_ = 0;
+        }
       }
       out_pos++;
     }
     offset++;
   }
+  bool can_send_more = congestion_control_ && acked_count > 0;
+  if (congestion_control_ && acked_count == 0 && skip_acked &&
+      limited_transmit_ < kLimitedTransmitMax) {
+    // Duplicate ack, reporting a packet that has left the network, without
+    // advancing the window. Allow a new packet to go out, to keep the acks
+    // flowing.
+    ++limited_transmit_;
+    can_send_more = true;
+  }
+  if (resyncing_) {
+    // The peer has sent this ack after processing the resume handshake, so
+    // anything sent before the handshake that is still unacked is lost.
+    resyncing_ = false;
+    if ((int32_t)(resync_serial_ - delivered_serial_) > 0) {
+      delivered_serial_ = resync_serial_;
+    }
+  }
+  return detectLosses() || can_send_more;
+}
+
+void Transmitter::onDelivered(const OutBuffer& buf, roo_time::Uptime now) {
+  if (buf.send_counter() == 0) return;
+  if ((int32_t)(buf.send_serial() - delivered_serial_) > 0) {
+    delivered_serial_ = buf.send_serial();
+  }
+  if (buf.send_counter() == 1 && !buf.acked()) {
+    uint32_t rtt_micros = (uint32_t)(now - buf.send_time()).inMicros();
+    if (rtt_micros == 0) rtt_micros = 1;
+    // Exponentially weighted moving average, with alpha = 1/8 (RFC 6298).
+    srtt_micros_ = (srtt_micros_ == 0)
+                       ? rtt_micros
+                       : srtt_micros_ - srtt_micros_ / 8 + rtt_micros / 8;
+  }
+}
+
+bool Transmitter::detectLosses() {
+  // Try to increase send throughput by quickly detecting dropped packets.
+  // Assuming in-order delivery of the underlying packet writer, if a packet
+  // has been acked, any packet transmitted before it would have been
+  // delivered already, unless lost. This covers retransmissions, too: a
+  // retransmitted packet that gets lost again is detected as soon as a packet
+  // transmitted after the retransmission gets acked.
   bool rushed = false;
-  // Try to increase send throughput by quickly detecting dropped packets,
-  // interpreting skip-ack as nack for packets that have only been sent once
-  // (which means that, assuming in-order delivery of the underlying package
-  // writer, if they were to be delivered, they would have been already
-  // delivered).
-  if (out_ring_.contains(last_acked)) {
-    bool next_to_send_updated = false;
-    // Rush re-delivery of any packets that have only been sent once and
-    // nacked.
-    for (SeqNum pos = out_ring_.begin(); pos != last_acked; ++pos) {
-      auto& buf = getOutBuffer(pos);
-      if (!buf.acked() && buf.send_counter() == 1) {
-        buf.rush();
-        rushed = true;
-        // Also, send the first nacked packet ASAP, to unblock the reader.
-        if (!next_to_send_updated) {
-          next_to_send_updated = true;
-          next_to_send_ = pos;
-        }
-      }
+  for (SeqNum pos = out_ring_.begin(); pos < out_ring_.end(); ++pos) {
+    auto& buf = getOutBuffer(pos);
+    if (buf.acked() || buf.send_counter() == 0) continue;
+    if (buf.expiration() == roo_time::Uptime::Start()) {
+      // Already scheduled for immediate retransmission.
+      continue;
+    }
+    if ((int32_t)(delivered_serial_ - buf.send_serial()) <
+        (int32_t)kDupThreshold) {
+      continue;
+    }
+    buf.rush();
+    onLossDetected(pos);
+    // Also, send the first nacked packet ASAP, to unblock the reader.
+    if (!rushed) {
+      rushed = true;
+      next_to_send_ = pos;
     }
   }
   return rushed;
 }
 
-bool Transmitter::updateRecvHimark(bool control_bit, uint16_t recv_himark) {
+SeqNum Transmitter::sendLimit() const {
+  if (!congestion_control_) return recv_himark_;
+  SeqNum cwnd_limit = out_ring_.begin() + cwnd_ + limited_transmit_;
+  return cwnd_limit < recv_himark_ ? cwnd_limit : recv_himark_;
+}
+
+void Transmitter::onPacketsAcked(uint16_t count) {
+  // No point in growing the window beyond what flow control permits anyway.
+  uint16_t max_cwnd = std::max<uint16_t>(peer_receive_buffer_size_, 1);
+  if (cwnd_ < ssthresh_) {
+    // Slow start.
+    cwnd_ = std::min<uint16_t>(cwnd_ + count, max_cwnd);
+    return;
+  }
+  // Congestion avoidance (additive increase).
+  cwnd_acked_ += count;
+  while (cwnd_acked_ >= cwnd_) {
+    cwnd_acked_ -= cwnd_;
+    if (cwnd_ < max_cwnd) ++cwnd_;
+  }
+}
+
+void Transmitter::onLossDetected(SeqNum seq) {
+  if (seq < recovery_point_) return;
+  // Multiplicative decrease.
+  ssthresh_ = std::max<uint16_t>(cwnd_ / 2, kMinSsthresh);
+  cwnd_ = ssthresh_;
+  cwnd_acked_ = 0;
+  recovery_point_ = out_ring_.end();
+}
+
+void Transmitter::onRetransmissionTimeout(SeqNum seq) {
+  if (seq < recovery_point_) return;
+  ssthresh_ = std::max<uint16_t>(cwnd_ / 2, kMinSsthresh);
+  cwnd_ = 1;
+  cwnd_acked_ = 0;
+  recovery_point_ = out_ring_.end();
+}
+
+bool Transmitter::updateRecvHimark(bool control_bit, uint16_t recv_himark,
+                                   int peer_receive_buffer_size_log2) {
   if (state_ != kConnected) return false;
   // Update to available slots received.
   if (control_bit_ == control_bit) {
     LOG(WARNING) << "Cross-talk detected. Check wiring and power.";
     return false;
   }
+  if (peer_receive_buffer_size_log2 >= 0) {
+    // The peer has resized its receive buffer.
+    peer_receive_buffer_size_ = 1
+                                << std::min(peer_receive_buffer_size_log2, 12);
+    if (cwnd_ > peer_receive_buffer_size_) cwnd_ = peer_receive_buffer_size_;
+  }
   SeqNum new_recv_himark = out_ring_.restorePosHighBits(recv_himark, 12);
   if (new_recv_himark < recv_himark_ ||
       new_recv_himark > out_ring_.end() + peer_receive_buffer_size_) {
@@ -3,6 +3,7 @@
 #include <memory>
 
 #include "roo_transport/link/internal/out_buffer.h"
+#include "roo_transport/link/internal/packet_buffer_array.h"
 #include "roo_transport/link/internal/ring_buffer.h"
 
 namespace roo_transport {
@@ -29,7 +30,8 @@ class Transmitter {
     kBroken = 3,
   };
 
-  Transmitter(unsigned int sendbuf_log2);
+  // The packet buffers are accounted to the specified quota, if any.
+  Transmitter(unsigned int sendbuf_log2, BufferPool::Quota* quota = nullptr);
 
   // Sets the state to kIdle.
   void reset();
@@ -45,24 +47,79 @@ class Transmitter {
   size_t availableForWrite() const;
   bool flush();
 
+  // Requests the data written so far to be flushed no later than the
+  // specified deadline, unless the packet fills up (or gets flushed) earlier.
+  // This lets the data written in the meantime share the packet. Until then,
+  // the packet is also exempt from auto-flush (see getBufferToSend()).
+  // Returns true if the deadline has been newly set or moved earlier, so that
+  // the sender needs to reschedule.
+  bool flushBy(roo_time::Uptime deadline);
+
+  // Called before writing a new message (see LinkOutputStream::writeMessage()).
+  // If the peer accepts messages out of order, makes the message start in a
+  // new packet, marked as the message start. Returns true if that finished
+  // the packet with the preceding data, making it ready to send.
+  bool startMessage();
+
   // Returns true if there are some unacked buffers in the queue.
   bool hasPendingData() const;
 
   // If connected, sets state to kClosed.
   void close();
 
-  void setConnected(uint16_t peer_receive_buffer_size, bool control_bit) {
+  // If peer_accepts_unordered is true, the packets that begin messages get
+  // marked as such (see startMessage()). The compact_framing flag indicates
+  // the negotiated message framing (see compact_framing()).
+  void setConnected(uint16_t peer_receive_buffer_size, bool control_bit,
+                    bool peer_accepts_unordered, bool compact_framing) {
     state_ = kConnected;
     peer_receive_buffer_size_ = peer_receive_buffer_size;
     control_bit_ = control_bit;
+    mark_messages_ = peer_accepts_unordered;
+    compact_framing_ = compact_framing;
     // Update the recv himark to reflect the peer's receive buffer size.
     recv_himark_ = out_ring_.begin() + peer_receive_buffer_size;
+    ssthresh_ = peer_receive_buffer_size;
   }
 
+  // Enables or disables the congestion window (enabled by default). When
+  // enabled, the number of packets in flight is additionally limited by a
+  // window that grows as packets get acked (slow start, then additive
+  // increase), and shrinks upon detected losses (halved on the first
+  // SACK-detected loss in a window; reset to one packet on retransmission
+  // timeout). This prevents flooding peers that drop data under burst load
+  // (e.g. due to UART FIFO overflows). On links with random, load-independent
+  // losses (e.g. noise), disabling it may improve throughput.
+  void setCongestionControl(bool enabled) { congestion_control_ = enabled; }
+
+  // Resizes the send buffer to 2^sendbuf_log2 packets. Growing takes effect
+  // immediately. When shrinking, no new packets get queued beyond the new
+  // size, and the buffer gets reallocated once enough of the queued packets
+  // have been acked. Returns true if more space is now available for writes.
+  bool setBufferSize(unsigned int sendbuf_log2);
+
+  // Returns the current congestion window, in packets.
+  uint16_t cwnd() const { return cwnd_; }
+
+  // Returns the smoothed round-trip time estimate, or zero if no round-trip
+  // has been measured yet.
+  roo_time::Duration srtt() const { return roo_time::Micros(srtt_micros_); }
+
   void setBroken();
 
+  // Called when the session gets resumed after a suspected outage (see
+  // Channel::resume()). The next ack received is treated as authoritative:
+  // any packet sent before this call and not acked by it is deemed lost, and
+  // gets retransmitted right away, rather than after its (likely backed off)
+  // retransmission timeout.
+  void resync();
+
   State state() const { return state_; }
 
+  // Whether the messages get prefixed with their length as a varint, rather
+  // than as a 32-bit integer (see kMessageStartPacket). Valid once connected.
+  bool compact_framing() const { return compact_framing_; }
+
   uint32_t my_stream_id() const { return my_stream_id_; }
 
   const OutBuffer* getBufferToSend(long& next_send_micros);
@@ -72,20 +129,83 @@ class Transmitter {
 
   // Called when an 'ack' package is received. Removes acked packages from the
   // send queue. Returns true if there is a packet that should be immediately
-  // re-delivered, without waiting for its expiration.
+  // re-delivered, without waiting for its expiration, or if the congestion
+  // window has advanced, possibly allowing more packets to be sent.
   bool ack(bool control_bit, uint16_t seq_id, const roo::byte* ack_bitmap,
            size_t ack_bitmap_len);
 
+  // Releases the memory of the packet buffers that have not been used for a
+  // while. Updates next_send_micros to reflect when to check again.
+  void releaseIdleBuffers(long& next_send_micros) {
+    out_buffers_.releaseIfIdle(out_ring_, next_send_micros);
+  }
+
+  // Returns true if writes are blocked by lack of memory for the packet
+  // buffers (or by the buffer quota).
+  bool out_of_memory() const { return out_of_memory_; }
+
+  // Called periodically while out_of_memory(). Retries the allocation, and
+  // returns true if it succeeded, so that the writers can proceed.
+  bool retryAllocation();
+
   // Returns true if the recv himark has changed, making room for new data to
-  // send.
-  bool updateRecvHimark(bool control_bit, uint16_t recv_himark);
+  // send. If peer_receive_buffer_size_log2 is non-negative, it reflects the
+  // new size of the peer's receive buffer (see Receiver::setBufferSize()).
+  bool updateRecvHimark(bool control_bit, uint16_t recv_himark,
+                        int peer_receive_buffer_size_log2 = -1);
 
  private:
   OutBuffer& getOutBuffer(SeqNum seq) {
     return out_buffers_[out_ring_.offset_for(seq)];
   }
 
-  void addEosPacket();
+  // Returns false if out of memory.
+  bool addEosPacket();
+
+  // Finishes the packet, so that it can be sent. If it is the packet being
+  // written to, the subsequent writes go to a new packet.
+  void finishPacket(OutBuffer& buf);
+
+  // Returns the number of packets that can be added to the send queue,
+  // accounting for a pending shrink of the buffer.
+  uint16_t slotsAvailable() const;
+
+  // Adds a new packet at the end of the send queue, allocating its memory as
+  // needed. Returns false (setting out_of_memory_) if out of memory.
+  bool push(SeqNum& pos);
+
+  // Reallocates the buffers to match the requested size, if it differs from
+  // the current one, and if the queued packets fit.
+  void maybeResize();
+
+  // Returns the position beyond which packets can't be currently sent, due to
+  // flow control or congestion control.
+  SeqNum sendLimit() const;
+
+  // Updates delivered_serial_ and the round-trip time estimate to account for
+  // the specified delivered packet.
+  void onDelivered(const OutBuffer& buf, roo_time::Uptime now);
+
+  // Returns how long to wait after the last transmission before sending the
+  // next tail loss probe.
+  roo_time::Duration tailLossProbeTimeout() const;
+
+  // Rushes retransmission of the packets that are deemed lost, because packets
+  // transmitted after them have already been acked. Returns true if any
+  // packets have been rushed.
+  bool detectLosses();
+
+  // Returns the packet to send as a tail loss probe, or nullptr if no probe
+  // is due yet (in which case, next_send_micros is updated to reflect when
+  // it will be).
+  OutBuffer* getTailLossProbe(roo_time::Uptime now, long& next_send_micros);
+
+  void markSent(OutBuffer& buf, roo_time::Uptime now);
+
+  // Congestion window updates.
+  void onPacketsAcked(uint16_t count);
+  void onLossDetected(SeqNum seq);
+  void onRetransmissionTimeout(SeqNum seq);
 
   uint32_t my_stream_id_;
 
@@ -96,10 +216,14 @@ class Transmitter {
   // connection.
   bool end_of_stream_;
 
-  std::unique_ptr<OutBuffer[]> out_buffers_;
+  PacketBufferArray<OutBuffer> out_buffers_;
   OutBuffer* current_out_buffer_;
   RingBuffer out_ring_;
 
+  // As requested by setBufferSize(). Differs from the out_ring_ capacity only
+  // while shrinking.
+  unsigned int requested_buffer_size_log2_;
+
   // Pointer used to cycle through packets to send, so that we generally send
   // packets in order before trying any retransmissions.
   SeqNum next_to_send_;
@@ -116,9 +240,78 @@ class Transmitter {
   // output queue at the nearest opportunity.
   bool has_pending_eof_;
 
+  // Whether to mark the packets that begin messages. Set if the peer accepts
+  // messages out of order.
+  bool mark_messages_;
+
+  // See compact_framing().
+  bool compact_framing_;
+
+  // Set by startMessage(); indicates that the next packet begins a message.
+  bool message_start_pending_;
+
+  // Set by flushBy(); the time at which current_out_buffer_ gets flushed.
+  // Uptime::Max() if no deferred flush is pending.
+  roo_time::Uptime flush_deadline_;
+
+  // Set when a packet buffer could not be allocated; cleared once the
+  // allocation succeeds.
+  bool out_of_memory_;
+
   uint32_t packets_sent_;
   uint32_t packets_delivered_;
 
+  // See setCongestionControl().
+  bool congestion_control_;
+
+  // Congestion window: max number of packets in flight, counting from the
+  // oldest unacked packet.
+  uint16_t cwnd_;
+
+  // Slow-start threshold. Below it, the window grows by one packet per acked
+  // packet; above it, by one packet per window's worth of acked packets.
+  uint16_t ssthresh_;
+
+  // Packets acked since the window was last increased above ssthresh_.
+  uint16_t cwnd_acked_;
+
+  // The window gets reduced at most once per window of data: losses of
+  // packets before this position (i.e., in flight at the time of the last
+  // reduction) are not acted upon.
+  SeqNum recovery_point_;
+
+  // Serial number to assign to the next transmitted packet. Incremented on
+  // every transmission, including retransmissions.
+  uint32_t next_send_serial_;
+
+  // The highest send serial among packets known to have been delivered. Any
+  // unacked packet transmitted before it is deemed lost (see detectLosses()).
+  uint32_t delivered_serial_;
+
+  // Number of extra packets that may be sent beyond the congestion window, in
+  // response to acks that report newly received packets without advancing the
+  // window (limited transmit). Reset when the window advances.
+  uint8_t limited_transmit_;
+
+  // Set by resync(); cleared by the next ack.
+  bool resyncing_;
+
+  // The value of next_send_serial_ at the time of resync().
+  uint32_t resync_serial_;
+
+  // Smoothed round-trip time, in microseconds, measured between sending a
+  // packet and receiving its ack. Only packets sent once are sampled, since
+  // acks of retransmitted packets are ambiguous. Zero until the first sample.
+  uint32_t srtt_micros_;
+
+  // Time of the most recent transmission of any data packet.
+  roo_time::Uptime last_send_time_;
+
+  // Number of tail loss probes sent since an ack last reported newly delivered
+  // packets. Bounds the number of probes per ack-less period; each successive
+  // probe waits twice as long as the previous one.
+  uint8_t tail_loss_probes_sent_;
+
   // Used to check validity of incoming flow control updates.
   uint16_t peer_receive_buffer_size_;
 
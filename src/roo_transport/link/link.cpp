@@ -35,6 +35,22 @@ Link& Link::operator=(Link&& other) {
   return *this;
 }
 
+bool Link::asyncRead(roo::byte* buf, size_t count, IoCompletionFn fn) {
+  if (channel_ == nullptr) {
+    fn(0, roo_io::kClosed);
+    return true;
+  }
+  return channel_->asyncRead(buf, count, my_stream_id_, std::move(fn));
+}
+
+bool Link::asyncWrite(const roo::byte* buf, size_t count, IoCompletionFn fn) {
+  if (channel_ == nullptr) {
+    fn(0, roo_io::kClosed);
+    return true;
+  }
+  return channel_->asyncWrite(buf, count, my_stream_id_, std::move(fn));
+}
+
 LinkStatus Link::status() const {
   return channel_ == nullptr ? LinkStatus::kIdle
                              : channel_->getLinkStatus(my_stream_id_);
@@ -50,6 +66,16 @@ bool Link::awaitConnected(roo_time::Duration timeout) {
   return channel_->awaitConnected(my_stream_id_, timeout);
 }
 
+bool Link::compactFraming() const {
+  if (channel_ == nullptr) return false;
+  return channel_->compactFraming();
+}
+
+bool Link::resume() {
+  if (channel_ == nullptr) return false;
+  return channel_->resume(my_stream_id_);
+}
+
 void Link::disconnect() {
   if (channel_ == nullptr) return;
   channel_->disconnect(my_stream_id_);
@@ -3,6 +3,7 @@
 #include "roo_io.h"
 #include "roo_io/core/output_stream.h"
 #include "roo_transport.h"
+#include "roo_transport/core/io_completion.h"
 #include "roo_transport/link/internal/thread_safe/channel.h"
 #include "roo_transport/link/link_input_stream.h"
 #include "roo_transport/link/link_output_stream.h"
@@ -33,6 +34,29 @@ class Link {
   // Obtains the output stream that can be used to write to the link.
   LinkOutputStream& out() { return out_; }
 
+  // Starts an asynchronous read of up to `count` bytes into `buf`. The callback
+  // is invoked once some data has been read, or the stream has ended or
+  // failed. It is invoked immediately (from the calling thread) if that can
+  // be determined right away, and otherwise later, from the thread that
+  // receives the packets. The callback should therefore not block; it may,
+  // however, start another asynchronous operation. The buffer must remain
+  // valid until the callback is invoked.
+  //
+  // At most one asynchronous read may be outstanding at a time, and it must
+  // not be mixed with concurrent blocking reads. Returns false, without
+  // invoking the callback, if another asynchronous read is outstanding.
+  //
+  // Note that the status reported to the callback is not reflected in
+  // in().status().
+  bool asyncRead(roo::byte* buf, size_t count, IoCompletionFn fn);
+
+  // Starts an asynchronous write of up to `count` bytes from `buf`. The
+  // callback is invoked once some data has been written (i.e. accepted into
+  // the send buffer), or the link has failed. Same rules as for asyncRead()
+  // apply. As with regular writes, call out().flush() to have the last,
+  // partially filled packet sent without delay.
+  bool asyncWrite(const roo::byte* buf, size_t count, IoCompletionFn fn);
+
   // Returns the current status of the link.
   LinkStatus status() const;
 
@@ -51,11 +75,31 @@ class Link {
   // link is already idle, does nothing.
   void disconnect();
 
+  // Re-runs the handshake for this connected link, without dropping any data
+  // buffered in either direction. Use it after a suspected transient outage
+  // (e.g. a loose cable, or a brief reset of the UART driver), when the
+  // retransmission timeouts may have backed off considerably. If the peer
+  // still holds the session, both sides retransmit whatever has been lost as
+  // soon as the peer responds, i.e. after a single round trip, and the link
+  // stays connected throughout. (If the peer has restarted in the meantime,
+  // the link eventually becomes broken, just as it would without resuming.)
+  //
+  // Returns immediately. Returns false if the link is not connected.
+  bool resume();
+
+  // Returns true if the messages written via LinkOutputStream::writeMessage()
+  // are framed compactly in this session (see
+  // LinkTransport::setCompactFraming()), i.e. prefixed with their length as a
+  // LEB128 varint, rather than as a 32-bit big-endian integer. Applies to both
+  // directions. Only meaningful once the link is connected.
+  bool compactFraming() const;
+
   // Returns the ID that identifies this link. The link objects created by
   // LinkTransport::connect() will have unique stream IDs.
   uint32_t streamId() const { return my_stream_id_; }
 
  private:
+  friend class LinkSelector;
   friend class LinkStream;
   friend class LinkTransport;
 
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "roo_time.h"
+
+namespace roo_transport {
+
+// Determines how often handshake packets get retransmitted while a link is
+// connecting. The n-th retry (counting from zero) is sent after
+// min_delay * factor^n, capped at max_delay, and randomized by +/- jitter
+// (as a fraction of the delay), so that unrelated peers spread their retries
+// more evenly in time. The factor must be at least 1, min_delay must not
+// exceed max_delay, and the jitter must be within [0, 1]; out-of-range values
+// get clamped.
+//
+// The defaults favor low overhead on idle links. Hot-swappable peers, that
+// need to reconnect quickly after being plugged in, may use a lower
+// max_delay. (Regardless of the policy, the backoff is reset whenever a
+// packet from the peer arrives while connecting.)
+struct LinkBackoffPolicy {
+  roo_time::Duration min_delay = roo_time::Millis(1);
+  roo_time::Duration max_delay = roo_time::Seconds(1);
+  float factor = 1.33f;
+  float jitter = 0.2f;
+};
+
+}  // namespace roo_transport
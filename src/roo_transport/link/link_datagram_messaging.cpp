@@ -0,0 +1,61 @@
+#include "roo_transport/link/link_datagram_messaging.h"
+
+namespace roo_transport {
+
+LinkDatagramMessaging::LinkDatagramMessaging(LinkTransport& link_transport,
+                                             roo_time::Duration ttl)
+    : transport_(link_transport), ttl_(ttl) {}
+
+void LinkDatagramMessaging::begin() {
+  transport_.setDatagramReceiver(
+      [this](uint32_t stream_id, const roo::byte* data, size_t len) {
+        received((ConnectionId)stream_id, data, len);
+      });
+}
+
+void LinkDatagramMessaging::end() { transport_.setDatagramReceiver(nullptr); }
+
+bool LinkDatagramMessaging::send(const roo::byte* header, size_t header_size,
+                                 const roo::byte* payload, size_t payload_size,
+                                 ConnectionId* connection_id) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendInternal(0, segments, 2, connection_id);
+}
+
+bool LinkDatagramMessaging::sendContinuation(ConnectionId connection_id,
+                                             const roo::byte* header,
+                                             size_t header_size,
+                                             const roo::byte* payload,
+                                             size_t payload_size) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendContinuationv(connection_id, segments, 2);
+}
+
+bool LinkDatagramMessaging::sendv(const IoVec* iov, size_t iovcnt,
+                                  ConnectionId* connection_id) {
+  return sendInternal(0, iov, iovcnt, connection_id);
+}
+
+bool LinkDatagramMessaging::sendContinuationv(ConnectionId connection_id,
+                                              const IoVec* iov,
+                                              size_t iovcnt) {
+  if (connection_id == 0) return false;
+  return sendInternal((uint32_t)connection_id, iov, iovcnt, nullptr);
+}
+
+bool LinkDatagramMessaging::sendInternal(uint32_t stream_id, const IoVec* iov,
+                                         size_t iovcnt,
+                                         ConnectionId* connection_id) {
+  stream_id = transport_.sendDatagram(iov, iovcnt, ttl_, stream_id);
+  if (stream_id == 0) return false;
+  if (connection_id != nullptr) *connection_id = (ConnectionId)stream_id;
+  return true;
+}
+
+}  // namespace roo_transport
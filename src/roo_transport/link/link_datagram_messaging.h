@@ -0,0 +1,64 @@
+#pragma once
+
+#include "roo_time.h"
+#include "roo_transport/link/link_transport.h"
+#include "roo_transport/messaging/messaging.h"
+
+namespace roo_transport {
+
+// Implementation of the Messaging interface over the datagrams of a
+// LinkTransport (see LinkTransport::sendDatagram()).
+//
+// Unlike LinkMessaging, the delivery is unreliable: messages may get lost,
+// and are never retransmitted, so a stale message (e.g. an outdated sensor
+// sample) doesn't delay the fresher ones. Each message must fit in a single
+// datagram (i.e., the header and the payload together may not exceed
+// LinkTransport::kMaxDatagramSize bytes). Messages that can't be sent within
+// the time to live get dropped.
+//
+// Datagrams share the session, and the physical link, with the reliable
+// traffic of the transport. The session must be established by other means,
+// e.g. by a LinkMessaging over the same transport, or by
+// LinkTransport::connect(); until then, send() returns false. The connection
+// ID identifies the session.
+class LinkDatagramMessaging : public Messaging {
+ public:
+  using Messaging::send;
+  using Messaging::sendContinuation;
+
+  LinkDatagramMessaging(LinkTransport& link_transport,
+                        roo_time::Duration ttl = roo_time::Millis(100));
+
+  // Starts receiving the datagrams. Replaces any other datagram receiver of
+  // the transport.
+  void begin();
+
+  // Stops receiving the datagrams.
+  void end();
+
+  // Sets the time to live of the subsequently sent messages.
+  void setTimeToLive(roo_time::Duration ttl) { ttl_ = ttl; }
+
+  bool send(const roo::byte* header, size_t header_size,
+            const roo::byte* payload, size_t payload_size,
+            ConnectionId* connection_id) override;
+
+  bool sendContinuation(ConnectionId connection_id, const roo::byte* header,
+                        size_t header_size, const roo::byte* payload,
+                        size_t payload_size) override;
+
+  bool sendv(const IoVec* iov, size_t iovcnt,
+             ConnectionId* connection_id) override;
+
+  bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                         size_t iovcnt) override;
+
+ private:
+  bool sendInternal(uint32_t stream_id, const IoVec* iov, size_t iovcnt,
+                    ConnectionId* connection_id);
+
+  LinkTransport& transport_;
+  roo_time::Duration ttl_;
+};
+
+}  // namespace roo_transport
@@ -54,6 +54,13 @@ size_t LinkInputStream::read(roo::byte* buf, size_t count) {
   // }
 }
 
+size_t LinkInputStream::read(roo::byte* buf, size_t count,
+                             roo_time::Uptime deadline,
+                             const CancellationToken* cancel) {
+  if (count == 0 || status_ != roo_io::kOk) return 0;
+  return channel_->read(buf, count, my_stream_id_, status_, deadline, cancel);
+}
+
 size_t LinkInputStream::tryRead(roo::byte* buf, size_t count) {
   if (count == 0 || status_ != roo_io::kOk) return 0;
   return channel_->tryRead(buf, count, my_stream_id_, status_);
@@ -28,6 +28,12 @@ class LinkInputStream : public roo_io::InputStream {
 
   size_t read(roo::byte* buf, size_t count) override;
 
+  // Like read(), but gives up when the specified deadline passes, or when the
+  // (optional) cancellation token gets cancelled, before any data could be
+  // read. In that case, returns zero, and leaves status() as kOk.
+  size_t read(roo::byte* buf, size_t count, roo_time::Uptime deadline,
+              const CancellationToken* cancel = nullptr);
+
   size_t tryRead(roo::byte* buf, size_t count) override;
 
   size_t available();
@@ -1,17 +1,74 @@
 #include "roo_transport/link/link_messaging.h"
 
+#include "roo_transport/link/internal/protocol.h"
+
 namespace roo_transport {
 
+namespace {
+
+// Reads the content of a message from the underlying stream, up to its size,
+// reporting the end of stream past it.
+class MessageContentStream : public roo_io::InputStream {
+ public:
+  MessageContentStream(roo_io::InputStream& in, size_t size)
+      : in_(in), remaining_(size) {}
+
+  size_t read(roo::byte* buf, size_t count) override {
+    if (count > remaining_) count = remaining_;
+    if (count == 0) return 0;
+    size_t result = in_.read(buf, count);
+    remaining_ -= result;
+    return result;
+  }
+
+  size_t tryRead(roo::byte* buf, size_t count) override {
+    if (count > remaining_) count = remaining_;
+    if (count == 0) return 0;
+    size_t result = in_.tryRead(buf, count);
+    remaining_ -= result;
+    return result;
+  }
+
+  // Leaves the underlying stream open; the remainder gets skipped.
+  void close() override {}
+
+  roo_io::Status status() const override {
+    roo_io::Status status = in_.status();
+    return (status == roo_io::kOk && remaining_ == 0) ? roo_io::kEndOfStream
+                                                      : status;
+  }
+
+  // Skips the content not consumed by the receiver. Returns false on error.
+  bool skipRemaining() {
+    roo::byte buf[64];
+    while (remaining_ > 0) {
+      if (read(buf, remaining_ < sizeof(buf) ? remaining_ : sizeof(buf)) == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  roo_io::InputStream& in_;
+  size_t remaining_;
+};
+
+}  // namespace
+
 LinkMessaging::LinkMessaging(roo_transport::LinkTransport& link_transport,
                              size_t max_recv_packet_size,
                              uint16_t recv_thread_stack_size,
-                             const char* recv_thread_name)
+                             const char* recv_thread_name,
+                             size_t recv_buffer_count)
     : transport_(link_transport),
       link_(),
       closed_(false),
       max_recv_packet_size_(max_recv_packet_size),
       recv_thread_stack_size_(recv_thread_stack_size),
-      recv_thread_name_(recv_thread_name) {}
+      recv_thread_name_(recv_thread_name),
+      batching_window_(roo_time::Micros(0)),
+      recv_buffers_(recv_buffer_count, max_recv_packet_size) {}
 
 void LinkMessaging::begin() {
   roo::thread::attributes attrs;
@@ -36,18 +93,61 @@ void LinkMessaging::end() {
 bool LinkMessaging::send(const roo::byte* header, size_t header_size,
                          const roo::byte* payload, size_t payload_size,
                          Messaging::ConnectionId* connection_id) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendv(segments, 2, connection_id);
+}
+
+bool LinkMessaging::sendv(const IoVec* iov, size_t iovcnt,
+                          Messaging::ConnectionId* connection_id) {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  awaitConnection(guard, connection_id);
+  return sendInternal(iov, iovcnt);
+}
+
+bool LinkMessaging::sendStream(const roo::byte* header, size_t header_size,
+                               roo_io::InputStream& payload,
+                               size_t payload_size,
+                               Messaging::ConnectionId* connection_id) {
   roo::unique_lock<roo::mutex> guard(mutex_);
+  awaitConnection(guard, connection_id);
+  LinkOutputStream& out = link_.out();
+  if (!out.beginMessage(header_size + payload_size)) return false;
+  out.writeFully(header, header_size);
+  roo::byte buf[128];
+  size_t remaining = payload_size;
+  while (remaining > 0 && out.isOpen()) {
+    size_t read =
+        payload.read(buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+    if (read == 0) {
+      // The message can't be completed; the peer would misinterpret whatever
+      // follows.
+      LOG(ERROR) << "Error: payload stream ended with " << remaining
+                 << " bytes to go: " << payload.status();
+      link_.disconnect();
+      return false;
+    }
+    out.writeFully(buf, read);
+    remaining -= read;
+  }
+  out.flush();
+  return out.isOpen();
+}
+
+void LinkMessaging::awaitConnection(roo::unique_lock<roo::mutex>& guard,
+                                    Messaging::ConnectionId* connection_id) {
   while (true) {
     LinkStatus status = link_.status();
     if (status == LinkStatus::kConnected || status == LinkStatus::kConnecting) {
       if (connection_id != nullptr) {
         *connection_id = (Messaging::ConnectionId)link_.streamId();
       }
-      break;
+      return;
     }
     reconnected_.wait(guard);
   }
-  return sendInternal(header, header_size, payload, payload_size);
 }
 
 bool LinkMessaging::sendContinuation(ConnectionId connection_id,
@@ -55,28 +155,56 @@ bool LinkMessaging::sendContinuation(ConnectionId connection_id,
                                      size_t header_size,
                                      const roo::byte* payload,
                                      size_t payload_size) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendContinuationv(connection_id, segments, 2);
+}
+
+bool LinkMessaging::sendContinuationv(ConnectionId connection_id,
+                                      const IoVec* iov, size_t iovcnt) {
   roo::unique_lock<roo::mutex> guard(mutex_);
   if ((ConnectionId)link_.streamId() != connection_id) {
     // Connection ID does not match the current link stream ID; the connection
     // must have been reset.
     return false;
   }
-  return sendInternal(header, header_size, payload, payload_size);
+  return sendInternal(iov, iovcnt);
 }
 
-bool LinkMessaging::sendInternal(const roo::byte* header, size_t header_size,
-                                 const roo::byte* payload,
-                                 size_t payload_size) {
-  roo_io::OutputStream& out = link_.out();
-  roo::byte serialized_size[4];
-  roo_io::StoreBeU32(header_size + payload_size, serialized_size);
-  out.writeFully(serialized_size, 4);
-  out.writeFully(header, header_size);
-  out.writeFully(payload, payload_size);
-  out.flush();
+bool LinkMessaging::sendInternal(const IoVec* iov, size_t iovcnt) {
+  LinkOutputStream& out = link_.out();
+  // Marks the message boundary, so that the peer can read the message out of
+  // order if it has enabled unordered delivery.
+  out.writeMessage(iov, iovcnt);
+  if (batching_window_.inMicros() > 0) {
+    out.flushWithin(batching_window_);
+  } else {
+    out.flush();
+  }
   return out.isOpen();
 }
 
+void LinkMessaging::setCompactFraming(bool enabled) {
+  transport_.setCompactFraming(enabled);
+}
+
+void LinkMessaging::setBatchingWindow(roo_time::Duration window) {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  batching_window_ = window;
+}
+
+void LinkMessaging::flush() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  link_.out().flush();
+}
+
+bool LinkMessaging::resume() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  return link_.resume();
+}
+
 uint32_t LinkMessaging::connect() {
   roo::lock_guard<roo::mutex> guard(mutex_);
   link_ = transport_.connectAsync();
@@ -94,18 +222,66 @@ roo_transport::LinkOutputStream& LinkMessaging::out() {
   return link_.out();
 }
 
+MessageBuffer LinkMessaging::acquireRecvBuffer() {
+  while (!closed_) {
+    // Wakes up periodically to check for closing.
+    MessageBuffer buffer = recv_buffers_.acquire(roo_time::Uptime::Now() +
+                                                 roo_time::Millis(100));
+    if (buffer) return buffer;
+  }
+  return MessageBuffer();
+}
+
+bool LinkMessaging::readMessageSize(roo_io::InputStream& in, uint32_t& size) {
+  roo::byte buf[internal::kMaxMessageSizePrefixLength];
+  if (in.readFully(buf, 1) < 1) return false;
+  // Known by now, since the connection has been established.
+  if (!link_.compactFraming()) {
+    if (in.readFully(buf + 1, 3) < 3) return false;
+    size = roo_io::LoadBeU32(buf);
+    return true;
+  }
+  // Varint; parsed byte by byte, since the message content follows.
+  size_t len = 1;
+  while (internal::DecodeMessageSize(buf, len, true, size) == 0) {
+    if (len == internal::kMaxMessageSizePrefixLength) return false;
+    if (in.readFully(buf + len, 1) < 1) return false;
+    ++len;
+  }
+  return true;
+}
+
+bool LinkMessaging::receiveStream(ConnectionId connection_id,
+                                  roo_io::InputStream& in, uint32_t size) {
+  MessageContentStream content(in, size);
+  if (!receivedStream(connection_id, content, size)) {
+    LOG(ERROR) << "Error: incoming size " << size << " exceeds max "
+               << max_recv_packet_size_ << ", and the receiver rejected it";
+    return false;
+  }
+  if (!content.skipRemaining()) {
+    if (in.status() == roo_io::kConnectionError &&
+        link_.status() == LinkStatus::kBroken) {
+      LOG(WARNING) << "Connection reset by peer.";
+    } else {
+      LOG(ERROR) << "Error: " << in.status();
+    }
+    return false;
+  }
+  return true;
+}
+
 void LinkMessaging::receiveLoop() {
-  std::unique_ptr<roo::byte[]> incoming_payload(
-      new roo::byte[max_recv_packet_size_]);
   while (!closed_) {
     ConnectionId connection_id = (ConnectionId)connect();
     roo_io::InputStream& in = this->in();
     while (true) {
-      roo::byte serialized_size[4];
-      size_t count = in.readFully(serialized_size, 4);
-      if (count < 4) {
-        if (in.status() == roo_io::kConnectionError &&
-            link_.status() == LinkStatus::kBroken) {
+      uint32_t incoming_size;
+      if (!readMessageSize(in, incoming_size)) {
+        if (in.status() == roo_io::kOk) {
+          LOG(ERROR) << "Error: malformed message size";
+        } else if (in.status() == roo_io::kConnectionError &&
+                   link_.status() == LinkStatus::kBroken) {
           LOG(WARNING) << "Connection reset by peer.";
         } else {
           LOG(ERROR) << "Error: " << in.status();
@@ -113,14 +289,19 @@ void LinkMessaging::receiveLoop() {
         reset(connection_id);
         break;
       }
-      uint32_t incoming_size = roo_io::LoadBeU32(serialized_size);
       if (incoming_size > max_recv_packet_size_) {
-        LOG(ERROR) << "Error: incoming size " << incoming_size
-                   << " exceeds max " << max_recv_packet_size_;
+        if (!receiveStream(connection_id, in, incoming_size)) {
+          reset(connection_id);
+          break;
+        }
+        continue;
+      }
+      MessageBuffer message = acquireRecvBuffer();
+      if (!message) {
         reset(connection_id);
         break;
       }
-      size_t read = in.readFully(incoming_payload.get(), incoming_size);
+      size_t read = in.readFully(message.mutable_data(), incoming_size);
       if (read < incoming_size) {
         if (in.status() == roo_io::kConnectionError &&
             link_.status() == LinkStatus::kBroken) {
@@ -131,7 +312,8 @@ void LinkMessaging::receiveLoop() {
         reset(connection_id);
         break;
       }
-      received(connection_id, incoming_payload.get(), incoming_size);
+      message.resize(incoming_size);
+      received(connection_id, message);
     }
   }
 }
@@ -8,21 +8,56 @@
 #include "roo_threads.h"
 #include "roo_threads/atomic.h"
 #include "roo_threads/mutex.h"
+#include "roo_transport/core/message_buffer.h"
 #include "roo_transport/link/link_transport.h"
 #include "roo_transport/messaging/messaging.h"
 
 namespace roo_transport {
 
 // Implementation of the Messaging interface over a LinkTransport.
+//
+// Messages are framed via LinkOutputStream::writeMessage(). If the underlying
+// transport has unordered delivery enabled (see
+// LinkTransport::setUnorderedDelivery()), the peer may receive the messages
+// out of order: a message whose packet got lost doesn't delay the subsequent
+// ones.
+//
+// Incoming messages are read into buffers from a pool, allocated at
+// construction (recv_buffer_count buffers of max_recv_packet_size bytes each),
+// and passed to the receiver via Messaging::Receiver::receivedBuffer(). The
+// receiver may retain the buffers (e.g. to process the messages on a worker
+// thread) without copying; reception stalls while all of them are retained.
+// The buffers must be released before the LinkMessaging is destroyed.
+//
+// Messages larger than max_recv_packet_size are not buffered; instead, they
+// are streamed to the receiver via Messaging::Receiver::receivedStream(),
+// straight off the link. (Receivers that don't support it reject them,
+// resetting the connection.) Conversely, sendStream() sends messages of
+// arbitrary size, copying the payload from a stream in small chunks.
+//
+// Messages are prefixed with their length, as a 32-bit integer, or, if
+// enabled on both sides (see setCompactFraming()), as a varint.
+//
+// By default, each message is flushed as soon as it is sent, taking up at
+// least one packet. For streams of small messages, setBatchingWindow() lets
+// the messages sent in quick succession share packets, at the cost of
+// latency bounded by the window. (Batching doesn't apply with unordered
+// delivery, which starts each message in a new packet.)
+//
+// The receiver is called on the reader thread; while it is busy, the link
+// doesn't get drained. Slow receivers can be offloaded to worker threads by
+// means of AsyncMessaging.
 class LinkMessaging : public Messaging {
  public:
   using Messaging::send;
   using Messaging::sendContinuation;
+  using Messaging::sendStream;
 
   LinkMessaging(roo_transport::LinkTransport& link_transport,
                 size_t max_recv_packet_size,
                 uint16_t recv_thread_stack_size = 4096,
-                const char* recv_thread_name = "linkMsgRcv");
+                const char* recv_thread_name = "linkMsgRcv",
+                size_t recv_buffer_count = 1);
 
   void begin();
 
@@ -36,13 +71,61 @@ class LinkMessaging : public Messaging {
                         size_t header_size, const roo::byte* payload,
                         size_t payload_size) override;
 
+  bool sendv(const IoVec* iov, size_t iovcnt,
+             ConnectionId* connection_id) override;
+
+  bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                         size_t iovcnt) override;
+
+  // Holds the sender lock until the entire payload has been sent, so that
+  // large streams delay the concurrent sends.
+  bool sendStream(const roo::byte* header, size_t header_size,
+                  roo_io::InputStream& payload, size_t payload_size,
+                  ConnectionId* connection_id) override;
+
+  // Enables the compact framing of messages, saving 3 bytes per message
+  // shorter than 128 bytes (see LinkTransport::setCompactFraming()). The
+  // peer falls back to the regular framing if it doesn't support it. Must be
+  // called before begin().
+  void setCompactFraming(bool enabled);
+
+  // Sets the max time that a sent message may wait for subsequent messages to
+  // share a packet with, before getting sent. Zero (the default) disables
+  // batching, flushing every message immediately. The messages also go out
+  // as soon as a packet fills up.
+  void setBatchingWindow(roo_time::Duration window);
+
+  // Sends the messages held back by batching right away. Use it after
+  // latency-critical messages.
+  void flush();
+
+  // Resumes the underlying link after a suspected transient outage, without
+  // dropping any messages in flight. See Link::resume().
+  bool resume();
+
  private:
   uint32_t connect();
   void receiveLoop();
 
+  // Blocks until a receive buffer is available. Returns a null buffer if the
+  // messaging gets closed in the meantime.
+  MessageBuffer acquireRecvBuffer();
+
+  // Reads the length prefix of the next message. Returns false on failure; if
+  // in.status() is still kOk, the prefix was malformed.
+  bool readMessageSize(roo_io::InputStream& in, uint32_t& size);
+
+  // Passes a message too large for the receive buffers to the receiver as a
+  // stream. Returns false if the connection needs to be reset.
+  bool receiveStream(ConnectionId connection_id, roo_io::InputStream& in,
+                     uint32_t size);
+
+  // Must hold mutex_. Blocks until connected or connecting.
+  void awaitConnection(roo::unique_lock<roo::mutex>& guard,
+                       ConnectionId* connection_id);
+
   // Must hold mutex_.
-  bool sendInternal(const roo::byte* header, size_t header_size,
-                    const roo::byte* payload, size_t payload_size);
+  bool sendInternal(const IoVec* iov, size_t iovcnt);
 
   roo_transport::LinkInputStream& in();
 
@@ -58,6 +141,8 @@ class LinkMessaging : public Messaging {
   size_t max_recv_packet_size_;
   uint16_t recv_thread_stack_size_;
   const char* recv_thread_name_;
+  roo_time::Duration batching_window_;
+  MessageBufferPool recv_buffers_;
   roo::thread reader_thread_;
   roo::condition_variable reconnected_;
   mutable roo::mutex mutex_;
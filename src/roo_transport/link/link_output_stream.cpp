@@ -47,11 +47,34 @@ size_t LinkOutputStream::write(const roo::byte* buf, size_t count) {
   // }
 }
 
+size_t LinkOutputStream::write(const roo::byte* buf, size_t count,
+                               roo_time::Uptime deadline,
+                               const CancellationToken* cancel) {
+  if (status_ != roo_io::kOk) return 0;
+  if (count == 0) return 0;
+  return channel_->write(buf, count, my_stream_id_, status_, deadline, cancel);
+}
+
 size_t LinkOutputStream::tryWrite(const roo::byte* buf, size_t count) {
   if (status_ != roo_io::kOk) return 0;
   return channel_->tryWrite(buf, count, my_stream_id_, status_);
 }
 
+size_t LinkOutputStream::writev(const IoVec* iov, size_t iovcnt) {
+  if (status_ != roo_io::kOk) return 0;
+  return channel_->writev(iov, iovcnt, my_stream_id_, status_);
+}
+
+bool LinkOutputStream::writeMessage(const IoVec* iov, size_t iovcnt) {
+  if (status_ != roo_io::kOk) return false;
+  return channel_->writeMessage(iov, iovcnt, my_stream_id_, status_);
+}
+
+bool LinkOutputStream::beginMessage(size_t size) {
+  if (status_ != roo_io::kOk) return false;
+  return channel_->beginMessage(size, my_stream_id_, status_);
+}
+
 size_t LinkOutputStream::availableForWrite() {
   if (status_ != roo_io::kOk) return 0;
   return channel_->availableForWrite(my_stream_id_, status_);
@@ -62,12 +85,26 @@ void LinkOutputStream::flush() {
   channel_->flush(my_stream_id_, status_);
 }
 
+void LinkOutputStream::flushWithin(roo_time::Duration delay) {
+  if (status_ != roo_io::kOk) return;
+  channel_->flushBy(roo_time::Uptime::Now() + delay, my_stream_id_, status_);
+}
+
 void LinkOutputStream::close() {
   if (status_ != roo_io::kOk) return;
   channel_->close(my_stream_id_, status_);
   if (status_ == roo_io::kOk) status_ = roo_io::kClosed;
 }
 
+bool LinkOutputStream::closeWithTimeout(roo_time::Duration timeout,
+                                        const CancellationToken* cancel) {
+  if (status_ != roo_io::kOk) return false;
+  bool result = channel_->close(my_stream_id_, status_,
+                                roo_time::Uptime::Now() + timeout, cancel);
+  if (status_ == roo_io::kOk) status_ = roo_io::kClosed;
+  return result;
+}
+
 }  // namespace roo_transport
 
 #endif  // ROO_USE_THREADS
\ No newline at end of file
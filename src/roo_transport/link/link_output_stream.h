@@ -4,6 +4,7 @@
 #ifdef ROO_USE_THREADS
 
 #include "roo_io/core/input_stream.h"
+#include "roo_transport/core/iovec.h"
 #include "roo_transport/link/internal/thread_safe/channel.h"
 
 namespace roo_transport {
@@ -24,14 +25,63 @@ class LinkOutputStream : public roo_io::OutputStream {
 
   size_t write(const roo::byte* buf, size_t count) override;
 
+  // Like write(), but gives up when the specified deadline passes, or when the
+  // (optional) cancellation token gets cancelled, before any data could be
+  // written. In that case, returns zero, and leaves status() as kOk.
+  size_t write(const roo::byte* buf, size_t count, roo_time::Uptime deadline,
+               const CancellationToken* cancel = nullptr);
+
   size_t tryWrite(const roo::byte* buf, size_t count) override;
 
+  // Writes all the data from the specified segments, in order, blocking as
+  // needed until all of it has been accepted. Equivalent to calling
+  // writeFully() for each segment, but acquires the transmitter lock once for
+  // the entire batch, rather than once per write. Returns the total number of
+  // bytes written, which is less than requested only if the stream has
+  // failed (in which case status() is updated accordingly).
+  size_t writev(const IoVec* iov, size_t iovcnt);
+
+  // Writes a single message, consisting of the concatenated segments, blocking
+  // as needed until all of it has been accepted. The message is preceded on
+  // the wire by its 32-bit big-endian length, or by its length as a varint if
+  // the compact framing is in use (see Link::compactFraming()). Since the
+  // framing gets negotiated in the handshake, waits for the connection to get
+  // established first. If the peer has enabled unordered delivery (see
+  // LinkTransport::setUnorderedDelivery()), the message starts in a new
+  // packet, and the peer may read it ahead of the preceding messages that are
+  // still being retransmitted. Otherwise, it is equivalent to writing the
+  // length, followed by the segments, via writev(). Returns true if the
+  // entire message has been written.
+  bool writeMessage(const IoVec* iov, size_t iovcnt);
+
+  // Like writeMessage(), but writes just the length prefix of a message of the
+  // specified size, which then must be followed by exactly that many bytes,
+  // written via regular writes (e.g. writev()), before the next message. For
+  // messages that are not available in memory in their entirety. Returns true
+  // if the prefix has been written.
+  bool beginMessage(size_t size);
+
   size_t availableForWrite();
 
   void flush() override;
 
+  // Like flush(), but lets the data get sent up to the specified delay later,
+  // so that the data written in the meantime may share the same packet. The
+  // packet goes out earlier if it fills up, or if flush() gets called. Useful
+  // for streams of small messages, where flushing each of them would waste a
+  // packet per message.
+  void flushWithin(roo_time::Duration delay);
+
   void close() override;
 
+  // Like close(), but waits for at most the specified timeout for the peer to
+  // confirm all the written data. Returns true if all the data has been
+  // confirmed; false on timeout, cancellation, or error. In any case, the
+  // stream is closed upon return (but the unconfirmed data may still get
+  // delivered later, as long as the connection is alive).
+  bool closeWithTimeout(roo_time::Duration timeout,
+                        const CancellationToken* cancel = nullptr);
+
   roo_io::Status status() const override { return status_; }
 
  private:
@@ -0,0 +1,188 @@
+#include "roo_transport/link/internal/thread_safe/compile_guard.h"
+#ifdef ROO_USE_THREADS
+
+#include "roo_transport/link/link_selector.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+namespace roo_transport {
+
+LinkSelector::LinkSelector()
+    : signaled_(false),
+      wakeup_requested_(false)
+#ifdef __linux__
+      ,
+      event_fd_(-1)
+#endif
+{
+}
+
+LinkSelector::~LinkSelector() {
+  roo::lock_guard<roo::mutex> guard(entries_mutex_);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    Channel* channel = entries_[i].channel;
+    bool first = true;
+    for (size_t j = 0; j < i; ++j) {
+      if (entries_[j].channel == channel) first = false;
+    }
+    if (first && channel != nullptr) channel->removeReadinessListener(this);
+  }
+#ifdef __linux__
+  if (event_fd_ >= 0) close(event_fd_);
+#endif
+}
+
+void LinkSelector::add(Link& link, int interest) {
+  roo::lock_guard<roo::mutex> guard(entries_mutex_);
+  bool channel_registered = false;
+  for (Entry& entry : entries_) {
+    if (entry.link == &link) {
+      entry.interest = interest;
+      onReadinessChanged();
+      return;
+    }
+    if (link.channel_ != nullptr && entry.channel == link.channel_) {
+      channel_registered = true;
+    }
+  }
+  entries_.push_back(Entry{&link, link.channel_, link.my_stream_id_, interest});
+  if (link.channel_ != nullptr && !channel_registered) {
+    link.channel_->addReadinessListener(this);
+  }
+  onReadinessChanged();
+}
+
+void LinkSelector::remove(Link& link) {
+  roo::lock_guard<roo::mutex> guard(entries_mutex_);
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->link != &link) continue;
+    Channel* channel = it->channel;
+    entries_.erase(it);
+    if (channel == nullptr) return;
+    for (const Entry& entry : entries_) {
+      if (entry.channel == channel) return;
+    }
+    channel->removeReadinessListener(this);
+    return;
+  }
+}
+
+int LinkSelector::readiness(const Entry& entry) {
+  if (entry.channel == nullptr) {
+    // Default-constructed link; all operations fail immediately.
+    return kLinkReadable | kLinkWritable;
+  }
+  Channel& channel = *entry.channel;
+  int events = 0;
+  LinkStatus status = channel.getLinkStatus(entry.my_stream_id);
+  if (status == LinkStatus::kConnected) {
+    events |= kLinkConnected;
+  } else if (status == LinkStatus::kBroken) {
+    events |= (kLinkBroken | kLinkReadable | kLinkWritable);
+  }
+  if ((entry.interest & kLinkReadable) != 0) {
+    roo_io::Status in_status;
+    if (channel.availableForRead(entry.my_stream_id, in_status) > 0 ||
+        in_status != roo_io::kOk) {
+      events |= kLinkReadable;
+    }
+  }
+  if ((entry.interest & kLinkWritable) != 0 &&
+      status == LinkStatus::kConnected) {
+    roo_io::Status out_status;
+    if (channel.availableForWrite(entry.my_stream_id, out_status) > 0 ||
+        out_status != roo_io::kOk) {
+      events |= kLinkWritable;
+    }
+  }
+  return events & entry.interest;
+}
+
+size_t LinkSelector::poll(ReadyLink* ready, size_t max_ready) {
+#ifdef __linux__
+  int event_fd;
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    event_fd = event_fd_;
+  }
+  if (event_fd >= 0) {
+    // Clear the descriptor before checking, so that no event gets lost.
+    eventfd_t ignored;
+    eventfd_read(event_fd, &ignored);
+  }
+#endif
+  roo::lock_guard<roo::mutex> guard(entries_mutex_);
+  size_t count = 0;
+  for (const Entry& entry : entries_) {
+    if (count >= max_ready) break;
+    int events = readiness(entry);
+    if (events != 0) {
+      ready[count++] = ReadyLink{entry.link, events};
+    }
+  }
+  return count;
+}
+
+size_t LinkSelector::waitUntil(ReadyLink* ready, size_t max_ready,
+                               roo_time::Uptime deadline) {
+  while (true) {
+    {
+      // Cleared before checking, so that an event arriving while we check
+      // makes the wait below return immediately.
+      roo::lock_guard<roo::mutex> guard(mutex_);
+      signaled_ = false;
+      if (wakeup_requested_) {
+        wakeup_requested_ = false;
+        return 0;
+      }
+    }
+    size_t count = poll(ready, max_ready);
+    if (count > 0) return count;
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (!signaled_) {
+      if (deadline == roo_time::Uptime::Max()) {
+        cv_.wait(guard);
+      } else if (cv_.wait_until(guard, deadline) == roo::cv_status::timeout) {
+        return 0;
+      }
+    }
+  }
+}
+
+void LinkSelector::wakeup() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  wakeup_requested_ = true;
+  signaled_ = true;
+  cv_.notify_all();
+#ifdef __linux__
+  if (event_fd_ >= 0) eventfd_write(event_fd_, 1);
+#endif
+}
+
+void LinkSelector::onReadinessChanged() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  signaled_ = true;
+  cv_.notify_all();
+#ifdef __linux__
+  if (event_fd_ >= 0) eventfd_write(event_fd_, 1);
+#endif
+}
+
+#ifdef __linux__
+int LinkSelector::eventFd() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  if (event_fd_ < 0) {
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // Make sure that the caller checks the links at least once.
+    if (event_fd_ >= 0) eventfd_write(event_fd_, 1);
+  }
+  return event_fd_;
+}
+#endif
+
+}  // namespace roo_transport
+
+#endif  // ROO_USE_THREADS
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "roo_transport/link/internal/thread_safe/compile_guard.h"
+#ifdef ROO_USE_THREADS
+
+#include <vector>
+
+#include "roo_threads.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_time.h"
+#include "roo_transport/link/internal/thread_safe/readiness_notification.h"
+#include "roo_transport/link/link.h"
+
+namespace roo_transport {
+
+// Waits for readiness of any of multiple links, in the spirit of poll(2).
+// Allows a single thread to serve many links, without spinning on
+// availableForRead() of each.
+//
+// Readiness is level-triggered, and means that the corresponding operation
+// will not block:
+//
+// * kLinkReadable: some data is available for read, or the input stream has
+//   ended or failed;
+// * kLinkWritable: the output stream has some space for writing, or has
+//   failed;
+// * kLinkConnected: the link is connected;
+// * kLinkBroken: the link is broken.
+//
+// The registered links must not be moved or destroyed until removed from the
+// selector. A link that gets disconnected after having been registered is
+// reported as broken.
+//
+// On Linux, the selector can also expose an eventfd, so that it can be
+// integrated into an existing epoll loop.
+class LinkSelector : private internal::ReadinessListener {
+ public:
+  enum Event {
+    kLinkReadable = 1,
+    kLinkWritable = 2,
+    kLinkConnected = 4,
+    kLinkBroken = 8,
+  };
+
+  struct ReadyLink {
+    Link* link;
+
+    // Bitmask of Events that are ready (and have been registered for).
+    int events;
+  };
+
+  LinkSelector();
+  ~LinkSelector();
+
+  LinkSelector(const LinkSelector&) = delete;
+  LinkSelector& operator=(const LinkSelector&) = delete;
+
+  // Registers the link, with the specified bitmask of Events of interest. If
+  // the link is already registered, updates its interest set.
+  void add(Link& link, int interest);
+
+  // Unregisters the link. If the link is not registered, does nothing.
+  void remove(Link& link);
+
+  // Checks the registered links, without blocking. Fills up to `max_ready`
+  // entries of `ready`, and returns their count.
+  size_t poll(ReadyLink* ready, size_t max_ready);
+
+  // Blocks until at least one of the registered links becomes ready, and
+  // then behaves like poll().
+  size_t wait(ReadyLink* ready, size_t max_ready) {
+    return waitUntil(ready, max_ready, roo_time::Uptime::Max());
+  }
+
+  // Like wait(), but gives up (returning zero) when the deadline passes.
+  size_t waitUntil(ReadyLink* ready, size_t max_ready,
+                   roo_time::Uptime deadline);
+
+  // Causes the current (or next) wait() to return, even if no link is ready.
+  void wakeup();
+
+#ifdef __linux__
+  // Returns a file descriptor that becomes readable whenever any of the
+  // registered links may have become ready (or wakeup() has been called).
+  // poll() clears it. The descriptor is owned by the selector. Returns -1 on
+  // error.
+  int eventFd();
+#endif
+
+ private:
+  struct Entry {
+    Link* link;
+    Channel* channel;
+    uint32_t my_stream_id;
+    int interest;
+  };
+
+  void onReadinessChanged() override;
+
+  // Returns the bitmask of ready events of the specified link.
+  static int readiness(const Entry& entry);
+
+  // Guards the entries. Never acquired by onReadinessChanged().
+  roo::mutex entries_mutex_;
+  std::vector<Entry> entries_;
+
+  // Guards the wake-up signal.
+  roo::mutex mutex_;
+  roo::condition_variable cv_;
+  bool signaled_;
+  bool wakeup_requested_;
+
+#ifdef __linux__
+  int event_fd_;
+#endif
+};
+
+}  // namespace roo_transport
+
+#endif  // ROO_USE_THREADS
@@ -5,6 +5,7 @@
 #include "roo_io/core/output_stream.h"
 #include "roo_transport/link/internal/thread_safe/channel.h"
 #include "roo_transport/link/link.h"
+#include "roo_transport/link/link_backoff_policy.h"
 #include "roo_transport/link/link_buffer_size.h"
 
 namespace roo_transport {
@@ -13,6 +14,19 @@ class LinkTransport {
  public:
   class StatsMonitor;
 
+  // Called, from the thread that processes the incoming packets, for each
+  // datagram received from the peer (see sendDatagram()). The stream ID
+  // identifies the session that the datagram has been received in.
+  using DatagramFn = Channel::DatagramFn;
+
+  // The send and receive buffers hold up to 2^sendbuf and 2^recvbuf packets,
+  // respectively, of up to 256 bytes each (hence their nominal sizes). The
+  // memory is allocated on demand from PacketBufferPool(), which is shared by
+  // all transports, except for one packet per direction, which each
+  // transport reserves up front. The pool is unbounded by default; if it is
+  // bounded (see ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_BLOCKS) below a
+  // window's size, it effectively limits the window (and a warning gets
+  // logged).
   LinkTransport(PacketSender& sender, LinkBufferSize sendbuf = kBufferSize4KB,
                 LinkBufferSize recvbuf = kBufferSize4KB);
 
@@ -25,6 +39,136 @@ class LinkTransport {
 
   void end() { channel_.end(); }
 
+  // Resizes the send buffer, without interrupting the current connection
+  // (e.g. to give more RAM to the link during a bulk transfer, and to take it
+  // back afterwards). Growing takes effect immediately. Shrinking takes effect
+  // once enough of the data that is already queued has been delivered; until
+  // then, writes are limited to the new size. See also the constructor, on
+  // the capacity of the packet buffer pool.
+  void setSendBufferSize(LinkBufferSize sendbuf) {
+    channel_.setSendBufferSize(sendbuf);
+  }
+
+  // Resizes the receive buffer, without interrupting the current connection.
+  // The new size gets advertised to the peer, so that it can send more (or
+  // less) data ahead. Shrinking takes effect once the data that the peer has
+  // already been allowed to send has been read.
+  void setReceiveBufferSize(LinkBufferSize recvbuf) {
+    channel_.setReceiveBufferSize(recvbuf);
+  }
+
+  // Limits the number of packet buffers (each holding one packet, either
+  // outgoing or incoming) that this transport may hold at a time. Packet
+  // buffers are allocated on demand from a pool shared by all transports (see
+  // PacketBufferPool()), so the quota bounds this transport's share of it.
+  // When the quota is reached, writes block, and incoming data packets get
+  // dropped (to be retransmitted by the peer later), as if the windows were
+  // smaller. Regardless of the quota, each direction can always hold at least
+  // one packet, so that the link never stalls. Unlimited by default.
+  void setBufferQuota(size_t max_packets) {
+    channel_.setBufferQuota(max_packets);
+  }
+
+  // Limits the rate at which data packets are handed to the packet sender, to
+  // match the bandwidth of the underlying transport (e.g. a UART). Without
+  // pacing, data packets get pushed as fast as they are produced, and the
+  // send thread blocks in the packet sender, so that acks and flow control
+  // updates get stuck behind bulk data in the transport's output buffer. With
+  // pacing, data goes out at (at most) the specified rate, and the control
+  // packets are sent ahead of it, improving latency under load.
+  //
+  // The rate is in bytes per second, as seen by the packet sender (i.e.
+  // excluding the framing overhead of the transport; e.g. for a UART at
+  // 1 Mbps in 8N1 mode, the line rate is 100000 bytes/s, and the rate should
+  // be set a few percent lower). The burst is the number of bytes that may be
+  // sent back-to-back after an idle period; it should not exceed the size of
+  // the transport's output buffer. Zero rate disables pacing (the default).
+  void setPacingRate(uint32_t bytes_per_second, uint32_t burst_bytes = 512) {
+    channel_.setPacingRate(bytes_per_second, burst_bytes);
+  }
+
+  // Enables or disables the congestion window (enabled by default). It limits
+  // the number of packets in flight below the peer's receive window, growing
+  // it as packets get acked, and shrinking it when losses are detected, so
+  // that peers that drop data under burst load (e.g. on UART FIFO overflow)
+  // don't get flooded with retransmissions. On links where losses are random
+  // and load-independent (e.g. line noise), disabling it may improve
+  // throughput.
+  void setCongestionControl(bool enabled) {
+    channel_.setCongestionControl(enabled);
+  }
+
+  // Sets the schedule of handshake retries while connecting. The default
+  // retries quickly at first, but backs off to once per second, so that a
+  // peer that has been absent for a while may wait up to a second to connect
+  // after it comes back. Any packet received from the peer while connecting
+  // also triggers an immediate retry.
+  void setHandshakeBackoff(const LinkBackoffPolicy& policy) {
+    channel_.setHandshakeBackoff(policy);
+  }
+
+  // Enables out-of-order delivery of messages written via
+  // LinkOutputStream::writeMessage() (e.g. by LinkMessaging). When enabled,
+  // a message that has been received in its entirety can be read even if some
+  // preceding messages are still missing packets, so that a single lost
+  // packet doesn't stall all the subsequent messages until it gets
+  // retransmitted. All messages still get delivered exactly once. Must only
+  // be enabled when the input is consumed message by message, since the
+  // messages may come in any order. Takes effect on the next connection.
+  void setUnorderedDelivery(bool enabled) {
+    channel_.setUnorderedDelivery(enabled);
+  }
+
+  // Enables the compact framing of messages written via
+  // LinkOutputStream::writeMessage() (e.g. by LinkMessaging): the messages
+  // get prefixed with their length as a LEB128 varint (1 byte for messages
+  // shorter than 128 bytes), rather than as a 32-bit integer. Used only if
+  // the peer has enabled it too, so that peers that don't support it keep
+  // using the 32-bit prefix. See Link::compactFraming(). Takes effect on the
+  // next connection.
+  void setCompactFraming(bool enabled) { channel_.setCompactFraming(enabled); }
+
+  // Enables dead-peer detection on idle links. When nothing has been received
+  // from the peer for the specified interval, a short keepalive packet is
+  // sent, to which the peer replies (the peer doesn't need to have keepalives
+  // enabled). After miss_threshold intervals of silence, the peer is presumed
+  // dead, and the link becomes broken: blocked reads and writes return with
+  // an error, and the disconnect callback gets called. Any traffic from the
+  // peer counts as a sign of life, so keepalives are suppressed while data is
+  // flowing. Peers that predate keepalives don't advertise replying to them
+  // in the handshake; sessions with such peers are never timed out. Zero
+  // interval disables keepalives (the default).
+  void setKeepAlive(roo_time::Duration interval, uint8_t miss_threshold = 3) {
+    channel_.setKeepAlive(interval, miss_threshold);
+  }
+
+  // Maximum size of a datagram.
+  static constexpr size_t kMaxDatagramSize = internal::kMaxDatagramSize;
+
+  // Sends an unreliable datagram, consisting of the concatenated segments
+  // (at most kMaxDatagramSize bytes in total), to the peer, outside of the
+  // reliable stream. Datagrams are neither acknowledged nor retransmitted, so
+  // they never wait for lost data, nor delay any other data when lost
+  // themselves; they suit e.g. periodic sensor samples, where a fresh sample
+  // supersedes any lost ones. The datagram gets dropped if it can't be sent
+  // within the specified time to live (e.g. due to pacing), or if it is
+  // superseded by newer datagrams while the (small) send queue is full.
+  //
+  // Datagrams can only be exchanged within a session established by
+  // connect() (whose Link may be used for reliable traffic at the same
+  // time). If stream_id is non-zero, the datagram is only sent if it matches
+  // the current session. Returns the stream ID of the session the datagram
+  // has been queued in, or zero if it has been rejected.
+  uint32_t sendDatagram(const IoVec* iov, size_t iovcnt,
+                        roo_time::Duration ttl, uint32_t stream_id = 0) {
+    return channel_.sendDatagram(iov, iovcnt, ttl, stream_id);
+  }
+
+  // Sets the function to be called for each datagram received from the peer.
+  void setDatagramReceiver(DatagramFn fn) {
+    channel_.setDatagramReceiver(std::move(fn));
+  }
+
   // Supply an incoming packet received from the underlying transport.
   void processIncomingPacket(const roo::byte* buf, size_t len);
 
@@ -71,6 +215,20 @@ class LinkTransport::StatsMonitor {
   // counter does not reset on new connections.
   uint32_t packets_received() const { return channel_.packets_received(); }
 
+  // Returns the number of packet buffers currently held by the transport
+  // (see setBufferQuota()).
+  size_t buffers_in_use() const { return channel_.buffers_in_use(); }
+
+  // Returns the maximum number of packet buffers held by the transport at the
+  // same time, since start.
+  size_t buffers_high_water_mark() const {
+    return channel_.buffers_high_water_mark();
+  }
+
+  // Returns the count of datagrams that have been dropped before sending,
+  // since start (see sendDatagram()).
+  uint32_t datagrams_dropped() const { return channel_.datagrams_dropped(); }
+
  private:
   Channel& channel_;
 };
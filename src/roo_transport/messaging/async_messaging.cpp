@@ -0,0 +1,205 @@
+#include "roo_transport/messaging/async_messaging.h"
+
+#include <string.h>
+
+#include "roo_io/memory/load.h"
+#include "roo_logging.h"
+
+namespace roo_transport {
+
+uint32_t AsyncMessaging::OrderByMuxChannel(ConnectionId connection_id,
+                                           const MessageBuffer& message) {
+  return message.size() == 0 ? 0 : roo_io::LoadU8(message.data());
+}
+
+AsyncMessaging::AsyncMessaging(Messaging& messaging, size_t worker_count,
+                               size_t queue_capacity,
+                               size_t max_copied_message_size,
+                               uint16_t worker_stack_size,
+                               const char* worker_name)
+    : messaging_(messaging),
+      dispatcher_(*this),
+      ordering_key_(nullptr),
+      worker_count_(worker_count),
+      queue_capacity_(queue_capacity),
+      worker_stack_size_(worker_stack_size),
+      worker_name_(worker_name),
+      copy_buffers_(queue_capacity, max_copied_message_size),
+      workers_(new Worker[worker_count]),
+      active_(false) {
+  CHECK_GT(worker_count, 0);
+  CHECK_GT(queue_capacity, 0);
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers_[i].queue.reset(new Entry[queue_capacity]);
+  }
+  messaging_.setReceiver(dispatcher_);
+}
+
+AsyncMessaging::~AsyncMessaging() {
+  end();
+  messaging_.unsetReceiver();
+}
+
+void AsyncMessaging::begin() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  if (active_) return;
+  active_ = true;
+  for (size_t i = 0; i < worker_count_; ++i) {
+    roo::thread::attributes attrs;
+    attrs.set_name(worker_name_);
+    attrs.set_stack_size(worker_stack_size_);
+    Worker* worker = &workers_[i];
+    worker->thread =
+        roo::thread(attrs, [this, worker]() { workerLoop(*worker); });
+  }
+}
+
+void AsyncMessaging::end() {
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (!active_) return;
+    active_ = false;
+    for (size_t i = 0; i < worker_count_; ++i) {
+      workers_[i].has_work.notify_all();
+    }
+    // Unblocks the reader, if it waits for space.
+    space_available_.notify_all();
+  }
+  for (size_t i = 0; i < worker_count_; ++i) {
+    if (workers_[i].thread.joinable()) workers_[i].thread.join();
+  }
+}
+
+bool AsyncMessaging::send(const roo::byte* header, size_t header_size,
+                          const roo::byte* payload, size_t payload_size,
+                          ConnectionId* connection_id) {
+  return messaging_.send(header, header_size, payload, payload_size,
+                         connection_id);
+}
+
+bool AsyncMessaging::sendContinuation(ConnectionId connection_id,
+                                      const roo::byte* header,
+                                      size_t header_size,
+                                      const roo::byte* payload,
+                                      size_t payload_size) {
+  return messaging_.sendContinuation(connection_id, header, header_size,
+                                     payload, payload_size);
+}
+
+bool AsyncMessaging::sendv(const IoVec* iov, size_t iovcnt,
+                           ConnectionId* connection_id) {
+  return messaging_.sendv(iov, iovcnt, connection_id);
+}
+
+bool AsyncMessaging::sendContinuationv(ConnectionId connection_id,
+                                       const IoVec* iov, size_t iovcnt) {
+  return messaging_.sendContinuationv(connection_id, iov, iovcnt);
+}
+
+bool AsyncMessaging::sendStream(const roo::byte* header, size_t header_size,
+                                roo_io::InputStream& payload,
+                                size_t payload_size,
+                                ConnectionId* connection_id) {
+  return messaging_.sendStream(header, header_size, payload, payload_size,
+                               connection_id);
+}
+
+void AsyncMessaging::Dispatcher::received(
+    Messaging::ConnectionId connection_id, const roo::byte* data, size_t len) {
+  if (len > async_.copy_buffers_.buffer_capacity()) {
+    LOG(ERROR) << "AsyncMessaging: message size " << len << " exceeds max "
+               << async_.copy_buffers_.buffer_capacity() << "; dropping.";
+    return;
+  }
+  MessageBuffer message = async_.copy_buffers_.acquire();
+  memcpy(message.mutable_data(), data, len);
+  message.resize(len);
+  async_.enqueue(connection_id, message);
+}
+
+void AsyncMessaging::Dispatcher::receivedBuffer(
+    Messaging::ConnectionId connection_id, const MessageBuffer& message) {
+  async_.enqueue(connection_id, message);
+}
+
+bool AsyncMessaging::Dispatcher::receivedStream(
+    Messaging::ConnectionId connection_id, roo_io::InputStream& content,
+    size_t size) {
+  async_.awaitIdle();
+  return async_.Messaging::receivedStream(connection_id, content, size);
+}
+
+void AsyncMessaging::Dispatcher::reset(Messaging::ConnectionId connection_id) {
+  async_.dispatchReset(connection_id);
+}
+
+void AsyncMessaging::enqueue(ConnectionId connection_id,
+                             const MessageBuffer& message) {
+  uint32_t key = (ordering_key_ != nullptr)
+                     ? ordering_key_(connection_id, message)
+                     : (uint32_t)connection_id;
+  Worker& worker = workers_[key % worker_count_];
+  {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (active_ && worker.size == queue_capacity_) {
+      space_available_.wait(guard);
+    }
+    if (active_) {
+      Entry& entry =
+          worker.queue[(worker.head + worker.size) % queue_capacity_];
+      entry.connection_id = connection_id;
+      entry.message = message;
+      ++worker.size;
+      worker.has_work.notify_one();
+      return;
+    }
+  }
+  // Not running; dispatch synchronously.
+  Messaging::received(connection_id, message);
+}
+
+void AsyncMessaging::awaitIdle() {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  while (active_ && !idle()) {
+    processed_.wait(guard);
+  }
+}
+
+void AsyncMessaging::dispatchReset(ConnectionId connection_id) {
+  // Let the preceding messages get processed first.
+  awaitIdle();
+  Messaging::reset(connection_id);
+}
+
+void AsyncMessaging::workerLoop(Worker& worker) {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  while (true) {
+    while (active_ && worker.size == 0) {
+      worker.has_work.wait(guard);
+    }
+    if (worker.size == 0) break;
+    Entry& entry = worker.queue[worker.head];
+    ConnectionId connection_id = entry.connection_id;
+    MessageBuffer message = std::move(entry.message);
+    worker.head = (worker.head + 1) % queue_capacity_;
+    --worker.size;
+    worker.busy = true;
+    space_available_.notify_all();
+    guard.unlock();
+    Messaging::received(connection_id, message);
+    // Returns the buffer to the pool before taking the next message.
+    message.reset();
+    guard.lock();
+    worker.busy = false;
+    processed_.notify_all();
+  }
+}
+
+bool AsyncMessaging::idle() const {
+  for (size_t i = 0; i < worker_count_; ++i) {
+    if (workers_[i].size > 0 || workers_[i].busy) return false;
+  }
+  return true;
+}
+
+}  // namespace roo_transport
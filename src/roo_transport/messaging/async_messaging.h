@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+
+#include "roo_threads.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_threads/thread.h"
+#include "roo_transport/core/message_buffer.h"
+#include "roo_transport/messaging/messaging.h"
+
+namespace roo_transport {
+
+/// Wraps a `Messaging`, dispatching the received messages to the receiver on
+/// a pool of worker threads, rather than on the thread that reads them off
+/// the transport. This way, a slow receiver (e.g. an RPC handler) doesn't
+/// stall the subsequent messages, nor the transport itself (e.g. the flow
+/// control of a `LinkMessaging`, which stops draining the link while its
+/// reader thread is blocked).
+///
+/// Messages with the same ordering key are dispatched in order, one at a
+/// time, by the same worker. By default, the key is the connection ID; use
+/// `OrderByMuxChannel` when the receiver is a `MuxMessaging`, so that each
+/// mux channel gets ordered independently.
+///
+/// Each worker has a bounded queue. When the queue is full, the reader thread
+/// blocks, applying back-pressure to the transport. Messages received in
+/// pooled buffers (e.g. from `LinkMessaging`) are queued without copying;
+/// for them to queue up, the underlying messaging needs enough receive
+/// buffers. Other messages get copied into the buffers of an internal pool,
+/// and are dropped (with an error) if they don't fit.
+///
+/// Reset notifications, as well as streamed messages (see
+/// `Receiver::receivedStream()`), are dispatched after all the messages
+/// received before them have been processed. Streamed messages are processed
+/// synchronously, on the reader thread, since the stream can't outlive the
+/// call.
+///
+/// Example:
+///
+///     LinkMessaging link_messaging(transport, 1024, 4096, "linkMsgRcv", 8);
+///     AsyncMessaging async(link_messaging, 2, 4);
+///     async.setOrderingKey(AsyncMessaging::OrderByMuxChannel);
+///     MuxMessaging mux(async);
+class AsyncMessaging : public Messaging {
+ public:
+  using Messaging::send;
+  using Messaging::sendContinuation;
+  using Messaging::sendStream;
+
+  /// Returns the key that determines the ordering of the message.
+  using OrderingKeyFn =
+      std::function<uint32_t(ConnectionId connection_id,
+                             const MessageBuffer& message)>;
+
+  /// Orders the messages by the mux channel (i.e., the first byte of the
+  /// message; see `MuxMessaging`).
+  static uint32_t OrderByMuxChannel(ConnectionId connection_id,
+                                    const MessageBuffer& message);
+
+  /// Uses `worker_count` worker threads, each with a queue of up to
+  /// `queue_capacity` messages. Messages that are not received in pooled
+  /// buffers get copied into `queue_capacity` buffers of
+  /// `max_copied_message_size` bytes.
+  AsyncMessaging(Messaging& messaging, size_t worker_count,
+                 size_t queue_capacity, size_t max_copied_message_size = 256,
+                 uint16_t worker_stack_size = 4096,
+                 const char* worker_name = "msgDispatch");
+
+  ~AsyncMessaging() override;
+
+  /// Sets the ordering key function. Must be called before `begin()`.
+  void setOrderingKey(OrderingKeyFn fn) { ordering_key_ = std::move(fn); }
+
+  /// Starts the worker threads. Until then, the messages are dispatched
+  /// synchronously.
+  void begin();
+
+  /// Processes the queued messages, and stops the worker threads.
+  void end();
+
+  bool send(const roo::byte* header, size_t header_size,
+            const roo::byte* payload, size_t payload_size,
+            ConnectionId* connection_id) override;
+
+  bool sendContinuation(ConnectionId connection_id, const roo::byte* header,
+                        size_t header_size, const roo::byte* payload,
+                        size_t payload_size) override;
+
+  bool sendv(const IoVec* iov, size_t iovcnt,
+             ConnectionId* connection_id) override;
+
+  bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                         size_t iovcnt) override;
+
+  bool sendStream(const roo::byte* header, size_t header_size,
+                  roo_io::InputStream& payload, size_t payload_size,
+                  ConnectionId* connection_id) override;
+
+ private:
+  class Dispatcher : public Messaging::Receiver {
+   public:
+    explicit Dispatcher(AsyncMessaging& async) : async_(async) {}
+
+    void received(Messaging::ConnectionId connection_id, const roo::byte* data,
+                  size_t len) override;
+
+    void receivedBuffer(Messaging::ConnectionId connection_id,
+                        const MessageBuffer& message) override;
+
+    bool receivedStream(Messaging::ConnectionId connection_id,
+                        roo_io::InputStream& content, size_t size) override;
+
+    void reset(Messaging::ConnectionId connection_id) override;
+
+   private:
+    AsyncMessaging& async_;
+  };
+
+  struct Entry {
+    ConnectionId connection_id;
+    MessageBuffer message;
+  };
+
+  struct Worker {
+    roo::thread thread;
+    roo::condition_variable has_work;
+    std::unique_ptr<Entry[]> queue;
+    size_t head = 0;
+    size_t size = 0;
+    bool busy = false;
+  };
+
+  void enqueue(ConnectionId connection_id, const MessageBuffer& message);
+
+  // Blocks until all the queued messages have been processed.
+  void awaitIdle();
+
+  void dispatchReset(ConnectionId connection_id);
+
+  void workerLoop(Worker& worker);
+
+  // Must hold mutex_.
+  bool idle() const;
+
+  Messaging& messaging_;
+  Dispatcher dispatcher_;
+  OrderingKeyFn ordering_key_;
+  size_t worker_count_;
+  size_t queue_capacity_;
+  uint16_t worker_stack_size_;
+  const char* worker_name_;
+  MessageBufferPool copy_buffers_;
+  std::unique_ptr<Worker[]> workers_;
+
+  roo::mutex mutex_;
+
+  // Notified when a message gets taken off a queue.
+  roo::condition_variable space_available_;
+
+  // Notified when a worker finishes processing a message.
+  roo::condition_variable processed_;
+
+  bool active_;
+};
+
+}  // namespace roo_transport
@@ -0,0 +1,330 @@
+#include "roo_transport/messaging/local_messaging.h"
+
+#include <string.h>
+
+#include "roo_logging.h"
+
+namespace roo_transport {
+
+namespace {
+
+// Reads the content of a message that consists of the specified segments,
+// followed by `tail_size` bytes of the (optional) tail stream.
+class MessageInputStream : public roo_io::InputStream {
+ public:
+  MessageInputStream(const IoVec* iov, size_t iovcnt,
+                     roo_io::InputStream* tail, size_t tail_size)
+      : iov_(iov),
+        iovcnt_(iovcnt),
+        offset_(0),
+        segments_remaining_(0),
+        tail_(tail),
+        tail_remaining_(tail_size) {
+    for (size_t i = 0; i < iovcnt; ++i) segments_remaining_ += iov[i].size;
+  }
+
+  size_t read(roo::byte* buf, size_t count) override {
+    while (iovcnt_ > 0 && offset_ == iov_->size) {
+      ++iov_;
+      --iovcnt_;
+      offset_ = 0;
+    }
+    if (iovcnt_ > 0) {
+      if (count > iov_->size - offset_) count = iov_->size - offset_;
+      memcpy(buf, iov_->data + offset_, count);
+      offset_ += count;
+      segments_remaining_ -= count;
+      return count;
+    }
+    if (count > tail_remaining_) count = tail_remaining_;
+    if (count == 0) return 0;
+    size_t result = tail_->read(buf, count);
+    tail_remaining_ -= result;
+    return result;
+  }
+
+  roo_io::Status status() const override {
+    if (segments_remaining_ > 0) return roo_io::kOk;
+    if (tail_remaining_ == 0) return roo_io::kEndOfStream;
+    roo_io::Status status = tail_->status();
+    // If the tail stream ended prematurely, the connection gets reset.
+    return status == roo_io::kEndOfStream ? roo_io::kConnectionError : status;
+  }
+
+  // Skips the content not consumed by the receiver. Returns false if the tail
+  // stream ended prematurely, or failed.
+  bool skipRemaining() {
+    roo::byte buf[64];
+    while (status() == roo_io::kOk) {
+      if (read(buf, sizeof(buf)) == 0) return false;
+    }
+    return status() == roo_io::kEndOfStream;
+  }
+
+ private:
+  const IoVec* iov_;
+  size_t iovcnt_;
+  size_t offset_;
+  size_t segments_remaining_;
+  roo_io::InputStream* tail_;
+  size_t tail_remaining_;
+};
+
+}  // namespace
+
+LocalMessaging::LocalMessaging(size_t max_message_size, size_t buffer_count,
+                               uint16_t thread_stack_size,
+                               const char* thread_name)
+    : server_(new Endpoint(*this, max_message_size, buffer_count,
+                           thread_stack_size, thread_name)),
+      client_(new Endpoint(*this, max_message_size, buffer_count,
+                           thread_stack_size, thread_name)),
+      connection_id_(1) {
+  server_->peer_ = client_.get();
+  client_->peer_ = server_.get();
+}
+
+LocalMessaging::~LocalMessaging() { end(); }
+
+void LocalMessaging::begin() {
+  server_->begin();
+  client_->begin();
+}
+
+void LocalMessaging::end() {
+  server_->end();
+  client_->end();
+}
+
+void LocalMessaging::reset() {
+  Messaging::ConnectionId connection_id = connection_id_.fetch_add(1);
+  server_->dispatchReset(connection_id);
+  client_->dispatchReset(connection_id);
+}
+
+LocalMessaging::Endpoint::Endpoint(LocalMessaging& pair,
+                                   size_t max_message_size,
+                                   size_t buffer_count,
+                                   uint16_t thread_stack_size,
+                                   const char* thread_name)
+    : pair_(pair),
+      peer_(nullptr),
+      thread_stack_size_(thread_stack_size),
+      thread_name_(thread_name),
+      buffers_(buffer_count, max_message_size),
+      queue_capacity_(2 * buffer_count + 1),
+      queue_(new Entry[2 * buffer_count + 1]),
+      head_(0),
+      size_(0),
+      busy_(false),
+      active_(false) {}
+
+bool LocalMessaging::Endpoint::send(const roo::byte* header,
+                                    size_t header_size,
+                                    const roo::byte* payload,
+                                    size_t payload_size,
+                                    ConnectionId* connection_id) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendv(segments, 2, connection_id);
+}
+
+bool LocalMessaging::Endpoint::sendContinuation(ConnectionId connection_id,
+                                                const roo::byte* header,
+                                                size_t header_size,
+                                                const roo::byte* payload,
+                                                size_t payload_size) {
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendContinuationv(connection_id, segments, 2);
+}
+
+bool LocalMessaging::Endpoint::sendv(const IoVec* iov, size_t iovcnt,
+                                     ConnectionId* connection_id) {
+  ConnectionId current = pair_.connection_id_.load();
+  if (connection_id != nullptr) *connection_id = current;
+  return sendInternal(current, iov, iovcnt, nullptr, 0);
+}
+
+bool LocalMessaging::Endpoint::sendContinuationv(ConnectionId connection_id,
+                                                 const IoVec* iov,
+                                                 size_t iovcnt) {
+  if (connection_id != pair_.connection_id_.load()) {
+    // The connection has been reset.
+    return false;
+  }
+  return sendInternal(connection_id, iov, iovcnt, nullptr, 0);
+}
+
+bool LocalMessaging::Endpoint::sendStream(const roo::byte* header,
+                                          size_t header_size,
+                                          roo_io::InputStream& payload,
+                                          size_t payload_size,
+                                          ConnectionId* connection_id) {
+  ConnectionId current = pair_.connection_id_.load();
+  if (connection_id != nullptr) *connection_id = current;
+  const IoVec segment = {header, header_size};
+  return sendInternal(current, &segment, 1, &payload, payload_size);
+}
+
+bool LocalMessaging::Endpoint::sendInternal(ConnectionId connection_id,
+                                            const IoVec* iov, size_t iovcnt,
+                                            roo_io::InputStream* tail,
+                                            size_t tail_size) {
+  return peer_->deliver(connection_id, iov, iovcnt, tail, tail_size);
+}
+
+bool LocalMessaging::Endpoint::deliver(ConnectionId connection_id,
+                                       const IoVec* iov, size_t iovcnt,
+                                       roo_io::InputStream* tail,
+                                       size_t tail_size) {
+  size_t size = tail_size;
+  for (size_t i = 0; i < iovcnt; ++i) size += iov[i].size;
+  if (size > buffers_.buffer_capacity()) {
+    MessageInputStream content(iov, iovcnt, tail, tail_size);
+    {
+      roo::unique_lock<roo::mutex> guard(mutex_);
+      acquireReceiver(guard);
+    }
+    bool accepted = receivedStream(connection_id, content, size);
+    bool complete = accepted && content.skipRemaining();
+    releaseReceiver();
+    if (!accepted) {
+      LOG(ERROR) << "LocalMessaging: message size " << size << " exceeds max "
+                 << buffers_.buffer_capacity()
+                 << ", and the receiver rejected it";
+      pair_.reset();
+      return false;
+    }
+    if (!complete) {
+      LOG(ERROR) << "LocalMessaging: payload stream ended prematurely";
+      pair_.reset();
+      return false;
+    }
+    return true;
+  }
+  MessageBuffer message = buffers_.acquire();
+  roo::byte* data = message.mutable_data();
+  for (size_t i = 0; i < iovcnt; ++i) {
+    if (iov[i].size == 0) continue;
+    memcpy(data, iov[i].data, iov[i].size);
+    data += iov[i].size;
+  }
+  if (tail_size > 0 && tail->readFully(data, tail_size) < tail_size) {
+    LOG(ERROR) << "LocalMessaging: payload stream ended prematurely: "
+               << tail->status();
+    message.reset();
+    pair_.reset();
+    return false;
+  }
+  message.resize(size);
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (active_) {
+      push(connection_id, std::move(message), false);
+      return true;
+    }
+  }
+  // Not running; deliver synchronously.
+  received(connection_id, message);
+  return true;
+}
+
+void LocalMessaging::Endpoint::push(ConnectionId connection_id,
+                                    MessageBuffer message, bool reset) {
+  // The buffers bound the number of queued messages, and the resets don't
+  // get queued back to back (see dispatchReset()).
+  DCHECK_LT(size_, queue_capacity_);
+  Entry& entry = queue_[(head_ + size_) % queue_capacity_];
+  entry.connection_id = connection_id;
+  entry.message = std::move(message);
+  entry.reset = reset;
+  ++size_;
+  changed_.notify_all();
+}
+
+void LocalMessaging::Endpoint::acquireReceiver(
+    roo::unique_lock<roo::mutex>& guard) {
+  while (active_ && (busy_ || size_ > 0)) {
+    changed_.wait(guard);
+  }
+  busy_ = true;
+}
+
+void LocalMessaging::Endpoint::releaseReceiver() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  busy_ = false;
+  changed_.notify_all();
+}
+
+void LocalMessaging::Endpoint::dispatchReset(ConnectionId connection_id) {
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (active_) {
+      // Doesn't wait for the receiver, which may be the caller (e.g. when a
+      // receiver's reply gets rejected).
+      if (size_ > 0 && queue_[(head_ + size_ - 1) % queue_capacity_].reset) {
+        // The pending notification covers this reset, too; no messages have
+        // been queued in between.
+        return;
+      }
+      push(connection_id, MessageBuffer(), true);
+      return;
+    }
+  }
+  Messaging::reset(connection_id);
+}
+
+void LocalMessaging::Endpoint::begin() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  if (active_) return;
+  active_ = true;
+  roo::thread::attributes attrs;
+  attrs.set_name(thread_name_);
+  attrs.set_stack_size(thread_stack_size_);
+  thread_ = roo::thread(attrs, [this]() { deliveryLoop(); });
+}
+
+void LocalMessaging::Endpoint::end() {
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    if (!active_) return;
+    active_ = false;
+    changed_.notify_all();
+  }
+  if (thread_.joinable()) thread_.join();
+}
+
+void LocalMessaging::Endpoint::deliveryLoop() {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  while (true) {
+    while ((active_ && size_ == 0) || busy_) {
+      changed_.wait(guard);
+    }
+    if (size_ == 0) break;
+    Entry& entry = queue_[head_];
+    ConnectionId connection_id = entry.connection_id;
+    MessageBuffer message = std::move(entry.message);
+    bool reset = entry.reset;
+    head_ = (head_ + 1) % queue_capacity_;
+    --size_;
+    busy_ = true;
+    guard.unlock();
+    if (reset) {
+      Messaging::reset(connection_id);
+    } else {
+      received(connection_id, message);
+    }
+    // Returns the buffer to the pool before taking the next message.
+    message.reset();
+    guard.lock();
+    busy_ = false;
+    changed_.notify_all();
+  }
+}
+
+}  // namespace roo_transport
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_threads/thread.h"
+#include "roo_transport/core/message_buffer.h"
+#include "roo_transport/messaging/messaging.h"
+
+namespace roo_transport {
+
+/// A pair of `Messaging` endpoints, connected to each other in memory. For
+/// tests, and for components that are co-located in one process, but that
+/// are written against `Messaging` (e.g. via `RpcClient` and `RpcServer`),
+/// so that they can as well talk over a link.
+///
+/// Messages are not serialized nor framed; they get copied, once, into a
+/// buffer from the receiving endpoint's pool, and handed over to its
+/// delivery thread. Receivers therefore see the same threading as with
+/// `LinkMessaging`: they are called on one thread, in order, and may retain
+/// the buffers (see `Messaging::Receiver::receivedBuffer()`). Senders block
+/// while all the buffers of the receiving endpoint are taken.
+///
+/// Messages larger than the buffers (e.g. sent via `sendStream()`) are
+/// passed to the receiver as streams (see
+/// `Messaging::Receiver::receivedStream()`), on the sender's thread, once
+/// the receiver is done with the preceding messages. If the receiver rejects
+/// such a message, the connection gets reset, like that of `LinkMessaging`.
+/// Since the sender waits for the peer's receiver, the receivers of both
+/// endpoints must not send such messages to each other at the same time
+/// (like with `LinkMessaging`).
+///
+/// Example:
+///
+///     LocalMessaging local;
+///     RpcServer server(local.server(), &function_table);
+///     RpcClient client(local.client());
+///     server.begin();
+///     client.begin();
+///     local.begin();
+class LocalMessaging {
+ public:
+  class Endpoint;
+
+  /// Each endpoint receives into `buffer_count` buffers of
+  /// `max_message_size` bytes.
+  LocalMessaging(size_t max_message_size = 1024, size_t buffer_count = 4,
+                 uint16_t thread_stack_size = 4096,
+                 const char* thread_name = "localMsgRcv");
+
+  ~LocalMessaging();
+
+  /// Starts the delivery threads. Until then, the messages are delivered
+  /// synchronously, on the sender's thread.
+  void begin();
+
+  /// Delivers the queued messages, and stops the delivery threads.
+  void end();
+
+  /// Simulates a reconnection: the subsequent messages get a new connection
+  /// ID, and the receivers of both endpoints get notified (see
+  /// `Messaging::Receiver::reset()`), after the preceding messages. Doesn't
+  /// wait for the notifications (unless the delivery threads are not
+  /// running), so that it can be called from within a receiver.
+  void reset();
+
+  Endpoint& server() { return *server_; }
+  Endpoint& client() { return *client_; }
+
+ private:
+  friend class Endpoint;
+
+  std::unique_ptr<Endpoint> server_;
+  std::unique_ptr<Endpoint> client_;
+
+  // Incremented on reset.
+  roo::atomic<Messaging::ConnectionId> connection_id_;
+};
+
+class LocalMessaging::Endpoint : public Messaging {
+ public:
+  using Messaging::send;
+  using Messaging::sendContinuation;
+  using Messaging::sendStream;
+
+  bool send(const roo::byte* header, size_t header_size,
+            const roo::byte* payload, size_t payload_size,
+            ConnectionId* connection_id) override;
+
+  bool sendContinuation(ConnectionId connection_id, const roo::byte* header,
+                        size_t header_size, const roo::byte* payload,
+                        size_t payload_size) override;
+
+  bool sendv(const IoVec* iov, size_t iovcnt,
+             ConnectionId* connection_id) override;
+
+  bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                         size_t iovcnt) override;
+
+  bool sendStream(const roo::byte* header, size_t header_size,
+                  roo_io::InputStream& payload, size_t payload_size,
+                  ConnectionId* connection_id) override;
+
+ private:
+  friend class LocalMessaging;
+
+  struct Entry {
+    ConnectionId connection_id;
+    MessageBuffer message;
+
+    // If set, the entry is a reset notification, rather than a message.
+    bool reset;
+  };
+
+  Endpoint(LocalMessaging& pair, size_t max_message_size, size_t buffer_count,
+           uint16_t thread_stack_size, const char* thread_name);
+
+  // Sends the message consisting of the segments, followed by `tail_size`
+  // bytes of the (optional) tail stream, to the peer.
+  bool sendInternal(ConnectionId connection_id, const IoVec* iov,
+                    size_t iovcnt, roo_io::InputStream* tail,
+                    size_t tail_size);
+
+  // Called by the peer. Queues the message for delivery, or, if it's too
+  // large for the buffers, passes it to the receiver as a stream.
+  bool deliver(ConnectionId connection_id, const IoVec* iov, size_t iovcnt,
+               roo_io::InputStream* tail, size_t tail_size);
+
+  // Must hold mutex_, and active_ must be set. Queues the entry for the
+  // delivery thread.
+  void push(ConnectionId connection_id, MessageBuffer message, bool reset);
+
+  // Must hold mutex_. Blocks until the preceding messages have been
+  // processed, and marks the receiver busy.
+  void acquireReceiver(roo::unique_lock<roo::mutex>& guard);
+
+  void releaseReceiver();
+
+  // Queues the reset notification after the preceding messages, or, if the
+  // delivery thread is not running, notifies the receiver right away.
+  void dispatchReset(ConnectionId connection_id);
+
+  void begin();
+
+  void end();
+
+  void deliveryLoop();
+
+  LocalMessaging& pair_;
+  Endpoint* peer_;
+  uint16_t thread_stack_size_;
+  const char* thread_name_;
+  MessageBufferPool buffers_;
+  // Fits a message per buffer, and a reset notification before and after
+  // each.
+  size_t queue_capacity_;
+  std::unique_ptr<Entry[]> queue_;
+  roo::thread thread_;
+
+  roo::mutex mutex_;
+
+  // Notified when a message gets queued, or when the receiver becomes idle.
+  roo::condition_variable changed_;
+
+  size_t head_;
+  size_t size_;
+
+  // Whether the receiver is being called.
+  bool busy_;
+
+  bool active_;
+};
+
+}  // namespace roo_transport
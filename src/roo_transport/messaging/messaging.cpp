@@ -1,7 +1,56 @@
 #include "roo_transport/messaging/messaging.h"
 
+#include <string.h>
+
 namespace roo_transport {
 
+namespace {
+
+// Splits the segments into a header and a payload, copying all but the last
+// segment into `buffer` if there are more than two of them.
+void Coalesce(const IoVec* iov, size_t iovcnt, IoVec& header, IoVec& payload,
+              std::unique_ptr<roo::byte[]>& buffer) {
+  header = {nullptr, 0};
+  payload = {nullptr, 0};
+  if (iovcnt == 0) return;
+  payload = iov[iovcnt - 1];
+  if (iovcnt == 1) return;
+  if (iovcnt == 2) {
+    header = iov[0];
+    return;
+  }
+  size_t size = 0;
+  for (size_t i = 0; i < iovcnt - 1; ++i) size += iov[i].size;
+  buffer.reset(new roo::byte[size]);
+  size_t offset = 0;
+  for (size_t i = 0; i < iovcnt - 1; ++i) {
+    if (iov[i].size == 0) continue;
+    memcpy(&buffer[offset], iov[i].data, iov[i].size);
+    offset += iov[i].size;
+  }
+  header = {buffer.get(), size};
+}
+
+}  // namespace
+
+bool Messaging::sendv(const IoVec* iov, size_t iovcnt,
+                      ConnectionId* connection_id) {
+  IoVec header, payload;
+  std::unique_ptr<roo::byte[]> buffer;
+  Coalesce(iov, iovcnt, header, payload, buffer);
+  return send(header.data, header.size, payload.data, payload.size,
+              connection_id);
+}
+
+bool Messaging::sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                                  size_t iovcnt) {
+  IoVec header, payload;
+  std::unique_ptr<roo::byte[]> buffer;
+  Coalesce(iov, iovcnt, header, payload, buffer);
+  return sendContinuation(connection_id, header.data, header.size,
+                          payload.data, payload.size);
+}
+
 void Messaging::received(ConnectionId connection_id, const roo::byte* data,
                          size_t len) {
   if (receiver_ != nullptr) {
@@ -9,6 +58,19 @@ void Messaging::received(ConnectionId connection_id, const roo::byte* data,
   }
 }
 
+void Messaging::received(ConnectionId connection_id,
+                         const MessageBuffer& message) {
+  if (receiver_ != nullptr) {
+    receiver_->receivedBuffer(connection_id, message);
+  }
+}
+
+bool Messaging::receivedStream(ConnectionId connection_id,
+                               roo_io::InputStream& content, size_t size) {
+  if (receiver_ == nullptr) return false;
+  return receiver_->receivedStream(connection_id, content, size);
+}
+
 void Messaging::reset(ConnectionId connection_id) {
   if (receiver_ != nullptr) {
     receiver_->reset(connection_id);
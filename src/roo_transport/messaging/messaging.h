@@ -7,6 +7,9 @@
 
 #include "roo_backport.h"
 #include "roo_backport/byte.h"
+#include "roo_io/core/input_stream.h"
+#include "roo_transport/core/iovec.h"
+#include "roo_transport/core/message_buffer.h"
 
 namespace roo_transport {
 
@@ -14,6 +17,10 @@ namespace roo_transport {
 ///
 /// Messages are arbitrary-length byte arrays with in-order, integrity-checked
 /// delivery. Messages may be lost across channel reset/reconnect boundaries.
+///
+/// Some implementations relax these guarantees, trading reliability for
+/// latency (e.g. `LinkDatagramMessaging`, which may drop messages, and
+/// doesn't retransmit them).
 class Messaging {
  public:
   using ConnectionId = uint32_t;
@@ -64,12 +71,58 @@ class Messaging {
     return sendContinuation(connection_id, nullptr, 0, payload, payload_size);
   }
 
+  /// Sends message gathered from the specified segments, without copying
+  /// them into a contiguous buffer. Lets wrappers prepend their headers (e.g.
+  /// the channel ID of `MuxMessaging`) cheaply.
+  ///
+  /// The default implementation coalesces all but the last segment into a
+  /// temporary header, and calls `send()`. Implementations that can write
+  /// the segments directly override it.
+  virtual bool sendv(const IoVec* iov, size_t iovcnt,
+                     ConnectionId* connection_id);
+
+  /// Like `sendv()`, but for continuation messages.
+  virtual bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                                 size_t iovcnt);
+
+  /// Sends a message with optional header, and the payload read from the
+  /// specified stream, in chunks, so that the message doesn't need to fit in
+  /// memory (e.g. a firmware image). Exactly `payload_size` bytes are read
+  /// from the stream; if it ends prematurely, the message can't be completed,
+  /// and the connection gets reset.
+  ///
+  /// The peer receives messages too large for its receive buffers via
+  /// `Receiver::receivedStream()`.
+  ///
+  /// @return true if accepted for send; false also if streaming is not
+  /// supported by the implementation (the default).
+  virtual bool sendStream(const roo::byte* header, size_t header_size,
+                          roo_io::InputStream& payload, size_t payload_size,
+                          ConnectionId* connection_id) {
+    return false;
+  }
+
+  /// Convenience overload for header-less streamed messages.
+  bool sendStream(roo_io::InputStream& payload, size_t payload_size,
+                  ConnectionId* connection_id = nullptr) {
+    return sendStream(nullptr, 0, payload, payload_size, connection_id);
+  }
+
  protected:
   Messaging() = default;
 
   /// Dispatches received message to registered receiver.
   void received(ConnectionId connection_id, const roo::byte* data, size_t len);
 
+  /// Dispatches received message, held in a pooled buffer, to registered
+  /// receiver, which may retain it without copying.
+  void received(ConnectionId connection_id, const MessageBuffer& message);
+
+  /// Dispatches streamed message to registered receiver. Returns false if
+  /// the receiver rejects it (or if there is no receiver).
+  bool receivedStream(ConnectionId connection_id, roo_io::InputStream& content,
+                      size_t size);
+
   /// Dispatches reset notification to registered receiver.
   void reset(ConnectionId connection_id);
 
@@ -88,6 +141,31 @@ class Messaging::Receiver {
   virtual void received(ConnectionId connection_id, const roo::byte* data,
                         size_t len) = 0;
 
+  /// Called instead of `received()` when the message is held in a pooled
+  /// buffer (e.g. by `LinkMessaging`).
+  ///
+  /// Receivers that need to keep the message past the call (e.g. to hand it
+  /// off to a worker thread) can override this method, and retain a copy of
+  /// the handle, rather than copying the data. Note that the buffer does not
+  /// return to the pool until released, so retaining too many buffers stalls
+  /// the reception. Defaults to calling `received()`.
+  virtual void receivedBuffer(ConnectionId connection_id,
+                              const MessageBuffer& message) {
+    received(connection_id, message.data(), message.size());
+  }
+
+  /// Called for messages too large to be received into a buffer (e.g. larger
+  /// than the `max_recv_packet_size` of `LinkMessaging`), with a stream of
+  /// the `size` bytes of the message content, to be consumed incrementally.
+  ///
+  /// The stream is valid only for the duration of the call. Content left
+  /// unread is skipped. The receiver should return false if it can't handle
+  /// the message; the connection then gets reset. Defaults to rejecting.
+  virtual bool receivedStream(ConnectionId connection_id,
+                              roo_io::InputStream& content, size_t size) {
+    return false;
+  }
+
   /// Notifies that underlying connection was closed/reset.
   ///
   /// Receiver should clear connection-associated state.
@@ -1,17 +1,94 @@
 #include "roo_transport/messaging/mux_messaging.h"
 
+#include <string.h>
+
 #include "roo_io/memory/load.h"
 #include "roo_io/memory/store.h"
 #include "roo_logging.h"
+#include "roo_threads/thread.h"
 
 namespace roo_transport {
 
-MuxMessaging::MuxMessaging(Messaging& messaging)
-    : messaging_(messaging), dispatcher_(*this) {
+namespace {
+
+// Reads the specified header, followed by the content of another stream.
+class PrefixedInputStream : public roo_io::InputStream {
+ public:
+  PrefixedInputStream(const roo::byte* prefix, size_t prefix_size,
+                      roo_io::InputStream& in)
+      : prefix_(prefix), prefix_size_(prefix_size), in_(in) {}
+
+  size_t read(roo::byte* buf, size_t count) override {
+    if (prefix_size_ == 0) return in_.read(buf, count);
+    if (count > prefix_size_) count = prefix_size_;
+    memcpy(buf, prefix_, count);
+    prefix_ += count;
+    prefix_size_ -= count;
+    return count;
+  }
+
+  roo_io::Status status() const override { return in_.status(); }
+
+ private:
+  const roo::byte* prefix_;
+  size_t prefix_size_;
+  roo_io::InputStream& in_;
+};
+
+}  // namespace
+
+MuxMessaging::MuxMessaging(Messaging& messaging, size_t channel_window,
+                           uint16_t grant_thread_stack_size,
+                           const char* grant_thread_name)
+    : messaging_(messaging),
+      dispatcher_(*this),
+      channel_window_(channel_window),
+      sending_(false),
+      waiting_count_(0),
+      last_sender_(0),
+      unacknowledged_(channel_window == 0 ? nullptr : new uint16_t[256]()),
+      grants_pending_(false),
+      grant_connection_id_(0),
+      active_(true),
+      phase_(0),
+      backlog_capacity_(0) {
+  CHECK_LE(channel_window, 65535);
+  for (auto& channel : channels_) channel.store(nullptr);
+  readers_[0].store(0);
+  readers_[1].store(0);
   messaging_.setReceiver(dispatcher_);
+  if (flowControlEnabled()) {
+    roo::thread::attributes attrs;
+    attrs.set_name(grant_thread_name);
+    attrs.set_stack_size(grant_thread_stack_size);
+    grant_thread_ = roo::thread(attrs, [this]() { grantLoop(); });
+  }
 }
 
-MuxMessaging::~MuxMessaging() = default;
+MuxMessaging::~MuxMessaging() {
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    active_ = false;
+    has_grants_.notify_all();
+  }
+  if (grant_thread_.joinable()) grant_thread_.join();
+}
+
+void MuxMessaging::setBacklogCapacity(size_t capacity) {
+  roo::lock_guard<roo::mutex> guard(backlog_mutex_);
+  backlog_capacity_ = capacity;
+  if (backlog_.size() > capacity) {
+    backlog_.erase(backlog_.begin(),
+                   backlog_.begin() + (backlog_.size() - capacity));
+  }
+}
+
+MuxMessaging::ReadGuard::ReadGuard(MuxMessaging& mux)
+    : mux_(mux), phase_(mux.phase_.load()) {
+  mux_.readers_[phase_].fetch_add(1);
+}
+
+MuxMessaging::ReadGuard::~ReadGuard() { mux_.readers_[phase_].fetch_sub(1); }
 
 void MuxMessaging::Dispatcher::received(Messaging::ConnectionId connection_id,
                                         const roo::byte* data, size_t len) {
@@ -21,57 +98,356 @@ void MuxMessaging::Dispatcher::received(Messaging::ConnectionId connection_id,
     return;
   }
   ChannelId channel_id = (ChannelId)roo_io::LoadU8(&data[0]);
-
+  if (channel_id == kControlChannelId && mux_.flowControlEnabled()) {
+    mux_.receivedControl(data + 1, len - 1);
+    return;
+  }
   mux_.received(connection_id, channel_id, data + 1, len - 1);
 }
 
+void MuxMessaging::Dispatcher::receivedBuffer(
+    Messaging::ConnectionId connection_id, const MessageBuffer& message) {
+  if (message.size() < 1) {
+    LOG(WARNING) << "Messaging: received message too short ("
+                 << message.size() << " bytes)";
+    return;
+  }
+  ChannelId channel_id = (ChannelId)roo_io::LoadU8(message.data());
+  if (channel_id == kControlChannelId && mux_.flowControlEnabled()) {
+    mux_.receivedControl(message.data() + 1, message.size() - 1);
+    return;
+  }
+  // Shares the buffer; no copying.
+  mux_.received(connection_id, channel_id, message.slice(1));
+}
+
+bool MuxMessaging::Dispatcher::receivedStream(
+    Messaging::ConnectionId connection_id, roo_io::InputStream& content,
+    size_t size) {
+  roo::byte channel_id;
+  if (size < 1 || content.readFully(&channel_id, 1) < 1) return false;
+  ChannelId id = (ChannelId)roo_io::LoadU8(&channel_id);
+  bool accepted;
+  {
+    ReadGuard guard(mux_);
+    Channel* channel = mux_.findChannel(id);
+    // Messages for unknown channels get skipped.
+    accepted = (channel == nullptr) ||
+               channel->receivedStream(connection_id, content, size - 1);
+  }
+  mux_.consumed(connection_id, id);
+  return accepted;
+}
+
 void MuxMessaging::received(Messaging::ConnectionId connection_id,
                             ChannelId channel_id, const roo::byte* data,
                             size_t len) {
-  auto it = receivers_.find(channel_id);
-  if (it == receivers_.end()) {
+  {
+    ReadGuard guard(*this);
+    Channel* channel =
+        findChannelOrBacklog(connection_id, channel_id, data, len);
+    if (channel != nullptr) {
+      // Dispatch the message to the appropriate channel receiver.
+      channel->received(connection_id, data, len);
+    }
+  }
+  consumed(connection_id, channel_id);
+}
+
+void MuxMessaging::received(Messaging::ConnectionId connection_id,
+                            ChannelId channel_id,
+                            const MessageBuffer& message) {
+  {
+    ReadGuard guard(*this);
+    Channel* channel = findChannelOrBacklog(connection_id, channel_id,
+                                            message.data(), message.size());
+    if (channel != nullptr) {
+      channel->received(connection_id, message);
+    }
+  }
+  consumed(connection_id, channel_id);
+}
+
+MuxMessaging::Channel* MuxMessaging::findChannel(ChannelId channel_id) {
+  Channel* channel = channels_[channel_id].load(roo::memory_order_acquire);
+  if (channel == nullptr) {
+    LOG(WARNING) << "Messaging: received message for unknown channel "
+                 << (int)channel_id;
+  }
+  return channel;
+}
+
+MuxMessaging::Channel* MuxMessaging::findChannelOrBacklog(
+    Messaging::ConnectionId connection_id, ChannelId channel_id,
+    const roo::byte* data, size_t len) {
+  Channel* channel = channels_[channel_id].load(roo::memory_order_acquire);
+  if (channel != nullptr) return channel;
+  roo::lock_guard<roo::mutex> guard(backlog_mutex_);
+  // Re-checks; the channel may have been registered (and its backlog
+  // replayed) in the meantime.
+  channel = channels_[channel_id].load(roo::memory_order_acquire);
+  if (channel != nullptr) return channel;
+  if (backlog_capacity_ == 0) {
     LOG(WARNING) << "Messaging: received message for unknown channel "
                  << (int)channel_id;
-  } else {
-    // Dispatch the message to the appropriate channel receiver.
-    it->second->received(connection_id, data, len);
+    return nullptr;
+  }
+  if (backlog_.size() == backlog_capacity_) {
+    LOG(WARNING) << "Messaging: backlog full; dropping a message for channel "
+                 << (int)backlog_.front().channel_id;
+    backlog_.erase(backlog_.begin());
+  }
+  BacklogEntry entry;
+  entry.connection_id = connection_id;
+  entry.channel_id = channel_id;
+  entry.data.reset(new roo::byte[len]);
+  if (len > 0) memcpy(entry.data.get(), data, len);
+  entry.size = len;
+  backlog_.push_back(std::move(entry));
+  return nullptr;
+}
+
+void MuxMessaging::replayBacklog(Channel& channel) {
+  auto it = backlog_.begin();
+  while (it != backlog_.end()) {
+    if (it->channel_id != channel.id_) {
+      ++it;
+      continue;
+    }
+    channel.received(it->connection_id, it->data.get(), it->size);
+    it = backlog_.erase(it);
+  }
+}
+
+void MuxMessaging::awaitReaders() {
+  roo::lock_guard<roo::mutex> guard(unregister_mutex_);
+  // Flips the phase twice, so that the readers that have read the phase just
+  // before a flip, and entered the previous one, get waited for, too.
+  for (int i = 0; i < 2; ++i) {
+    uint8_t previous = phase_.load();
+    phase_.store(previous ^ 1);
+    while (readers_[previous].load() > 0) {
+      roo::this_thread::sleep_for(roo_time::Millis(1));
+    }
   }
 }
 
 void MuxMessaging::reset(Messaging::ConnectionId connection_id) {
-  for (auto& entry : receivers_) {
-    entry.second->reset(connection_id);
+  if (flowControlEnabled()) {
+    // The peer starts over, too.
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    for (auto& entry : channels_) {
+      Channel* channel = entry.load(roo::memory_order_acquire);
+      if (channel != nullptr) channel->credits_ = channel_window_;
+    }
+    for (size_t i = 0; i < 256; ++i) unacknowledged_[i] = 0;
+    grants_pending_ = false;
+    can_send_.notify_all();
+  }
+  {
+    // Stale; the messages of a reset connection may get lost anyway.
+    roo::lock_guard<roo::mutex> guard(backlog_mutex_);
+    backlog_.clear();
+  }
+  ReadGuard guard(*this);
+  for (auto& entry : channels_) {
+    Channel* channel = entry.load(roo::memory_order_acquire);
+    if (channel != nullptr) channel->reset(connection_id);
   }
 }
 
 void MuxMessaging::registerChannel(Channel& channel) {
-  CHECK(receivers_.insert({channel.id_, &channel}).second)
+  CHECK(!flowControlEnabled() || channel.id_ != kControlChannelId)
+      << "Channel ID " << (int)channel.id_ << " is reserved for flow control.";
+  {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    channel.credits_ = channel_window_;
+  }
+  roo::lock_guard<roo::mutex> guard(backlog_mutex_);
+  CHECK(channels_[channel.id_].load() == nullptr)
+      << "Channel ID " << (int)channel.id_ << " is already registered.";
+  // Before publishing the channel, so that the subsequent messages don't
+  // overtake the backlogged ones.
+  replayBacklog(channel);
+  Channel* expected = nullptr;
+  CHECK(channels_[channel.id_].compare_exchange_strong(
+      expected, &channel, roo::memory_order_acq_rel))
       << "Channel ID " << (int)channel.id_ << " is already registered.";
 }
 
 void MuxMessaging::unregisterChannel(Channel& channel) {
-  CHECK(receivers_.erase(channel.id_))
-      << "Channel ID " << (int)channel.id_ << " is not registered.";
+  {
+    // Excludes the senders' scheduling, which inspects the channels.
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    Channel* expected = &channel;
+    CHECK(channels_[channel.id_].compare_exchange_strong(
+        expected, nullptr, roo::memory_order_acq_rel))
+        << "Channel ID " << (int)channel.id_ << " is not registered.";
+  }
+  awaitReaders();
+}
+
+void MuxMessaging::beginSend(Channel& channel) {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  ++channel.waiting_;
+  ++waiting_count_;
+  while (!maySend(channel)) {
+    can_send_.wait(guard);
+  }
+  --channel.waiting_;
+  --waiting_count_;
+  if (flowControlEnabled()) --channel.credits_;
+  sending_ = true;
+  last_sender_ = channel.id_;
+}
+
+bool MuxMessaging::maySend(const Channel& channel) {
+  if (sending_) return false;
+  if (flowControlEnabled() && channel.credits_ == 0) return false;
+  // Uncontended; no need to look for other senders.
+  if (waiting_count_ == 1) return true;
+  return nextSender() == &channel;
+}
+
+void MuxMessaging::endSend() {
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  sending_ = false;
+  can_send_.notify_all();
+}
+
+MuxMessaging::Channel* MuxMessaging::nextSender() {
+  // The channels that follow the last sender go first, wrapping around.
+  for (size_t i = 1; i <= 256; ++i) {
+    Channel* channel = channels_[(ChannelId)(last_sender_ + i)].load(
+        roo::memory_order_acquire);
+    if (channel == nullptr || channel->waiting_ == 0) continue;
+    if (flowControlEnabled() && channel->credits_ == 0) continue;
+    return channel;
+  }
+  return nullptr;
+}
+
+void MuxMessaging::consumed(Messaging::ConnectionId connection_id,
+                            ChannelId channel_id) {
+  if (!flowControlEnabled()) return;
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  grant_connection_id_ = connection_id;
+  // Acknowledges in batches, to save on the control messages, but early
+  // enough for the sender to keep going.
+  if (++unacknowledged_[channel_id] < grantBatchSize()) return;
+  grants_pending_ = true;
+  has_grants_.notify_one();
+}
+
+void MuxMessaging::grantLoop() {
+  roo::unique_lock<roo::mutex> guard(mutex_);
+  while (true) {
+    while (active_ && !grants_pending_) has_grants_.wait(guard);
+    if (!active_) break;
+    grants_pending_ = false;
+    Messaging::ConnectionId connection_id = grant_connection_id_;
+    for (size_t i = 0; i < 256; ++i) {
+      uint16_t credits = unacknowledged_[i];
+      if (credits < grantBatchSize()) continue;
+      unacknowledged_[i] = 0;
+      guard.unlock();
+      roo::byte grant[4];
+      roo_io::StoreU8(kControlChannelId, &grant[0]);
+      roo_io::StoreU8((ChannelId)i, &grant[1]);
+      roo_io::StoreBeU16(credits, &grant[2]);
+      // Bypasses the round-robin, so that it doesn't wait for the local
+      // senders, which may in turn be waiting for the peer.
+      messaging_.sendContinuation(connection_id, grant, sizeof(grant));
+      guard.lock();
+    }
+  }
+}
+
+void MuxMessaging::receivedControl(const roo::byte* data, size_t len) {
+  if (len != 3) {
+    LOG(WARNING) << "Messaging: malformed credit grant (" << len << " bytes)";
+    return;
+  }
+  ChannelId channel_id = (ChannelId)roo_io::LoadU8(&data[0]);
+  uint16_t credits = roo_io::LoadBeU16(&data[1]);
+  roo::lock_guard<roo::mutex> guard(mutex_);
+  Channel* channel = channels_[channel_id].load(roo::memory_order_acquire);
+  if (channel == nullptr) return;
+  channel->credits_ += credits;
+  if (channel->credits_ > channel_window_) {
+    // Possible if the grant crossed a reset.
+    channel->credits_ = channel_window_;
+  }
+  can_send_.notify_all();
 }
 
 bool MuxMessaging::Channel::send(const roo::byte* header, size_t header_size,
                                  const roo::byte* payload, size_t payload_size,
                                  ConnectionId* connection_id) {
-  roo::byte new_header[header_size + 1];
-  roo_io::StoreU8((uint8_t)id_, &new_header[0]);
-  memcpy(&new_header[1], header, header_size);
-  return messaging_.messaging_.send(new_header, header_size + 1, payload,
-                                    payload_size, connection_id);
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendv(segments, 2, connection_id);
 }
 
 bool MuxMessaging::Channel::sendContinuation(
     Messaging::ConnectionId connection_id, const roo::byte* header,
     size_t header_size, const roo::byte* payload, size_t payload_size) {
-  roo::byte new_header[header_size + 1];
-  roo_io::StoreU8((uint8_t)id_, &new_header[0]);
-  memcpy(&new_header[1], header, header_size);
-  return messaging_.messaging_.sendContinuation(
-      connection_id, new_header, header_size + 1, payload, payload_size);
+  const IoVec segments[] = {
+      {header, header_size},
+      {payload, payload_size},
+  };
+  return sendContinuationv(connection_id, segments, 2);
+}
+
+bool MuxMessaging::Channel::sendv(const IoVec* iov, size_t iovcnt,
+                                  ConnectionId* connection_id) {
+  if (iovcnt > kMaxSegments) {
+    // Coalesces the segments, and comes back via send().
+    return Messaging::sendv(iov, iovcnt, connection_id);
+  }
+  IoVec segments[kMaxSegments + 1];
+  size_t count = prependId(iov, iovcnt, segments);
+  messaging_.beginSend(*this);
+  bool result = messaging_.messaging_.sendv(segments, count, connection_id);
+  messaging_.endSend();
+  return result;
+}
+
+bool MuxMessaging::Channel::sendContinuationv(
+    Messaging::ConnectionId connection_id, const IoVec* iov, size_t iovcnt) {
+  if (iovcnt > kMaxSegments) {
+    return Messaging::sendContinuationv(connection_id, iov, iovcnt);
+  }
+  IoVec segments[kMaxSegments + 1];
+  size_t count = prependId(iov, iovcnt, segments);
+  messaging_.beginSend(*this);
+  bool result = messaging_.messaging_.sendContinuationv(connection_id,
+                                                        segments, count);
+  messaging_.endSend();
+  return result;
+}
+
+bool MuxMessaging::Channel::sendStream(const roo::byte* header,
+                                       size_t header_size,
+                                       roo_io::InputStream& payload,
+                                       size_t payload_size,
+                                       ConnectionId* connection_id) {
+  // The original header gets streamed along with the payload.
+  PrefixedInputStream content(header, header_size, payload);
+  messaging_.beginSend(*this);
+  bool result = messaging_.messaging_.sendStream(
+      &id_byte_, 1, content, header_size + payload_size, connection_id);
+  messaging_.endSend();
+  return result;
+}
+
+size_t MuxMessaging::Channel::prependId(const IoVec* iov, size_t iovcnt,
+                                        IoVec* result) const {
+  result[0] = {&id_byte_, 1};
+  for (size_t i = 0; i < iovcnt; ++i) result[i + 1] = iov[i];
+  return iovcnt + 1;
 }
 
 }  // namespace roo_transport
\ No newline at end of file
@@ -1,24 +1,89 @@
 #pragma once
 
-#include "roo_collections.h"
-#include "roo_collections/flat_small_hash_map.h"
+#include <memory>
+#include <vector>
+
+#include "roo_threads.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/mutex.h"
+#include "roo_threads/thread.h"
 #include "roo_transport/messaging/messaging.h"
 
 namespace roo_transport {
 
 /// Multiplexes up to 256 logical messaging channels over one `Messaging` link.
+///
+/// Each message is prefixed with its one-byte channel ID, which indexes a
+/// table of the registered channels on the receiving side. The ID is sent as
+/// a separate segment (see `Messaging::sendv()`), so the messages don't get
+/// copied.
+///
+/// Concurrent senders on different channels take turns in round-robin order,
+/// so that a chatty channel doesn't starve the others.
+///
+/// Optionally (see the constructor), the channels get credit-based flow
+/// control: each channel may have at most `channel_window` messages in
+/// flight, i.e. sent but not yet processed by the peer's receiver. Senders
+/// block while the window is full. This bounds the buffering that any channel
+/// can take up, so that a channel with a slow receiver doesn't back up its
+/// siblings (provided that the receivers don't block each other; see
+/// `AsyncMessaging`). Credits get returned to the sender on channel
+/// `kControlChannelId`, which is then reserved. Both peers must use the same
+/// window. The credits get sent by a dedicated thread, so that the reader
+/// never waits for the underlying link's send path (which may, in turn, be
+/// waiting for the peer's reader).
+///
+/// Channels can be registered and unregistered (i.e. constructed and
+/// destroyed) at any time, also while messages are being received. Messages
+/// for channels that are not registered are dropped, unless a backlog is
+/// configured (see `setBacklogCapacity()`).
 class MuxMessaging {
  public:
   using ChannelId = uint8_t;
 
   class Channel;
 
-  MuxMessaging(Messaging& messaging);
+  /// Carries the credit grants, when flow control is enabled.
+  static constexpr ChannelId kControlChannelId = 255;
+
+  /// If `channel_window` is non-zero, enables flow control, allowing each
+  /// channel up to `channel_window` (at most 65535) messages in flight, and
+  /// starts the thread that sends the credits.
+  MuxMessaging(Messaging& messaging, size_t channel_window = 0,
+               uint16_t grant_thread_stack_size = 2048,
+               const char* grant_thread_name = "muxGrants");
   ~MuxMessaging();
 
+  /// Sets the max number of messages for unregistered channels to hold on to,
+  /// and to deliver once their channel gets registered with a receiver (see
+  /// `Channel`). When the backlog is full, the oldest messages get dropped.
+  /// Zero (the default) disables the backlog. Streamed messages (see
+  /// `Messaging::Receiver::receivedStream()`) are never held.
+  void setBacklogCapacity(size_t capacity);
+
  private:
   friend class Channel;
 
+  // Marks a read-side critical section, in which the registered channels
+  // can't get destroyed (see unregisterChannel()).
+  class ReadGuard {
+   public:
+    explicit ReadGuard(MuxMessaging& mux);
+    ~ReadGuard();
+
+   private:
+    MuxMessaging& mux_;
+    uint8_t phase_;
+  };
+
+  struct BacklogEntry {
+    Messaging::ConnectionId connection_id;
+    ChannelId channel_id;
+    std::unique_ptr<roo::byte[]> data;
+    size_t size;
+  };
+
   class Dispatcher : public Messaging::Receiver {
    public:
     explicit Dispatcher(MuxMessaging& mux) : mux_(mux) {}
@@ -26,6 +91,12 @@ class MuxMessaging {
     void received(Messaging::ConnectionId connection_id, const roo::byte* data,
                   size_t len) override;
 
+    void receivedBuffer(Messaging::ConnectionId connection_id,
+                        const MessageBuffer& message) override;
+
+    bool receivedStream(Messaging::ConnectionId connection_id,
+                        roo_io::InputStream& content, size_t size) override;
+
     void reset(Messaging::ConnectionId connection_id) override {
       mux_.reset(connection_id);
     }
@@ -37,26 +108,155 @@ class MuxMessaging {
   /// Called by `Channel` constructor.
   void registerChannel(Channel& channel);
 
-  /// Called by `Channel` destructor.
+  /// Called by `Channel` destructor. Blocks until the dispatches that may
+  /// still be using the channel complete.
   void unregisterChannel(Channel& channel);
 
   void received(Messaging::ConnectionId connection_id, ChannelId channel_id,
                 const roo::byte* data, size_t len);
 
+  void received(Messaging::ConnectionId connection_id, ChannelId channel_id,
+                const MessageBuffer& message);
+
+  // Must be in a ReadGuard. Returns nullptr (logging a warning) if the
+  // channel is not registered.
+  Channel* findChannel(ChannelId channel_id);
+
+  // Must be in a ReadGuard. Like findChannel(), but if the channel is not
+  // registered, puts a copy of the message in the backlog (or drops it).
+  Channel* findChannelOrBacklog(Messaging::ConnectionId connection_id,
+                                ChannelId channel_id, const roo::byte* data,
+                                size_t len);
+
+  // Must hold backlog_mutex_. Delivers the backlogged messages for the
+  // channel.
+  void replayBacklog(Channel& channel);
+
+  // Blocks until all the read-side critical sections that have started
+  // before the call complete.
+  void awaitReaders();
+
   void reset(Messaging::ConnectionId connection_id);
 
+  // Blocks until the channel may send a message: it has a credit, and no
+  // other channel with a pending message is ahead of it in the round-robin
+  // order. Must be followed by endSend().
+  void beginSend(Channel& channel);
+
+  void endSend();
+
+  // Must hold mutex_. Returns whether the channel may send now.
+  bool maySend(const Channel& channel);
+
+  // Must hold mutex_. Returns the channel that gets to send next, or nullptr
+  // if no channel is ready to send.
+  Channel* nextSender();
+
+  // Called once a message for the specified channel has been processed.
+  // Schedules the credits to be returned to the sender, in batches.
+  void consumed(Messaging::ConnectionId connection_id, ChannelId channel_id);
+
+  // Sends the scheduled credit grants, until the mux gets destroyed.
+  void grantLoop();
+
+  // Must hold mutex_. Returns the number of processed messages that make a
+  // credit grant worth sending.
+  uint16_t grantBatchSize() const { return (channel_window_ + 1) / 2; }
+
+  // Handles a credit grant from the peer.
+  void receivedControl(const roo::byte* data, size_t len);
+
+  bool flowControlEnabled() const { return channel_window_ > 0; }
+
   Messaging& messaging_;
   Dispatcher dispatcher_;
-  roo_collections::FlatSmallHashMap<ChannelId, Channel*> receivers_;
+
+  // Registered channels, indexed by ID. Looked up without locking.
+  roo::atomic<Channel*> channels_[256];
+
+  size_t channel_window_;
+
+  roo::mutex mutex_;
+
+  // Notified when a channel may be able to send.
+  roo::condition_variable can_send_;
+
+  // Whether some channel is sending (i.e. between beginSend() and endSend()).
+  bool sending_;
+
+  // Total number of senders in beginSend().
+  size_t waiting_count_;
+
+  // The channel that sent most recently.
+  ChannelId last_sender_;
+
+  // Processed messages not yet acknowledged to the peer, per channel ID.
+  std::unique_ptr<uint16_t[]> unacknowledged_;
+
+  // Whether some channel has enough unacknowledged messages for a grant.
+  bool grants_pending_;
+
+  // The connection that the unacknowledged messages came from. The grants
+  // are sent as its continuation, so that they get dropped, rather than
+  // wait for a new connection, if it gets reset.
+  Messaging::ConnectionId grant_connection_id_;
+
+  // Notified when grants become pending, or when the mux is being destroyed.
+  roo::condition_variable has_grants_;
+
+  // Cleared when the mux is being destroyed.
+  bool active_;
+
+  roo::thread grant_thread_;
+
+  // Numbers of readers in ReadGuards, per phase. Unregistration flips the
+  // phase, and waits for the readers of the previous one to leave.
+  roo::atomic<uint32_t> readers_[2];
+  roo::atomic<uint8_t> phase_;
+
+  // Serializes awaitReaders().
+  roo::mutex unregister_mutex_;
+
+  // Guards the backlog, and orders its replay before any messages that
+  // follow.
+  roo::mutex backlog_mutex_;
+  size_t backlog_capacity_;
+  std::vector<BacklogEntry> backlog_;
 };
 
+/// A logical channel of `MuxMessaging`.
+///
+/// Note that the destructor blocks while the channel's receiver is being
+/// called; thus, a channel must not be destroyed from within a receiver of
+/// the same mux.
 class MuxMessaging::Channel : public Messaging {
  public:
   using Messaging::send;
   using Messaging::sendContinuation;
+  using Messaging::sendStream;
 
+  /// Registers the channel. Any messages held for it in the backlog get
+  /// dropped, since there is no receiver yet to take them; use the other
+  /// constructor to get them.
   Channel(MuxMessaging& messaging, ChannelId id)
-      : messaging_(messaging), id_(id) {
+      : messaging_(messaging),
+        id_(id),
+        id_byte_((roo::byte)id),
+        credits_(0),
+        waiting_(0) {
+    messaging_.registerChannel(*this);
+  }
+
+  /// Registers the channel with the specified receiver, which also gets the
+  /// messages held for it in the backlog (see `setBacklogCapacity()`),
+  /// before the constructor returns.
+  Channel(MuxMessaging& messaging, ChannelId id, Receiver& receiver)
+      : messaging_(messaging),
+        id_(id),
+        id_byte_((roo::byte)id),
+        credits_(0),
+        waiting_(0) {
+    setReceiver(receiver);
     messaging_.registerChannel(*this);
   }
 
@@ -70,11 +270,35 @@ class MuxMessaging::Channel : public Messaging {
                         size_t header_size, const roo::byte* payload,
                         size_t payload_size) override;
 
+  bool sendv(const IoVec* iov, size_t iovcnt,
+             ConnectionId* connection_id) override;
+
+  bool sendContinuationv(ConnectionId connection_id, const IoVec* iov,
+                         size_t iovcnt) override;
+
+  bool sendStream(const roo::byte* header, size_t header_size,
+                  roo_io::InputStream& payload, size_t payload_size,
+                  ConnectionId* connection_id) override;
+
  private:
   friend class MuxMessaging;
 
+  // Vectored sends with more segments get coalesced.
+  static constexpr size_t kMaxSegments = 4;
+
+  // Fills `result` with the channel ID segment, followed by the specified
+  // segments. Returns the resulting number of segments.
+  size_t prependId(const IoVec* iov, size_t iovcnt, IoVec* result) const;
+
   MuxMessaging& messaging_;
   ChannelId id_;
+
+  // The channel ID, as sent.
+  roo::byte id_byte_;
+
+  // Guarded by the mutex of the MuxMessaging.
+  size_t credits_;
+  size_t waiting_;
 };
 
 }  // namespace roo_transport
@@ -18,6 +18,7 @@ LinkLoopback::LinkLoopback(size_t client_to_server_pipe_capacity,
       server_packet_receiver_(server_input_),
       client_packet_sender_(noisy_client_output_),
       client_packet_receiver_(client_input_),
+      server_drain_rate_(0),
       server_(server_packet_sender_, kBufferSize4KB, kBufferSize4KB),
       client_(client_packet_sender_, kBufferSize4KB, kBufferSize4KB) {
   begin();
@@ -37,6 +38,10 @@ bool LinkLoopback::serverReceive() {
   if (server_input_.status() != roo_io::kOk) return false;
   server_packet_receiver_.receive([this](const roo::byte* buf, size_t len) {
     server_.processIncomingPacket(buf, len);
+    if (server_drain_rate_ > 0) {
+      roo::this_thread::sleep_for(
+          roo_time::Micros((uint64_t)len * 1000000 / server_drain_rate_));
+    }
   });
   return true;
 }
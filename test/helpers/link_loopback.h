@@ -38,6 +38,14 @@ class LinkLoopback {
     noisy_client_output_.setErrorRate(error_rate);
   }
 
+  // Emulates a server whose receive FIFO has a limited capacity (as specified
+  // in the constructor), and which drains it at a limited rate. Data sent by
+  // the client while the FIFO is full gets dropped.
+  void setServerInputOverflow(uint32_t drain_bytes_per_second) {
+    noisy_client_output_.setDropOnOverflow(true);
+    server_drain_rate_ = drain_bytes_per_second;
+  }
+
   bool serverReceive();
 
   bool clientReceive();
@@ -60,6 +68,8 @@ class LinkLoopback {
   PacketSenderOverStream client_packet_sender_;
   PacketReceiverOverStream client_packet_receiver_;
 
+  uint32_t server_drain_rate_;
+
   roo_transport::LinkTransport server_;
   roo_transport::LinkTransport client_;
 
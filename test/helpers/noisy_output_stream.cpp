@@ -21,14 +21,25 @@ std::unique_ptr<roo::byte[]> PerturbData(const roo::byte* data, size_t size,
 }  // namespace
 
 NoisyOutputStream::NoisyOutputStream(roo_io::OutputStream& out, int error_rate)
-    : out_(out), error_rate_(error_rate), counter_(0) {}
+    : out_(out),
+      error_rate_(error_rate),
+      drop_on_overflow_(false),
+      counter_(0) {}
 
 void NoisyOutputStream::setErrorRate(int error_rate) {
   error_rate_ = error_rate;
 }
 
+void NoisyOutputStream::setDropOnOverflow(bool drop_on_overflow) {
+  drop_on_overflow_ = drop_on_overflow;
+}
+
 size_t NoisyOutputStream::write(const roo::byte* data, size_t len) {
   std::unique_ptr<roo::byte[]> buf = PerturbData(data, len, error_rate_);
+  if (drop_on_overflow_) {
+    out_.tryWrite(buf.get(), len);
+    return len;
+  }
   return out_.write(buf.get(), len);
 }
 
@@ -10,6 +10,10 @@ class NoisyOutputStream : public roo_io::OutputStream {
 
   void setErrorRate(int error_rate);
 
+  // If enabled, writes never block; instead, the data that does not fit in
+  // the underlying stream gets dropped, as in a FIFO overflow.
+  void setDropOnOverflow(bool drop_on_overflow);
+
   size_t write(const roo::byte* data, size_t len) override;
 
   size_t tryWrite(const roo::byte* data, size_t len) override;
@@ -21,6 +25,7 @@ class NoisyOutputStream : public roo_io::OutputStream {
  private:
   roo_io::OutputStream& out_;
   int error_rate_;
+  bool drop_on_overflow_;
   int counter_;
 };
 
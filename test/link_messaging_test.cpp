@@ -1,8 +1,14 @@
 #include "roo_transport/link/link_messaging.h"
 
+#include <string>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "helpers/link_loopback.h"
 #include "helpers/rand.h"
+#include "roo_threads/latch.h"
+#include "roo_transport/link/link_datagram_messaging.h"
+#include "roo_transport/messaging/async_messaging.h"
 #include "roo_transport/messaging/mux_messaging.h"
 
 namespace roo_transport {
@@ -202,4 +208,611 @@ TEST_F(MuxMessagingTest, SendReceiveOneEach) {
   EXPECT_EQ(clientReceived(), std::vector<Message>{"Hello, World!"});
 }
 
+TEST_F(MuxMessagingTest, SendVectored) {
+  const IoVec segments[] = {
+      {(const roo::byte*)"Hel", 3},
+      {nullptr, 0},
+      {(const roo::byte*)"lo, ", 4},
+      {(const roo::byte*)"World!", 7},
+  };
+  EXPECT_TRUE(server().sendv(segments, 4, nullptr));
+  // More segments than the channel prepends its ID to; coalesced.
+  const IoVec many[] = {
+      {(const roo::byte*)"a", 1}, {(const roo::byte*)"b", 1},
+      {(const roo::byte*)"c", 1}, {(const roo::byte*)"d", 1},
+      {(const roo::byte*)"e", 1}, {(const roo::byte*)"", 1},
+  };
+  EXPECT_TRUE(server().sendv(many, 6, nullptr));
+  server().send(nullptr, 0);
+  client().send(nullptr, 0);
+  join();
+  EXPECT_EQ(clientReceived(), (std::vector<Message>{"Hello, World!", "abcde"}));
+}
+
+TEST_F(SimpleLinkMessagingTest, BatchingSharesPackets) {
+  LinkTransport::StatsMonitor stats(loopback_.client());
+  LoopbackTestBase::client_.setBatchingWindow(roo_time::Millis(50));
+  const int kMessageCount = 100;
+  std::vector<Message> expected;
+  uint32_t packets_sent = stats.packets_sent();
+  for (int i = 0; i < kMessageCount; ++i) {
+    char msg[16];
+    snprintf(msg, sizeof(msg), "msg %d", i);
+    client().send((const roo::byte*)msg, strlen(msg) + 1);
+    expected.emplace_back(msg);
+    // Gives the sender a chance to catch up.
+    roo::this_thread::sleep_for(roo_time::Micros(100));
+  }
+  server().send(nullptr, 0);
+  client().send(nullptr, 0);
+  LoopbackTestBase::client_.flush();
+  join();
+  EXPECT_EQ(serverReceived(), expected);
+  // Unbatched, each message would take up a packet.
+  EXPECT_LT(stats.packets_sent() - packets_sent, kMessageCount / 4);
+}
+
+TEST(LinkMessagingTest, CompactFraming) {
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 1500);
+  LinkMessaging client(loopback.client(), 1500);
+  server.setCompactFraming(true);
+  client.setCompactFraming(true);
+  MessagingTester tester(server, client);
+  server.begin();
+  client.begin();
+  // Sizes straddle the boundaries of the varint encoding.
+  std::vector<Message> expected;
+  for (size_t size : {1, 127, 128, 1000, 1500}) {
+    std::string msg(size - 1, 'a' + size % 26);
+    client.send((const roo::byte*)msg.c_str(), size);
+    expected.emplace_back(msg.c_str());
+  }
+  server.send(nullptr, 0);
+  client.send(nullptr, 0);
+  tester.join();
+  EXPECT_EQ(tester.serverReceived(), expected);
+  server.end();
+  client.end();
+}
+
+TEST(MessageBufferPool, AcquireAndRelease) {
+  MessageBufferPool pool(2, 16);
+  MessageBuffer a = pool.tryAcquire();
+  ASSERT_TRUE(a);
+  EXPECT_EQ(a.size(), 0);
+  EXPECT_EQ(a.capacity(), 16);
+  memcpy(a.mutable_data(), "hello", 6);
+  a.resize(6);
+  MessageBuffer b = pool.acquire();
+  ASSERT_TRUE(b);
+  EXPECT_FALSE(pool.tryAcquire());
+  EXPECT_FALSE(pool.acquire(roo_time::Uptime::Now() + roo_time::Millis(10)));
+  EXPECT_EQ(pool.available(), 0);
+
+  // Copies and slices share the buffer.
+  MessageBuffer copy = a;
+  MessageBuffer slice = a.slice(1);
+  EXPECT_FALSE(a.unique());
+  EXPECT_EQ(copy.data(), a.data());
+  EXPECT_EQ(slice.data(), a.data() + 1);
+  EXPECT_EQ(slice.size(), 5);
+  EXPECT_STREQ((const char*)slice.data(), "ello");
+  a.reset();
+  copy.reset();
+  EXPECT_EQ(pool.available(), 0);
+  slice.reset();
+  EXPECT_EQ(pool.available(), 1);
+
+  // A blocked acquire gets woken up by a release.
+  roo::thread releaser([&]() {
+    roo::this_thread::sleep_for(roo_time::Millis(20));
+    b.reset();
+  });
+  MessageBuffer c = pool.acquire();
+  MessageBuffer d = pool.acquire();
+  EXPECT_TRUE(c);
+  EXPECT_TRUE(d);
+  releaser.join();
+}
+
+// Retains the received messages, without copying them.
+class RetainingReceiver : public Messaging::Receiver {
+ public:
+  void received(Messaging::ConnectionId connection_id, const roo::byte* data,
+                size_t len) override {
+    FAIL() << "Expected a pooled buffer";
+  }
+
+  void receivedBuffer(Messaging::ConnectionId connection_id,
+                      const MessageBuffer& message) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.push_back(message);
+    cv_.notify_all();
+  }
+
+  // Waits for the specified number of messages, and hands them over.
+  std::vector<MessageBuffer> await(size_t count) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (messages_.size() < count) cv_.wait(guard);
+    std::vector<MessageBuffer> result;
+    result.swap(messages_);
+    return result;
+  }
+
+ private:
+  roo::mutex mutex_;
+  roo::condition_variable cv_;
+  std::vector<MessageBuffer> messages_;
+};
+
+TEST(LinkMessagingTest, ReceiverRetainsPooledBuffers) {
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100, 4096, "server", 3);
+  LinkMessaging client(loopback.client(), 100, 4096, "client", 3);
+  RetainingReceiver receiver;
+  server.setReceiver(receiver);
+  server.begin();
+  client.begin();
+  std::vector<MessageBuffer> messages;
+  {
+    // All the buffers get retained, so that the reception stalls.
+    for (int i = 0; i < 4; ++i) {
+      std::string msg = "msg" + std::to_string(i);
+      EXPECT_TRUE(client.send((const roo::byte*)msg.c_str(), msg.size() + 1));
+    }
+    messages = receiver.await(3);
+    ASSERT_EQ(messages.size(), 3);
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_STREQ((const char*)messages[i].data(),
+                   ("msg" + std::to_string(i)).c_str());
+    }
+    // Handing the buffers off, e.g. to another thread, doesn't copy them.
+    std::vector<MessageBuffer> handed_off = std::move(messages);
+    EXPECT_STREQ((const char*)handed_off[2].data(), "msg2");
+  }
+  // Released; the reception resumes.
+  messages = receiver.await(1);
+  ASSERT_EQ(messages.size(), 1);
+  EXPECT_STREQ((const char*)messages[0].data(), "msg3");
+  messages.clear();
+  server.end();
+  client.end();
+  loopback.close();
+}
+
+// Generates a deterministic byte pattern of the specified size.
+class PatternInputStream : public roo_io::InputStream {
+ public:
+  explicit PatternInputStream(size_t size) : size_(size), pos_(0) {}
+
+  size_t read(roo::byte* buf, size_t count) override {
+    if (count > size_ - pos_) count = size_ - pos_;
+    for (size_t i = 0; i < count; ++i) buf[i] = Pattern(pos_ + i);
+    pos_ += count;
+    return count;
+  }
+
+  roo_io::Status status() const override {
+    return pos_ == size_ ? roo_io::kEndOfStream : roo_io::kOk;
+  }
+
+  static roo::byte Pattern(size_t pos) { return (roo::byte)(pos % 251); }
+
+ private:
+  size_t size_;
+  size_t pos_;
+};
+
+// Consumes streamed messages in small chunks, verifying their content.
+class StreamingReceiver : public Messaging::Receiver {
+ public:
+  // Reads at most `read_limit` bytes of each streamed message.
+  explicit StreamingReceiver(size_t read_limit) : read_limit_(read_limit) {}
+
+  void received(Messaging::ConnectionId connection_id, const roo::byte* data,
+                size_t len) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.emplace_back((const char*)data, len);
+    cv_.notify_all();
+  }
+
+  bool receivedStream(Messaging::ConnectionId connection_id,
+                      roo_io::InputStream& content, size_t size) override {
+    size_t pos = 0;
+    roo::byte buf[100];
+    while (pos < size && pos < read_limit_) {
+      size_t read = content.read(buf, sizeof(buf));
+      EXPECT_GT(read, 0);
+      if (read == 0) return false;
+      for (size_t i = 0; i < read; ++i) {
+        EXPECT_EQ(buf[i], PatternInputStream::Pattern(pos + i));
+      }
+      pos += read;
+    }
+    if (pos == size) {
+      EXPECT_EQ(content.read(buf, sizeof(buf)), 0);
+      EXPECT_EQ(content.status(), roo_io::kEndOfStream);
+    }
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.push_back("stream:" + std::to_string(size));
+    cv_.notify_all();
+    return true;
+  }
+
+  std::vector<std::string> await(size_t count) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (messages_.size() < count) cv_.wait(guard);
+    return messages_;
+  }
+
+ private:
+  size_t read_limit_;
+  roo::mutex mutex_;
+  roo::condition_variable cv_;
+  std::vector<std::string> messages_;
+};
+
+TEST(LinkMessagingTest, StreamsMessagesLargerThanReceiveBuffers) {
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100);
+  LinkMessaging client(loopback.client(), 100);
+  MuxMessaging server_mux(server);
+  MuxMessaging client_mux(client);
+  MuxMessaging::Channel server_channel(server_mux, 7);
+  MuxMessaging::Channel client_channel(client_mux, 7);
+  // Skips the tail of the messages, to check that the framing survives it.
+  StreamingReceiver receiver(3000);
+  server_channel.setReceiver(receiver);
+  server.begin();
+  client.begin();
+  PatternInputStream large(5000);
+  EXPECT_TRUE(client_channel.sendStream(large, 5000));
+  EXPECT_TRUE(client_channel.send((const roo::byte*)"small", 5));
+  // Small enough for a buffer; received as a regular message.
+  PatternInputStream medium(50);
+  EXPECT_TRUE(client_channel.sendStream(medium, 50));
+  PatternInputStream full(2000);
+  EXPECT_TRUE(client_channel.sendStream(full, 2000));
+  std::vector<std::string> messages = receiver.await(4);
+  ASSERT_EQ(messages.size(), 4);
+  EXPECT_EQ(messages[0], "stream:5000");
+  EXPECT_EQ(messages[1], "small");
+  EXPECT_EQ(messages[2].size(), 50);
+  EXPECT_EQ(messages[3], "stream:2000");
+  server.end();
+  client.end();
+  loopback.close();
+}
+
+TEST(AsyncMessagingTest, SlowChannelDoesNotStallOthers) {
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100, 4096, "server", 8);
+  LinkMessaging client(loopback.client(), 100, 4096, "client", 8);
+  AsyncMessaging async(server, 2, 4);
+  async.setOrderingKey(AsyncMessaging::OrderByMuxChannel);
+  MuxMessaging mux(async);
+  MuxMessaging::Channel slow_channel(mux, 1);
+  MuxMessaging::Channel fast_channel(mux, 2);
+  MuxMessaging client_mux(client);
+  MuxMessaging::Channel client_slow_channel(client_mux, 1);
+  MuxMessaging::Channel client_fast_channel(client_mux, 2);
+
+  roo::mutex mutex;
+  roo::condition_variable cv;
+  std::vector<std::string> slow_received;
+  std::vector<std::string> fast_received;
+  roo::latch unblock(1);
+  Messaging::SimpleReceiver slow_receiver(
+      [&](Messaging::ConnectionId, const roo::byte* data, size_t len) {
+        // The first message blocks the receiver until the test unblocks it.
+        unblock.wait();
+        roo::lock_guard<roo::mutex> guard(mutex);
+        slow_received.emplace_back((const char*)data, len);
+        cv.notify_all();
+      });
+  Messaging::SimpleReceiver fast_receiver(
+      [&](Messaging::ConnectionId, const roo::byte* data, size_t len) {
+        roo::lock_guard<roo::mutex> guard(mutex);
+        fast_received.emplace_back((const char*)data, len);
+        cv.notify_all();
+      });
+  slow_channel.setReceiver(slow_receiver);
+  fast_channel.setReceiver(fast_receiver);
+  async.begin();
+  server.begin();
+  client.begin();
+
+  for (int i = 0; i < 3; ++i) {
+    std::string msg = "slow" + std::to_string(i);
+    EXPECT_TRUE(client_slow_channel.send((const roo::byte*)msg.data(),
+                                         msg.size()));
+  }
+  for (int i = 0; i < 10; ++i) {
+    std::string msg = "fast" + std::to_string(i);
+    EXPECT_TRUE(client_fast_channel.send((const roo::byte*)msg.data(),
+                                         msg.size()));
+  }
+  {
+    // The fast channel gets all its messages, in order, while the slow one is
+    // still blocked on its first.
+    roo::unique_lock<roo::mutex> guard(mutex);
+    while (fast_received.size() < 10) cv.wait(guard);
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_EQ(fast_received[i], "fast" + std::to_string(i));
+    }
+    EXPECT_TRUE(slow_received.empty());
+  }
+  unblock.count_down();
+  {
+    roo::unique_lock<roo::mutex> guard(mutex);
+    while (slow_received.size() < 3) cv.wait(guard);
+    EXPECT_EQ(slow_received,
+              (std::vector<std::string>{"slow0", "slow1", "slow2"}));
+  }
+  server.end();
+  client.end();
+  async.end();
+  loopback.close();
+}
+
+TEST(MuxMessagingFlowControlTest, SlowChannelDoesNotBackUpOthers) {
+  constexpr size_t kWindow = 2;
+  constexpr int kMessageCount = 10;
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100, 4096, "server", 8);
+  LinkMessaging client(loopback.client(), 100, 4096, "client", 8);
+  // Without flow control, the slow channel would fill up the queue of its
+  // worker, stalling the reader, and thus the fast channel.
+  AsyncMessaging async(server, 2, 4);
+  async.setOrderingKey(AsyncMessaging::OrderByMuxChannel);
+  MuxMessaging mux(async, kWindow);
+  MuxMessaging::Channel slow_channel(mux, 1);
+  MuxMessaging::Channel fast_channel(mux, 2);
+  MuxMessaging client_mux(client, kWindow);
+  MuxMessaging::Channel client_slow_channel(client_mux, 1);
+  MuxMessaging::Channel client_fast_channel(client_mux, 2);
+
+  roo::mutex mutex;
+  roo::condition_variable cv;
+  std::vector<std::string> slow_received;
+  std::vector<std::string> fast_received;
+  roo::latch unblock(1);
+  Messaging::SimpleReceiver slow_receiver(
+      [&](Messaging::ConnectionId, const roo::byte* data, size_t len) {
+        unblock.wait();
+        roo::lock_guard<roo::mutex> guard(mutex);
+        slow_received.emplace_back((const char*)data, len);
+        cv.notify_all();
+      });
+  Messaging::SimpleReceiver fast_receiver(
+      [&](Messaging::ConnectionId, const roo::byte* data, size_t len) {
+        roo::lock_guard<roo::mutex> guard(mutex);
+        fast_received.emplace_back((const char*)data, len);
+        cv.notify_all();
+      });
+  slow_channel.setReceiver(slow_receiver);
+  fast_channel.setReceiver(fast_receiver);
+  async.begin();
+  server.begin();
+  client.begin();
+
+  roo::atomic<size_t> slow_sent(0);
+  roo::thread slow_sender([&]() {
+    for (int i = 0; i < kMessageCount; ++i) {
+      std::string msg = "slow" + std::to_string(i);
+      EXPECT_TRUE(client_slow_channel.send((const roo::byte*)msg.data(),
+                                           msg.size()));
+      ++slow_sent;
+    }
+  });
+  for (int i = 0; i < kMessageCount; ++i) {
+    std::string msg = "fast" + std::to_string(i);
+    EXPECT_TRUE(client_fast_channel.send((const roo::byte*)msg.data(),
+                                         msg.size()));
+  }
+  {
+    roo::unique_lock<roo::mutex> guard(mutex);
+    while (fast_received.size() < kMessageCount) cv.wait(guard);
+    EXPECT_TRUE(slow_received.empty());
+  }
+  // The slow sender is held back once its window is full.
+  while (slow_sent < kWindow) {
+    roo::this_thread::sleep_for(roo_time::Millis(1));
+  }
+  roo::this_thread::sleep_for(roo_time::Millis(20));
+  EXPECT_EQ(slow_sent, kWindow);
+  unblock.count_down();
+  slow_sender.join();
+  {
+    roo::unique_lock<roo::mutex> guard(mutex);
+    while (slow_received.size() < kMessageCount) cv.wait(guard);
+    for (int i = 0; i < kMessageCount; ++i) {
+      EXPECT_EQ(slow_received[i], "slow" + std::to_string(i));
+    }
+  }
+  server.end();
+  client.end();
+  async.end();
+  loopback.close();
+}
+
+TEST(MuxMessagingFlowControlTest, BulkTransfersBothWays) {
+  constexpr size_t kWindow = 2;
+  constexpr int kMessageCount = 20;
+  constexpr size_t kMessageSize = 5000;
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100);
+  LinkMessaging client(loopback.client(), 100);
+  MuxMessaging server_mux(server, kWindow);
+  MuxMessaging client_mux(client, kWindow);
+  StreamingReceiver server_receiver(kMessageSize);
+  StreamingReceiver client_receiver(kMessageSize);
+  MuxMessaging::Channel server_channel(server_mux, 1, server_receiver);
+  MuxMessaging::Channel client_channel(client_mux, 1, client_receiver);
+  server.begin();
+  client.begin();
+
+  // Each side keeps its link's send path busy with large messages, while its
+  // reader returns credits to the peer. The credits must not wait for the
+  // send path, which may in turn be waiting for the peer's reader.
+  roo::thread server_sender([&]() {
+    for (int i = 0; i < kMessageCount; ++i) {
+      PatternInputStream content(kMessageSize);
+      EXPECT_TRUE(server_channel.sendStream(content, kMessageSize));
+    }
+  });
+  for (int i = 0; i < kMessageCount; ++i) {
+    PatternInputStream content(kMessageSize);
+    EXPECT_TRUE(client_channel.sendStream(content, kMessageSize));
+  }
+  server_sender.join();
+  EXPECT_EQ(server_receiver.await(kMessageCount).size(), kMessageCount);
+  EXPECT_EQ(client_receiver.await(kMessageCount).size(), kMessageCount);
+  server.end();
+  client.end();
+  loopback.close();
+}
+
+// Collects the received messages as strings.
+class CollectingReceiver : public Messaging::Receiver {
+ public:
+  void received(Messaging::ConnectionId connection_id, const roo::byte* data,
+                size_t len) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.emplace_back((const char*)data, len);
+    cv_.notify_all();
+  }
+
+  std::vector<std::string> await(size_t count) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (messages_.size() < count) cv_.wait(guard);
+    return messages_;
+  }
+
+  size_t count() {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    return messages_.size();
+  }
+
+ private:
+  roo::mutex mutex_;
+  roo::condition_variable cv_;
+  std::vector<std::string> messages_;
+};
+
+TEST(MuxMessagingRegistrationTest, BacklogHeldUntilRegistered) {
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100);
+  LinkMessaging client(loopback.client(), 100);
+  MuxMessaging server_mux(server);
+  MuxMessaging client_mux(client);
+  server_mux.setBacklogCapacity(4);
+  CollectingReceiver control_receiver;
+  MuxMessaging::Channel server_control(server_mux, 1, control_receiver);
+  MuxMessaging::Channel client_control(client_mux, 1);
+  MuxMessaging::Channel client_late(client_mux, 9);
+  server.begin();
+  client.begin();
+  for (int i = 0; i < 6; ++i) {
+    std::string msg = "late" + std::to_string(i);
+    EXPECT_TRUE(client_late.send((const roo::byte*)msg.data(), msg.size()));
+  }
+  // Received in order; the preceding messages have been backlogged by now.
+  EXPECT_TRUE(client_control.send((const roo::byte*)"sync", 4));
+  control_receiver.await(1);
+  {
+    // The oldest messages didn't fit.
+    CollectingReceiver late_receiver;
+    MuxMessaging::Channel server_late(server_mux, 9, late_receiver);
+    EXPECT_EQ(late_receiver.count(), 4);
+    EXPECT_TRUE(client_late.send((const roo::byte*)"on time", 7));
+    EXPECT_EQ(late_receiver.await(5),
+              (std::vector<std::string>{"late2", "late3", "late4", "late5",
+                                        "on time"}));
+  }
+  server.end();
+  client.end();
+  loopback.close();
+}
+
+TEST(MuxMessagingRegistrationTest, ChannelsComeAndGoUnderLoad) {
+  constexpr int kMessageCount = 200;
+  LinkLoopback loopback;
+  LinkMessaging server(loopback.server(), 100);
+  LinkMessaging client(loopback.client(), 100);
+  MuxMessaging server_mux(server);
+  MuxMessaging client_mux(client);
+  CollectingReceiver steady_receiver;
+  MuxMessaging::Channel server_steady(server_mux, 1, steady_receiver);
+  MuxMessaging::Channel client_steady(client_mux, 1);
+  MuxMessaging::Channel client_transient(client_mux, 2);
+  server.begin();
+  client.begin();
+  roo::atomic<bool> done(false);
+  roo::thread transient_sender([&]() {
+    while (!done) {
+      EXPECT_TRUE(client_transient.send((const roo::byte*)"x", 1));
+    }
+  });
+  roo::thread steady_sender([&]() {
+    for (int i = 0; i < kMessageCount; ++i) {
+      std::string msg = std::to_string(i);
+      EXPECT_TRUE(
+          client_steady.send((const roo::byte*)msg.data(), msg.size()));
+    }
+  });
+  // Registers and unregisters the transient channel while its messages keep
+  // coming.
+  int transient_received = 0;
+  while (steady_receiver.count() < kMessageCount) {
+    CollectingReceiver transient_receiver;
+    MuxMessaging::Channel server_transient(server_mux, 2, transient_receiver);
+    roo::this_thread::sleep_for(roo_time::Millis(1));
+    transient_received += transient_receiver.count();
+  }
+  steady_sender.join();
+  done = true;
+  transient_sender.join();
+  std::vector<std::string> messages = steady_receiver.await(kMessageCount);
+  for (int i = 0; i < kMessageCount; ++i) {
+    EXPECT_EQ(messages[i], std::to_string(i));
+  }
+  EXPECT_GT(transient_received, 0);
+  server.end();
+  client.end();
+  loopback.close();
+}
+
+TEST(LinkDatagramMessagingTest, SendReceiveOneEach) {
+  LinkLoopback loopback;
+  LinkDatagramMessaging server(loopback.server());
+  LinkDatagramMessaging client(loopback.client());
+  // The session needs to be established first.
+  EXPECT_FALSE(client.send((const roo::byte*)"Too early", 10));
+  Link server_link = loopback.server().connectAsync();
+  Link client_link = loopback.client().connect();
+  server_link.awaitConnected();
+  {
+    MessagingTester tester(server, client);
+    server.begin();
+    client.begin();
+    Messaging::ConnectionId connection_id;
+    EXPECT_TRUE(client.send((const roo::byte*)"Hello, World!", 14,
+                            &connection_id));
+    EXPECT_EQ(connection_id, client_link.streamId());
+    EXPECT_TRUE(server.send((const roo::byte*)"Hello back!", 12));
+    EXPECT_TRUE(server.send(nullptr, 0));
+    EXPECT_TRUE(client.sendContinuation(connection_id, nullptr, 0));
+    // Stale connection.
+    EXPECT_FALSE(client.sendContinuation(connection_id + 1, nullptr, 0));
+    tester.join();
+    server.end();
+    client.end();
+    EXPECT_EQ(tester.serverReceived(), std::vector<Message>{"Hello, World!"});
+    EXPECT_EQ(tester.clientReceived(), std::vector<Message>{"Hello back!"});
+  }
+  loopback.close();
+}
+
 }  // namespace roo_transport
\ No newline at end of file
@@ -1,10 +1,28 @@
 #include "roo_transport/link/link_transport.h"
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "helpers/link_loopback.h"
 #include "helpers/rand.h"
+#include "roo_io/memory/load.h"
+#include "roo_io/memory/store.h"
+#include "roo_threads/atomic.h"
+#include "roo_threads/condition_variable.h"
+#include "roo_threads/latch.h"
 #include "roo_threads/mutex.h"
+#include "roo_transport/core/buffer_pool.h"
+#include "roo_transport/core/cancellation_token.h"
+#include "roo_transport/link/internal/transmitter.h"
+#include "roo_transport/link/link_selector.h"
 #include "roo_transport/link/link_transport.h"
+
+#ifdef __linux__
+#include <poll.h>
+#endif
+
 namespace roo_transport {
 
 class NullPacketSender : public PacketSender {
@@ -254,6 +272,1111 @@ TEST(LinkTransport, DisconnectFnCalledWhenDisconnectDetected) {
   server_thread.join();
 }
 
+TEST(LinkTransport, VectoredWrite) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  // Large enough to span multiple packets.
+  roo::byte large[600];
+  for (size_t i = 0; i < sizeof(large); ++i) {
+    large[i] = (roo::byte)(i % 251);
+  }
+  const IoVec segments[] = {
+      {(const roo::byte*)"Hello", 5},
+      {nullptr, 0},
+      {large, sizeof(large)},
+      {(const roo::byte*)"!", 1},
+  };
+  EXPECT_EQ(client.out().writev(segments, 4), sizeof(large) + 6);
+  EXPECT_EQ(client.out().status(), roo_io::kOk);
+  client.out().close();
+
+  roo::byte buf[700];
+  size_t n = server.in().readFully(buf, sizeof(buf));
+  ASSERT_EQ(n, sizeof(large) + 6);
+  EXPECT_EQ(memcmp(buf, "Hello", 5), 0);
+  EXPECT_EQ(memcmp(buf + 5, large, sizeof(large)), 0);
+  EXPECT_EQ(buf[n - 1], (roo::byte)'!');
+  EXPECT_EQ(server.in().status(), roo_io::kEndOfStream);
+  server.out().close();
+}
+
+TEST(LinkTransport, ReadWithDeadlineTimesOut) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  roo::byte buf[10];
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  EXPECT_EQ(server.in().read(buf, 10, start + roo_time::Millis(50)), 0);
+  EXPECT_GE(roo_time::Uptime::Now() - start, roo_time::Millis(50));
+  EXPECT_EQ(server.in().status(), roo_io::kOk);
+
+  // The stream remains usable.
+  client.out().writeFully((const roo::byte*)"Hi", 2);
+  client.out().flush();
+  EXPECT_EQ(server.in().readFully(buf, 2), 2);
+  EXPECT_EQ(memcmp(buf, "Hi", 2), 0);
+}
+
+TEST(LinkTransport, CancelWakesUpBlockedRead) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  CancellationToken cancel;
+  roo::thread canceller([&]() {
+    roo::this_thread::sleep_for(roo_time::Millis(20));
+    cancel.cancel();
+  });
+  roo::byte buf[10];
+  EXPECT_EQ(server.in().read(buf, 10, roo_time::Uptime::Max(), &cancel), 0);
+  EXPECT_EQ(server.in().status(), roo_io::kOk);
+  canceller.join();
+
+  // Cancelled token fails fast, until reset.
+  EXPECT_EQ(server.in().read(buf, 10, roo_time::Uptime::Max(), &cancel), 0);
+  cancel.reset();
+  client.out().writeFully((const roo::byte*)"Hi", 2);
+  client.out().flush();
+  EXPECT_EQ(server.in().read(buf, 10, roo_time::Uptime::Max(), &cancel), 2);
+}
+
+TEST(LinkTransport, WriteAndCloseWithDeadlineTimeOut) {
+  NullPacketSender sender;
+  LinkTransport transport(sender);
+  Link link = transport.connectAsync();
+
+  // The peer never responds, so the link never gets any send window.
+  roo::byte buf[256] = {};
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  EXPECT_EQ(link.out().write(buf, sizeof(buf), start + roo_time::Millis(20)),
+            0);
+  EXPECT_GE(roo_time::Uptime::Now() - start, roo_time::Millis(20));
+  EXPECT_EQ(link.out().status(), roo_io::kOk);
+
+  EXPECT_FALSE(link.out().closeWithTimeout(roo_time::Millis(10)));
+  EXPECT_EQ(link.out().status(), roo_io::kClosed);
+}
+
+TEST(LinkTransport, AsyncReadWrite) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  std::string sent;
+  for (int i = 0; i < 20000; ++i) sent.push_back('a' + i % 26);
+
+  // Server: chain of async reads, until the end of stream.
+  std::string received;
+  roo_io::Status final_status = roo_io::kOk;
+  roo::latch read_done(1);
+  roo::byte read_buf[100];
+  std::function<void()> read_next = [&]() {
+    ASSERT_TRUE(server.asyncRead(
+        read_buf, sizeof(read_buf), [&](size_t count, roo_io::Status status) {
+          if (status != roo_io::kOk) {
+            final_status = status;
+            read_done.count_down();
+            return;
+          }
+          received.append((const char*)read_buf, count);
+          read_next();
+        }));
+  };
+  read_next();
+
+  // Client: chain of async writes, until everything is written.
+  size_t total_written = 0;
+  roo::latch write_done(1);
+  std::function<void()> write_next = [&]() {
+    ASSERT_TRUE(client.asyncWrite(
+        (const roo::byte*)sent.data() + total_written,
+        sent.size() - total_written,
+        [&](size_t count, roo_io::Status status) {
+          ASSERT_EQ(status, roo_io::kOk);
+          total_written += count;
+          if (total_written == sent.size()) {
+            write_done.count_down();
+          } else {
+            write_next();
+          }
+        }));
+  };
+  write_next();
+  write_done.wait();
+  client.out().close();
+  EXPECT_EQ(client.out().status(), roo_io::kClosed);
+
+  read_done.wait();
+  EXPECT_EQ(final_status, roo_io::kEndOfStream);
+  EXPECT_EQ(received, sent);
+}
+
+TEST(LinkTransport, AsyncReadFailsOnDisconnect) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  roo::byte buf[10];
+  roo_io::Status status = roo_io::kOk;
+  roo::latch done(1);
+  EXPECT_TRUE(server.asyncRead(buf, sizeof(buf),
+                               [&](size_t count, roo_io::Status s) {
+                                 EXPECT_EQ(count, 0);
+                                 status = s;
+                                 done.count_down();
+                               }));
+  // Only one outstanding read is allowed.
+  EXPECT_FALSE(server.asyncRead(buf, sizeof(buf),
+                                [](size_t count, roo_io::Status s) {
+                                  FAIL() << "Unexpected callback";
+                                }));
+  server.disconnect();
+  done.wait();
+  EXPECT_EQ(status, roo_io::kConnectionError);
+}
+
+TEST(LinkTransport, SelectorReportsReadableLink) {
+  LinkLoopback loopback1;
+  LinkLoopback loopback2;
+
+  Link server1 = loopback1.server().connectAsync();
+  Link server2 = loopback2.server().connectAsync();
+  Link client1 = loopback1.client().connect();
+  Link client2 = loopback2.client().connect();
+  server1.awaitConnected();
+  server2.awaitConnected();
+
+  LinkSelector selector;
+  selector.add(server1, LinkSelector::kLinkReadable);
+  selector.add(server2, LinkSelector::kLinkReadable);
+  LinkSelector::ReadyLink ready[2];
+  EXPECT_EQ(selector.poll(ready, 2), 0);
+  EXPECT_EQ(
+      selector.waitUntil(ready, 2,
+                         roo_time::Uptime::Now() + roo_time::Millis(20)),
+      0);
+
+  roo::thread writer([&]() {
+    roo::this_thread::sleep_for(roo_time::Millis(20));
+    client2.out().writeFully((const roo::byte*)"Hi", 2);
+    client2.out().flush();
+  });
+  ASSERT_EQ(selector.wait(ready, 2), 1);
+  EXPECT_EQ(ready[0].link, &server2);
+  EXPECT_EQ(ready[0].events, LinkSelector::kLinkReadable);
+  writer.join();
+
+  roo::byte buf[2];
+  EXPECT_EQ(server2.in().readFully(buf, 2), 2);
+  EXPECT_EQ(selector.poll(ready, 2), 0);
+
+  // Interest sets can be updated.
+  selector.add(server1, LinkSelector::kLinkWritable |
+                            LinkSelector::kLinkConnected);
+  ASSERT_EQ(selector.poll(ready, 2), 1);
+  EXPECT_EQ(ready[0].link, &server1);
+  EXPECT_EQ(ready[0].events,
+            LinkSelector::kLinkWritable | LinkSelector::kLinkConnected);
+
+  selector.remove(server1);
+  selector.remove(server2);
+}
+
+TEST(LinkTransport, SelectorWakeup) {
+  LinkSelector selector;
+  LinkSelector::ReadyLink ready[1];
+  roo::thread waker([&]() {
+    roo::this_thread::sleep_for(roo_time::Millis(20));
+    selector.wakeup();
+  });
+  EXPECT_EQ(selector.wait(ready, 1), 0);
+  waker.join();
+}
+
+#ifdef __linux__
+TEST(LinkTransport, SelectorEventFd) {
+  LinkLoopback loopback;
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+
+  LinkSelector selector;
+  selector.add(server, LinkSelector::kLinkReadable);
+  int fd = selector.eventFd();
+  ASSERT_GE(fd, 0);
+  LinkSelector::ReadyLink ready[1];
+  EXPECT_EQ(selector.poll(ready, 1), 0);
+
+  client.out().writeFully((const roo::byte*)"Hi", 2);
+  client.out().flush();
+  struct pollfd pfd = {fd, POLLIN, 0};
+  ASSERT_EQ(::poll(&pfd, 1, 1000), 1);
+  // Spurious events are possible; the data arrives eventually.
+  while (selector.poll(ready, 1) == 0) {
+    ASSERT_EQ(::poll(&pfd, 1, 1000), 1);
+  }
+  EXPECT_EQ(ready[0].link, &server);
+  selector.remove(server);
+}
+#endif
+
+TEST(LinkTransport, PacingLimitsThroughput) {
+  LinkLoopback loopback;
+  // 100 KB/s.
+  loopback.client().setPacingRate(100000);
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  std::unique_ptr<roo::byte[]> data(new roo::byte[20000]);
+  for (size_t i = 0; i < 20000; ++i) data[i] = (roo::byte)(i % 251);
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  roo::thread writer([&]() {
+    client.out().writeFully(data.get(), 20000);
+    client.out().flush();
+  });
+  std::unique_ptr<roo::byte[]> received(new roo::byte[20000]);
+  ASSERT_EQ(server.in().readFully(received.get(), 20000), 20000);
+  roo_time::Duration elapsed = roo_time::Uptime::Now() - start;
+  writer.join();
+  EXPECT_EQ(memcmp(data.get(), received.get(), 20000), 0);
+  // Allow for the initial burst, and for the payload headers not being
+  // counted.
+  EXPECT_GE(elapsed, roo_time::Millis(180));
+}
+
+// Transfers data from the client to a server that drops data under burst
+// load, and returns the number of packets the client had to send.
+uint32_t PacketsSentToOverflowingPeer(bool congestion_control) {
+  // The server drains its 1 KB input FIFO at 500 KB/s.
+  LinkLoopback loopback(1024, 1024);
+  loopback.setServerInputOverflow(500000);
+  loopback.client().setCongestionControl(congestion_control);
+  LinkTransport::StatsMonitor stats(loopback.client());
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+
+  const size_t kSize = 100000;
+  std::unique_ptr<roo::byte[]> data(new roo::byte[kSize]);
+  for (size_t i = 0; i < kSize; ++i) data[i] = (roo::byte)(i % 251);
+  uint32_t packets_sent_before = stats.packets_sent();
+  roo::thread writer([&]() {
+    client.out().writeFully(data.get(), kSize);
+    client.out().close();
+  });
+  std::unique_ptr<roo::byte[]> received(new roo::byte[kSize]);
+  EXPECT_EQ(server.in().readFully(received.get(), kSize), kSize);
+  writer.join();
+  EXPECT_EQ(memcmp(data.get(), received.get(), kSize), 0);
+  return stats.packets_sent() - packets_sent_before;
+}
+
+TEST(LinkTransport, CongestionControlReducesRetransmissions) {
+  uint32_t sent_without_cc = PacketsSentToOverflowingPeer(false);
+  uint32_t sent_with_cc = PacketsSentToOverflowingPeer(true);
+  // The data itself takes about 400 packets.
+  EXPECT_LT(sent_with_cc, sent_without_cc)
+      << "Without congestion control: " << sent_without_cc
+      << ", with congestion control: " << sent_with_cc;
+}
+
+TEST(LinkTransport, ConnectsPromptlyWhenPeerComesBack) {
+  LinkLoopback loopback;
+  // The client has been trying to connect for a while, and has backed off.
+  Link client = loopback.client().connectAsync();
+  roo::this_thread::sleep_for(roo_time::Millis(1500));
+  EXPECT_EQ(client.status(), LinkStatus::kConnecting);
+
+  // The server (e.g. a hot-swapped module) comes up. The client responds to
+  // its handshake right away, rather than waiting for its next retry.
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  Link server = loopback.server().connect();
+  client.awaitConnected();
+  EXPECT_LT(roo_time::Uptime::Now() - start, roo_time::Millis(100));
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+  EXPECT_EQ(client.status(), LinkStatus::kConnected);
+}
+
+TEST(LinkTransport, HandshakeBackoffPolicy) {
+  LinkLoopback loopback;
+  LinkBackoffPolicy policy;
+  policy.max_delay = roo_time::Millis(20);
+  loopback.server().setHandshakeBackoff(policy);
+  loopback.client().setHandshakeBackoff(policy);
+  // Neither side can hear the other for a while.
+  loopback.setClientOutputErrorRate(10000);
+  loopback.setServerOutputErrorRate(10000);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connectAsync();
+  roo::this_thread::sleep_for(roo_time::Millis(1500));
+  EXPECT_EQ(client.status(), LinkStatus::kConnecting);
+
+  // With the default policy, it could take up to a second for the next
+  // handshake to go out.
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  loopback.setClientOutputErrorRate(0);
+  loopback.setServerOutputErrorRate(0);
+  client.awaitConnected();
+  server.awaitConnected();
+  EXPECT_LT(roo_time::Uptime::Now() - start, roo_time::Millis(100));
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+  EXPECT_EQ(client.status(), LinkStatus::kConnected);
+}
+
+TEST(LinkTransport, KeepAliveDetectsDeadPeer) {
+  LinkLoopback loopback;
+  roo::latch disconnected(1);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect(
+      [&disconnected]() { disconnected.count_down(); });
+  server.awaitConnected();
+  loopback.client().setKeepAlive(roo_time::Millis(20), 3);
+
+  // An idle link with a live peer stays connected.
+  roo::this_thread::sleep_for(roo_time::Millis(200));
+  EXPECT_EQ(client.status(), LinkStatus::kConnected);
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+
+  // The server goes silent; a blocked read gets woken up with an error.
+  loopback.setServerOutputErrorRate(10000);
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  roo::byte buf[10];
+  EXPECT_EQ(client.in().read(buf, sizeof(buf)), 0);
+  EXPECT_NE(client.in().status(), roo_io::kOk);
+  EXPECT_LT(roo_time::Uptime::Now() - start, roo_time::Millis(200));
+  EXPECT_EQ(client.status(), LinkStatus::kBroken);
+  // The callback gets called right after the waiters are woken up.
+  disconnected.wait();
+}
+
+// Records the packets sent by a transport, so that the test can play the part
+// of its peer.
+class RecordingPacketSender : public PacketSender {
+ public:
+  void send(const roo::byte* buf, size_t len) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    packets_.emplace_back(buf, buf + len);
+    cv_.notify_all();
+  }
+
+  // Waits for the first packet of the specified type, and returns it (or an
+  // empty vector on timeout).
+  std::vector<roo::byte> awaitPacket(internal::PacketType type) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    roo_time::Uptime deadline = roo_time::Uptime::Now() + roo_time::Millis(500);
+    while (true) {
+      for (const auto& packet : packets_) {
+        if (internal::GetPacketType(roo_io::LoadBeU16(packet.data())) == type) {
+          return packet;
+        }
+      }
+      if (cv_.wait_until(guard, deadline) == roo::cv_status::timeout) {
+        return {};
+      }
+    }
+  }
+
+  size_t count(internal::PacketType type) const {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    return std::count_if(packets_.begin(), packets_.end(),
+                         [type](const std::vector<roo::byte>& packet) {
+                           return internal::GetPacketType(roo_io::LoadBeU16(
+                                      packet.data())) == type;
+                         });
+  }
+
+ private:
+  mutable roo::mutex mutex_;
+  roo::condition_variable cv_;
+  std::vector<std::vector<roo::byte>> packets_;
+};
+
+// Connects the transport to an emulated peer, which goes silent right after
+// the handshake. The peer advertises keepalive support as specified.
+Link ConnectToSilentPeer(LinkTransport& transport,
+                         RecordingPacketSender& sender, bool peer_keepalive) {
+  Link link = transport.connectAsync();
+  std::vector<roo::byte> handshake =
+      sender.awaitPacket(internal::kHandshakePacket);
+  EXPECT_EQ(handshake.size(), 11);
+  if (handshake.size() != 11) return link;
+  // We advertise keepalive support ourselves.
+  EXPECT_TRUE(internal::GetPacketControlBit(roo_io::LoadBeU16(&handshake[0])));
+  roo::byte reply[11];
+  roo_io::StoreBeU16(
+      internal::FormatPacketHeader(internal::SeqNum(0),
+                                   internal::kHandshakePacket, peer_keepalive),
+      reply);
+  roo_io::StoreBeU32(0x12345678, reply + 2);
+  // Acknowledging the transport's stream ID.
+  memcpy(reply + 6, &handshake[2], 4);
+  // Receive buffer of 16 packets; no ack requested.
+  roo_io::StoreU8(4, reply + 10);
+  transport.processIncomingPacket(reply, sizeof(reply));
+  link.awaitConnected();
+  EXPECT_EQ(link.status(), LinkStatus::kConnected);
+  return link;
+}
+
+TEST(LinkTransport, KeepAliveSparesPeersWithoutSupport) {
+  RecordingPacketSender sender;
+  LinkTransport transport(sender);
+  transport.begin();
+  transport.setKeepAlive(roo_time::Millis(20), 3);
+  // An older peer ignores pings, so it would look dead whenever idle.
+  Link link = ConnectToSilentPeer(transport, sender, false);
+  roo::this_thread::sleep_for(roo_time::Millis(200));
+  EXPECT_EQ(link.status(), LinkStatus::kConnected);
+  EXPECT_EQ(sender.count(internal::kKeepAlivePacket), 0);
+}
+
+TEST(LinkTransport, KeepAlivePingsPeersWithSupport) {
+  RecordingPacketSender sender;
+  LinkTransport transport(sender);
+  transport.begin();
+  transport.setKeepAlive(roo_time::Millis(20), 3);
+  Link link = ConnectToSilentPeer(transport, sender, true);
+  roo::this_thread::sleep_for(roo_time::Millis(200));
+  EXPECT_EQ(link.status(), LinkStatus::kBroken);
+  EXPECT_GT(sender.count(internal::kKeepAlivePacket), 0);
+}
+
+TEST(LinkTransport, ResumeAfterOutage) {
+  LinkLoopback loopback;
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+  EXPECT_FALSE(Link().resume());
+
+  // Everything the client sends gets lost for a while, so that its
+  // retransmission timeouts back off.
+  loopback.setClientOutputErrorRate(10000);
+  roo::byte data[100];
+  for (size_t i = 0; i < sizeof(data); ++i) data[i] = (roo::byte)i;
+  EXPECT_EQ(client.out().writeFully(data, sizeof(data)), sizeof(data));
+  client.out().flush();
+  roo::this_thread::sleep_for(roo_time::Millis(1000));
+  loopback.setClientOutputErrorRate(0);
+
+  roo_time::Uptime start = roo_time::Uptime::Now();
+  EXPECT_TRUE(client.resume());
+  roo::byte received[100];
+  EXPECT_EQ(server.in().readFully(received, sizeof(received)),
+            sizeof(received));
+  EXPECT_LT(roo_time::Uptime::Now() - start, roo_time::Millis(50));
+  EXPECT_EQ(memcmp(data, received, sizeof(data)), 0);
+  EXPECT_EQ(client.status(), LinkStatus::kConnected);
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+
+  // The link remains fully functional, in both directions.
+  EXPECT_EQ(server.out().writeFully(data, sizeof(data)), sizeof(data));
+  server.out().flush();
+  EXPECT_EQ(client.in().readFully(received, sizeof(received)),
+            sizeof(received));
+  EXPECT_EQ(memcmp(data, received, sizeof(data)), 0);
+}
+
+TEST(LinkTransport, IdleLinkReleasesBufferMemory) {
+  BufferPool& pool = PacketBufferPool();
+  size_t blocks_in_use = pool.blocks_in_use();
+  LinkLoopback loopback;
+  // Each transport reserves a block per direction.
+  blocks_in_use += 4;
+  EXPECT_EQ(pool.blocks_in_use(), blocks_in_use);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  // No memory is committed for the buffers until data flows.
+  EXPECT_EQ(pool.blocks_in_use(), blocks_in_use);
+
+  roo::byte data[2000];
+  for (size_t i = 0; i < sizeof(data); ++i) data[i] = (roo::byte)i;
+  roo::byte received[sizeof(data)];
+  EXPECT_EQ(client.out().writeFully(data, sizeof(data)), sizeof(data));
+  client.out().flush();
+  EXPECT_EQ(server.in().readFully(received, sizeof(received)),
+            sizeof(received));
+  EXPECT_GT(pool.blocks_in_use(), blocks_in_use);
+
+  // Once the link goes idle, the memory gets released.
+  roo::this_thread::sleep_for(roo_time::Millis(2500));
+  EXPECT_EQ(pool.blocks_in_use(), blocks_in_use);
+
+  // The link remains fully functional.
+  EXPECT_EQ(client.out().writeFully(data, sizeof(data)), sizeof(data));
+  client.out().flush();
+  EXPECT_EQ(server.in().readFully(received, sizeof(received)),
+            sizeof(received));
+  EXPECT_EQ(memcmp(data, received, sizeof(data)), 0);
+}
+
+// A write that follows an acked partial packet must not go to that packet's
+// buffer, which may have been released in the meantime. (Built with ASan and
+// ROO_TRANSPORT_PACKET_BUFFER_POOL_MAX_RETAINED_BLOCKS=0, any such access
+// gets reported directly.)
+TEST(LinkTransport, WriteAfterIdleReleaseUsesFreshBuffer) {
+  // Both set up front, so that nothing else takes the released blocks.
+  LinkLoopback loopback_a;
+  LinkLoopback loopback_b;
+  Link server_a = loopback_a.server().connectAsync();
+  Link client_a = loopback_a.client().connect();
+  Link server_b = loopback_b.server().connectAsync();
+  Link client_b = loopback_b.client().connect();
+  server_a.awaitConnected();
+  server_b.awaitConnected();
+
+  // The partial packet gets sent and acked, and then, once the link goes
+  // idle, its memory gets released.
+  roo::byte buf[10];
+  EXPECT_EQ(client_a.out().writeFully((const roo::byte*)"AAA", 3), 3);
+  client_a.out().flush();
+  EXPECT_EQ(server_a.in().readFully(buf, 3), 3);
+  roo::this_thread::sleep_for(roo_time::Millis(2500));
+
+  // Reuse the released blocks (of both directions), holding the packets
+  // open.
+  EXPECT_EQ(client_b.out().writeFully((const roo::byte*)"BBB", 3), 3);
+  client_b.out().flushWithin(roo_time::Seconds(10));
+  EXPECT_EQ(server_b.out().writeFully((const roo::byte*)"CCC", 3), 3);
+  server_b.out().flushWithin(roo_time::Seconds(10));
+
+  // Must not write to the released block.
+  EXPECT_EQ(client_a.out().writeFully((const roo::byte*)"aaa", 3), 3);
+  client_a.out().flush();
+  EXPECT_EQ(server_a.in().read(buf, 3,
+                               roo_time::Uptime::Now() + roo_time::Seconds(2)),
+            3);
+  EXPECT_EQ(memcmp(buf, "aaa", 3), 0);
+
+  client_b.out().flush();
+  server_b.out().flush();
+  EXPECT_EQ(server_b.in().readFully(buf, 3), 3);
+  EXPECT_EQ(memcmp(buf, "BBB", 3), 0);
+  EXPECT_EQ(client_b.in().readFully(buf, 3), 3);
+  EXPECT_EQ(memcmp(buf, "CCC", 3), 0);
+  EXPECT_EQ(server_b.in().read(buf, sizeof(buf),
+                               roo_time::Uptime::Now() + roo_time::Millis(100)),
+            0);
+  EXPECT_EQ(client_b.in().read(buf, sizeof(buf),
+                               roo_time::Uptime::Now() + roo_time::Millis(100)),
+            0);
+}
+
+TEST(BufferPool, AllocatesUpToCapacity) {
+  BufferPool pool(64, 3, 1);
+  void* a = pool.allocate();
+  void* b = pool.allocate();
+  void* c = pool.allocate();
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  ASSERT_NE(c, nullptr);
+  EXPECT_EQ(pool.allocate(), nullptr);
+  EXPECT_EQ(pool.blocks_in_use(), 3u);
+  pool.release(a);
+  pool.release(b);
+  EXPECT_EQ(pool.blocks_in_use(), 1u);
+  EXPECT_EQ(pool.blocks_retained(), 1u);
+  EXPECT_EQ(pool.high_water_mark(), 3u);
+  a = pool.allocate();
+  ASSERT_NE(a, nullptr);
+  EXPECT_EQ(pool.blocks_retained(), 0u);
+  pool.release(a);
+  pool.release(c);
+  pool.trim();
+  EXPECT_EQ(pool.blocks_in_use(), 0u);
+  EXPECT_EQ(pool.blocks_retained(), 0u);
+}
+
+TEST(BufferPool, QuotaLimitsAllocations) {
+  BufferPool pool(64, 8, 8);
+  BufferPool::Quota quota(pool, 2);
+  void* a = quota.allocate();
+  void* b = quota.allocate();
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  EXPECT_EQ(quota.allocate(), nullptr);
+  void* c = quota.allocate(/*ignore_limit=*/true);
+  ASSERT_NE(c, nullptr);
+  EXPECT_EQ(quota.blocks_in_use(), 3u);
+  EXPECT_EQ(pool.blocks_in_use(), 3u);
+  quota.release(c);
+  quota.release(b);
+  EXPECT_EQ(quota.blocks_in_use(), 1u);
+  EXPECT_EQ(quota.high_water_mark(), 3u);
+  quota.setLimit(3);
+  b = quota.allocate();
+  c = quota.allocate();
+  ASSERT_NE(b, nullptr);
+  ASSERT_NE(c, nullptr);
+  EXPECT_EQ(quota.allocate(), nullptr);
+  quota.release(a);
+  quota.release(b);
+  quota.release(c);
+  EXPECT_EQ(pool.blocks_in_use(), 0u);
+}
+
+TEST(BufferPool, ConcurrentAllocations) {
+  BufferPool pool(16, 64, 16);
+  std::vector<roo::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&pool, t]() {
+      std::vector<uint32_t*> blocks;
+      for (int i = 0; i < 10000; ++i) {
+        if (blocks.size() < 16 && (i % 3) != 2) {
+          uint32_t* block = static_cast<uint32_t*>(pool.allocate());
+          ASSERT_NE(block, nullptr);
+          *block = t * 100000 + i;
+          blocks.push_back(block);
+        } else if (!blocks.empty()) {
+          uint32_t* block = blocks.back();
+          blocks.pop_back();
+          // Not clobbered by any other thread.
+          EXPECT_EQ(*block / 100000, (uint32_t)t);
+          pool.release(block);
+        }
+      }
+      for (uint32_t* block : blocks) pool.release(block);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(pool.blocks_in_use(), 0u);
+  EXPECT_LE(pool.high_water_mark(), 64u);
+}
+
+TEST(LinkTransport, BufferQuotaLimitsMemory) {
+  LinkLoopback loopback;
+  LinkTransport::StatsMonitor client_stats(loopback.client());
+  LinkTransport::StatsMonitor server_stats(loopback.server());
+  loopback.client().setBufferQuota(4);
+  loopback.server().setBufferQuota(4);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+
+  std::vector<roo::byte> data(64 * 248);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = (roo::byte)(i * 3);
+  std::vector<roo::byte> received(data.size());
+  roo::thread reader([&]() {
+    EXPECT_EQ(server.in().readFully(&received[0], received.size()),
+              received.size());
+  });
+  EXPECT_EQ(client.out().writeFully(&data[0], data.size()), data.size());
+  client.out().flush();
+  reader.join();
+  EXPECT_EQ(data, received);
+
+  // The windows are 16 packets, but no more than 4 buffers have been used.
+  EXPECT_GT(client_stats.buffers_high_water_mark(), 0u);
+  EXPECT_LE(client_stats.buffers_high_water_mark(), 4u);
+  EXPECT_GT(server_stats.buffers_high_water_mark(), 0u);
+  EXPECT_LE(server_stats.buffers_high_water_mark(), 4u);
+}
+
+TEST(LinkTransport, ResizeBuffersOnLiveLink) {
+  LinkLoopback loopback;
+  LinkTransport::StatsMonitor client_stats(loopback.client());
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  EXPECT_EQ(client.out().availableForWrite(), size_t{16});
+
+  // Grow both windows (e.g. for a bulk transfer). The server does not read
+  // yet, so all the data needs to fit in its enlarged receive buffer.
+  loopback.server().setReceiveBufferSize(kBufferSize16KB);
+  loopback.client().setSendBufferSize(kBufferSize16KB);
+  EXPECT_EQ(client.out().availableForWrite(), size_t{64});
+  std::vector<roo::byte> data(64 * 248);
+  for (size_t i = 0; i < data.size(); ++i) data[i] = (roo::byte)(i * 7);
+  EXPECT_EQ(client.out().writeFully(&data[0], data.size()), data.size());
+  client.out().flush();
+  roo_time::Uptime deadline = roo_time::Uptime::Now() + roo_time::Seconds(1);
+  while (client_stats.packets_delivered() < 64 &&
+         roo_time::Uptime::Now() < deadline) {
+    roo::this_thread::sleep_for(roo_time::Millis(1));
+  }
+  EXPECT_EQ(client_stats.packets_delivered(), 64u);
+
+  // Shrink them back, while the server's buffer is still full.
+  loopback.server().setReceiveBufferSize(kBufferSize1KB);
+  loopback.client().setSendBufferSize(kBufferSize1KB);
+  EXPECT_EQ(client.out().availableForWrite(), size_t{4});
+  std::vector<roo::byte> received(data.size());
+  EXPECT_EQ(server.in().readFully(&received[0], received.size()),
+            received.size());
+  EXPECT_EQ(data, received);
+
+  // The link remains fully functional.
+  roo::thread writer([&]() {
+    EXPECT_EQ(client.out().writeFully(&data[0], data.size()), data.size());
+    client.out().flush();
+  });
+  EXPECT_EQ(server.in().readFully(&received[0], received.size()),
+            received.size());
+  writer.join();
+  EXPECT_EQ(data, received);
+  EXPECT_EQ(client.status(), LinkStatus::kConnected);
+  EXPECT_EQ(server.status(), LinkStatus::kConnected);
+}
+
+namespace {
+
+void WriteFullPacket(internal::Transmitter& transmitter) {
+  roo::byte data[248] = {};
+  bool ready;
+  EXPECT_EQ(transmitter.tryWrite(data, sizeof(data), ready), sizeof(data));
+}
+
+// Returns the sequence number of the next packet to be sent, or -1 if there
+// is no packet to send at this time.
+int SendNext(internal::Transmitter& transmitter) {
+  long next_send_micros = 0;
+  const internal::OutBuffer* buf =
+      transmitter.getBufferToSend(next_send_micros);
+  if (buf == nullptr) return -1;
+  return roo_io::LoadBeU16(buf->data()) & 0x0FFF;
+}
+
+}  // namespace
+
+TEST(LinkTransport, LostRetransmissionIsFastRetransmitted) {
+  internal::Transmitter transmitter(4);
+  transmitter.init(1, internal::SeqNum(0));
+  transmitter.setConnected(16, false, false, false);
+  transmitter.setCongestionControl(false);
+  for (int i = 0; i < 5; ++i) WriteFullPacket(transmitter);
+  for (int i = 0; i < 4; ++i) EXPECT_EQ(SendNext(transmitter), i);
+
+  // Packet 1 got through, but packet 0 did not.
+  roo::byte bitmap[] = {roo::byte{0x80}};
+  EXPECT_TRUE(transmitter.ack(true, 0, bitmap, 1));
+  EXPECT_EQ(SendNext(transmitter), 0);
+  EXPECT_EQ(SendNext(transmitter), 4);
+
+  // Packets 2 and 3, sent before the retransmission of packet 0, are
+  // reported; it does not mean that the retransmission is lost.
+  bitmap[0] = roo::byte{0xE0};
+  EXPECT_FALSE(transmitter.ack(true, 0, bitmap, 1));
+  EXPECT_EQ(SendNext(transmitter), -1);
+
+  // Packet 4, sent after the retransmission of packet 0, is reported; the
+  // retransmission is lost, too.
+  bitmap[0] = roo::byte{0xF0};
+  EXPECT_TRUE(transmitter.ack(true, 0, bitmap, 1));
+  EXPECT_EQ(SendNext(transmitter), 0);
+
+  EXPECT_FALSE(transmitter.ack(true, 5, nullptr, 0));
+  EXPECT_FALSE(transmitter.hasPendingData());
+}
+
+// Measures round-trip times of small request/response exchanges, over a link
+// that corrupts (and thus, drops) some packets in both directions. Returns the
+// 99th percentile, in milliseconds.
+float SmallRpcP99Millis(int error_rate) {
+  LinkLoopback loopback;
+  loopback.setClientOutputErrorRate(error_rate);
+  loopback.setServerOutputErrorRate(error_rate);
+  constexpr int kNumSamples = 500;
+  constexpr size_t kMessageSize = 16;
+  roo::thread server_thread([&]() {
+    Link server = loopback.server().connect();
+    roo::byte buf[kMessageSize];
+    for (int i = 0; i < kNumSamples; ++i) {
+      ASSERT_EQ(server.in().readFully(buf, kMessageSize), kMessageSize);
+      server.out().writeFully(buf, kMessageSize);
+      server.out().flush();
+    }
+  });
+  Link client = loopback.client().connect();
+  std::vector<float> rtt;
+  roo::byte buf[kMessageSize] = {};
+  for (int i = 0; i < kNumSamples; ++i) {
+    roo_time::Uptime start = roo_time::Uptime::Now();
+    client.out().writeFully(buf, kMessageSize);
+    client.out().flush();
+    EXPECT_EQ(client.in().readFully(buf, kMessageSize), kMessageSize);
+    rtt.push_back((roo_time::Uptime::Now() - start).inMillisFloat());
+  }
+  server_thread.join();
+  std::sort(rtt.begin(), rtt.end());
+  return rtt[kNumSamples * 99 / 100];
+}
+
+TEST(LinkTransport, SmallRpcTailLatencyUnderLoss) {
+  // Drops about 10% of small packets. Without tail loss probes, lost packets
+  // would only get recovered by retransmission timeouts, and p99 would exceed
+  // 20 ms.
+  float p99 = SmallRpcP99Millis(30);
+  EXPECT_LT(p99, 10.0f);
+}
+
+// Reads a message written via LinkOutputStream::writeMessage().
+std::string ReadMessage(LinkInputStream& in, bool compact_framing = false) {
+  uint32_t size = 0;
+  if (compact_framing) {
+    for (int shift = 0;; shift += 7) {
+      roo::byte b;
+      if (in.readFully(&b, 1) != 1) return "";
+      size |= (uint32_t)(b & roo::byte{0x7F}) << shift;
+      if ((b & roo::byte{0x80}) == roo::byte{0}) break;
+    }
+  } else {
+    roo::byte prefix[4];
+    if (in.readFully(prefix, 4) != 4) return "";
+    size = roo_io::LoadBeU32(prefix);
+  }
+  std::string result(size, ' ');
+  size_t read = in.readFully((roo::byte*)&result[0], result.size());
+  result.resize(read);
+  return result;
+}
+
+bool WriteMessage(LinkOutputStream& out, const std::string& msg) {
+  IoVec segment = {(const roo::byte*)msg.data(), msg.size()};
+  return out.writeMessage(&segment, 1);
+}
+
+TEST(LinkTransport, UnorderedDeliveryBypassesLostMessage) {
+  LinkLoopback loopback;
+  loopback.server().setUnorderedDelivery(true);
+  // Otherwise, after the retransmission timeouts, the congestion window would
+  // not let the client send anything past the lost packet.
+  loopback.client().setCongestionControl(false);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  // The first message gets lost, and so do the acks, so that the client
+  // backs off, and doesn't retransmit it for a while.
+  loopback.setClientOutputErrorRate(10000);
+  loopback.setServerOutputErrorRate(10000);
+  EXPECT_TRUE(WriteMessage(client.out(), "first"));
+  client.out().flush();
+  roo::this_thread::sleep_for(roo_time::Millis(300));
+
+  // The subsequent messages get through, and can be read right away. (The
+  // framer may still drop the first packet after the noise stops, so we send
+  // two.)
+  loopback.setClientOutputErrorRate(0);
+  EXPECT_TRUE(WriteMessage(client.out(), "second"));
+  client.out().flush();
+  EXPECT_TRUE(WriteMessage(client.out(), "third"));
+  client.out().flush();
+  std::vector<std::string> received;
+  received.push_back(ReadMessage(server.in()));
+  EXPECT_NE(received.back(), "first");
+
+  // The first one gets delivered eventually.
+  loopback.setServerOutputErrorRate(0);
+  received.push_back(ReadMessage(server.in()));
+  received.push_back(ReadMessage(server.in()));
+  std::sort(received.begin(), received.end());
+  EXPECT_EQ(received, (std::vector<std::string>{"first", "second", "third"}));
+
+  // The link remains fully functional.
+  EXPECT_TRUE(WriteMessage(client.out(), "fourth"));
+  client.out().flush();
+  EXPECT_EQ(ReadMessage(server.in()), "fourth");
+}
+
+void TestUnorderedDeliveryUnderLoss(bool compact_framing) {
+  LinkLoopback loopback;
+  loopback.server().setUnorderedDelivery(true);
+  loopback.server().setCompactFraming(compact_framing);
+  loopback.client().setCompactFraming(compact_framing);
+  loopback.setClientOutputErrorRate(30);
+  loopback.setServerOutputErrorRate(30);
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  constexpr int kNumMessages = 500;
+  roo::thread writer([&]() {
+    for (int i = 0; i < kNumMessages; ++i) {
+      // Sizes vary, so that some messages span multiple packets.
+      std::string msg = std::to_string(i) + std::string(i % 600, '.');
+      EXPECT_TRUE(WriteMessage(client.out(), msg));
+    }
+    client.out().close();
+  });
+  std::vector<bool> received(kNumMessages, false);
+  for (int i = 0; i < kNumMessages; ++i) {
+    std::string msg = ReadMessage(server.in(), compact_framing);
+    int idx = atoi(msg.c_str());
+    ASSERT_LT(idx, kNumMessages);
+    EXPECT_FALSE(received[idx]) << idx;
+    EXPECT_EQ(msg, std::to_string(idx) + std::string(idx % 600, '.'));
+    received[idx] = true;
+  }
+  writer.join();
+  // Nothing but the end of stream remains.
+  roo::byte buf[1];
+  EXPECT_EQ(server.in().read(buf, 1), 0);
+  EXPECT_EQ(server.in().status(), roo_io::kEndOfStream);
+}
+
+TEST(LinkTransport, UnorderedDeliveryUnderLoss) {
+  TestUnorderedDeliveryUnderLoss(false);
+}
+
+TEST(LinkTransport, UnorderedDeliveryUnderLossWithCompactFraming) {
+  TestUnorderedDeliveryUnderLoss(true);
+}
+
+TEST(LinkTransport, CompactFramingNegotiation) {
+  for (bool client_compact : {false, true}) {
+    LinkLoopback loopback;
+    loopback.server().setCompactFraming(true);
+    loopback.client().setCompactFraming(client_compact);
+    Link server = loopback.server().connectAsync();
+    Link client = loopback.client().connect();
+    server.awaitConnected();
+    ASSERT_EQ(server.status(), LinkStatus::kConnected);
+    // Used only if both sides support it.
+    EXPECT_EQ(server.compactFraming(), client_compact);
+    EXPECT_EQ(client.compactFraming(), client_compact);
+
+    EXPECT_TRUE(WriteMessage(client.out(), "hello"));
+    std::string large(300, 'x');
+    EXPECT_TRUE(WriteMessage(server.out(), large));
+    client.out().flush();
+    server.out().flush();
+    if (client_compact) {
+      // One-byte prefix.
+      roo::byte prefix;
+      ASSERT_EQ(server.in().readFully(&prefix, 1), 1);
+      EXPECT_EQ(prefix, roo::byte{5});
+      std::string content(5, ' ');
+      server.in().readFully((roo::byte*)&content[0], 5);
+      EXPECT_EQ(content, "hello");
+    } else {
+      EXPECT_EQ(ReadMessage(server.in()), "hello");
+    }
+    EXPECT_EQ(ReadMessage(client.in(), client_compact), large);
+  }
+}
+
+TEST(LinkTransport, DatagramsCoexistWithReliableData) {
+  LinkLoopback loopback;
+  roo::mutex mutex;
+  roo::condition_variable cv;
+  std::vector<int> datagrams;
+  loopback.server().setDatagramReceiver(
+      [&](uint32_t stream_id, const roo::byte* data, size_t len) {
+        roo::lock_guard<roo::mutex> guard(mutex);
+        ASSERT_EQ(len, 1);
+        datagrams.push_back((int)data[0]);
+        cv.notify_all();
+      });
+  roo::byte sample[] = {roo::byte{0}};
+  IoVec segment = {sample, 1};
+  // No session yet.
+  EXPECT_EQ(loopback.client().sendDatagram(&segment, 1, roo_time::Millis(100)),
+            0);
+
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  const size_t kSize = 20000;
+  std::unique_ptr<roo::byte[]> data(new roo::byte[kSize]);
+  for (size_t i = 0; i < kSize; ++i) data[i] = (roo::byte)(i % 251);
+  roo::thread writer([&]() {
+    client.out().writeFully(data.get(), kSize);
+    client.out().close();
+  });
+  constexpr int kNumDatagrams = 50;
+  for (int i = 0; i < kNumDatagrams; ++i) {
+    sample[0] = (roo::byte)i;
+    EXPECT_EQ(
+        loopback.client().sendDatagram(&segment, 1, roo_time::Millis(100)),
+        client.streamId());
+    roo::this_thread::sleep_for(roo_time::Millis(1));
+  }
+  std::unique_ptr<roo::byte[]> received(new roo::byte[kSize]);
+  EXPECT_EQ(server.in().readFully(received.get(), kSize), kSize);
+  writer.join();
+  EXPECT_EQ(memcmp(data.get(), received.get(), kSize), 0);
+
+  roo::unique_lock<roo::mutex> guard(mutex);
+  roo_time::Uptime deadline = roo_time::Uptime::Now() + roo_time::Millis(500);
+  while (datagrams.size() < kNumDatagrams &&
+         cv.wait_until(guard, deadline) != roo::cv_status::timeout) {
+  }
+  ASSERT_EQ(datagrams.size(), kNumDatagrams);
+  // The loopback doesn't reorder packets.
+  for (int i = 0; i < kNumDatagrams; ++i) EXPECT_EQ(datagrams[i], i);
+  guard.unlock();
+
+  // The receiver refers to the local variables.
+  loopback.server().setDatagramReceiver(nullptr);
+}
+
+TEST(LinkTransport, ExpiredDatagramsGetDropped) {
+  LinkLoopback loopback;
+  roo::atomic<int> received(0);
+  loopback.server().setDatagramReceiver(
+      [&](uint32_t stream_id, const roo::byte* data, size_t len) {
+        ++received;
+      });
+  LinkTransport::StatsMonitor stats(loopback.client());
+  Link server = loopback.server().connectAsync();
+  Link client = loopback.client().connect();
+  server.awaitConnected();
+  ASSERT_EQ(server.status(), LinkStatus::kConnected);
+
+  // At this rate, it takes 50 ms to send each datagram.
+  loopback.client().setPacingRate(4000, 250);
+  roo::byte sample[200] = {};
+  IoVec segment = {sample, sizeof(sample)};
+  roo::byte too_large[LinkTransport::kMaxDatagramSize + 1] = {};
+  IoVec too_large_segment = {too_large, sizeof(too_large)};
+  EXPECT_EQ(loopback.client().sendDatagram(&too_large_segment, 1,
+                                           roo_time::Millis(100)),
+            0);
+  constexpr int kNumDatagrams = 20;
+  for (int i = 0; i < kNumDatagrams; ++i) {
+    EXPECT_NE(
+        loopback.client().sendDatagram(&segment, 1, roo_time::Millis(20)), 0);
+  }
+  roo_time::Uptime deadline = roo_time::Uptime::Now() + roo_time::Millis(1000);
+  while (received + (int)stats.datagrams_dropped() < kNumDatagrams &&
+         roo_time::Uptime::Now() < deadline) {
+    roo::this_thread::sleep_for(roo_time::Millis(10));
+  }
+  EXPECT_EQ(received + (int)stats.datagrams_dropped(), kNumDatagrams);
+  // The first one or two get sent within the burst; the queue holds only a
+  // few more, and they expire long before the pacer lets them through.
+  EXPECT_LE(received, 3);
+
+  // The receiver refers to the local variables.
+  loopback.server().setDatagramReceiver(nullptr);
+}
+
 class TransferTest : public ::testing::TestWithParam<int> {
  protected:
   TransferTest() : loopback_() {}
@@ -0,0 +1,220 @@
+#include "roo_transport/messaging/local_messaging.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "roo_transport/messaging/mux_messaging.h"
+
+namespace roo_transport {
+
+// Collects the received messages, including the streamed ones, as strings.
+// Streams that fail midway are skipped.
+class TestReceiver : public Messaging::Receiver {
+ public:
+  void received(Messaging::ConnectionId connection_id, const roo::byte* data,
+                size_t len) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.emplace_back((const char*)data, len);
+    cv_.notify_all();
+  }
+
+  bool receivedStream(Messaging::ConnectionId connection_id,
+                      roo_io::InputStream& content, size_t size) override {
+    if (!accept_streams_) return false;
+    std::string data;
+    roo::byte buf[100];
+    while (true) {
+      size_t read = content.read(buf, sizeof(buf));
+      if (read == 0) break;
+      data.append((const char*)buf, read);
+    }
+    if (content.status() != roo_io::kEndOfStream) return true;
+    EXPECT_EQ(data.size(), size);
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    messages_.push_back(data);
+    cv_.notify_all();
+    return true;
+  }
+
+  void reset(Messaging::ConnectionId connection_id) override {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    resets_.push_back(connection_id);
+    cv_.notify_all();
+  }
+
+  std::vector<std::string> await(size_t count) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (messages_.size() < count) cv_.wait(guard);
+    return messages_;
+  }
+
+  size_t count() {
+    roo::lock_guard<roo::mutex> guard(mutex_);
+    return messages_.size();
+  }
+
+  std::vector<Messaging::ConnectionId> awaitResets(size_t count) {
+    roo::unique_lock<roo::mutex> guard(mutex_);
+    while (resets_.size() < count) cv_.wait(guard);
+    return resets_;
+  }
+
+  void set_accept_streams(bool accept) { accept_streams_ = accept; }
+
+ private:
+  roo::mutex mutex_;
+  roo::condition_variable cv_;
+  std::vector<std::string> messages_;
+  std::vector<Messaging::ConnectionId> resets_;
+  bool accept_streams_ = true;
+};
+
+// Reads from a string.
+class StringInputStream : public roo_io::InputStream {
+ public:
+  explicit StringInputStream(std::string data) : data_(data), pos_(0) {}
+
+  size_t read(roo::byte* buf, size_t count) override {
+    if (count > data_.size() - pos_) count = data_.size() - pos_;
+    memcpy(buf, data_.data() + pos_, count);
+    pos_ += count;
+    return count;
+  }
+
+  roo_io::Status status() const override {
+    return pos_ == data_.size() ? roo_io::kEndOfStream : roo_io::kOk;
+  }
+
+ private:
+  std::string data_;
+  size_t pos_;
+};
+
+TEST(LocalMessagingTest, SendReceiveInOrder) {
+  LocalMessaging local(64, 2);
+  TestReceiver server_receiver;
+  TestReceiver client_receiver;
+  local.server().setReceiver(server_receiver);
+  local.client().setReceiver(client_receiver);
+  local.begin();
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; ++i) {
+    std::string msg = "msg" + std::to_string(i);
+    EXPECT_TRUE(local.client().send((const roo::byte*)msg.data(), msg.size()));
+    expected.push_back(msg);
+  }
+  const IoVec segments[] = {
+      {(const roo::byte*)"Hello, ", 7},
+      {nullptr, 0},
+      {(const roo::byte*)"World", 5},
+  };
+  EXPECT_TRUE(local.server().sendv(segments, 3, nullptr));
+  EXPECT_EQ(server_receiver.await(100), expected);
+  EXPECT_EQ(client_receiver.await(1),
+            std::vector<std::string>{"Hello, World"});
+  local.end();
+}
+
+TEST(LocalMessagingTest, DeliversSynchronouslyBeforeBegin) {
+  LocalMessaging local;
+  TestReceiver server_receiver;
+  local.server().setReceiver(server_receiver);
+  EXPECT_TRUE(local.client().send((const roo::byte*)"sync", 4));
+  // Already there, without waiting.
+  EXPECT_EQ(server_receiver.count(), 1);
+  EXPECT_EQ(server_receiver.await(1), std::vector<std::string>{"sync"});
+}
+
+TEST(LocalMessagingTest, ContinuationsEndWithReset) {
+  LocalMessaging local;
+  TestReceiver server_receiver;
+  TestReceiver client_receiver;
+  local.server().setReceiver(server_receiver);
+  local.client().setReceiver(client_receiver);
+  local.begin();
+  Messaging::ConnectionId connection_id;
+  EXPECT_TRUE(local.client().send(nullptr, 0, (const roo::byte*)"a", 1,
+                                  &connection_id));
+  EXPECT_TRUE(local.server().sendContinuation(connection_id,
+                                              (const roo::byte*)"b", 1));
+  local.reset();
+  EXPECT_FALSE(local.server().sendContinuation(connection_id,
+                                               (const roo::byte*)"c", 1));
+  EXPECT_EQ(server_receiver.await(1), std::vector<std::string>{"a"});
+  EXPECT_EQ(client_receiver.await(1), std::vector<std::string>{"b"});
+  EXPECT_EQ(server_receiver.awaitResets(1),
+            std::vector<Messaging::ConnectionId>{connection_id});
+  EXPECT_EQ(client_receiver.awaitResets(1),
+            std::vector<Messaging::ConnectionId>{connection_id});
+  local.end();
+}
+
+TEST(LocalMessagingTest, StreamsMessagesLargerThanBuffers) {
+  LocalMessaging local(16, 2);
+  // Through a mux, which prepends its header.
+  MuxMessaging server_mux(local.server());
+  MuxMessaging client_mux(local.client());
+  TestReceiver receiver;
+  MuxMessaging::Channel server_channel(server_mux, 3, receiver);
+  MuxMessaging::Channel client_channel(client_mux, 3);
+  local.begin();
+  std::string large(1000, 'x');
+  EXPECT_TRUE(
+      client_channel.send((const roo::byte*)large.data(), large.size()));
+  StringInputStream payload("streamed payload, longer than a buffer");
+  EXPECT_TRUE(client_channel.sendStream((const roo::byte*)"hdr:", 4, payload,
+                                        38, nullptr));
+  StringInputStream small_payload("short");
+  EXPECT_TRUE(client_channel.sendStream(small_payload, 5));
+  EXPECT_EQ(receiver.await(3),
+            (std::vector<std::string>{
+                large, "hdr:streamed payload, longer than a buffer",
+                "short"}));
+
+  // So does a payload stream that ends prematurely.
+  StringInputStream short_payload("short");
+  EXPECT_FALSE(client_channel.sendStream(short_payload, 8));
+  EXPECT_EQ(receiver.awaitResets(1).size(), 1);
+  StringInputStream short_large_payload(large);
+  EXPECT_FALSE(client_channel.sendStream(short_large_payload, 2000));
+  EXPECT_EQ(receiver.awaitResets(2).size(), 2);
+
+  // Rejecting a stream resets the connection.
+  receiver.set_accept_streams(false);
+  EXPECT_FALSE(
+      client_channel.send((const roo::byte*)large.data(), large.size()));
+  EXPECT_EQ(receiver.awaitResets(3).size(), 3);
+  EXPECT_EQ(receiver.await(3).size(), 3);
+  local.end();
+}
+
+TEST(LocalMessagingTest, ReceiverRepliesWithRejectedLargeMessage) {
+  LocalMessaging local(16, 2);
+  TestReceiver client_receiver;
+  client_receiver.set_accept_streams(false);
+  std::string large(100, 'x');
+  // Replies to each request with a message too large for the buffers, which
+  // the client rejects, resetting the connection from within the receiver.
+  Messaging::SimpleReceiver server_receiver(
+      [&](Messaging::ConnectionId connection_id, const roo::byte* data,
+          size_t len) {
+        EXPECT_FALSE(local.server().sendContinuation(
+            connection_id, (const roo::byte*)large.data(), large.size()));
+      });
+  local.server().setReceiver(server_receiver);
+  local.client().setReceiver(client_receiver);
+  local.begin();
+  Messaging::ConnectionId connection_id;
+  EXPECT_TRUE(local.client().send(nullptr, 0, (const roo::byte*)"request", 7,
+                                  &connection_id));
+  EXPECT_EQ(client_receiver.awaitResets(1),
+            std::vector<Messaging::ConnectionId>{connection_id});
+
+  // The endpoints keep working on the new connection.
+  EXPECT_TRUE(local.server().send((const roo::byte*)"hello", 5));
+  EXPECT_EQ(client_receiver.await(1), std::vector<std::string>{"hello"});
+  local.end();
+}
+
+}  // namespace roo_transport